@@ -0,0 +1,110 @@
+/*
+ * @file main/admin.h
+ *
+ * @proj imp-term
+ * @brief Authenticated admin sessions for configuration over BLE and HTTP
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_ADMIN_H
+#define IMP_TERM_ADMIN_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "config.h"
+#include "audit.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+#define ADMIN_CHALLENGE_LEN 16
+#define ADMIN_RESPONSE_LEN 32 // Full HMAC-SHA256
+#define ADMIN_TAG_LEN 8 // Truncated HMAC-SHA256 appended to every admin write
+#define ADMIN_TRAILER_LEN (sizeof(uint32_t) + ADMIN_TAG_LEN) // Counter + tag
+#define ADMIN_MAX_PAYLOAD_LEN 80 // Largest configuration value accepted, gatt_schema.c checks the schema against it
+#define ADMIN_HTTP_CONN_BASE 0x1000 // Sessions of HTTP clients take handles above any BLE connection
+
+/*
+ * Protocol:
+ *  1. Client reads the login characteristic (GET /api/login) and gets a fresh challenge
+ *  2. Client writes HMAC(admin PIN, "login" | challenge) to it
+ *  3. Both sides derive session key K = HMAC(admin PIN, "session" | challenge)
+ *  4. Every configuration write is then `payload | counter | tag`, where
+ *     counter (u32 LE) grows with each write and
+ *     tag = HMAC(K, characteristic UUID (16 B, LE) | counter | payload)[0:8]
+ * Over HTTP the same bytes travel hex encoded, see main/http_server.c
+*/
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Allocate session slots and their expiry timers
+*/
+esp_err_t admin_init();
+
+/*
+ * @brief Generate a login challenge for a connection
+ * @param challenge Output buffer of ADMIN_CHALLENGE_LEN bytes
+*/
+esp_err_t admin_challenge(uint16_t conn_handle, uint8_t * challenge);
+
+/*
+ * @brief Generate a login challenge for a handle of a range that has no session and no recent challenge
+ * @param client Address of the client, a client's new challenge replaces its unanswered one
+ * @param conn_handle Set to the handle the challenge was issued for
+ * @return ESP_ERR_NOT_FOUND if every handle is logged in or logging in
+ * @note For clients without a connection of their own (HTTP), a login never ends another one
+*/
+esp_err_t admin_challenge_free(uint16_t first, uint8_t count, uint32_t client, uint16_t * conn_handle, uint8_t * challenge);
+
+/*
+ * @brief Check a login response and open a session on success
+ * @return 0 or a BLE ATT error code, BLE_ATT_ERR_INSUFFICIENT_RES while the source has to wait
+ * @note This is the only place where the admin PIN is read and the session key derived
+ * @note A failure starts the shared lockout and a wait for its source (BLE or HTTP) that
+ *       doubles with each failure in a row, up to ADMIN_LOGIN_BACKOFF_MAX_SEC
+*/
+int admin_login(uint16_t conn_handle, const uint8_t * response, uint16_t len);
+
+/*
+ * @brief Verify an admin write against the session of its connection
+ * @param uuid128 Characteristic UUID the write is addressed to
+ * @param value Written value (payload | counter | tag)
+ * @param payload Output buffer for the payload
+ * @param payload_len In: size of the payload buffer, out: payload length
+ * @return 0 or a BLE ATT error code
+*/
+int admin_verify_write(uint16_t conn_handle, const uint8_t * uuid128, const uint8_t * value, uint16_t len,
+                       uint8_t * payload, uint16_t * payload_len);
+
+/*
+ * @brief Drop the session of a connection (e.g. on disconnect)
+*/
+void admin_logout(uint16_t conn_handle);
+
+/*
+ * @brief Hold off the verified writes of other sessions while applying one
+ * @note The write handlers run in the NimBLE host task and in the HTTP workers
+*/
+void admin_write_begin();
+
+/*
+ * @brief Let the next verified write through
+*/
+void admin_write_end();
+
+/*
+ * @brief Audit source of a session, by the kind of its handle
+*/
+static inline uint8_t admin_source(uint16_t conn_handle)
+{
+    return conn_handle >= ADMIN_HTTP_CONN_BASE && conn_handle < ADMIN_HTTP_CONN_BASE + HTTP_ADMIN_SESSIONS
+           ? AUDIT_SOURCE_HTTP : AUDIT_SOURCE_BLE;
+}
+
+
+#endif // IMP_TERM_ADMIN_H
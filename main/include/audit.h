@@ -0,0 +1,141 @@
+/*
+ * @file main/audit.h
+ *
+ * @proj imp-term
+ * @brief Append-only audit log of access events kept in a flash ring
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_AUDIT_H
+#define IMP_TERM_AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+#define AUDIT_SLOT_NONE 0xFF // Event not tied to any credential slot
+
+// Credential slots used by the keypad
+#define AUDIT_SLOT_ACCESS_PIN 0
+#define AUDIT_SLOT_ADMIN_PIN  1
+
+// Enrolled phones, by allowlist index
+#define AUDIT_SLOT_PHONE(index) (0x10 + (index))
+
+// TOTP secrets, by slot
+#define AUDIT_SLOT_TOTP(index) (0x20 + (index))
+
+// Enrolled cards, by card list index
+#define AUDIT_SLOT_CARD(index) (0x40 + (index))
+
+// Single-use visitor codes, by slot
+#define AUDIT_SLOT_VISITOR(index) (0x80 + (index))
+
+enum AuditEventType {
+    AUDIT_EVT_BOOT = 1,     // aux = esp_reset_reason_t
+    AUDIT_EVT_ACCESS,       // Credential presented (PIN, card or phone)
+    AUDIT_EVT_ADMIN_AUTH,   // Admin PIN submitted
+    AUDIT_EVT_PIN_CHANGE,   // Access PIN changed (keypad, BLE or HTTP)
+    AUDIT_EVT_CONFIG_CHANGE,// Other configuration changed over BLE or HTTP
+    AUDIT_EVT_DOOR_OPEN,
+    AUDIT_EVT_DOOR_CLOSE,
+    AUDIT_EVT_TIME_SET,     // Wall clock set over BLE or HTTP
+    AUDIT_EVT_HANG,         // Deadline overdue by SUPERVISOR_HANG_MS, the terminal restarts (aux = enum Deadline)
+    AUDIT_EVT_DOOR_FORCED,  // Door contact opened while locked
+    AUDIT_EVT_DOOR_HELD,    // Door still open DOOR_HELD_OPEN_SEC after relocking
+};
+
+enum AuditResult {
+    AUDIT_RES_OK = 0,
+    AUDIT_RES_GRANTED,
+    AUDIT_RES_DENIED,
+    AUDIT_RES_FAIL,
+    AUDIT_RES_SCHEDULE,     // Valid credential outside of its schedule
+};
+
+/*
+ * One record as stored in flash and sent over BLE (little endian, 16 bytes)
+ * @note seq == UINT32_MAX marks an erased (never written) slot
+*/
+typedef struct __attribute__((packed)) {
+    uint32_t seq;       // Monotonic sequence number
+    uint32_t timestamp; // Seconds since epoch (since boot if time is not set)
+    uint8_t  type;      // enum AuditEventType
+    uint8_t  slot;      // Credential slot or AUDIT_SLOT_NONE
+    uint8_t  result;    // enum AuditResult
+    uint8_t  source;    // Input the event came from (keypad, BLE...)
+    uint16_t aux;       // Event specific value (e.g. new door duration)
+    uint16_t crc;       // CRC-16 over the preceding bytes
+} audit_record_t;
+
+_Static_assert(sizeof(audit_record_t) == 16, "audit record must stay 16 bytes");
+
+// Sources an event can come from
+#define AUDIT_SOURCE_SYSTEM 0
+#define AUDIT_SOURCE_KEYPAD 1
+#define AUDIT_SOURCE_BLE    2
+#define AUDIT_SOURCE_CARD   3
+#define AUDIT_SOURCE_REX    4 // Request-to-exit button
+#define AUDIT_SOURCE_HTTP   5 // Local configuration server
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Mount the audit partition and recover the write position
+ * @note Must be called before any other audit function
+*/
+esp_err_t audit_init();
+
+/*
+ * @brief Append an event to the audit log
+ * @note Only a RAM append under a spinlock, cheap enough for the unlock path
+*/
+void audit_log_event(uint8_t type, uint8_t slot, uint8_t result, uint8_t source, uint16_t aux);
+
+/*
+ * @brief Wake the writer to flush the records buffered in RAM now, e.g. before a restart
+*/
+void audit_flush_request();
+
+/*
+ * @brief Sequence number of the newest event, flushed to flash or not (0 if none was ever logged)
+*/
+uint32_t audit_last_seq();
+
+/*
+ * @brief Read records from flash in sequence order
+ * @param from_seq First sequence number wanted, older records are skipped
+ * @param records Buffer for up to max records
+ * @return Records read, the first one is newer than from_seq if the ring has overwritten it meanwhile
+ * @note Only what has been flushed to flash is returned, see audit_flush_request()
+*/
+size_t audit_read(uint32_t from_seq, audit_record_t * records, size_t max);
+
+/*
+ * @brief Start streaming records to a BLE client as notifications
+ * @param conn_handle Connection to send the records to
+ * @param attr_handle Characteristic value handle to notify on
+ * @param from_seq First sequence number the client wants (resume cursor)
+ * @return ESP_ERR_INVALID_STATE if an export is already running
+*/
+esp_err_t audit_export_start(uint16_t conn_handle, uint16_t attr_handle, uint32_t from_seq);
+
+/*
+ * @brief Abort a running export (e.g. when the client disconnects)
+*/
+void audit_export_stop(uint16_t conn_handle);
+
+/*
+ * @brief Flush buffered records to flash and serve export requests
+*/
+noreturn void audit_writer_task();
+
+
+#endif // IMP_TERM_AUDIT_H
@@ -0,0 +1,31 @@
+/*
+ * @file main/bench.h
+ *
+ * @proj imp-term
+ * @brief Microbenchmark console over UART, cycle counts of the hot paths on the device itself
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_BENCH_H
+#define IMP_TERM_BENCH_H
+
+#include <esp_err.h>
+
+#include "config.h"
+
+
+// EXPORTED SYMBOLS
+
+#if BENCH_CONSOLE
+
+/*
+ * @brief Start the console REPL with the bench, inject, tasks and heap commands
+ * @note Only in images built by make bench-console
+*/
+esp_err_t bench_console_start();
+
+#endif // BENCH_CONSOLE
+
+
+#endif // IMP_TERM_BENCH_H
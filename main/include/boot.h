@@ -0,0 +1,61 @@
+/*
+ * @file main/boot.h
+ *
+ * @proj imp-term
+ * @brief Staged boot timestamps and profile report
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_BOOT_H
+#define IMP_TERM_BOOT_H
+
+#include <stdint.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+// Boot stages in the order they normally complete
+#define BOOT_STAGES(X) \
+    X(APP_MAIN,     "app_main entered") \
+    X(GPIO,         "GPIO configured") \
+    X(CONFIG,       "NVS and config cache loaded") \
+    X(AUDIT,        "audit log recovered") \
+    X(KEYPAD_READY, "keypad and door ready") \
+    X(BLE_STACK,    "NimBLE stack and GATT initialized") \
+    X(BLE_READY,    "BLE services and host task started")
+
+enum BootStage {
+#define BOOT_STAGE_ENUM(name, desc) BOOT_STAGE_##name,
+    BOOT_STAGES(BOOT_STAGE_ENUM)
+#undef BOOT_STAGE_ENUM
+    BOOT_STAGE_COUNT
+};
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Record the time a boot stage completed
+ * @note Safe to call from any task, each stage is only written once
+*/
+void boot_mark(enum BootStage stage);
+
+/*
+ * @brief Log the boot profile (time since reset and since the previous stage)
+*/
+void boot_report();
+
+/*
+ * @brief Time a boot stage completed
+ * @return Microseconds since startup or 0 if the stage was not reached yet
+*/
+int64_t boot_time(enum BootStage stage);
+
+/*
+ * @brief Identifier of a boot stage, e.g. "KEYPAD_READY"
+*/
+const char * boot_stage_id(enum BootStage stage);
+
+
+#endif // IMP_TERM_BOOT_H
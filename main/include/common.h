@@ -26,6 +26,17 @@
 
 #define array_len(arr) (sizeof(arr) / sizeof(arr[0]))
 
+// Create a task as placed by its TASK_* entry in config.h
+#define task_create(fn, param, handle, task) task_create_spec(fn, param, handle, task)
+#define task_create_spec(fn, param, handle, name, stack, prio, core) \
+    xTaskCreatePinnedToCore(fn, name, stack, param, prio, handle, core)
+#define task_priority(task) task_priority_spec(task)
+#define task_priority_spec(name, stack, prio, core) (prio)
+#define task_stack(task) task_stack_spec(task)
+#define task_stack_spec(name, stack, prio, core) (stack)
+#define task_core(task) task_core_spec(task)
+#define task_core_spec(name, stack, prio, core) (core)
+
 /*
  * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
  *
@@ -49,13 +60,15 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
-/* NimBLE stack APIs */
+/* NimBLE stack APIs, on the linux target only in tools/sim, which stands in for them */
+#if !CONFIG_IDF_TARGET_LINUX || __has_include("nimble/nimble_port.h")
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
 #include "host/util/util.h"
 #include "nimble/ble.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
+#endif
 
 #include <freertos/FreeRTOS.h>
 
@@ -10,7 +10,11 @@
 #ifndef IMP_TERM_CONFIG_H
 #define IMP_TERM_CONFIG_H
 
+#include <sdkconfig.h>
+// The storage benchmark (tools/storage_bench) has no GPIO driver, the simulator (tools/sim) brings its own
+#if !CONFIG_IDF_TARGET_LINUX || __has_include(<driver/gpio.h>)
 #include <driver/gpio.h>
+#endif
 
 // CONFIGURABLE OPTIONS
 
@@ -32,11 +36,184 @@
 #define DOOR_OPEN_LED   GPIO_NUM_19 // Door open LED GPIO pin
 #define DOOR_CLOSED_LED GPIO_NUM_18 // Door closed LED GPIO pin
 
-// Rows and columns are not in order
-#define GPIO_KEYPAD_PIN_COLS {GPIO_NUM_26, GPIO_NUM_5, GPIO_NUM_17}
-#define GPIO_KEYPAD_PIN_ROWS {GPIO_NUM_23, GPIO_NUM_27, GPIO_NUM_16, GPIO_NUM_25}
+// Keypads, all scan tables in gpio.c are generated from these at compile time
+// Keymaps list the keys row by row
+// A second keypad (e.g. on the exit side) is one more line here, e.g.
+// X(KEYPAD_EXIT, 4, 4, KEYPAD_KEYMAP_4X4), plus its pins below
+#define KEYPAD_KEYMAP_3X4 "123" "456" "789" "*0#"
+#define KEYPAD_KEYMAP_4X4 "123A" "456B" "789C" "*0#D"
+
+//                id            cols rows keymap
+#define KEYPADS(X) \
+        X(KEYPAD_ENTRY, 3,   4,   KEYPAD_KEYMAP_3X4)
+
+// Keypad wiring, rows and columns are not in order
+// Rows must be inputs with a pulldown (GPIO 34-39 have none), columns must be outputs
+//                           keypad        col GPIO
+#define KEYPAD_COL_PINS(X) \
+        X(KEYPAD_ENTRY, 0,  GPIO_NUM_26) \
+        X(KEYPAD_ENTRY, 1,  GPIO_NUM_5)  \
+        X(KEYPAD_ENTRY, 2,  GPIO_NUM_17)
+//                           keypad        row GPIO
+#define KEYPAD_ROW_PINS(X) \
+        X(KEYPAD_ENTRY, 0,  GPIO_NUM_23) \
+        X(KEYPAD_ENTRY, 1,  GPIO_NUM_27) \
+        X(KEYPAD_ENTRY, 2,  GPIO_NUM_16) \
+        X(KEYPAD_ENTRY, 3,  GPIO_NUM_25)
 
 #define KEYPAD_STORAGE_NAME "keypad"
+#define PHONE_STORAGE_NAME "phone"
+#define CREDENTIAL_STORAGE_NAME "credential"
+#define SCHEDULE_STORAGE_NAME "schedule"
+#define OTP_STORAGE_NAME "otp"
+#define UPLINK_STORAGE_NAME "uplink"
 #define ESP_INTR_FLAG_DEFAULT 0 // Default interrupt flags
 
+// Card reader (Wiegand 26/34-bit)
+#define WIEGAND_ENABLE 0 // Keeps the CPU out of light sleep, the pulses are too short to wake it
+#define WIEGAND_PIN_D0 GPIO_NUM_21
+#define WIEGAND_PIN_D1 GPIO_NUM_22
+#define WIEGAND_FRAME_GAP_MS 25 // Idle time that ends a frame, bits come every 0.2-20 ms
+#define WIEGAND_MIN_BIT_GAP_US 200 // Shorter gaps between bits are treated as noise
+#define CREDENTIAL_MAX_CARDS 64
+
+// Door contact and request-to-exit (REX) button, dry contacts to GND on the internal pullups
+#ifndef DOOR_CONTACT_ENABLE
+#define DOOR_CONTACT_ENABLE 0 // An unwired contact reads as an open door, enable once it is fitted (make test sets it)
+#endif
+#define DOOR_CONTACT_PIN GPIO_NUM_32 // Low while the door is shut
+#define DOOR_CONTACT_DEBOUNCE_MS 50 // Level has to be stable this long
+#define DOOR_HELD_OPEN_SEC 30 // Door still open this long after relocking raises a held-open event
+#define DOOR_REX_ENABLE 1
+#define DOOR_REX_PIN GPIO_NUM_33 // Low while pressed
+#define DOOR_REX_DEBOUNCE_MS 250 // Edges after a press are ignored for this long
+
+// Access schedules
+#define TIME_ZONE "CET-1CEST,M3.5.0,M10.5.0/3" // POSIX TZ string, local time used by the schedules
+#define SCHEDULE_COUNT 8 // Including the built-in "always" schedule 0
+#define SCHEDULE_MAX_HOLIDAYS 16
+
+// One-time codes typed instead of the access PIN (see main/otp.h for the TOTP parameters)
+#define OTP_MAX_SECRETS 16 // Enrolled TOTP secrets (authenticator apps)
+#define OTP_MAX_VISITOR_CODES 64 // Single-use visitor codes
+
+// Audit log
+#define AUDIT_PARTITION_LABEL "auditlog" // See partitions.csv
+#define AUDIT_RAM_RECORDS 64 // Records buffered in RAM while waiting for flash
+#define AUDIT_FLUSH_INTERVAL_SEC 5 // Max time a record stays in RAM only
+#define AUDIT_EXPORT_RETRY_MS 10 // Backoff when the BLE stack runs out of buffers
+
+// Firmware update over BLE
+#define OTA_BUF_SIZE 4096 // One flash sector per buffer
+#define OTA_BUF_COUNT 3 // One being written, the rest being filled by BLE
+#define OTA_CONN_ITVL_MIN 6 // Connection interval requested during a transfer (1.25 ms units)
+#define OTA_CONN_ITVL_MAX 12
+#define OTA_REBOOT_DELAY_MS 1000 // Time for the final notification to reach the client
+
+// Power management
+#define POWER_SAVE 1 // Automatic light sleep between events, needs CONFIG_PM_ENABLE (see sdkconfig.defaults)
+#define POWER_MAX_FREQ_MHZ 160
+#define POWER_MIN_FREQ_MHZ 40
+#define POWER_PIN_ENTRY_TIMEOUT_SEC 10 // Unfinished PIN entry is discarded after this
+#define HEARTBEAT_PERIOD_MS (POWER_SAVE ? 5000 : 1000)
+#define BLE_ADV_ITVL_MS (POWER_SAVE ? 1000 : 500)
+
+// Deadline supervisor, a deadline overdue by SUPERVISOR_HANG_MS restarts the terminal
+#define SUPERVISOR_KEY_MS 50 // Key handled after its interrupt
+#define SUPERVISOR_DOOR_EVENT_MS 50 // Door event taken by the door task after it was queued
+#define SUPERVISOR_DOOR_CLOSE_SLACK_MS 1000 // Door closed after its open duration
+#define SUPERVISOR_HANG_MS 10000
+#define SUPERVISOR_FEED_MS 2000 // Watched tasks feed the task watchdog (CONFIG_ESP_TASK_WDT_TIMEOUT_S) at least this often
+#define SUPERVISOR_RESTART_DELAY_MS 200 // Time for the audit writer to flush before a restart
+
+// Task placement and priorities
+// Door actuation and keypad handling run on the access core above everything cosmetic,
+// BLE owns the other core (the controller too, see sdkconfig.defaults)
+#define TASK_CORE_ACCESS 0
+#define TASK_CORE_BLE    (portNUM_PROCESSORS - 1)
+#define TASK_CORE_ANY    tskNO_AFFINITY
+
+//                          name              stack   prio core
+#define TASK_SUPERVISOR     "supervisor",     3*1024, 11,  TASK_CORE_ANY // Above everything it watches
+#define TASK_DOOR_OPEN      "door_open",      2*1024, 10,  TASK_CORE_ACCESS // Closes the door on time
+#define TASK_DOOR_HANDLER   "door_handler",   4*1024, 9,   TASK_CORE_ACCESS
+#define TASK_KEYPAD_HANDLER "keypad_handler", 4*1024, 8,   TASK_CORE_ACCESS
+#define TASK_WIEGAND        "wiegand",        3*1024, 8,   TASK_CORE_ACCESS
+#define TASK_DOOR_IO        "door_io",        3*1024, 8,   TASK_CORE_ACCESS // Exit button opens from its ISR
+#define TASK_NIMBLE_HOST    "nimble_host",    4*1024, 5,   TASK_CORE_BLE
+#define TASK_BLE_INIT       "ble_init",       4*1024, 4,   TASK_CORE_BLE
+#define TASK_OTA_FLASH      "ota_flash",      4*1024, 3,   TASK_CORE_BLE
+#define TASK_AUDIT_WRITER   "audit_writer",   4*1024, 2,   TASK_CORE_BLE
+#define TASK_OTP            "otp",            3*1024, 2,   TASK_CORE_BLE // TOTP table and used visitor codes, off the esp_timer task
+#define TASK_UPLINK         "uplink",         4*1024, 2,   TASK_CORE_BLE // UPLINK images only
+#define TASK_HTTPD          "httpd",          4*1024, 2,   TASK_CORE_BLE // HTTP_SERVER images only, parses requests
+#define TASK_HTTP_WORKER    "http_worker",    5*1024, 2,   TASK_CORE_BLE // HTTP_SERVER images only, runs them
+#define TASK_GPIO_BLINK     "gpio_blink",     1024,   1,   TASK_CORE_ANY
+#define TASK_LED_HEARTBEAT  "led_heartbeat",  4*1024, 1,   TASK_CORE_ANY
+#define TASK_PERF           "perf",           4*1024, 1,   TASK_CORE_ANY // PERF_HOOKS images only
+#define TASK_CONSOLE        "console",        6*1024, 1,   TASK_CORE_ANY // BENCH_CONSOLE images only
+#define TASK_SOAK           "soak",           3*1024, 7,   TASK_CORE_ACCESS // BENCH_CONSOLE images only, below the keypad
+
+// Performance regression run in QEMU (make perf, see tools/perf), set by the build, never in release images
+#ifndef PERF_HOOKS
+#define PERF_HOOKS 0
+#endif
+#define PERF_SAMPLES 20 // Keypress-to-door measurements per run
+
+// Microbenchmark console over UART (make bench-console, see main/bench.c), set by the build, never in release images
+#ifndef BENCH_CONSOLE
+#define BENCH_CONSOLE 0
+#endif
+
+// Virtual keypad, keys injected into the keypad queue; only the test images above have it
+#define KEYPAD_INJECT (PERF_HOOKS || BENCH_CONSOLE)
+#define KEYPAD_INJECT_TIMEOUT_MS 5000 // Longer than a security delay, the keypad task blocks during one
+#define SOAK_MAX_SCRIPT_LEN 64
+
+// Events and metrics to an MQTT broker (make uplink, see main/uplink.c), set by the build
+#ifndef UPLINK
+#define UPLINK 0
+#endif
+#ifndef UPLINK_BROKER_URI
+#define UPLINK_BROKER_URI "mqtt://10.0.2.2" // The host, as seen from QEMU user networking
+#endif
+#define UPLINK_TOPIC_PREFIX "imp-term" // Topics are <prefix>/<MAC>/events, /metrics and /status
+#define UPLINK_BATCH_RECORDS 32 // Audit records per events message at most
+#define UPLINK_BATCH_DELAY_SEC 10 // Max time an event waits for its batch to fill, after reaching flash
+#define UPLINK_POLL_MS 1000
+#define UPLINK_ACK_TIMEOUT_MS 10000 // Broker acknowledgement of one events message (QoS 1)
+#define UPLINK_METRICS_INTERVAL_SEC 60
+#define UPLINK_CURSOR_SAVE_SEC 300 // Acknowledged position written to NVS at most this often, events since are sent again after a restart
+
+// Local configuration server and web client (make http, see main/http_server.c), set by the build
+#ifndef HTTP_SERVER
+#define HTTP_SERVER 0
+#endif
+#define HTTP_PORT 80
+#define HTTP_WORKERS 2 // Requests handled at once, the rest wait in the queue
+#define HTTP_QUEUE_LEN 4 // Requests waiting for a worker, more are answered 503 right away
+#define HTTP_MAX_SOCKETS 7 // Open connections, least recently used one is closed for a new one
+#define HTTP_MAX_BODY_LEN 256 // Largest JSON request body
+#define HTTP_ADMIN_SESSIONS 2 // Admin sessions of HTTP clients, a login never ends another one
+#define HTTP_AUDIT_BATCH 32 // Audit records per response at most
+#define WWW_PARTITION_NAME "www"
+
+// Wi-Fi station, or Ethernet in QEMU, for the images above, set by the build
+#define NET (UPLINK || HTTP_SERVER)
+#ifndef NET_WIFI_SSID
+#define NET_WIFI_SSID ""
+#endif
+#ifndef NET_WIFI_PASSWORD
+#define NET_WIFI_PASSWORD ""
+#endif
+
+// Admin sessions over BLE and HTTP
+#define ADMIN_SESSION_TIMEOUT_SEC 300 // Session lifetime after a successful login
+#define ADMIN_CHALLENGE_TIMEOUT_SEC 10 // An unanswered HTTP challenge holds its handle this long
+#define ADMIN_LOGIN_BACKOFF_SEC KEYPAD_SECURITY_DELAY_SEC // Wait after a failed login, doubled with each failure in a row from the same source
+#define ADMIN_LOGIN_BACKOFF_MAX_SEC 600 // Longest wait between failed logins from one source
+
+// Phone unlock
+#define PHONE_CHALLENGE_TIMEOUT_SEC 10 // An unlock challenge has to be answered within this time
+
 #endif // IMP_TERM_CONFIG_H
@@ -0,0 +1,155 @@
+/*
+ * @file main/credential.h
+ *
+ * @proj imp-term
+ * @brief Common pipeline for credentials from all input sources (keypad, card reader, phone)
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_CREDENTIAL_H
+#define IMP_TERM_CREDENTIAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "host/ble_hs.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+enum CredentialType {
+    CREDENTIAL_PIN,   // Access PIN or one-time code typed on a keypad
+    CREDENTIAL_CARD,  // Card number read by a card reader
+    CREDENTIAL_PHONE  // Bonded phone, identified by its identity address and signed response
+};
+
+// A credential as presented by an input source
+typedef struct {
+    uint8_t type;   // enum CredentialType
+    uint8_t source; // AUDIT_SOURCE_*
+    uint8_t reader; // Keypad or reader number, recorded in the audit log
+    union {
+        const char * pin;
+        uint32_t card;
+        struct {
+            const ble_addr_t * addr;
+            const uint8_t * response; // PHONE_RESPONSE_LEN bytes
+        } phone;
+    };
+} credential_t;
+
+enum CardCommand {
+    CARD_CMD_ADD = 1, // Followed by the card number (u32, little endian) and optionally its schedule (u8)
+    CARD_CMD_REMOVE,  // Followed by the card number (u32, little endian)
+    CARD_CMD_CLEAR    // Remove all cards
+};
+
+// Enrolled card, also the record format of the card list read for a sync
+typedef struct __attribute__((packed)) {
+    uint32_t number;
+    uint8_t schedule;
+} card_t;
+
+/*
+ * Bulk provisioning: the client reads the card list, sends only the changed
+ * records as numbered chunks (write without response) between BEGIN and
+ * COMMIT, and the device replaces its cards with the batch in one NVS write
+ * if the batch matches the digest the client computed for the new list.
+*/
+#define CARD_SYNC_DIGEST_LEN 8 // Truncated SHA-256 of the card records sorted by number
+#define CARD_SYNC_ACK_INTERVAL 8 // Chunks between two status notifications
+#define CARD_SYNC_CMD_MAX_LEN (1 + CARD_SYNC_DIGEST_LEN)
+#define CARD_SYNC_CHUNK_MAX_OPS 85 // Longest attribute value (512 B) less the sequence number
+
+enum CardSyncCommand {
+    CARD_SYNC_CMD_BEGIN = 1, // Start a batch from the enrolled cards
+    CARD_SYNC_CMD_COMMIT,    // Followed by the digest of the new card list, replaces the cards with the batch
+    CARD_SYNC_CMD_ABORT
+};
+
+enum CardSyncState {
+    CARD_SYNC_IDLE = 0,
+    CARD_SYNC_RECEIVING,
+    CARD_SYNC_ERROR, // Invalid record or too many cards, the batch has to be started again
+};
+
+enum CardSyncOp {
+    CARD_SYNC_OP_PUT = 1, // Add the card or change its schedule
+    CARD_SYNC_OP_REMOVE
+};
+
+// Data chunk: u16 sequence number (little endian) followed by operations
+typedef struct __attribute__((packed)) {
+    uint8_t op; // enum CardSyncOp
+    card_t card; // Schedule is ignored by CARD_SYNC_OP_REMOVE
+} card_sync_op_t;
+
+/*
+ * Status read from (and notified on) the sync control characteristic (little endian)
+*/
+typedef struct __attribute__((packed)) {
+    uint8_t state;     // enum CardSyncState
+    uint8_t count;     // Cards in the batch while receiving, enrolled cards otherwise
+    uint16_t max_ops;  // Operations fitting one data chunk at the current MTU
+    uint16_t next_seq; // Next chunk expected (resume point)
+    uint8_t digest[CARD_SYNC_DIGEST_LEN]; // Of the enrolled cards
+} card_sync_status_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Load enrolled cards from NVS into RAM
+ * @note Call after nvs_configure()
+*/
+esp_err_t credential_init();
+
+/*
+ * @brief Decide a credential and open the door if it is valid
+ * @return true if access was granted
+ * @note Looks the credential up, checks its schedule, applies the shared lockout, records
+ *       the attempt in the audit log and requests the door; an unknown credential starts the lockout
+*/
+bool credential_submit(const credential_t * credential);
+
+/*
+ * @brief Handle an (admin authenticated) card enrollment command
+ * @param source Audit source of the admin session sending it
+ * @return 0 or a BLE ATT error code
+*/
+int credential_card_command(const uint8_t * cmd, uint16_t len, uint8_t source);
+
+/*
+ * @brief Append the enrolled cards (card_t records) to a read response
+ * @return 0 or a BLE ATT error code
+*/
+int credential_card_list(struct os_mbuf * om);
+
+/*
+ * @brief Handle an (admin authenticated) card sync command
+ * @return 0 or a BLE ATT error code
+*/
+int credential_sync_command(uint16_t conn_handle, uint16_t attr_handle, const uint8_t * cmd, uint16_t len);
+
+/*
+ * @brief Apply a data chunk to the batch being synced
+ * @return 0 or a BLE ATT error code
+ * @note Only accepted from the connection that began the batch
+*/
+int credential_sync_data(uint16_t conn_handle, const struct os_mbuf * om);
+
+/*
+ * @brief Drop the batch of a connection that closed
+*/
+void credential_sync_disconnect(uint16_t conn_handle);
+
+/*
+ * @brief Fill in the current sync status
+*/
+void credential_sync_status(uint16_t conn_handle, card_sync_status_t * status);
+
+
+#endif // IMP_TERM_CREDENTIAL_H
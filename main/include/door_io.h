@@ -0,0 +1,50 @@
+/*
+ * @file main/door_io.h
+ *
+ * @proj imp-term
+ * @brief Door contact and request-to-exit button
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_DOOR_IO_H
+#define IMP_TERM_DOOR_IO_H
+
+#include <stdbool.h>
+
+#include <esp_err.h>
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Configure the contact and exit button inputs and start their task
+ * @note Call after gpio_configure() and door_configure()
+*/
+esp_err_t door_io_init();
+
+/*
+ * @brief Tell the door input task that the lock was opened or closed
+*/
+void door_io_lock_changed();
+
+/*
+ * @brief Check whether the door contact reports a shut door
+ * @note Always true when DOOR_CONTACT_ENABLE is disabled in config.h
+*/
+bool door_io_is_shut();
+
+/*
+ * @brief Arm level wakeup on the door inputs, called right before light sleep
+ * @note Runs with interrupts disabled, IRAM only
+*/
+void door_io_sleep_prepare();
+
+/*
+ * @brief Restore edge interrupts on the door inputs after light sleep
+ * @note Runs with interrupts disabled, IRAM only
+*/
+void door_io_sleep_restore();
+
+
+#endif // IMP_TERM_DOOR_IO_H
@@ -10,12 +10,15 @@
 #ifndef IMP_TERM_GPIO_H
 #define IMP_TERM_GPIO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdnoreturn.h>
 
 #include <driver/gpio.h>
 #include <freertos/FreeRTOS.h>
 
+#include "config.h"
+
 
 // CONVENIENCE DEFINITIONS
 
@@ -24,8 +27,13 @@
 
 #define E_KEYPAD_NO_KEY_FOUND ((uint8_t) -1)
 
-#define map_keypad_col_to_gpio_pin(col) gpio_keypad_pin_cols[col]
-#define map_keypad_row_to_gpio_pin(row) gpio_keypad_pin_rows[row]
+// Keypad ids, see KEYPADS in config.h
+#define X_KEYPAD_ID(id, cols, rows, keymap) id,
+enum Keypad {
+    KEYPADS(X_KEYPAD_ID)
+    KEYPAD_COUNT
+};
+#undef X_KEYPAD_ID
 
 
 // EXPORTED SYMBOLS
@@ -63,10 +71,46 @@ void gpio_configure();
 
 /*
  * @brief Lookup a key from a GPIO number
- * @param io_num GPIO number
+ * @param io_num GPIO number of the row that raised the event
+ * @param keypad Set to the keypad the row belongs to
  * @return Key value or E_KEYPAD_NO_KEY_FOUND if no key was found
 */
-uint8_t gpio_keypad_key_lookup(uint32_t io_num);
+uint8_t gpio_keypad_key_lookup(uint32_t io_num, uint8_t * keypad);
+
+#if KEYPAD_INJECT
+// Injected keys share the queue with the row interrupts, tagged so that the lookup skips the scan;
+// below the tag a sequence number (bits 16-23), the keypad (8-15) and the key (0-7)
+#define GPIO_KEYPAD_INJECTED BIT(31)
+
+/*
+ * @brief Queue a key as if it was pressed and wait until the keypad task has handled it
+ * @param timeout Time to wait for the previous injected key and for this one
+ * @return Microseconds from queuing to handled, -1 if the keypad task did not get to it in time
+ * @note One injected key is in flight at a time, so injected keys do not drop each other; one can still
+ *       be dropped with the bounces of a real key or an entry timeout, it then times out and the next
+ *       key goes ahead
+*/
+int64_t gpio_keypad_inject_key(uint8_t keypad, char key, TickType_t timeout);
+
+/*
+ * @brief Tell a waiting gpio_keypad_inject_key() that its key was handled, called by the keypad task
+ * @param event Queue item of the injected key, one that already timed out is ignored
+*/
+void gpio_keypad_inject_done(uint32_t event);
+#endif
+
+/*
+ * @brief Arm level wakeup on the keypad rows, called right before light sleep
+ * @note Runs with interrupts disabled, IRAM only
+*/
+void gpio_keypad_sleep_prepare();
+
+/*
+ * @brief Restore edge interrupts on the keypad rows after light sleep
+ * @return true if a row was already pressed (and queued as a key event)
+ * @note Runs with interrupts disabled, IRAM only
+*/
+bool gpio_keypad_sleep_restore();
 
 // Queue for GPIO events
 extern QueueHandle_t gpio_evt_queue;
@@ -0,0 +1,65 @@
+/*
+ * @file main/http_server.h
+ *
+ * @proj imp-term
+ * @brief Local configuration server, the web client from flash and a JSON API
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_HTTP_SERVER_H
+#define IMP_TERM_HTTP_SERVER_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "config.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+#define WWW_MAGIC 0x57504d49 // "IMPW"
+#define WWW_FORMAT_VERSION 1
+#define WWW_PATH_LEN 48
+#define WWW_TYPE_LEN 32
+
+#define WWW_F_IMMUTABLE (1 << 0) // Name carries a content hash, cached by browsers for good
+
+/*
+ * Web client image in the www partition, written by tools/wwwpack.py (little endian):
+ * this header, count index entries sorted by path, then the gzipped files
+*/
+typedef struct __attribute__((packed)) {
+    uint32_t magic;   // WWW_MAGIC
+    uint16_t version; // WWW_FORMAT_VERSION
+    uint16_t count;
+    uint32_t size;    // Whole image, header included
+} www_header_t;
+
+typedef struct __attribute__((packed)) {
+    char path[WWW_PATH_LEN]; // Without the leading slash, zero padded
+    char type[WWW_TYPE_LEN]; // Content-Type, zero terminated
+    uint32_t offset;         // From the start of the image
+    uint32_t length;         // Gzipped
+    uint32_t etag;           // CRC-32 of the gzipped file
+    uint32_t flags;          // WWW_F_*
+} www_entry_t;
+
+_Static_assert(sizeof(www_entry_t) == 96, "tools/wwwpack.py packs 96 byte entries");
+
+
+// EXPORTED SYMBOLS
+
+#if HTTP_SERVER
+
+/*
+ * @brief Map the web client, bring up the network and start the server and its workers
+ * @note Only in images built by make http, the access path never waits on it
+*/
+esp_err_t http_server_start();
+
+#endif // HTTP_SERVER
+
+
+#endif // IMP_TERM_HTTP_SERVER_H
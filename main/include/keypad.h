@@ -2,7 +2,7 @@
  * @file main/keypad.h
  *
  * @proj imp-term
- * @brief PIN checking and memory access related functions
+ * @brief PIN entry on the keypads, access lockout and door control
  * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
  * @year 2024
 */
@@ -10,34 +10,63 @@
 #ifndef IMP_TERM_KEYPAD_H
 #define IMP_TERM_KEYPAD_H
 
+#include <stdbool.h>
+#include <stdnoreturn.h>
+
+#include <freertos/FreeRTOS.h>
+
 
 // EXPORTED SYMBOLS
 
 /*
- * @brief Initialize NVS storage and if empty, set default values
+ * @brief Check if the door is open
 */
-void nvs_configure();
+bool is_door_open();
 
 /*
- * @brief Update PIN in NVS storage
+ * @brief Check whether a recent failed attempt still locks out all credentials
 */
-esp_err_t change_pin(const char * pin_to_write, const char * pin_name);
+bool access_locked_out();
 
 /*
- * @brief Update door duration in NVS storage
+ * @brief Start the lockout after a failed attempt from any credential source
 */
-esp_err_t update_door_duration(uint16_t duration);
+void access_register_failure();
 
 /*
- * @brief Check if the door is open
+ * @brief Continue a lockout that was running when the terminal restarted
 */
-bool is_door_open();
+void access_restore_lockout(uint32_t left_ms);
+
+/*
+ * @brief Ask the door task to open the door without blocking
+ * @return false if another door event is still pending
+*/
+bool door_request_open();
+
+/*
+ * @brief Ask the door task to open the door, from an interrupt
+ * @param woken Set to pdTRUE if the door task has to run before the interrupt returns
+ * @return false if another door event is still pending
+*/
+bool door_request_open_from_isr(BaseType_t * woken);
+
+/*
+ * @brief Ask the door task to lock early because the door was shut again after an opening
+ * @return false if another door event is still pending
+*/
+bool door_request_shut();
 
 /*
  * @brief Handle a keypress on the keypad
 */
 noreturn void keypad_handler_task();
 
+/*
+ * @brief Create the door event queue, call before starting the keypad and door tasks
+*/
+void door_configure();
+
 /*
  * @brief Handle a door open/close event
 */
@@ -0,0 +1,31 @@
+/*
+ * @file main/net.h
+ *
+ * @proj imp-term
+ * @brief Network interface shared by the uplink and the HTTP server
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_NET_H
+#define IMP_TERM_NET_H
+
+#include <esp_err.h>
+
+#include "config.h"
+
+
+// EXPORTED SYMBOLS
+
+#if NET
+
+/*
+ * @brief Bring up Wi-Fi on NET_WIFI_SSID, or Ethernet in QEMU images
+ * @note Safe to call from every user, only the first call starts anything
+*/
+esp_err_t net_start();
+
+#endif // NET
+
+
+#endif // IMP_TERM_NET_H
@@ -0,0 +1,96 @@
+/*
+ * @file main/ota.h
+ *
+ * @proj imp-term
+ * @brief Firmware update streamed over BLE
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_OTA_H
+#define IMP_TERM_OTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include <esp_err.h>
+
+struct os_mbuf;
+
+
+// CONVENIENCE DEFINITIONS
+
+// Commands written to the control characteristic (first byte)
+#define OTA_CMD_BEGIN 1 // Followed by u32 image size and 32 B SHA-256 of the image
+#define OTA_CMD_END   2 // All data sent, verify and reboot into the new image
+#define OTA_CMD_ABORT 3
+#define OTA_BEGIN_CMD_LEN (1 + sizeof(uint32_t) + 32)
+
+enum OtaState {
+    OTA_STATE_IDLE = 0,
+    OTA_STATE_STARTING,  // Waiting for the flash task to open the partition
+    OTA_STATE_RECEIVING,
+    OTA_STATE_VERIFYING,
+    OTA_STATE_DONE,      // Image accepted, the device is about to reboot
+    OTA_STATE_ERROR,
+};
+
+/*
+ * Status read from (and notified on) the control characteristic (little endian)
+*/
+typedef struct __attribute__((packed)) {
+    uint8_t  state;     // enum OtaState
+    uint8_t  error;     // Last esp_err_t truncated to its low byte, 0 if none
+    uint16_t max_chunk; // Largest data payload fitting one write at the current MTU
+    uint32_t window;    // Bytes the client may send ahead of `committed`
+    uint32_t size;      // Image size announced by OTA_CMD_BEGIN
+    uint32_t received;  // Next offset expected on the data characteristic (resume point)
+    uint32_t committed; // Bytes written to flash
+} ota_status_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Allocate the transfer buffers and queues
+*/
+esp_err_t ota_init();
+
+/*
+ * @brief Mark the running image valid so the bootloader does not roll it back
+ * @note Call once the firmware has initialized successfully
+*/
+void ota_confirm_image();
+
+/*
+ * @brief Check whether a transfer has been started and not yet finished
+*/
+bool ota_in_progress();
+
+/*
+ * @brief Handle a command written to the control characteristic
+ * @param cmd Command already verified by the admin session
+ * @return 0 or a BLE ATT error code
+*/
+int ota_control_write(uint16_t conn_handle, uint16_t attr_handle, const uint8_t * cmd, uint16_t len);
+
+/*
+ * @brief Handle a write to the data characteristic (u32 offset + payload)
+ * @return 0 or a BLE ATT error code, BLE_ATT_ERR_WRITE_NOT_PERMITTED from another connection than the one that began the update
+ * @note Only copies the payload into a flash buffer, never touches flash itself
+*/
+int ota_data_write(uint16_t conn_handle, const struct os_mbuf * om);
+
+/*
+ * @brief Fill in the current transfer status
+*/
+void ota_get_status(uint16_t conn_handle, ota_status_t * status);
+
+/*
+ * @brief Write filled buffers to the inactive OTA partition
+*/
+noreturn void ota_flash_task();
+
+
+#endif // IMP_TERM_OTA_H
@@ -0,0 +1,80 @@
+/*
+ * @file main/otp.h
+ *
+ * @proj imp-term
+ * @brief Time-based (RFC 6238) and single-use visitor codes typed on the keypad
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_OTP_H
+#define IMP_TERM_OTP_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "config.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+// TOTP parameters, the defaults of authenticator apps (HMAC-SHA1, 6 digits, 30 s)
+#define OTP_SECRET_LEN 20
+#define OTP_TOTP_DIGITS 6
+#define OTP_STEP_SEC 30
+#define OTP_WINDOW 1 // Steps accepted on either side of the current one (clock drift)
+
+#define OTP_VISITOR_DIGITS 8
+#define OTP_VISITOR_MAX 99999999
+
+#define OTP_CMD_MAX_CODES 16 // Visitor codes per command
+
+enum OtpCommand {
+    OTP_CMD_TOTP_SET = 1,  // Slot (u8), schedule (u8), secret (OTP_SECRET_LEN bytes)
+    OTP_CMD_TOTP_REMOVE,   // Slot (u8)
+    OTP_CMD_VISITOR_ADD,   // Up to OTP_CMD_MAX_CODES codes (u32, little endian, at most OTP_VISITOR_MAX)
+    OTP_CMD_VISITOR_CLEAR  // Remove all visitor codes
+};
+
+#define OTP_CMD_MAX_LEN (1 + OTP_CMD_MAX_CODES * sizeof(uint32_t))
+
+#define OTP_USED_WORDS ((OTP_MAX_VISITOR_CODES + 31) / 32) // Used visitor code bitmap
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Load secrets and visitor codes from NVS and start the code table refresh
+ * @note Call after nvs_configure()
+*/
+esp_err_t otp_init();
+
+/*
+ * @brief Mark the visitor codes used in the previous run, taken from the restart snapshot
+ * @note Only adds used bits; they reach NVS with the next batch
+*/
+void otp_restore_used(const uint32_t * used);
+
+/*
+ * @brief Match a keypad entry against the precomputed TOTP codes and unused visitor codes
+ * @return Audit slot or -1; the match is claimed so it cannot be used twice
+ * @note A table compare, the HMACs are computed by a timer at every time step
+*/
+int otp_claim(const char * code, uint8_t * schedule);
+
+/*
+ * @brief Give back a code claimed by otp_claim() when access was not granted after all
+ * @note Does nothing for slots that are not one-time codes
+*/
+void otp_release(int slot);
+
+/*
+ * @brief Handle an (admin authenticated) one-time code command
+ * @param source Audit source of the admin session sending it
+ * @return 0 or a BLE ATT error code
+*/
+int otp_command(const uint8_t * cmd, uint16_t len, uint8_t source);
+
+
+#endif // IMP_TERM_OTP_H
@@ -0,0 +1,40 @@
+/*
+ * @file main/perf.h
+ *
+ * @proj imp-term
+ * @brief Scripted workload and metrics report for the QEMU performance regression run
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_PERF_H
+#define IMP_TERM_PERF_H
+
+#include <stdnoreturn.h>
+
+#include "config.h"
+
+
+// EXPORTED SYMBOLS
+
+#if PERF_HOOKS
+
+/*
+ * @brief Type PINs on an injected keypad and print the "PERF <metric> <value>" report to the console
+ * @note Only in images built by make perf, the report is checked by tools/perf/perf.py
+*/
+noreturn void perf_task();
+
+/*
+ * @brief Record that the door lock was driven, ends a keypress-to-door measurement
+*/
+void perf_door_opened();
+
+#else
+
+static inline void perf_door_opened() {}
+
+#endif // PERF_HOOKS
+
+
+#endif // IMP_TERM_PERF_H
@@ -0,0 +1,93 @@
+/*
+ * @file main/phone.h
+ *
+ * @proj imp-term
+ * @brief Bonded phones as access credentials (tap-to-unlock over BLE)
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_PHONE_H
+#define IMP_TERM_PHONE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "host/ble_hs.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+// One bond slot is always kept free so a new phone can pair for enrollment
+#define PHONE_ALLOWLIST_LEN (CONFIG_BT_NIMBLE_MAX_BONDS - 1)
+
+/*
+ * Every enrolled phone has its own unlock key, sent once with the enrollment.
+ * An unlock reads a fresh challenge and writes HMAC-SHA256(key, "unlock" | challenge),
+ * so a request is signed by the phone and not only carried over its bonded link.
+*/
+#define PHONE_KEY_LEN 16       // Unlock key generated by the phone
+#define PHONE_CHALLENGE_LEN 16 // Read from the unlock characteristic, valid for one write
+#define PHONE_RESPONSE_LEN 32  // Written to the unlock characteristic
+#define PHONE_ENROLL_CMD_MAX_LEN (1 + PHONE_KEY_LEN)
+
+enum PhoneEnrollCommand {
+    PHONE_CMD_ENROLL = 1, // Allow the phone of this connection, followed by its unlock key
+    PHONE_CMD_REVOKE,     // Remove the phone of this connection and its bond
+    PHONE_CMD_CLEAR       // Remove all phones and all bonds
+};
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Build the RAM allowlist from NVS, keeping only phones that are still bonded
+ * @note Call after ble_store_config_init()
+*/
+esp_err_t phone_init();
+
+/*
+ * @brief Issue an unlock challenge to the enrolled phone of a connection
+ * @return 0 or a BLE ATT error code
+ * @note Runs on the NimBLE host task only, so the allowlist needs no locking
+*/
+int phone_challenge(uint16_t conn_handle, uint8_t * challenge);
+
+/*
+ * @brief Decide a signed unlock request from a connection and open the door if allowed
+ * @return 0 or a BLE ATT error code
+*/
+int phone_unlock(uint16_t conn_handle, const uint8_t * response);
+
+/*
+ * @brief Check an unlock response against the phone's pending challenge, which it uses up
+ * @return Allowlist index or -1 if the phone is not enrolled or the response is wrong
+*/
+int phone_verify(const ble_addr_t * id_addr, const uint8_t * response);
+
+/*
+ * @brief Handle an (admin authenticated) enrollment command
+ * @return 0 or a BLE ATT error code
+*/
+int phone_enroll(uint16_t conn_handle, const uint8_t * cmd, uint16_t len);
+
+/*
+ * @brief Bond store status callback, evicts the oldest bond that is not an enrolled phone
+*/
+int phone_store_status_cb(struct ble_store_status_event * event, void * arg);
+
+/*
+ * @brief Allowlist index of an enrolled phone
+ * @return Index or -1 if the phone is not enrolled
+*/
+int phone_find(const ble_addr_t * id_addr);
+
+/*
+ * @brief Check whether a bonded peer is an enrolled phone
+*/
+bool phone_is_enrolled(const ble_addr_t * id_addr);
+
+
+#endif // IMP_TERM_PHONE_H
@@ -0,0 +1,61 @@
+/*
+ * @file main/power.h
+ *
+ * @proj imp-term
+ * @brief Power management (automatic light sleep) and sleep time accounting
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_POWER_H
+#define IMP_TERM_POWER_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+// Reasons to stay awake, each backed by its own PM lock
+enum PowerLock {
+    POWER_LOCK_PIN_ENTRY, // Keys pressed, PIN not submitted yet
+    POWER_LOCK_DOOR,      // Door open
+    POWER_LOCK_BLE,       // BLE connection active
+    POWER_LOCK_READER,    // Card reader attached
+    POWER_LOCK_COUNT
+};
+
+typedef struct __attribute__((packed)) {
+    uint32_t uptime_ms;   // Time since boot
+    uint32_t sleep_ms;    // Time spent in light sleep
+    uint32_t wakeups;     // Light sleep exits
+    uint32_t key_wakeups; // Exits caused by a keypad row
+} power_stats_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Enable DFS and automatic light sleep with keypad wakeup
+ * @note Does nothing but accounting when POWER_SAVE is disabled in config.h
+*/
+esp_err_t power_init();
+
+/*
+ * @brief Keep the device awake for a reason, calls nest per reason
+*/
+void power_acquire(enum PowerLock lock);
+
+/*
+ * @brief Drop one hold of a reason acquired with power_acquire()
+*/
+void power_release(enum PowerLock lock);
+
+/*
+ * @brief Read sleep/active time counters
+*/
+void power_get_stats(power_stats_t * stats);
+
+
+#endif // IMP_TERM_POWER_H
@@ -0,0 +1,88 @@
+/*
+ * @file main/schedule.h
+ *
+ * @proj imp-term
+ * @brief Weekly access schedules, holidays and wall clock time
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SCHEDULE_H
+#define IMP_TERM_SCHEDULE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+#define SCHEDULE_ALWAYS 0 // Built-in schedule that allows access at any time, cannot be changed
+
+#define SCHEDULE_WEEK_HOURS (7 * 24)
+#define SCHEDULE_WEEK_BYTES (SCHEDULE_WEEK_HOURS / 8)
+
+#define SCHEDULE_F_HOLIDAYS 0x01 // Access is also allowed on holidays
+
+// Time before which the clock is considered not set (2024-01-01)
+#define SCHEDULE_MIN_VALID_TIME 1704067200
+
+/*
+ * One schedule as stored in NVS and pushed over BLE
+ * @note Bit (day * 24 + hour) of week allows that hour, day 0 is Sunday (struct tm)
+*/
+typedef struct __attribute__((packed)) {
+    uint8_t week[SCHEDULE_WEEK_BYTES];
+    uint8_t flags;
+} schedule_t;
+
+enum ScheduleCommand {
+    SCHEDULE_CMD_SET = 1,    // Schedule id (u8), schedule_t
+    SCHEDULE_CMD_PIN,        // Schedule id (u8) of the access PIN
+    SCHEDULE_CMD_HOLIDAYS,   // Up to SCHEDULE_MAX_HOLIDAYS local dates (u16, days since 1970-01-01), replaces the list
+};
+
+#define SCHEDULE_CMD_MAX_LEN (1 + 2 * SCHEDULE_MAX_HOLIDAYS)
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Set the time zone and load schedules and holidays from NVS
+ * @note Call after nvs_configure()
+*/
+esp_err_t schedule_init();
+
+/*
+ * @brief Check whether a schedule allows access right now
+ * @note A bit test on a cached hour of week, the calendar is only consulted once per hour
+*/
+bool schedule_allows(uint8_t schedule);
+
+/*
+ * @brief Schedule assigned to the access PIN
+*/
+uint8_t schedule_pin();
+
+/*
+ * @brief Set the wall clock (kept by the RTC across resets and light sleep)
+ * @param source Audit source of the admin session setting it
+*/
+esp_err_t schedule_set_time(uint32_t epoch, uint8_t source);
+
+/*
+ * @brief Handle an (admin authenticated) schedule configuration command
+ * @param source Audit source of the admin session sending it
+ * @return 0 or a BLE ATT error code
+*/
+int schedule_command(const uint8_t * cmd, uint16_t len, uint8_t source);
+
+/*
+ * @brief Days since 1970-01-01 of a calendar date (proleptic Gregorian)
+*/
+int32_t schedule_days_from_civil(int32_t year, uint32_t month, uint32_t day);
+
+
+#endif // IMP_TERM_SCHEDULE_H
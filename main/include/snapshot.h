@@ -0,0 +1,64 @@
+/*
+ * @file main/snapshot.h
+ *
+ * @proj imp-term
+ * @brief Runtime state kept in RTC memory across software and watchdog restarts
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SNAPSHOT_H
+#define IMP_TERM_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "storage.h"
+#include "otp.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+#define SNAPSHOT_MAGIC 0x534E4150 // "SNAP"
+#define SNAPSHOT_VERSION 2 // Bump on any change to the snapshot layout or meaning
+
+// State restored on a warm boot
+typedef struct {
+    keypad_config_t config;
+    uint32_t lockout_left_ms; // Rest of the security delay, 0 if none
+    bool door_open;           // Door was unlocked when the terminal went down
+    uint32_t otp_used[OTP_USED_WORDS]; // Visitor codes used, some maybe not in NVS yet
+} snapshot_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Take the state left by the previous run
+ * @return false after a power-on or brownout reset, or if the snapshot is torn or from another layout
+ * @note Call once at boot, before any snapshot_save_*()
+*/
+bool snapshot_load(snapshot_t * snapshot);
+
+/*
+ * @brief Record the keypad config
+*/
+void snapshot_save_config(const keypad_config_t * config);
+
+/*
+ * @brief Record the start of a security delay
+*/
+void snapshot_save_lockout(uint32_t duration_ms);
+
+/*
+ * @brief Record whether the door is unlocked
+*/
+void snapshot_save_door(bool open);
+
+/*
+ * @brief Record the used visitor code bitmap (OTP_USED_WORDS words)
+*/
+void snapshot_save_otp_used(const uint32_t * used);
+
+
+#endif // IMP_TERM_SNAPSHOT_H
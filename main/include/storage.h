@@ -0,0 +1,80 @@
+/*
+ * @file main/storage.h
+ *
+ * @proj imp-term
+ * @brief Keypad configuration (PINs, door open duration) kept in NVS and cached in RAM
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_STORAGE_H
+#define IMP_TERM_STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "config.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+// Keypad config as cached in RAM and kept in the warm restart snapshot
+typedef struct {
+    char access_pin[KEYPAD_PIN_MAX_LEN + 1];
+    char admin_pin[KEYPAD_PIN_MAX_LEN + 1];
+    char new_pin[KEYPAD_PIN_MAX_LEN + 1];
+    uint16_t door_duration;
+} keypad_config_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Initialize NVS storage and if empty, set default values
+*/
+void nvs_configure();
+
+/*
+ * @brief Initialize NVS storage and take the config cache from a warm restart snapshot
+ * @note Nothing is read from NVS, storage_reconcile() checks the cache against it later
+*/
+void nvs_configure_warm(const keypad_config_t * config);
+
+/*
+ * @brief Compare the config cache with NVS and take the NVS values where they differ
+ * @note NVS stays authoritative, this only fixes a snapshot that missed a write
+*/
+esp_err_t storage_reconcile();
+
+/*
+ * @brief Read PIN from NVS storage
+ * @param len Size of the pin buffer including the null terminator
+*/
+esp_err_t read_pin(const char * pin_name, char * pin, size_t len);
+
+/*
+ * @brief Compare a PIN with a stored one (RAM cached)
+ * @param pin_name "access_pin", "admin_pin" or "new_pin"
+*/
+esp_err_t check_pin(const char * pin_to_check, const char * pin_name, bool * is_correct);
+
+/*
+ * @brief Update PIN in NVS storage
+*/
+esp_err_t change_pin(const char * pin_to_write, const char * pin_name);
+
+/*
+ * @brief Update door duration in NVS storage
+*/
+esp_err_t update_door_duration(uint16_t duration);
+
+/*
+ * @brief Door open duration (RAM cached)
+*/
+esp_err_t read_door_duration(uint16_t * duration);
+
+
+#endif // IMP_TERM_STORAGE_H
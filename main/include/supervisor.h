@@ -0,0 +1,93 @@
+/*
+ * @file main/supervisor.h
+ *
+ * @proj imp-term
+ * @brief Deadlines of the access path, task watchdog and restart of a hung terminal
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SUPERVISOR_H
+#define IMP_TERM_SUPERVISOR_H
+
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include <esp_attr.h>
+
+#include "config.h"
+#include "common.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+enum Deadline {
+    DEADLINE_KEY,        // Key handled after its interrupt (SUPERVISOR_KEY_MS)
+    DEADLINE_DOOR_EVENT, // Door event taken by the door task after it was queued (SUPERVISOR_DOOR_EVENT_MS)
+    DEADLINE_DOOR_CLOSE, // Door closed after its open duration (+ SUPERVISOR_DOOR_CLOSE_SLACK_MS)
+    DEADLINE_COUNT
+};
+
+typedef struct __attribute__((packed)) {
+    uint32_t misses;    // Runs that took longer than the deadline
+    uint32_t worst_us;  // Longest finished run
+    uint32_t last_miss; // Seconds since boot of the last miss, 0 if none
+} deadline_stats_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Let the next deadline_start_from_isr() of a deadline start it
+ * @note Call right before waiting for the event, events coming while the task is busy are not timed
+*/
+void deadline_expect(enum Deadline deadline);
+
+/*
+ * @brief Start an expected deadline with its default limit, from an interrupt
+*/
+void IRAM_ATTR deadline_start_from_isr(enum Deadline deadline);
+
+/*
+ * @brief Start a deadline
+ * @param limit_ms Time allowed until deadline_done(), 0 for the default limit
+*/
+void deadline_start(enum Deadline deadline, uint32_t limit_ms);
+
+/*
+ * @brief Stop a deadline, count it as missed if it took too long
+ * @note Does nothing if the deadline is not running
+*/
+void deadline_done(enum Deadline deadline);
+
+/*
+ * @brief Read the miss counters of all deadlines
+*/
+void deadline_get_stats(deadline_stats_t stats[DEADLINE_COUNT]);
+
+/*
+ * @brief Subscribe the calling task to the task watchdog
+ * @note The task has to call supervisor_feed() at least every SUPERVISOR_FEED_MS
+*/
+void supervisor_watch_task();
+
+/*
+ * @brief Reset the task watchdog of the calling task
+*/
+void supervisor_feed();
+
+/*
+ * @brief Limit a blocking wait so that a watched task keeps feeding the watchdog while idle
+*/
+static inline TickType_t supervisor_wait(TickType_t wait)
+{
+    return wait < pdMS_TO_TICKS(SUPERVISOR_FEED_MS) ? wait : pdMS_TO_TICKS(SUPERVISOR_FEED_MS);
+}
+
+/*
+ * @brief Count missed deadlines and restart the terminal when one is overdue by SUPERVISOR_HANG_MS
+*/
+noreturn void supervisor_task();
+
+
+#endif // IMP_TERM_SUPERVISOR_H
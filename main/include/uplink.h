@@ -0,0 +1,65 @@
+/*
+ * @file main/uplink.h
+ *
+ * @proj imp-term
+ * @brief Batched upload of audit events and metrics to an MQTT broker
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_UPLINK_H
+#define IMP_TERM_UPLINK_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "config.h"
+#include "audit.h"
+#include "supervisor.h"
+
+
+// CONVENIENCE DEFINITIONS
+
+#define UPLINK_FORMAT_VERSION 1
+
+/*
+ * Events message (<prefix>/<MAC>/events, QoS 1, little endian): this header
+ * followed by count audit records as stored in flash (see audit_record_t)
+*/
+typedef struct __attribute__((packed)) {
+    uint8_t version;  // UPLINK_FORMAT_VERSION
+    uint8_t count;
+    uint16_t reserved;
+    uint32_t lost;    // Records overwritten in flash before they could be sent, right before this batch
+} uplink_batch_header_t;
+
+// Metrics message (<prefix>/<MAC>/metrics, QoS 0, little endian)
+typedef struct __attribute__((packed)) {
+    uint8_t version;  // UPLINK_FORMAT_VERSION
+    uint8_t reserved[3];
+    uint32_t uptime_sec;
+    uint32_t heap_free;
+    uint32_t heap_min_free;
+    uint32_t last_seq;   // Newest audit event
+    uint32_t acked_seq;  // Newest event the broker has, last_seq - acked_seq are waiting
+    uint32_t lost;       // Events lost to the ring since boot
+    uint32_t reconnects; // Broker connections since boot
+    uint32_t deadline_misses[DEADLINE_COUNT];
+} uplink_metrics_t;
+
+
+// EXPORTED SYMBOLS
+
+#if UPLINK
+
+/*
+ * @brief Bring up the network and the MQTT client and start the uplink task
+ * @note Only in images built by make uplink, the access path never waits on it
+*/
+esp_err_t uplink_start();
+
+#endif // UPLINK
+
+
+#endif // IMP_TERM_UPLINK_H
@@ -0,0 +1,66 @@
+/*
+ * @file main/wiegand.h
+ *
+ * @proj imp-term
+ * @brief Wiegand 26/34-bit card reader input
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_WIEGAND_H
+#define IMP_TERM_WIEGAND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+#define WIEGAND_PULSE_BUF_LEN 128 // Pulses buffered between the ISR and the decoder, power of two
+
+// Frame being received, bits are appended as their pulses come
+typedef struct {
+    uint64_t bits;    // First bit in the most significant position
+    uint8_t count;
+    uint32_t last_us; // Time of the last accepted pulse
+} wiegand_frame_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Configure the D0/D1 lines and start the decoder task
+ * @note Does nothing when WIEGAND_ENABLE is disabled in config.h; call after gpio_configure()
+*/
+esp_err_t wiegand_init();
+
+/*
+ * @brief Decode a Wiegand frame
+ * @param bits Received bits, the first one in the most significant position
+ * @param count Number of received bits
+ * @param card Card number (all bits except the two parity bits)
+ * @return ESP_ERR_INVALID_SIZE for frames other than 26 or 34 bits,
+ *         ESP_ERR_INVALID_CRC if a parity bit does not match
+*/
+esp_err_t wiegand_decode(uint64_t bits, uint8_t count, uint32_t * card);
+
+/*
+ * @brief Add a pulse to the frame being received
+ * @param bit 0 for a pulse on D0, 1 for D1
+ * @param time_us When the pulse came, wraps around as esp_timer_get_time() truncated to 32 bits
+ * @param done The previous frame, if the pulse came after WIEGAND_FRAME_GAP_MS and started a new one
+ * @return true if a frame was completed into done
+ * @note Pulses closer than WIEGAND_MIN_BIT_GAP_US to the last one are dropped as noise
+*/
+bool wiegand_frame_pulse(wiegand_frame_t * frame, uint8_t bit, uint32_t time_us, wiegand_frame_t * done);
+
+/*
+ * @brief End the frame being received once it has been idle for WIEGAND_FRAME_GAP_MS
+ * @return true if a frame was completed into done
+*/
+bool wiegand_frame_idle(wiegand_frame_t * frame, uint32_t now_us, wiegand_frame_t * done);
+
+
+#endif // IMP_TERM_WIEGAND_H
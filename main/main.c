@@ -8,17 +8,49 @@
 */
 
 #include <esp_log.h>
+#include <esp_system.h>
 #include <nvs.h>
 #include <nvs_flash.h>
 
 #include "config.h"
 #include "gpio.h"
 #include "keypad.h"
+#include "storage.h"
+#include "audit.h"
+#include "ota.h"
+#include "admin.h"
+#include "phone.h"
+#include "boot.h"
+#include "power.h"
+#include "credential.h"
+#include "schedule.h"
+#include "otp.h"
+#include "wiegand.h"
+#include "door_io.h"
+#include "snapshot.h"
+#include "bench.h"
+#include "perf.h"
+#include "uplink.h"
+#include "http_server.h"
+#include "supervisor.h"
 
 #include "common.h"
 #include "gap.h"
 #include "gatt_svc.h"
 
+// A BLE write or a burst of LED blinks must never delay a door close
+static_assert(task_priority(TASK_SUPERVISOR) > task_priority(TASK_DOOR_OPEN), "Supervisor must see the door task starve");
+static_assert(task_priority(TASK_DOOR_OPEN) > task_priority(TASK_DOOR_HANDLER), "Door close must preempt door events");
+static_assert(task_priority(TASK_DOOR_HANDLER) > task_priority(TASK_KEYPAD_HANDLER), "Door events must preempt the keypad");
+static_assert(task_priority(TASK_KEYPAD_HANDLER) > task_priority(TASK_NIMBLE_HOST), "Keypad must preempt BLE");
+static_assert(task_priority(TASK_WIEGAND) > task_priority(TASK_NIMBLE_HOST), "Card reader must preempt BLE");
+static_assert(task_priority(TASK_DOOR_HANDLER) > task_priority(TASK_DOOR_IO), "Exit button opens before it is audited");
+static_assert(task_priority(TASK_KEYPAD_HANDLER) > task_priority(TASK_UPLINK), "Keypad must preempt the network uplink");
+static_assert(task_priority(TASK_KEYPAD_HANDLER) > task_priority(TASK_HTTPD), "Keypad must preempt the HTTP server");
+static_assert(task_priority(TASK_KEYPAD_HANDLER) > task_priority(TASK_HTTP_WORKER), "Keypad must preempt the HTTP server");
+static_assert(task_priority(TASK_NIMBLE_HOST) > task_priority(TASK_GPIO_BLINK), "LEDs are cosmetic");
+static_assert(task_priority(TASK_NIMBLE_HOST) > task_priority(TASK_LED_HEARTBEAT), "LEDs are cosmetic");
+
 /*
  * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
  *
@@ -55,7 +87,14 @@ static void nimble_host_config_init(void) {
     ble_hs_cfg.reset_cb = on_stack_reset;
     ble_hs_cfg.sync_cb = on_stack_sync;
     ble_hs_cfg.gatts_register_cb = gatt_svr_register_cb;
-    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+    ble_hs_cfg.store_status_cb = phone_store_status_cb;
+
+    /* Bond with peers so enrolled phones can unlock over an encrypted link */
+    ble_hs_cfg.sm_io_cap = BLE_HS_IO_NO_INPUT_OUTPUT;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
 
     /* Store host configuration */
     ble_store_config_init();
@@ -73,7 +112,7 @@ static void nimble_host_task(void *param) {
 }
 
 noreturn void led_heartbeat_task() {
-    // Blink every second indefinitely
+    // Double blink every heartbeat period indefinitely
     ESP_LOGI(PROJ_NAME, "Heartbeat blink started");
     while(1) {
         if(gpio_get_level(STATUS_LED) == GPIO_LOW) { // Not currently used by other tasks
@@ -81,16 +120,15 @@ noreturn void led_heartbeat_task() {
             vTaskDelaySec(0.1);
             gpio_blink_blocking(STATUS_LED, seconds(0.1));
         }
-        vTaskDelaySec(0.7);
+        vTaskDelayMSec(HEARTBEAT_PERIOD_MS - 300);
     }
 }
 
-void app_main(void)
+/*
+ * @brief Bring up BLE and everything that depends on it, off the keypad's critical path
+*/
+static void ble_init_task(void *param)
 {
-    // Initialization
-    gpio_configure();
-    nvs_configure();
-
     int rc;
     esp_err_t ret;
 
@@ -99,48 +137,155 @@ void app_main(void)
     if (ret != ESP_OK) {
         ESP_LOGE(PROJ_NAME, "failed to initialize nimble stack, error code: %d ",
                  ret);
-        return;
+        vTaskDelete(NULL);
     }
 
     /* GAP service initialization */
     rc = gap_init();
     if (rc != 0) {
         ESP_LOGE(PROJ_NAME, "failed to initialize GAP service, error code: %d", rc);
-        return;
+        vTaskDelete(NULL);
     }
 
     /* GATT server initialization */
     rc = gatt_svc_init();
     if (rc != 0) {
         ESP_LOGE(PROJ_NAME, "failed to initialize GATT server, error code: %d", rc);
-        return;
+        vTaskDelete(NULL);
     }
 
     /* NimBLE host configuration initialization */
     nimble_host_config_init();
+    boot_mark(BOOT_STAGE_BLE_STACK);
+
+    /* Firmware update buffers */
+    ESP_ERROR_CHECK(ota_init());
+    ESP_ERROR_CHECK(phone_init());
+
+    if(task_create(&ota_flash_task, NULL, NULL, TASK_OTA_FLASH) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create OTA flash task");
+        abort();
+    }
+
+    /* Start NimBLE host task thread */
+    if(task_create(nimble_host_task, NULL, NULL, TASK_NIMBLE_HOST) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create NimBLE host task");
+        abort();
+    }
+    boot_mark(BOOT_STAGE_BLE_READY);
+
+    /* Everything came up, the bootloader can stop considering a rollback */
+    ota_confirm_image();
 
     ESP_LOGI(PROJ_NAME, "Initialization complete");
-    ESP_LOGI(PROJ_NAME, "Starting tasks...");
+    boot_report();
+    vTaskDelete(NULL);
+}
 
-    // Create long-running tasks
-    if(xTaskCreate(&led_heartbeat_task, "led_heartbeat", 4*1024, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
-        ESP_LOGE(PROJ_NAME, "Failed to create heartbeat task");
+void app_main(void)
+{
+    boot_mark(BOOT_STAGE_APP_MAIN);
+
+    // Stage 1: everything the keypad needs, from the config cached in RAM
+    gpio_configure();
+    if(power_init() != ESP_OK) {
+        ESP_LOGW(PROJ_NAME, "Power management unavailable, staying awake");
+    }
+    boot_mark(BOOT_STAGE_GPIO);
+    // After a software or watchdog restart the keypad config comes from RTC memory
+    snapshot_t snapshot;
+    bool warm = snapshot_load(&snapshot);
+    if(warm)
+        nvs_configure_warm(&snapshot.config);
+    else
+        nvs_configure();
+    ESP_ERROR_CHECK(credential_init());
+    ESP_ERROR_CHECK(schedule_init());
+    ESP_ERROR_CHECK(otp_init());
+    if(warm)
+        otp_restore_used(snapshot.otp_used);
+    boot_mark(BOOT_STAGE_CONFIG);
+    if(audit_init() != ESP_OK) {
+        ESP_LOGE(PROJ_NAME, "Audit log unavailable, events will not be recorded");
+    }
+    // The reset reason tells a supervisor or watchdog restart from a power cycle
+    audit_log_event(AUDIT_EVT_BOOT, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, esp_reset_reason());
+    boot_mark(BOOT_STAGE_AUDIT);
+
+    // Before the tasks it watches, so no deadline is started unseen
+    if(task_create(&supervisor_task, NULL, NULL, TASK_SUPERVISOR) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create supervisor task");
         abort();
     }
-    if(xTaskCreate(&keypad_handler_task, "keypad_handler", 4*1024, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
+
+    door_configure();
+    if(warm) {
+        access_restore_lockout(snapshot.lockout_left_ms);
+        // Fail secure, the rest of the interrupted open is not resumed
+        if(snapshot.door_open) {
+            ESP_LOGW(PROJ_NAME, "Door was open when the terminal restarted, keeping it locked");
+            audit_log_event(AUDIT_EVT_DOOR_CLOSE, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, 0);
+            snapshot_save_door(false);
+        }
+    }
+    if(task_create(&door_handler_task, NULL, NULL, TASK_DOOR_HANDLER) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create door handler task");
+        abort();
+    }
+    if(task_create(&keypad_handler_task, NULL, NULL, TASK_KEYPAD_HANDLER) != pdPASS) {
         ESP_LOGE(PROJ_NAME, "Failed to create keypad handler task");
         abort();
     }
-    if(xTaskCreate(&door_handler_task, "door_handler", 4*1024, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
-        ESP_LOGE(PROJ_NAME, "Failed to create door handler task");
+    ESP_ERROR_CHECK(wiegand_init());
+    ESP_ERROR_CHECK(door_io_init());
+    boot_mark(BOOT_STAGE_KEYPAD_READY);
+    ESP_LOGI(PROJ_NAME, "Keypad ready");
+
+    // Stage 2: BLE on the other core, the keypad is already usable meanwhile
+    // Admin sessions first, the HTTP server has them too and QEMU images start no BLE
+    ESP_ERROR_CHECK(admin_init());
+#if PERF_HOOKS || CONFIG_ETH_USE_OPENETH
+    ESP_LOGW(PROJ_NAME, "QEMU image, BLE not started (not emulated by QEMU)");
+#else
+    if(task_create(&ble_init_task, NULL, NULL, TASK_BLE_INIT) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create BLE init task");
         abort();
     }
+#endif
 
-    /* Start NimBLE host task thread and return */
-    if(xTaskCreate(nimble_host_task, "nimble_host", 4*1024, NULL, 5, NULL) != pdPASS) {
-        ESP_LOGE(PROJ_NAME, "Failed to create NimBLE host task");
+    // Stage 3: background tasks
+    if(task_create(&led_heartbeat_task, NULL, NULL, TASK_LED_HEARTBEAT) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create heartbeat task");
+        abort();
+    }
+    if(task_create(&audit_writer_task, NULL, NULL, TASK_AUDIT_WRITER) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create audit writer task");
         abort();
     }
+    // The keypad already runs on the restored config, NVS only has to confirm it
+    if(warm && storage_reconcile() != ESP_OK) {
+        ESP_LOGE(PROJ_NAME, "Failed to check the restored config against NVS");
+    }
+#if PERF_HOOKS
+    if(task_create(&perf_task, NULL, NULL, TASK_PERF) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create perf task");
+        abort();
+    }
+#endif
+#if BENCH_CONSOLE
+    ESP_ERROR_CHECK(bench_console_start());
+#endif
+#if UPLINK
+    // After the audit writer, whose flash ring is the uplink's send queue
+    if(uplink_start() != ESP_OK) {
+        ESP_LOGE(PROJ_NAME, "Uplink unavailable, events are only kept in the audit log");
+    }
+#endif
+#if HTTP_SERVER
+    if(http_server_start() != ESP_OK) {
+        ESP_LOGE(PROJ_NAME, "HTTP server unavailable, configure over BLE");
+    }
+#endif
 
     return;
 }
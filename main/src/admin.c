@@ -0,0 +1,370 @@
+/*
+ * @file main/admin.c
+ *
+ * @proj imp-term
+ * @brief Authenticated admin sessions for configuration over BLE and HTTP
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <mbedtls/md.h>
+
+#include <freertos/semphr.h>
+
+#include "config.h"
+#include "admin.h"
+#include "audit.h"
+#include "storage.h"
+#include "keypad.h"
+#include "common.h"
+
+// One per BLE connection, plus the HTTP clients' own, so neither can crowd out the other
+#define ADMIN_MAX_SESSIONS (CONFIG_BT_NIMBLE_MAX_CONNECTIONS + (HTTP_SERVER ? HTTP_ADMIN_SESSIONS : 0))
+#define ADMIN_HMAC_LEN 32
+
+typedef struct {
+    uint16_t conn_handle; // BLE_HS_CONN_HANDLE_NONE for a free slot
+    bool challenged;      // Challenge issued and not yet answered
+    int64_t challenged_at; // esp_timer time of the challenge
+    uint32_t client;      // Address of the HTTP client the challenge went to
+    bool active;          // Logged in
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint32_t counter;     // Last accepted write counter
+    // HMAC context keyed with the session key, only reset per write so the
+    // key schedule (inner/outer pad hashing) is done once per session
+    mbedtls_md_context_t mac;
+    esp_timer_handle_t expiry;
+} admin_session_t;
+
+// Failed logins in a row from one source (BLE or HTTP) and the wait they impose on it. A new
+// connection or HTTP handle does not start the count over, only a successful login does
+typedef struct {
+    uint8_t failures;
+    int64_t locked_until; // esp_timer time
+} admin_backoff_t;
+
+static admin_session_t sessions[ADMIN_MAX_SESSIONS];
+static admin_backoff_t backoff[2]; // BLE, HTTP
+static SemaphoreHandle_t sessions_mutex;
+static SemaphoreHandle_t write_mutex;
+
+static void admin_session_expired(void * arg)
+{
+    admin_session_t * session = arg;
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+    if(session->active) {
+        ESP_LOGI(PROJ_NAME, "Admin session on connection %d expired", session->conn_handle);
+        session->active = false;
+    }
+    xSemaphoreGive(sessions_mutex);
+}
+
+esp_err_t admin_init()
+{
+    sessions_mutex = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(sessions_mutex != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create session mutex");
+    write_mutex = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(write_mutex != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create write mutex");
+
+    const mbedtls_md_info_t * sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    for(uint8_t i = 0; i < ADMIN_MAX_SESSIONS; i++) {
+        sessions[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        mbedtls_md_init(&sessions[i].mac);
+        ESP_RETURN_ON_FALSE(mbedtls_md_setup(&sessions[i].mac, sha256, 1) == 0, ESP_ERR_NO_MEM, PROJ_NAME, "Failed to set up HMAC context");
+
+        esp_timer_create_args_t timer_args = {
+            .callback = &admin_session_expired,
+            .arg = &sessions[i],
+            .name = "admin_session",
+        };
+        ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &sessions[i].expiry), PROJ_NAME, "Failed to create session timer");
+    }
+    return ESP_OK;
+}
+
+/*
+ * @brief Find the session slot of a connection
+ * @note Must be called with sessions_mutex held
+*/
+static admin_session_t * admin_find_session(uint16_t conn_handle)
+{
+    for(uint8_t i = 0; i < ADMIN_MAX_SESSIONS; i++) {
+        if(sessions[i].conn_handle == conn_handle)
+            return &sessions[i];
+    }
+    return NULL;
+}
+
+/*
+ * @brief Backoff of the source of a connection
+ * @note Must be called with sessions_mutex held
+*/
+static admin_backoff_t * admin_find_backoff(uint16_t conn_handle)
+{
+    return &backoff[admin_source(conn_handle) == AUDIT_SOURCE_HTTP];
+}
+
+/*
+ * @brief Count a failed login of a source and make it wait twice as long as after the last one
+ * @note Must be called with sessions_mutex held
+*/
+static void admin_register_failure(admin_backoff_t * source, int64_t now)
+{
+    uint32_t wait_sec = ADMIN_LOGIN_BACKOFF_SEC;
+    for(uint8_t i = 0; i < source->failures && wait_sec < ADMIN_LOGIN_BACKOFF_MAX_SEC; i++)
+        wait_sec *= 2;
+    if(wait_sec > ADMIN_LOGIN_BACKOFF_MAX_SEC)
+        wait_sec = ADMIN_LOGIN_BACKOFF_MAX_SEC;
+    if(source->failures < UINT8_MAX)
+        source->failures++;
+    source->locked_until = now + (int64_t) seconds(wait_sec) * 1000;
+
+    // The keypads and the other credential sources wait too
+    access_register_failure();
+}
+
+/*
+ * @brief Compare two buffers in time independent of their content
+*/
+static bool admin_equal(const uint8_t * a, const uint8_t * b, size_t len)
+{
+    uint8_t diff = 0;
+    for(size_t i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/*
+ * @brief HMAC(admin PIN, label | challenge)
+*/
+static esp_err_t admin_derive(const char * admin_pin, const char * label, const uint8_t * challenge, uint8_t * out)
+{
+    uint8_t msg[16 + ADMIN_CHALLENGE_LEN];
+    size_t label_len = strlen(label);
+    assert(label_len <= 16);
+    memcpy(msg, label, label_len);
+    memcpy(&msg[label_len], challenge, ADMIN_CHALLENGE_LEN);
+
+    int rc = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                             (const uint8_t *) admin_pin, strlen(admin_pin),
+                             msg, label_len + ADMIN_CHALLENGE_LEN, out);
+    return rc == 0 ? ESP_OK : ESP_FAIL;
+}
+
+/*
+ * @brief Give a slot to a connection and issue its challenge
+ * @note Must be called with sessions_mutex held
+*/
+static void admin_issue_challenge(admin_session_t * session, uint16_t conn_handle, uint8_t * challenge)
+{
+    esp_timer_stop(session->expiry);
+    session->conn_handle = conn_handle;
+    session->active = false;
+    session->challenged = true;
+    session->challenged_at = esp_timer_get_time();
+    esp_fill_random(session->challenge, ADMIN_CHALLENGE_LEN);
+    memcpy(challenge, session->challenge, ADMIN_CHALLENGE_LEN);
+}
+
+esp_err_t admin_challenge(uint16_t conn_handle, uint8_t * challenge)
+{
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+    admin_session_t * session = admin_find_session(conn_handle);
+    if(session == NULL)
+        session = admin_find_session(BLE_HS_CONN_HANDLE_NONE);
+
+    // Asking for a new challenge ends any session the connection had
+    if(session != NULL)
+        admin_issue_challenge(session, conn_handle, challenge);
+    else
+        ret = ESP_ERR_NO_MEM;
+    xSemaphoreGive(sessions_mutex);
+    return ret;
+}
+
+/*
+ * @brief Check whether a session holds a challenge that is neither answered nor expired
+ * @note Must be called with sessions_mutex held
+*/
+static bool admin_challenge_pending(const admin_session_t * session, int64_t now)
+{
+    return session != NULL && !session->active && session->challenged &&
+           now - session->challenged_at < seconds((int64_t) ADMIN_CHALLENGE_TIMEOUT_SEC) * 1000;
+}
+
+esp_err_t admin_challenge_free(uint16_t first, uint8_t count, uint32_t client, uint16_t * conn_handle, uint8_t * challenge)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    int64_t now = esp_timer_get_time();
+    admin_session_t * session = NULL;
+    uint16_t handle;
+
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+
+    // One unanswered challenge per client: asking again replaces its own, so a
+    // single client cannot hold every handle with challenges it never answers
+    for(handle = first; handle < first + count; handle++) {
+        session = admin_find_session(handle);
+        if(admin_challenge_pending(session, now) && session->client == client)
+            break;
+    }
+
+    if(handle == first + count) {
+        for(handle = first; handle < first + count; handle++) {
+            session = admin_find_session(handle);
+            if(session != NULL && (session->active || admin_challenge_pending(session, now)))
+                continue; // Logged in, or another client's login in progress
+            if(session == NULL)
+                session = admin_find_session(BLE_HS_CONN_HANDLE_NONE);
+            break;
+        }
+    }
+
+    if(handle < first + count && session != NULL) {
+        admin_issue_challenge(session, handle, challenge);
+        session->client = client;
+        *conn_handle = handle;
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(sessions_mutex);
+    return ret;
+}
+
+int admin_login(uint16_t conn_handle, const uint8_t * response, uint16_t len)
+{
+    uint8_t expected[ADMIN_HMAC_LEN];
+    uint8_t session_key[ADMIN_HMAC_LEN];
+    char admin_pin[KEYPAD_PIN_MAX_LEN + 1] = {0};
+    int rc = 0;
+
+    if(len != ADMIN_RESPONSE_LEN)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+    admin_session_t * session = admin_find_session(conn_handle);
+    if(session == NULL || !session->challenged) {
+        rc = BLE_ATT_ERR_WRITE_NOT_PERMITTED; // Read a challenge first
+        goto out;
+    }
+    session->challenged = false; // One attempt per challenge
+
+    // Refused unchecked, so a waiting source learns nothing about the PIN
+    admin_backoff_t * source = admin_find_backoff(conn_handle);
+    int64_t now = esp_timer_get_time();
+    if(access_locked_out() || now < source->locked_until) {
+        ESP_LOGI(PROJ_NAME, "Admin login on connection %d refused, locked out", conn_handle);
+        rc = BLE_ATT_ERR_INSUFFICIENT_RES;
+        goto out;
+    }
+
+    if(read_pin("admin_pin", admin_pin, sizeof(admin_pin)) != ESP_OK ||
+       admin_derive(admin_pin, "login", session->challenge, expected) != ESP_OK) {
+        rc = BLE_ATT_ERR_UNLIKELY;
+        goto out;
+    }
+
+    if(!admin_equal(response, expected, ADMIN_RESPONSE_LEN)) {
+        ESP_LOGI(PROJ_NAME, "Admin login on connection %d failed", conn_handle);
+        audit_log_event(AUDIT_EVT_ADMIN_AUTH, AUDIT_SLOT_ADMIN_PIN, AUDIT_RES_DENIED, admin_source(conn_handle), 0);
+        admin_register_failure(source, now);
+        rc = BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+        goto out;
+    }
+
+    // The only expensive step of a session: derive the key and run its HMAC key schedule
+    if(admin_derive(admin_pin, "session", session->challenge, session_key) != ESP_OK ||
+       mbedtls_md_hmac_starts(&session->mac, session_key, sizeof(session_key)) != 0) {
+        rc = BLE_ATT_ERR_UNLIKELY;
+        goto out;
+    }
+
+    source->failures = 0;
+    session->counter = 0;
+    session->active = true;
+    esp_timer_stop(session->expiry);
+    esp_timer_start_once(session->expiry, (uint64_t) ADMIN_SESSION_TIMEOUT_SEC * 1000 * 1000);
+
+    ESP_LOGI(PROJ_NAME, "Admin session opened on connection %d", conn_handle);
+    audit_log_event(AUDIT_EVT_ADMIN_AUTH, AUDIT_SLOT_ADMIN_PIN, AUDIT_RES_GRANTED, admin_source(conn_handle), 0);
+
+out:
+    xSemaphoreGive(sessions_mutex);
+    memset(admin_pin, 0, sizeof(admin_pin));
+    memset(session_key, 0, sizeof(session_key));
+    return rc;
+}
+
+int admin_verify_write(uint16_t conn_handle, const uint8_t * uuid128, const uint8_t * value, uint16_t len,
+                       uint8_t * payload, uint16_t * payload_len)
+{
+    const uint8_t * counter_raw;
+    const uint8_t * tag;
+    uint8_t expected[ADMIN_HMAC_LEN];
+    uint32_t counter;
+    int rc = 0;
+
+    if(len < ADMIN_TRAILER_LEN || len - ADMIN_TRAILER_LEN > *payload_len)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    *payload_len = len - ADMIN_TRAILER_LEN;
+    memcpy(payload, value, *payload_len);
+    counter_raw = &value[*payload_len];
+    tag = &counter_raw[sizeof(counter)];
+    memcpy(&counter, counter_raw, sizeof(counter));
+
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+    admin_session_t * session = admin_find_session(conn_handle);
+    if(session == NULL || !session->active) {
+        rc = BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+        goto out;
+    }
+    if(counter <= session->counter) {
+        rc = BLE_ATT_ERR_INSUFFICIENT_AUTHEN; // Replayed write
+        goto out;
+    }
+
+    mbedtls_md_hmac_reset(&session->mac);
+    mbedtls_md_hmac_update(&session->mac, uuid128, 16);
+    mbedtls_md_hmac_update(&session->mac, counter_raw, sizeof(counter));
+    mbedtls_md_hmac_update(&session->mac, payload, *payload_len);
+    mbedtls_md_hmac_finish(&session->mac, expected);
+
+    if(!admin_equal(tag, expected, ADMIN_TAG_LEN)) {
+        rc = BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+        goto out;
+    }
+    session->counter = counter;
+
+out:
+    xSemaphoreGive(sessions_mutex);
+    return rc;
+}
+
+void admin_logout(uint16_t conn_handle)
+{
+    xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+    admin_session_t * session = admin_find_session(conn_handle);
+    if(session != NULL) {
+        esp_timer_stop(session->expiry);
+        session->active = false;
+        session->challenged = false;
+        session->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    xSemaphoreGive(sessions_mutex);
+}
+
+void admin_write_begin()
+{
+    xSemaphoreTake(write_mutex, portMAX_DELAY);
+}
+
+void admin_write_end()
+{
+    xSemaphoreGive(write_mutex);
+}
@@ -0,0 +1,456 @@
+/*
+ * @file main/audit.c
+ *
+ * @proj imp-term
+ * @brief Append-only audit log of access events kept in a flash ring
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <stddef.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <freertos/semphr.h>
+
+#include "config.h"
+#include "audit.h"
+#include "common.h"
+
+/*
+ * Layout: the partition is a ring of flash sectors, each holding
+ * AUDIT_RECORDS_PER_SECTOR fixed size records. Records carry a monotonic
+ * sequence number and a CRC, so the ring needs no extra metadata:
+ *  - the newest sector is the one whose first valid record has the highest seq
+ *  - a record torn by power loss fails its CRC and is skipped
+ *  - a sector is erased right before its first record is written, so a torn
+ *    erase only ever hits the sector following the newest one
+*/
+
+#define AUDIT_SECTOR_SIZE 4096
+#define AUDIT_PAGE_SIZE   256 // Flash program page, the unit of batched writes
+#define AUDIT_RECORD_SIZE sizeof(audit_record_t)
+#define AUDIT_RECORDS_PER_SECTOR (AUDIT_SECTOR_SIZE / AUDIT_RECORD_SIZE)
+#define AUDIT_RECORDS_PER_PAGE   (AUDIT_PAGE_SIZE / AUDIT_RECORD_SIZE)
+#define AUDIT_MAX_SECTORS 64
+#define AUDIT_SEQ_NONE UINT32_MAX
+
+#define audit_offset_to_sector(offset) ((offset) / AUDIT_SECTOR_SIZE)
+
+static const esp_partition_t * audit_part;
+static uint32_t audit_size;       // Usable size (whole sectors only)
+static uint32_t audit_write_offset; // Next free record slot
+static uint32_t sector_first_seq[AUDIT_MAX_SECTORS]; // AUDIT_SEQ_NONE = empty
+
+// RAM staging ring, indices only ever grow (wrap at UINT32_MAX is harmless)
+static audit_record_t ram_ring[AUDIT_RAM_RECORDS];
+static uint32_t ram_head;
+static uint32_t ram_tail;
+static uint32_t ram_dropped;
+static uint32_t next_seq = 1;
+static portMUX_TYPE ram_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t audit_task_handle;
+
+// Held while the ring in flash changes, so that readers on other tasks see whole writes
+static SemaphoreHandle_t flash_lock;
+
+// Export request, written by the NimBLE host and consumed by the writer task
+static struct {
+    bool active;
+    uint32_t generation; // Bumped on every new request
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    uint32_t from_seq;
+} export_req;
+
+static uint16_t audit_crc(const audit_record_t * rec)
+{
+    return esp_rom_crc16_le(0, (const uint8_t *) rec, offsetof(audit_record_t, crc));
+}
+
+static bool audit_record_valid(const audit_record_t * rec)
+{
+    return rec->seq != AUDIT_SEQ_NONE && rec->crc == audit_crc(rec);
+}
+
+static bool audit_record_erased(const audit_record_t * rec)
+{
+    const uint8_t * bytes = (const uint8_t *) rec;
+    for(size_t i = 0; i < AUDIT_RECORD_SIZE; i++) {
+        if(bytes[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * @brief Find the sequence number of the first valid record in a sector
+ * @return AUDIT_SEQ_NONE if the sector holds no valid record
+*/
+static uint32_t audit_scan_first_seq(uint32_t sector)
+{
+    audit_record_t page[AUDIT_RECORDS_PER_PAGE];
+    for(uint32_t offset = 0; offset < AUDIT_SECTOR_SIZE; offset += sizeof(page)) {
+        if(esp_partition_read(audit_part, sector * AUDIT_SECTOR_SIZE + offset, page, sizeof(page)) != ESP_OK)
+            return AUDIT_SEQ_NONE;
+        for(uint8_t i = 0; i < array_len(page); i++) {
+            if(audit_record_valid(&page[i]))
+                return page[i].seq;
+            if(audit_record_erased(&page[i]))
+                return AUDIT_SEQ_NONE; // Nothing was written past this point
+        }
+    }
+    return AUDIT_SEQ_NONE;
+}
+
+/*
+ * @brief Find the write position inside the newest sector
+ * @param last_seq Highest valid sequence number found in the sector
+ * @return Slot index after the last non-erased slot
+*/
+static uint32_t audit_scan_head(uint32_t sector, uint32_t * last_seq)
+{
+    audit_record_t page[AUDIT_RECORDS_PER_PAGE];
+    uint32_t used = 0;
+    for(uint32_t slot = 0; slot < AUDIT_RECORDS_PER_SECTOR; slot += AUDIT_RECORDS_PER_PAGE) {
+        ESP_ERROR_CHECK(esp_partition_read(audit_part, sector * AUDIT_SECTOR_SIZE + slot * AUDIT_RECORD_SIZE, page, sizeof(page)));
+        for(uint8_t i = 0; i < array_len(page); i++) {
+            if(audit_record_erased(&page[i]))
+                continue;
+            used = slot + i + 1; // A torn record still occupies its slot
+            if(audit_record_valid(&page[i]) && page[i].seq > *last_seq)
+                *last_seq = page[i].seq;
+        }
+    }
+    return used;
+}
+
+esp_err_t audit_init()
+{
+    ESP_LOGI(PROJ_NAME, "Configuring audit log");
+
+    flash_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(flash_lock != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Error creating audit lock");
+
+    audit_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, AUDIT_PARTITION_LABEL);
+    ESP_RETURN_ON_FALSE(audit_part != NULL, ESP_ERR_NOT_FOUND, PROJ_NAME, "Audit partition not found");
+
+    uint32_t sector_count = audit_part->size / AUDIT_SECTOR_SIZE;
+    if(sector_count > AUDIT_MAX_SECTORS)
+        sector_count = AUDIT_MAX_SECTORS;
+    ESP_RETURN_ON_FALSE(sector_count >= 2, ESP_ERR_INVALID_SIZE, PROJ_NAME, "Audit partition too small");
+    audit_size = sector_count * AUDIT_SECTOR_SIZE;
+
+    // Newest sector is the one starting with the highest sequence number
+    uint32_t head = 0;
+    uint32_t head_seq = 0;
+    bool empty = true;
+    for(uint32_t sector = 0; sector < sector_count; sector++) {
+        sector_first_seq[sector] = audit_scan_first_seq(sector);
+        if(sector_first_seq[sector] != AUDIT_SEQ_NONE && (empty || sector_first_seq[sector] > head_seq)) {
+            head = sector;
+            head_seq = sector_first_seq[sector];
+            empty = false;
+        }
+    }
+
+    uint32_t last_seq = 0;
+    uint32_t used = empty ? 0 : audit_scan_head(head, &last_seq);
+    next_seq = last_seq + 1;
+
+    if(used == 0 || used == AUDIT_RECORDS_PER_SECTOR) {
+        // Start on a fresh sector, redoing an erase power loss may have cut short
+        if(used != 0)
+            head = (head + 1) % sector_count;
+        used = 0;
+        ESP_RETURN_ON_ERROR(esp_partition_erase_range(audit_part, head * AUDIT_SECTOR_SIZE, AUDIT_SECTOR_SIZE), PROJ_NAME, "Error erasing audit sector");
+        sector_first_seq[head] = AUDIT_SEQ_NONE;
+    }
+    audit_write_offset = head * AUDIT_SECTOR_SIZE + used * AUDIT_RECORD_SIZE;
+
+    ESP_LOGI(PROJ_NAME, "Audit log configured (next seq %lu, sector %lu, slot %lu)",
+             (unsigned long) next_seq, (unsigned long) head, (unsigned long) used);
+    return ESP_OK;
+}
+
+void audit_log_event(uint8_t type, uint8_t slot, uint8_t result, uint8_t source, uint16_t aux)
+{
+    audit_record_t rec = {
+        .timestamp = (uint32_t) time(NULL),
+        .type = type,
+        .slot = slot,
+        .result = result,
+        .source = source,
+        .aux = aux,
+    };
+    bool page_ready = false;
+
+    taskENTER_CRITICAL(&ram_lock);
+    if(ram_head - ram_tail < AUDIT_RAM_RECORDS) {
+        rec.seq = next_seq++;
+        ram_ring[ram_head++ % AUDIT_RAM_RECORDS] = rec;
+        page_ready = ram_head - ram_tail >= AUDIT_RECORDS_PER_PAGE;
+    } else {
+        ram_dropped++;
+    }
+    taskEXIT_CRITICAL(&ram_lock);
+
+    // CRC and flash write happen on the writer task, wake it once a page is full
+    if(page_ready && audit_task_handle != NULL)
+        xTaskNotifyGive(audit_task_handle);
+}
+
+void audit_flush_request()
+{
+    if(audit_task_handle != NULL)
+        xTaskNotifyGive(audit_task_handle);
+}
+
+/*
+ * @brief Write buffered records to flash, one page-bounded batch at a time
+*/
+static void audit_flush()
+{
+    audit_record_t batch[AUDIT_RECORDS_PER_PAGE];
+
+    while(1) {
+        uint32_t slot = audit_write_offset / AUDIT_RECORD_SIZE;
+        uint32_t room = AUDIT_RECORDS_PER_PAGE - slot % AUDIT_RECORDS_PER_PAGE;
+        uint32_t count;
+
+        taskENTER_CRITICAL(&ram_lock);
+        count = ram_head - ram_tail;
+        if(count > room)
+            count = room;
+        for(uint32_t i = 0; i < count; i++)
+            batch[i] = ram_ring[(ram_tail + i) % AUDIT_RAM_RECORDS];
+        taskEXIT_CRITICAL(&ram_lock);
+
+        if(count == 0)
+            return;
+
+        for(uint32_t i = 0; i < count; i++)
+            batch[i].crc = audit_crc(&batch[i]);
+
+        xSemaphoreTake(flash_lock, portMAX_DELAY);
+        uint32_t sector = audit_offset_to_sector(audit_write_offset);
+        if(slot % AUDIT_RECORDS_PER_SECTOR == 0) {
+            // Entering a new sector, it has to be erased first (drops the oldest records)
+            if(esp_partition_erase_range(audit_part, sector * AUDIT_SECTOR_SIZE, AUDIT_SECTOR_SIZE) != ESP_OK) {
+                xSemaphoreGive(flash_lock);
+                ESP_LOGE(PROJ_NAME, "Error erasing audit sector %lu", (unsigned long) sector);
+                return;
+            }
+            sector_first_seq[sector] = AUDIT_SEQ_NONE;
+        }
+
+        if(esp_partition_write(audit_part, audit_write_offset, batch, count * AUDIT_RECORD_SIZE) != ESP_OK) {
+            xSemaphoreGive(flash_lock);
+            ESP_LOGE(PROJ_NAME, "Error writing audit records");
+            return;
+        }
+        if(sector_first_seq[sector] == AUDIT_SEQ_NONE)
+            sector_first_seq[sector] = batch[0].seq;
+
+        audit_write_offset = (audit_write_offset + count * AUDIT_RECORD_SIZE) % audit_size;
+        xSemaphoreGive(flash_lock);
+
+        taskENTER_CRITICAL(&ram_lock);
+        ram_tail += count;
+        taskEXIT_CRITICAL(&ram_lock);
+    }
+}
+
+/*
+ * @brief Find the flash offset of the first record with seq >= from_seq
+ * @note Starts at the oldest record if from_seq has already been overwritten
+*/
+static uint32_t audit_locate(uint32_t from_seq)
+{
+    uint32_t sector_count = audit_size / AUDIT_SECTOR_SIZE;
+    uint32_t best = UINT32_MAX;
+    uint32_t oldest = UINT32_MAX;
+
+    for(uint32_t sector = 0; sector < sector_count; sector++) {
+        uint32_t first = sector_first_seq[sector];
+        if(first == AUDIT_SEQ_NONE)
+            continue;
+        if(oldest == UINT32_MAX || first < sector_first_seq[oldest])
+            oldest = sector;
+        if(first <= from_seq && (best == UINT32_MAX || first > sector_first_seq[best]))
+            best = sector;
+    }
+
+    if(best == UINT32_MAX)
+        best = oldest;
+    if(best == UINT32_MAX)
+        return audit_write_offset; // Log is empty
+    return best * AUDIT_SECTOR_SIZE;
+}
+
+uint32_t audit_last_seq()
+{
+    taskENTER_CRITICAL(&ram_lock);
+    uint32_t seq = next_seq - 1;
+    taskEXIT_CRITICAL(&ram_lock);
+    return seq;
+}
+
+size_t audit_read(uint32_t from_seq, audit_record_t * records, size_t max)
+{
+    size_t count = 0;
+
+    if(audit_part == NULL)
+        return 0;
+
+    xSemaphoreTake(flash_lock, portMAX_DELAY);
+    uint32_t offset = audit_locate(from_seq);
+    while(count < max && offset != audit_write_offset) {
+        if(esp_partition_read(audit_part, offset, &records[count], AUDIT_RECORD_SIZE) != ESP_OK)
+            break;
+        offset = (offset + AUDIT_RECORD_SIZE) % audit_size;
+        if(audit_record_valid(&records[count]) && records[count].seq >= from_seq)
+            count++;
+    }
+    xSemaphoreGive(flash_lock);
+    return count;
+}
+
+// Export state private to the writer task
+static uint32_t export_generation;
+static uint32_t export_offset;
+
+/*
+ * @brief Send as many notifications as the BLE stack accepts right now
+ * @return true if the export is still running
+*/
+static bool audit_export_step()
+{
+    taskENTER_CRITICAL(&ram_lock);
+    bool active = export_req.active;
+    uint32_t generation = export_req.generation;
+    uint16_t conn_handle = export_req.conn_handle;
+    uint16_t attr_handle = export_req.attr_handle;
+    uint32_t from_seq = export_req.from_seq;
+    taskEXIT_CRITICAL(&ram_lock);
+
+    if(!active)
+        return false;
+
+    if(generation != export_generation) {
+        export_generation = generation;
+        export_offset = audit_locate(from_seq);
+    }
+
+    uint16_t mtu = ble_att_mtu(conn_handle);
+    if(mtu == 0) // Connection is gone
+        goto done;
+
+    // Largest batch of whole records fitting in one notification (ATT header is 3 bytes)
+    uint8_t buf[BLE_ATT_MTU_MAX];
+    size_t per_notify = (mtu - 3) / AUDIT_RECORD_SIZE;
+    if(per_notify * AUDIT_RECORD_SIZE > sizeof(buf))
+        per_notify = sizeof(buf) / AUDIT_RECORD_SIZE;
+
+    while(1) {
+        size_t count = 0;
+        uint32_t offset = export_offset;
+        audit_record_t * out = (audit_record_t *) buf;
+
+        while(count < per_notify && offset != audit_write_offset) {
+            ESP_ERROR_CHECK(esp_partition_read(audit_part, offset, &out[count], AUDIT_RECORD_SIZE));
+            offset = (offset + AUDIT_RECORD_SIZE) % audit_size;
+            if(audit_record_valid(&out[count]) && out[count].seq >= from_seq)
+                count++;
+        }
+
+        // An empty notification tells the client it has everything
+        struct os_mbuf * om = ble_hs_mbuf_from_flat(buf, count * AUDIT_RECORD_SIZE);
+        if(om == NULL)
+            return true; // Out of buffers, retry after a backoff
+
+        int rc = ble_gatts_notify_custom(conn_handle, attr_handle, om);
+        if(rc == BLE_HS_ENOMEM)
+            return true;
+        if(rc != 0) {
+            ESP_LOGE(PROJ_NAME, "Audit export aborted, error code: %d", rc);
+            goto done;
+        }
+
+        export_offset = offset;
+        if(count == 0) {
+            ESP_LOGI(PROJ_NAME, "Audit export finished");
+            goto done;
+        }
+    }
+
+done:
+    taskENTER_CRITICAL(&ram_lock);
+    if(export_req.generation == generation)
+        export_req.active = false;
+    taskEXIT_CRITICAL(&ram_lock);
+    return false;
+}
+
+esp_err_t audit_export_start(uint16_t conn_handle, uint16_t attr_handle, uint32_t from_seq)
+{
+    esp_err_t ret = ESP_OK;
+
+    taskENTER_CRITICAL(&ram_lock);
+    if(export_req.active && export_req.conn_handle != conn_handle) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        // Same client asking again simply restarts from the new cursor
+        export_req.active = true;
+        export_req.generation++;
+        export_req.conn_handle = conn_handle;
+        export_req.attr_handle = attr_handle;
+        export_req.from_seq = from_seq;
+    }
+    taskEXIT_CRITICAL(&ram_lock);
+
+    if(ret == ESP_OK && audit_task_handle != NULL)
+        xTaskNotifyGive(audit_task_handle);
+    return ret;
+}
+
+void audit_export_stop(uint16_t conn_handle)
+{
+    taskENTER_CRITICAL(&ram_lock);
+    if(export_req.conn_handle == conn_handle)
+        export_req.active = false;
+    taskEXIT_CRITICAL(&ram_lock);
+}
+
+noreturn void audit_writer_task()
+{
+    audit_task_handle = xTaskGetCurrentTaskHandle();
+    TickType_t wait = pdMS_TO_TICKS(seconds(AUDIT_FLUSH_INTERVAL_SEC));
+    uint32_t dropped_reported = 0;
+
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        if(audit_part == NULL) { // No partition, keep the RAM ring from filling up
+            taskENTER_CRITICAL(&ram_lock);
+            ram_tail = ram_head;
+            taskEXIT_CRITICAL(&ram_lock);
+            continue;
+        }
+
+        audit_flush();
+
+        if(ram_dropped != dropped_reported) {
+            dropped_reported = ram_dropped;
+            ESP_LOGE(PROJ_NAME, "Audit log overflow, %lu records dropped so far", (unsigned long) dropped_reported);
+        }
+
+        // Poll quickly while an export is waiting for BLE buffers
+        wait = audit_export_step() ? pdMS_TO_TICKS(AUDIT_EXPORT_RETRY_MS)
+                                   : pdMS_TO_TICKS(seconds(AUDIT_FLUSH_INTERVAL_SEC));
+    }
+}
@@ -0,0 +1,485 @@
+/*
+ * @file main/bench.c
+ *
+ * @proj imp-term
+ * @brief Microbenchmark console over UART, cycle counts of the hot paths on the device itself
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+
+#if BENCH_CONSOLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <argtable3/argtable3.h>
+#include <esp_console.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_private/esp_clk.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+
+#include "bench.h"
+#include "gpio.h"
+#include "storage.h"
+#include "gatt_schema.h"
+#include "common.h"
+
+/*
+ * Every benchmark runs its operation n times and reports the spread of the
+ * CPU cycles each call took, one "BENCH <name>.<stat> <value>" line per stat,
+ * so that runs on different boards or builds can be diffed line by line.
+ * Logging is silenced while a benchmark runs, printing would dominate.
+ * The console holds the CPU at its maximum clock, so frequency scaling and
+ * light sleep never land in the middle of a measurement.
+*/
+
+#define BENCH_MAX_ITERATIONS 10000
+#define BENCH_MAX_TASKS 32
+
+#define X_FIRST_ROW(keypad, row, gpio) gpio,
+static const uint32_t bench_rows[] = { KEYPAD_ROW_PINS(X_FIRST_ROW) };
+#undef X_FIRST_ROW
+
+static uint32_t cycles[BENCH_MAX_ITERATIONS];
+static uint8_t bench_data[64]; // Input of the hash benchmarks
+static uint8_t bench_digest[32];
+
+static esp_err_t op_key_lookup(uint32_t i)
+{
+    // Nothing is pressed on the bench, so this is the full scan of the first row's keypad
+    uint8_t keypad;
+    gpio_keypad_key_lookup(bench_rows[0], &keypad);
+    return ESP_OK;
+}
+
+static esp_err_t op_check_pin(uint32_t i)
+{
+    bool is_correct;
+    return check_pin(i % 2 ? KEYPAD_DEFAULT_ACCESS_PIN : "0000", "access_pin", &is_correct);
+}
+
+static esp_err_t op_change_pin(uint32_t i)
+{
+    // The staged new PIN, so the access PIN stays as it is
+    return change_pin(i % 2 ? "1111" : "2222", "new_pin");
+}
+
+static uint16_t saved_duration;
+
+static esp_err_t op_update_door_duration(uint32_t i)
+{
+    return update_door_duration(saved_duration + i % 2);
+}
+
+static esp_err_t op_gatt_write(uint32_t i)
+{
+    uint16_t duration = saved_duration + i % 2;
+    return gatt_door_open_duration_write(BLE_HS_CONN_HANDLE_NONE, 0, (const uint8_t *) &duration, sizeof(duration)) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t op_sha256(uint32_t i)
+{
+    return mbedtls_sha256(bench_data, sizeof(bench_data), bench_digest, 0) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t op_hmac(uint32_t i)
+{
+    // Same sizes as an admin login, see admin_derive()
+    return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                           (const uint8_t *) KEYPAD_DEFAULT_ADMIN_PIN, strlen(KEYPAD_DEFAULT_ADMIN_PIN),
+                           bench_data, 48, bench_digest) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static const struct {
+    const char * name;
+    esp_err_t (*run)(uint32_t i);
+    uint16_t default_n; // Flash writing ones run less, every call wears the NVS sectors
+} benches[] = {
+    {"key_lookup", op_key_lookup, 1000},
+    {"check_pin", op_check_pin, 1000},
+    {"change_pin", op_change_pin, 100},
+    {"update_door_duration", op_update_door_duration, 100},
+    {"gatt_write", op_gatt_write, 100},
+    {"sha256", op_sha256, 1000},
+    {"hmac_sha256", op_hmac, 1000},
+};
+
+static int compare_u32(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(uint8_t bench, uint32_t n)
+{
+    uint32_t errors = 0;
+
+    char saved_new_pin[KEYPAD_PIN_MAX_LEN + 1];
+    ESP_ERROR_CHECK(read_pin("new_pin", saved_new_pin, sizeof(saved_new_pin)));
+    ESP_ERROR_CHECK(read_door_duration(&saved_duration));
+
+    esp_log_level_t level = esp_log_level_get(PROJ_NAME);
+    esp_log_level_set(PROJ_NAME, ESP_LOG_NONE);
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t start = esp_cpu_get_cycle_count();
+        errors += benches[bench].run(i) != ESP_OK;
+        cycles[i] = esp_cpu_get_cycle_count() - start;
+        if(i % 64 == 63)
+            vTaskDelay(1); // Let the idle task feed the task watchdog on long runs
+    }
+
+    // Leave the config as it was
+    if(benches[bench].run == op_change_pin)
+        change_pin(saved_new_pin, "new_pin");
+    else if(benches[bench].run == op_update_door_duration || benches[bench].run == op_gatt_write)
+        update_door_duration(saved_duration);
+    esp_log_level_set(PROJ_NAME, level);
+
+    qsort(cycles, n, sizeof(cycles[0]), compare_u32);
+    printf("BENCH %s.n %lu\n", benches[bench].name, (unsigned long) n);
+    printf("BENCH %s.errors %lu\n", benches[bench].name, (unsigned long) errors);
+    printf("BENCH %s.p50_cycles %lu\n", benches[bench].name, (unsigned long) cycles[(n - 1) / 2]);
+    printf("BENCH %s.p90_cycles %lu\n", benches[bench].name, (unsigned long) cycles[(n - 1) * 9 / 10]);
+    printf("BENCH %s.p99_cycles %lu\n", benches[bench].name, (unsigned long) cycles[(n - 1) * 99 / 100]);
+    printf("BENCH %s.max_cycles %lu\n", benches[bench].name, (unsigned long) cycles[n - 1]);
+}
+
+static struct {
+    struct arg_int * iterations;
+    struct arg_str * name;
+    struct arg_end * end;
+} bench_args;
+
+static int cmd_bench(int argc, char ** argv)
+{
+    if(arg_parse(argc, argv, (void **) &bench_args) != 0) {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+
+    const char * name = bench_args.name->count ? bench_args.name->sval[0] : "all";
+    int n = bench_args.iterations->count ? bench_args.iterations->ival[0] : 0;
+    if(n < 0 || n > BENCH_MAX_ITERATIONS) {
+        printf("Iterations must be 1-%u\n", BENCH_MAX_ITERATIONS);
+        return 1;
+    }
+
+    bool found = false;
+    printf("BENCH cpu_mhz %lu\n", (unsigned long) esp_clk_cpu_freq() / 1000000);
+    for(uint8_t i = 0; i < array_len(benches); i++) {
+        if(strcmp(name, "all") == 0 || strcmp(name, benches[i].name) == 0) {
+            bench_run(i, n ? n : benches[i].default_n);
+            found = true;
+        }
+    }
+    if(!found) {
+        printf("Unknown benchmark %s, one of:", name);
+        for(uint8_t i = 0; i < array_len(benches); i++)
+            printf(" %s", benches[i].name);
+        printf("\n");
+        return 1;
+    }
+    printf("BENCH done\n");
+    return 0;
+}
+
+static struct {
+    struct arg_int * keypad;
+    struct arg_int * interval;
+    struct arg_str * keys;
+    struct arg_end * end;
+} inject_args;
+
+static int cmd_inject(int argc, char ** argv)
+{
+    if(arg_parse(argc, argv, (void **) &inject_args) != 0) {
+        arg_print_errors(stderr, inject_args.end, argv[0]);
+        return 1;
+    }
+
+    int keypad = inject_args.keypad->count ? inject_args.keypad->ival[0] : 0;
+    int interval = inject_args.interval->count ? inject_args.interval->ival[0] : 100;
+    if(keypad < 0 || keypad >= KEYPAD_COUNT || interval < 0) {
+        printf("Keypad must be 0-%u, interval at least 0\n", KEYPAD_COUNT - 1);
+        return 1;
+    }
+
+    for(const char * key = inject_args.keys->sval[0]; *key; key++) {
+        int64_t latency = gpio_keypad_inject_key(keypad, *key, pdMS_TO_TICKS(KEYPAD_INJECT_TIMEOUT_MS));
+        if(latency < 0)
+            printf("INJECT %c timeout\n", *key);
+        else
+            printf("INJECT %c %lld\n", *key, latency);
+        vTaskDelayMSec(interval);
+    }
+    return 0;
+}
+
+/*
+ * Soak runs repeat a key script at a fixed rate in a task of their own, so the
+ * console stays free to watch the counters. Each key waits until the keypad
+ * task has handled it, a key that is not handled within KEYPAD_INJECT_TIMEOUT_MS
+ * counts as a timeout, and a key that could not be sent on schedule as late.
+ * A failed PIN blocks the keypad for the security delay, scripts meant to run
+ * fast should only type correct PINs and single keys that close the door.
+*/
+static struct {
+    char script[SOAK_MAX_SCRIPT_LEN + 1];
+    uint8_t keypad;
+    uint32_t period_us;
+    uint32_t target_runs; // 0 until stopped
+    volatile bool stop;
+    TaskHandle_t task;
+
+    // Counters of the current or last run
+    int64_t started_us;
+    int64_t finished_us;
+    uint32_t runs;
+    uint32_t keys;
+    uint32_t timeouts;
+    uint32_t late;
+    uint64_t latency_sum_us;
+    uint32_t latency_max_us;
+} soak;
+static portMUX_TYPE soak_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void soak_print_status()
+{
+    taskENTER_CRITICAL(&soak_lock);
+    typeof(soak) copy = soak;
+    taskEXIT_CRITICAL(&soak_lock);
+
+    int64_t end = copy.task != NULL ? esp_timer_get_time() : copy.finished_us;
+    printf("SOAK running %d\n", copy.task != NULL);
+    printf("SOAK elapsed_s %lld\n", (end - copy.started_us) / 1000000);
+    printf("SOAK runs %lu\n", (unsigned long) copy.runs);
+    printf("SOAK keys %lu\n", (unsigned long) copy.keys);
+    printf("SOAK timeouts %lu\n", (unsigned long) copy.timeouts);
+    printf("SOAK late %lu\n", (unsigned long) copy.late);
+    printf("SOAK latency_avg_us %llu\n", copy.keys ? copy.latency_sum_us / copy.keys : 0);
+    printf("SOAK latency_max_us %lu\n", (unsigned long) copy.latency_max_us);
+    printf("SOAK heap.free %u\n", heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    printf("SOAK heap.min_free %u\n", heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+}
+
+static void soak_task(void * param)
+{
+    int64_t next = esp_timer_get_time();
+
+    while(!soak.stop && (soak.target_runs == 0 || soak.runs < soak.target_runs)) {
+        for(const char * key = soak.script; *key && !soak.stop; key++) {
+            int64_t now = esp_timer_get_time();
+            bool late = now > next + soak.period_us;
+            if(late)
+                next = now; // Carry on from here, catching up would hide the stall
+            else if(next > now)
+                vTaskDelay(pdMS_TO_TICKS((next - now) / 1000)); // Sub-tick rest is not waited for
+            next += soak.period_us;
+
+            int64_t latency = gpio_keypad_inject_key(soak.keypad, *key, pdMS_TO_TICKS(KEYPAD_INJECT_TIMEOUT_MS));
+
+            taskENTER_CRITICAL(&soak_lock);
+            soak.late += late;
+            if(latency < 0) {
+                soak.timeouts++;
+            } else {
+                soak.keys++;
+                soak.latency_sum_us += latency;
+                if(latency > soak.latency_max_us)
+                    soak.latency_max_us = latency;
+            }
+            taskEXIT_CRITICAL(&soak_lock);
+        }
+        taskENTER_CRITICAL(&soak_lock);
+        soak.runs++;
+        taskEXIT_CRITICAL(&soak_lock);
+    }
+
+    taskENTER_CRITICAL(&soak_lock);
+    soak.finished_us = esp_timer_get_time();
+    soak.task = NULL;
+    taskEXIT_CRITICAL(&soak_lock);
+    soak_print_status();
+    printf("SOAK done\n");
+    vTaskDelete(NULL);
+}
+
+static struct {
+    struct arg_int * keypad;
+    struct arg_int * rate;
+    struct arg_int * runs;
+    struct arg_str * script;
+    struct arg_end * end;
+} soak_args;
+
+static int cmd_soak(int argc, char ** argv)
+{
+    if(arg_parse(argc, argv, (void **) &soak_args) != 0) {
+        arg_print_errors(stderr, soak_args.end, argv[0]);
+        return 1;
+    }
+    if(soak.task != NULL) {
+        printf("A soak run is in progress, soak_stop first\n");
+        return 1;
+    }
+
+    int keypad = soak_args.keypad->count ? soak_args.keypad->ival[0] : 0;
+    int rate = soak_args.rate->count ? soak_args.rate->ival[0] : 100;
+    int runs = soak_args.runs->count ? soak_args.runs->ival[0] : 0;
+    const char * script = soak_args.script->sval[0];
+    if(keypad < 0 || keypad >= KEYPAD_COUNT || rate < 1 || rate > 1000 || runs < 0
+       || strlen(script) == 0 || strlen(script) > SOAK_MAX_SCRIPT_LEN) {
+        printf("Keypad must be 0-%u, rate 1-1000 keys/s, runs at least 0 and the script 1-%u keys\n",
+               KEYPAD_COUNT - 1, SOAK_MAX_SCRIPT_LEN);
+        return 1;
+    }
+
+    memset(&soak, 0, sizeof(soak));
+    strcpy(soak.script, script);
+    soak.keypad = keypad;
+    soak.period_us = 1000000 / rate;
+    soak.target_runs = runs;
+    soak.started_us = esp_timer_get_time();
+    if(task_create(&soak_task, NULL, &soak.task, TASK_SOAK) != pdPASS) {
+        printf("Failed to create soak task\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_soak_status(int argc, char ** argv)
+{
+    soak_print_status();
+    return 0;
+}
+
+static int cmd_soak_stop(int argc, char ** argv)
+{
+    soak.stop = true; // The task prints the final counters
+    return 0;
+}
+
+static int cmd_tasks(int argc, char ** argv)
+{
+#if configUSE_TRACE_FACILITY
+    // Stack high water marks are in bytes on ESP-IDF
+    static TaskStatus_t tasks[BENCH_MAX_TASKS];
+    uint32_t total;
+    UBaseType_t count = uxTaskGetSystemState(tasks, BENCH_MAX_TASKS, &total);
+    for(UBaseType_t i = 0; i < count; i++) {
+        printf("TASK %s prio %u core %d stack_free %lu runtime %lu\n",
+               tasks[i].pcTaskName, tasks[i].uxCurrentPriority,
+               tasks[i].xCoreID == tskNO_AFFINITY ? -1 : (int) tasks[i].xCoreID,
+               (unsigned long) tasks[i].usStackHighWaterMark, (unsigned long) tasks[i].ulRunTimeCounter);
+    }
+    return 0;
+#else
+    printf("Needs CONFIG_FREERTOS_USE_TRACE_FACILITY\n");
+    return 1;
+#endif
+}
+
+static int cmd_heap(int argc, char ** argv)
+{
+    printf("HEAP free %u\n", heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    printf("HEAP min_free %u\n", heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    printf("HEAP largest_block %u\n", heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    printf("HEAP internal_free %u\n", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    return 0;
+}
+
+esp_err_t bench_console_start()
+{
+    for(uint8_t i = 0; i < sizeof(bench_data); i++)
+        bench_data[i] = i;
+
+    // Fails with ESP_ERR_NOT_SUPPORTED without CONFIG_PM_ENABLE, the clock is fixed then anyway
+    esp_pm_lock_handle_t cpu_lock;
+    if(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "bench", &cpu_lock) == ESP_OK)
+        esp_pm_lock_acquire(cpu_lock);
+
+    bench_args.iterations = arg_int0("n", "iterations", "<n>", "Calls per benchmark (default depends on the benchmark)");
+    bench_args.name = arg_str0(NULL, NULL, "<name>", "Benchmark to run, all by default");
+    bench_args.end = arg_end(2);
+    const esp_console_cmd_t bench_cmd = {
+        .command = "bench",
+        .help = "Cycle count percentiles of the hot paths (key_lookup, check_pin, change_pin, "
+                "update_door_duration, gatt_write, sha256, hmac_sha256)",
+        .func = &cmd_bench,
+        .argtable = &bench_args,
+    };
+
+    inject_args.keypad = arg_int0("k", "keypad", "<keypad>", "Keypad index (default 0)");
+    inject_args.interval = arg_int0("i", "interval", "<ms>", "Delay after each key (default 100)");
+    inject_args.keys = arg_str1(NULL, NULL, "<keys>", "Keys to press, e.g. 1234#");
+    inject_args.end = arg_end(3);
+    const esp_console_cmd_t inject_cmd = {
+        .command = "inject",
+        .help = "Press keys as if they came from the keypad, prints how long each took to handle",
+        .func = &cmd_inject,
+        .argtable = &inject_args,
+    };
+
+    soak_args.keypad = arg_int0("k", "keypad", "<keypad>", "Keypad index (default 0)");
+    soak_args.rate = arg_int0("r", "rate", "<keys/s>", "Keys per second, 1-1000 (default 100)");
+    soak_args.runs = arg_int0("n", "runs", "<runs>", "Script repetitions, 0 until soak_stop (default)");
+    soak_args.script = arg_str1(NULL, NULL, "<script>", "Keys to repeat, e.g. 1234#0");
+    soak_args.end = arg_end(4);
+    const esp_console_cmd_t soak_cmd = {
+        .command = "soak",
+        .help = "Repeat a key script at a fixed rate in the background",
+        .func = &cmd_soak,
+        .argtable = &soak_args,
+    };
+    const esp_console_cmd_t soak_status_cmd = {
+        .command = "soak_status",
+        .help = "Keys, timeouts, late keys, handling latency and heap of the current or last soak run",
+        .func = &cmd_soak_status,
+    };
+    const esp_console_cmd_t soak_stop_cmd = {
+        .command = "soak_stop",
+        .help = "Stop the soak run after the current key",
+        .func = &cmd_soak_stop,
+    };
+
+    const esp_console_cmd_t tasks_cmd = {
+        .command = "tasks",
+        .help = "Priority, core, free stack and run time of every task",
+        .func = &cmd_tasks,
+    };
+    const esp_console_cmd_t heap_cmd = {
+        .command = "heap",
+        .help = "Free, lowest free and largest free block of the heap",
+        .func = &cmd_heap,
+    };
+
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&bench_cmd), PROJ_NAME, "Failed to register bench");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&inject_cmd), PROJ_NAME, "Failed to register inject");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&soak_cmd), PROJ_NAME, "Failed to register soak");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&soak_status_cmd), PROJ_NAME, "Failed to register soak_status");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&soak_stop_cmd), PROJ_NAME, "Failed to register soak_stop");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&tasks_cmd), PROJ_NAME, "Failed to register tasks");
+    ESP_RETURN_ON_ERROR(esp_console_cmd_register(&heap_cmd), PROJ_NAME, "Failed to register heap");
+    ESP_RETURN_ON_ERROR(esp_console_register_help_command(), PROJ_NAME, "Failed to register help");
+
+    esp_console_repl_t * repl = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    repl_config.prompt = PROJ_NAME ">";
+    repl_config.task_stack_size = task_stack(TASK_CONSOLE);
+    repl_config.task_priority = task_priority(TASK_CONSOLE);
+    repl_config.task_core_id = task_core(TASK_CONSOLE);
+    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    ESP_RETURN_ON_ERROR(esp_console_new_repl_uart(&uart_config, &repl_config, &repl), PROJ_NAME, "Failed to create console");
+    return esp_console_start_repl(repl);
+}
+
+#endif // BENCH_CONSOLE
@@ -0,0 +1,60 @@
+/*
+ * @file main/boot.c
+ *
+ * @proj imp-term
+ * @brief Staged boot timestamps and profile report
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "boot.h"
+#include "common.h"
+
+static const char * boot_stage_names[] = {
+#define BOOT_STAGE_NAME(name, desc) desc,
+    BOOT_STAGES(BOOT_STAGE_NAME)
+#undef BOOT_STAGE_NAME
+};
+
+static const char * boot_stage_ids[] = {
+#define BOOT_STAGE_ID(name, desc) #name,
+    BOOT_STAGES(BOOT_STAGE_ID)
+#undef BOOT_STAGE_ID
+};
+
+// Microseconds since esp_timer started (early in startup, before app_main)
+static int64_t boot_times[BOOT_STAGE_COUNT];
+
+void boot_mark(enum BootStage stage)
+{
+    if(boot_times[stage] == 0)
+        boot_times[stage] = esp_timer_get_time();
+}
+
+int64_t boot_time(enum BootStage stage)
+{
+    return boot_times[stage];
+}
+
+const char * boot_stage_id(enum BootStage stage)
+{
+    return boot_stage_ids[stage];
+}
+
+void boot_report()
+{
+    int64_t prev = 0;
+    ESP_LOGI(PROJ_NAME, "Boot profile:");
+    for(uint8_t stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        if(boot_times[stage] == 0) {
+            ESP_LOGI(PROJ_NAME, "\t%-36s    not reached", boot_stage_names[stage]);
+            continue;
+        }
+        ESP_LOGI(PROJ_NAME, "\t%-36s %6lld ms (+%lld ms)", boot_stage_names[stage],
+                 boot_times[stage] / 1000, (boot_times[stage] - prev) / 1000);
+        prev = boot_times[stage];
+    }
+}
@@ -0,0 +1,413 @@
+/*
+ * @file main/credential.c
+ *
+ * @proj imp-term
+ * @brief Common pipeline for credentials from all input sources (keypad, card reader, phone)
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <mbedtls/sha256.h>
+
+#include "config.h"
+#include "credential.h"
+#include "gpio.h"
+#include "keypad.h"
+#include "storage.h"
+#include "phone.h"
+#include "audit.h"
+#include "schedule.h"
+#include "otp.h"
+#include "common.h"
+
+static_assert(AUDIT_SLOT_CARD(CREDENTIAL_MAX_CARDS - 1) < AUDIT_SLOT_NONE, "Too many cards for audit slots");
+
+// Enrolled cards, mirrored in NVS. Read by the card reader task, written
+// by the NimBLE host task, so both go through the spinlock.
+static card_t cards[CREDENTIAL_MAX_CARDS];
+static uint8_t cards_len = 0;
+static portMUX_TYPE card_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Card sync batch, only touched by the NimBLE host task
+static struct {
+    uint8_t state;
+    bool nacked; // Status already sent for the current gap in the sequence
+    uint16_t next_seq;
+    uint16_t conn_handle;
+    uint16_t ctrl_handle;
+    uint8_t len;
+    card_t cards[CREDENTIAL_MAX_CARDS];
+} sync = {
+    .state = CARD_SYNC_IDLE,
+    .conn_handle = BLE_HS_CONN_HANDLE_NONE,
+};
+
+static int card_find(const card_t * list, uint8_t len, uint32_t card)
+{
+    for(uint8_t i = 0; i < len; i++) {
+        if(list[i].number == card)
+            return i;
+    }
+    return -1;
+}
+
+static esp_err_t card_write(const card_t * list, uint8_t len)
+{
+    nvs_handle_t handle;
+    ESP_RETURN_ON_ERROR(nvs_open(CREDENTIAL_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    esp_err_t ret = nvs_set_blob(handle, "cards", list, len * sizeof(list[0]));
+    if(ret == ESP_OK)
+        ret = nvs_commit(handle);
+    nvs_close(handle);
+    return ret;
+}
+
+static esp_err_t card_save()
+{
+    card_t copy[CREDENTIAL_MAX_CARDS];
+    uint8_t len;
+
+    taskENTER_CRITICAL(&card_lock);
+    len = cards_len;
+    memcpy(copy, cards, len * sizeof(cards[0]));
+    taskEXIT_CRITICAL(&card_lock);
+
+    return card_write(copy, len);
+}
+
+esp_err_t credential_init()
+{
+    size_t len = sizeof(cards);
+    nvs_handle_t handle;
+
+    ESP_RETURN_ON_ERROR(nvs_open(CREDENTIAL_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    esp_err_t ret = nvs_get_blob(handle, "cards", cards, &len);
+    nvs_close(handle);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(PROJ_NAME, "No cards enrolled");
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_ERROR(ret, PROJ_NAME, "Error reading cards");
+    ESP_RETURN_ON_FALSE(len % sizeof(cards[0]) == 0, ESP_ERR_INVALID_SIZE, PROJ_NAME, "Corrupted card list");
+
+    cards_len = len / sizeof(cards[0]);
+    ESP_LOGI(PROJ_NAME, "%u card(s) enrolled", cards_len);
+    return ESP_OK;
+}
+
+/*
+ * @brief Find the audit slot and schedule of a credential
+ * @return Slot or -1 if the credential is not valid
+*/
+static int credential_lookup(const credential_t * credential, uint8_t * schedule)
+{
+    bool is_correct = false;
+    int index;
+
+    *schedule = SCHEDULE_ALWAYS;
+    switch(credential->type) {
+        case CREDENTIAL_PIN:
+            ESP_ERROR_CHECK(check_pin(credential->pin, "access_pin", &is_correct));
+            if(is_correct) {
+                *schedule = schedule_pin();
+                return AUDIT_SLOT_ACCESS_PIN;
+            }
+            return otp_claim(credential->pin, schedule);
+
+        case CREDENTIAL_CARD:
+            taskENTER_CRITICAL(&card_lock);
+            index = card_find(cards, cards_len, credential->card);
+            if(index >= 0)
+                *schedule = cards[index].schedule;
+            taskEXIT_CRITICAL(&card_lock);
+            if(index < 0)
+                ESP_LOGI(PROJ_NAME, "Unknown card %lu", credential->card);
+            return index >= 0 ? AUDIT_SLOT_CARD(index) : -1;
+
+        case CREDENTIAL_PHONE:
+            index = phone_verify(credential->phone.addr, credential->phone.response);
+            return index >= 0 ? AUDIT_SLOT_PHONE(index) : -1;
+    }
+    return -1;
+}
+
+bool credential_submit(const credential_t * credential)
+{
+    int64_t start = esp_timer_get_time();
+    uint8_t schedule;
+
+    int slot = credential_lookup(credential, &schedule);
+    bool in_schedule = slot >= 0 && schedule_allows(schedule);
+    bool granted = in_schedule && !access_locked_out() && door_request_open();
+
+    uint8_t result = granted ? AUDIT_RES_GRANTED : (slot >= 0 && !in_schedule) ? AUDIT_RES_SCHEDULE : AUDIT_RES_DENIED;
+    audit_log_event(AUDIT_EVT_ACCESS, slot >= 0 ? slot : AUDIT_SLOT_NONE, result, credential->source, credential->reader);
+    ESP_LOGI(PROJ_NAME, "Access %s (credential type %u, reader %u) in %lld us",
+             granted ? "granted" : "denied", credential->type, credential->reader, esp_timer_get_time() - start);
+
+    if(slot < 0)
+        access_register_failure();
+    else if(!granted)
+        otp_release(slot); // A one-time code that did not open the door stays valid
+    return granted;
+}
+
+int credential_card_command(const uint8_t * cmd, uint16_t len, uint8_t source)
+{
+    uint32_t card = 0;
+    uint8_t schedule = SCHEDULE_ALWAYS;
+    int index;
+    int rc = 0;
+
+    if(cmd[0] != CARD_CMD_CLEAR) {
+        if(len != 1 + sizeof(card) && len != 1 + sizeof(card) + 1)
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        memcpy(&card, &cmd[1], sizeof(card)); // Little endian, same as the CPU
+        if(len > 1 + sizeof(card))
+            schedule = cmd[1 + sizeof(card)];
+        if(schedule >= SCHEDULE_COUNT)
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    taskENTER_CRITICAL(&card_lock);
+    switch(cmd[0]) {
+        case CARD_CMD_ADD:
+            if((index = card_find(cards, cards_len, card)) >= 0) {
+                cards[index].schedule = schedule; // Re-adding a card changes its schedule
+                break;
+            }
+            if(cards_len >= CREDENTIAL_MAX_CARDS) {
+                rc = BLE_ATT_ERR_INSUFFICIENT_RES;
+                break;
+            }
+            cards[cards_len++] = (card_t) { .number = card, .schedule = schedule };
+            break;
+
+        case CARD_CMD_REMOVE:
+            if((index = card_find(cards, cards_len, card)) >= 0)
+                cards[index] = cards[--cards_len];
+            break;
+
+        case CARD_CMD_CLEAR:
+            cards_len = 0;
+            break;
+
+        default:
+            rc = BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+    taskEXIT_CRITICAL(&card_lock);
+    if(rc != 0)
+        return rc;
+
+    if(card_save() != ESP_OK)
+        return BLE_ATT_ERR_UNLIKELY;
+    audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, source, cmd[0]);
+    ESP_LOGI(PROJ_NAME, "Cards updated (command %u), %u card(s) enrolled", cmd[0], cards_len);
+    return 0;
+}
+
+int credential_card_list(struct os_mbuf * om)
+{
+    card_t copy[CREDENTIAL_MAX_CARDS];
+    uint8_t len;
+
+    taskENTER_CRITICAL(&card_lock);
+    len = cards_len;
+    memcpy(copy, cards, len * sizeof(cards[0]));
+    taskEXIT_CRITICAL(&card_lock);
+
+    return os_mbuf_append(om, copy, len * sizeof(copy[0])) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+/*
+ * @brief Digest of a card list, independent of the order the cards were enrolled in
+*/
+static void card_digest(const card_t * list, uint8_t len, uint8_t digest[CARD_SYNC_DIGEST_LEN])
+{
+    card_t sorted[CREDENTIAL_MAX_CARDS];
+    uint8_t sha[32];
+
+    for(uint8_t i = 0; i < len; i++) {
+        card_t card = list[i];
+        uint8_t j = i;
+        for(; j > 0 && sorted[j - 1].number > card.number; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = card;
+    }
+    mbedtls_sha256((const uint8_t *) sorted, len * sizeof(sorted[0]), sha, 0);
+    memcpy(digest, sha, CARD_SYNC_DIGEST_LEN);
+}
+
+void credential_sync_status(uint16_t conn_handle, card_sync_status_t * status)
+{
+    card_t copy[CREDENTIAL_MAX_CARDS];
+    uint8_t len;
+
+    taskENTER_CRITICAL(&card_lock);
+    len = cards_len;
+    memcpy(copy, cards, len * sizeof(cards[0]));
+    taskEXIT_CRITICAL(&card_lock);
+
+    // ATT write header is 3 bytes, the sequence number another 2
+    uint16_t mtu = ble_att_mtu(conn_handle);
+    uint16_t payload = mtu > 5 ? mtu - 5 : 0;
+    if(payload > CARD_SYNC_CHUNK_MAX_OPS * sizeof(card_sync_op_t))
+        payload = CARD_SYNC_CHUNK_MAX_OPS * sizeof(card_sync_op_t);
+
+    status->state = sync.state;
+    status->count = sync.state == CARD_SYNC_RECEIVING ? sync.len : len;
+    status->max_ops = payload / sizeof(card_sync_op_t);
+    status->next_seq = sync.next_seq;
+    card_digest(copy, len, status->digest);
+}
+
+static void credential_sync_notify()
+{
+    if(sync.conn_handle == BLE_HS_CONN_HANDLE_NONE)
+        return;
+
+    card_sync_status_t status;
+    credential_sync_status(sync.conn_handle, &status);
+    struct os_mbuf * om = ble_hs_mbuf_from_flat(&status, sizeof(status));
+    if(om != NULL)
+        ble_gatts_notify_custom(sync.conn_handle, sync.ctrl_handle, om);
+}
+
+static void credential_sync_fail(const char * reason)
+{
+    ESP_LOGW(PROJ_NAME, "Card sync failed: %s", reason);
+    sync.state = CARD_SYNC_ERROR;
+    credential_sync_notify();
+}
+
+int credential_sync_command(uint16_t conn_handle, uint16_t attr_handle, const uint8_t * cmd, uint16_t len)
+{
+    uint8_t digest[CARD_SYNC_DIGEST_LEN];
+
+    switch(cmd[0]) {
+        case CARD_SYNC_CMD_BEGIN:
+            taskENTER_CRITICAL(&card_lock);
+            sync.len = cards_len;
+            memcpy(sync.cards, cards, cards_len * sizeof(cards[0]));
+            taskEXIT_CRITICAL(&card_lock);
+            sync.state = CARD_SYNC_RECEIVING;
+            sync.nacked = false;
+            sync.next_seq = 0;
+            sync.conn_handle = conn_handle;
+            sync.ctrl_handle = attr_handle;
+            ESP_LOGI(PROJ_NAME, "Card sync started with %u card(s)", sync.len);
+            return 0;
+
+        case CARD_SYNC_CMD_COMMIT:
+            if(len != CARD_SYNC_CMD_MAX_LEN)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            if(sync.state != CARD_SYNC_RECEIVING || conn_handle != sync.conn_handle)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+
+            // A lost chunk or a tampered one shows up as a different list
+            card_digest(sync.cards, sync.len, digest);
+            if(memcmp(digest, &cmd[1], sizeof(digest)) != 0) {
+                credential_sync_fail("digest mismatch");
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            }
+
+            // One blob write, so a power loss leaves either the old or the new list
+            if(card_write(sync.cards, sync.len) != ESP_OK) {
+                credential_sync_fail("error writing cards");
+                return BLE_ATT_ERR_UNLIKELY;
+            }
+            taskENTER_CRITICAL(&card_lock);
+            cards_len = sync.len;
+            memcpy(cards, sync.cards, sync.len * sizeof(cards[0]));
+            taskEXIT_CRITICAL(&card_lock);
+
+            sync.state = CARD_SYNC_IDLE;
+            audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_BLE, cmd[0]);
+            ESP_LOGI(PROJ_NAME, "Card sync committed, %u chunk(s), %u card(s) enrolled", sync.next_seq, sync.len);
+            credential_sync_notify();
+            return 0;
+
+        case CARD_SYNC_CMD_ABORT:
+            sync.state = CARD_SYNC_IDLE;
+            ESP_LOGI(PROJ_NAME, "Card sync aborted by client");
+            return 0;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+}
+
+int credential_sync_data(uint16_t conn_handle, const struct os_mbuf * om)
+{
+    uint16_t len = OS_MBUF_PKTLEN(om);
+    uint16_t seq;
+
+    // Chunks are not authenticated, only the connection that began the batch may send them
+    if(sync.state != CARD_SYNC_RECEIVING || conn_handle != sync.conn_handle)
+        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    if(len <= sizeof(seq) || (len - sizeof(seq)) % sizeof(card_sync_op_t) != 0)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    os_mbuf_copydata(om, 0, sizeof(seq), &seq);
+    if(seq != sync.next_seq) {
+        // Lost or repeated chunk, the client resends from next_seq
+        if(!sync.nacked)
+            credential_sync_notify();
+        sync.nacked = true;
+        return BLE_ATT_ERR_INVALID_OFFSET;
+    }
+    sync.nacked = false;
+
+    for(uint16_t offset = sizeof(seq); offset < len; offset += sizeof(card_sync_op_t)) {
+        card_sync_op_t op;
+        os_mbuf_copydata(om, offset, sizeof(op), &op);
+        int index = card_find(sync.cards, sync.len, op.card.number);
+
+        switch(op.op) {
+            case CARD_SYNC_OP_PUT:
+                if(op.card.schedule >= SCHEDULE_COUNT) {
+                    credential_sync_fail("invalid schedule");
+                    return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+                }
+                if(index >= 0) {
+                    sync.cards[index].schedule = op.card.schedule;
+                    break;
+                }
+                if(sync.len >= CREDENTIAL_MAX_CARDS) {
+                    credential_sync_fail("too many cards");
+                    return BLE_ATT_ERR_INSUFFICIENT_RES;
+                }
+                sync.cards[sync.len++] = op.card;
+                break;
+
+            case CARD_SYNC_OP_REMOVE:
+                if(index >= 0)
+                    sync.cards[index] = sync.cards[--sync.len];
+                break;
+
+            default:
+                credential_sync_fail("invalid operation");
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+    }
+
+    if(++sync.next_seq % CARD_SYNC_ACK_INTERVAL == 0)
+        credential_sync_notify();
+    return 0;
+}
+
+void credential_sync_disconnect(uint16_t conn_handle)
+{
+    if(sync.conn_handle != conn_handle)
+        return;
+    if(sync.state == CARD_SYNC_RECEIVING)
+        ESP_LOGI(PROJ_NAME, "Card sync dropped, its connection closed");
+    sync.state = CARD_SYNC_IDLE;
+    sync.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+}
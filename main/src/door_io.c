@@ -0,0 +1,225 @@
+/*
+ * @file main/door_io.c
+ *
+ * @proj imp-term
+ * @brief Door contact and request-to-exit button
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+#include <soc/gpio_struct.h>
+#include <hal/gpio_ll.h>
+
+#include "config.h"
+#include "door_io.h"
+#include "keypad.h"
+#include "audit.h"
+#include "gpio.h"
+#include "common.h"
+
+/*
+ * The exit button opens the door from its interrupt, straight into the door
+ * event queue: no credential check, no task in between, and it works during a
+ * lockout. Later edges of the same press are ignored for DOOR_REX_DEBOUNCE_MS.
+ *
+ * The contact is debounced by its task, which tracks an opening against the
+ * lock state: an opening while unlocked relocks as soon as the door is shut
+ * again, an opening while locked is a forced door, and a door left open
+ * DOOR_HELD_OPEN_SEC after relocking is held open.
+*/
+
+// Task notification bits
+#define DOOR_IO_REX     BIT(0) // Exit button pressed, door already requested
+#define DOOR_IO_CONTACT BIT(1) // Contact edge, debounce restarts
+#define DOOR_IO_LOCK    BIT(2) // Lock opened or closed
+
+static TaskHandle_t door_io_task_handle = NULL; // Also tells the sleep hooks the inputs are set up
+static int64_t rex_last_us = -DOOR_REX_DEBOUNCE_MS * 1000;
+static volatile bool contact_shut = true;
+static int contact_sleep_level;
+static int rex_sleep_level;
+
+static void IRAM_ATTR door_io_rex_pressed(BaseType_t * woken)
+{
+    int64_t now = esp_timer_get_time();
+    if(now - rex_last_us < DOOR_REX_DEBOUNCE_MS * 1000)
+        return; // Bounce or a held button
+    rex_last_us = now;
+
+    door_request_open_from_isr(woken);
+    xTaskNotifyFromISR(door_io_task_handle, DOOR_IO_REX, eSetBits, woken);
+}
+
+static void IRAM_ATTR door_io_rex_interrupt(void * arg)
+{
+    BaseType_t woken = pdFALSE;
+    door_io_rex_pressed(&woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void IRAM_ATTR door_io_contact_interrupt(void * arg)
+{
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(door_io_task_handle, DOOR_IO_CONTACT, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void door_io_lock_changed()
+{
+    if(door_io_task_handle != NULL)
+        xTaskNotify(door_io_task_handle, DOOR_IO_LOCK, eSetBits);
+}
+
+bool door_io_is_shut()
+{
+    return contact_shut;
+}
+
+static noreturn void door_io_task()
+{
+    bool opened_unlocked = false; // Current opening started while unlocked
+    bool held_reported = false;
+    int64_t debounce_until = 0;   // 0 while the contact is settled
+    int64_t relocked_at = 0;      // Relocked while the door was still open, 0 if not
+
+    while(1) {
+        // Sleep until an input changes or one of the timers runs out
+        TickType_t timeout = portMAX_DELAY;
+        int64_t now = esp_timer_get_time();
+        int64_t next = INT64_MAX;
+        if(debounce_until != 0)
+            next = debounce_until;
+        if(relocked_at != 0 && !held_reported && relocked_at + seconds((int64_t) DOOR_HELD_OPEN_SEC) * 1000 < next)
+            next = relocked_at + seconds((int64_t) DOOR_HELD_OPEN_SEC) * 1000;
+        if(next != INT64_MAX)
+            timeout = next > now ? pdMS_TO_TICKS((next - now) / 1000) + 1 : 0;
+
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, timeout);
+        now = esp_timer_get_time();
+
+        if(bits & DOOR_IO_REX) {
+            ESP_LOGI(PROJ_NAME, "Request to exit");
+            audit_log_event(AUDIT_EVT_ACCESS, AUDIT_SLOT_NONE, AUDIT_RES_GRANTED, AUDIT_SOURCE_REX, 0);
+        }
+
+        if(bits & DOOR_IO_CONTACT)
+            debounce_until = now + DOOR_CONTACT_DEBOUNCE_MS * 1000;
+
+        if(bits & DOOR_IO_LOCK) {
+            if(is_door_open())
+                relocked_at = 0;
+            else if(!contact_shut && opened_unlocked)
+                relocked_at = now;
+        }
+
+        if(debounce_until != 0 && now >= debounce_until) {
+            debounce_until = 0;
+            bool shut = gpio_get_level(DOOR_CONTACT_PIN) == GPIO_LOW;
+            if(shut != contact_shut) {
+                contact_shut = shut;
+                if(!shut && is_door_open()) {
+                    ESP_LOGI(PROJ_NAME, "Door opened");
+                    opened_unlocked = true;
+                } else if(!shut) {
+                    ESP_LOGW(PROJ_NAME, "Door forced open");
+                    audit_log_event(AUDIT_EVT_DOOR_FORCED, AUDIT_SLOT_NONE, AUDIT_RES_FAIL, AUDIT_SOURCE_SYSTEM, 0);
+                } else {
+                    ESP_LOGI(PROJ_NAME, "Door shut");
+                    // The passage is over, no need to keep it unlocked for the rest of the duration
+                    if(opened_unlocked && is_door_open())
+                        door_request_shut();
+                    opened_unlocked = false;
+                    held_reported = false;
+                    relocked_at = 0;
+                }
+            }
+        }
+
+        if(relocked_at != 0 && !held_reported && now >= relocked_at + seconds((int64_t) DOOR_HELD_OPEN_SEC) * 1000) {
+            ESP_LOGW(PROJ_NAME, "Door held open");
+            audit_log_event(AUDIT_EVT_DOOR_HELD, AUDIT_SLOT_NONE, AUDIT_RES_FAIL, AUDIT_SOURCE_SYSTEM, DOOR_HELD_OPEN_SEC);
+            held_reported = true;
+        }
+    }
+}
+
+esp_err_t door_io_init()
+{
+    if(!DOOR_CONTACT_ENABLE && !DOOR_REX_ENABLE)
+        return ESP_OK;
+
+    ESP_RETURN_ON_FALSE(task_create(&door_io_task, NULL, &door_io_task_handle, TASK_DOOR_IO) == pdPASS,
+                        ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create door input task");
+
+    if(DOOR_CONTACT_ENABLE) {
+        gpio_config_t conf = {
+            .pin_bit_mask = BIT64(DOOR_CONTACT_PIN),
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,
+            .intr_type = GPIO_INTR_ANYEDGE,
+        };
+        ESP_RETURN_ON_ERROR(gpio_config(&conf), PROJ_NAME, "Failed to configure door contact pin");
+        contact_shut = gpio_get_level(DOOR_CONTACT_PIN) == GPIO_LOW;
+        ESP_RETURN_ON_ERROR(gpio_isr_handler_add(DOOR_CONTACT_PIN, &door_io_contact_interrupt, NULL),
+                            PROJ_NAME, "Failed to add door contact ISR");
+        ESP_LOGI(PROJ_NAME, "Door contact ready, door %s", contact_shut ? "shut" : "open");
+    }
+
+    if(DOOR_REX_ENABLE) {
+        gpio_config_t conf = {
+            .pin_bit_mask = BIT64(DOOR_REX_PIN),
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,
+            .intr_type = GPIO_INTR_NEGEDGE,
+        };
+        ESP_RETURN_ON_ERROR(gpio_config(&conf), PROJ_NAME, "Failed to configure exit button pin");
+        ESP_RETURN_ON_ERROR(gpio_isr_handler_add(DOOR_REX_PIN, &door_io_rex_interrupt, NULL),
+                            PROJ_NAME, "Failed to add exit button ISR");
+        ESP_LOGI(PROJ_NAME, "Exit button ready");
+    }
+    return ESP_OK;
+}
+
+void IRAM_ATTR door_io_sleep_prepare()
+{
+    // power_init() installs the hooks before door_io_init() runs
+    if(door_io_task_handle == NULL)
+        return;
+
+    // Level wakeup replaces the edge interrupt type, as for the keypad rows
+    if(DOOR_CONTACT_ENABLE) {
+        contact_sleep_level = gpio_ll_get_level(&GPIO, DOOR_CONTACT_PIN);
+        gpio_ll_wakeup_enable(&GPIO, DOOR_CONTACT_PIN, contact_sleep_level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    }
+    // A button held down would wake the CPU right away, it is not armed until released
+    if(DOOR_REX_ENABLE) {
+        rex_sleep_level = gpio_ll_get_level(&GPIO, DOOR_REX_PIN);
+        if(rex_sleep_level)
+            gpio_ll_wakeup_enable(&GPIO, DOOR_REX_PIN, GPIO_INTR_LOW_LEVEL);
+    }
+}
+
+void IRAM_ATTR door_io_sleep_restore()
+{
+    if(door_io_task_handle == NULL)
+        return;
+
+    if(DOOR_CONTACT_ENABLE) {
+        gpio_ll_wakeup_disable(&GPIO, DOOR_CONTACT_PIN);
+        gpio_ll_set_intr_type(&GPIO, DOOR_CONTACT_PIN, GPIO_INTR_ANYEDGE);
+        if(gpio_ll_get_level(&GPIO, DOOR_CONTACT_PIN) != contact_sleep_level)
+            xTaskNotifyFromISR(door_io_task_handle, DOOR_IO_CONTACT, eSetBits, NULL);
+    }
+    if(DOOR_REX_ENABLE) {
+        gpio_ll_wakeup_disable(&GPIO, DOOR_REX_PIN);
+        gpio_ll_set_intr_type(&GPIO, DOOR_REX_PIN, GPIO_INTR_NEGEDGE);
+        // Its edge may not have been latched while the GPIO clock was gated; only a press
+        // that started asleep counts, a button held across the sleep was handled when pressed
+        if(rex_sleep_level && !gpio_ll_get_level(&GPIO, DOOR_REX_PIN))
+            door_io_rex_pressed(NULL);
+    }
+}
@@ -8,6 +8,11 @@
 #include "common.h"
 #include "gatt_svc.h"
 #include "config.h"
+#include "audit.h"
+#include "admin.h"
+#include "credential.h"
+#include "phone.h"
+#include "power.h"
 
 /* Private function declarations */
 inline static void format_addr(char *addr_str, uint8_t addr[]);
@@ -98,7 +103,7 @@ static void start_advertising(void) {
     rsp_fields.uri_len = sizeof(esp_uri);
 
     /* Set advertising interval */
-    rsp_fields.adv_itvl = BLE_GAP_ADV_ITVL_MS(500);
+    rsp_fields.adv_itvl = BLE_GAP_ADV_ITVL_MS(BLE_ADV_ITVL_MS);
     rsp_fields.adv_itvl_is_present = 1;
 
     /* Set scan response fields */
@@ -113,8 +118,8 @@ static void start_advertising(void) {
     adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
 
     /* Set advertising interval */
-    adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(500);
-    adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(510);
+    adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(BLE_ADV_ITVL_MS);
+    adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(BLE_ADV_ITVL_MS + 10);
 
     /* Start advertising */
     rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER, &adv_params,
@@ -160,6 +165,9 @@ static int gap_event_handler(struct ble_gap_event *event, void *arg) {
             /* Print connection descriptor */
             print_conn_desc(&desc);
 
+            /* Stay awake while connected */
+            power_acquire(POWER_LOCK_BLE);
+
             /* Try to update connection parameters */
             struct ble_gap_upd_params params = {.itvl_min = desc.conn_itvl,
                                                 .itvl_max = desc.conn_itvl,
@@ -187,6 +195,16 @@ static int gap_event_handler(struct ble_gap_event *event, void *arg) {
         ESP_LOGI(GATT_TAG, "disconnected from peer; reason=%d",
                  event->disconnect.reason);
 
+        /* Stop any audit log export running for this peer */
+        audit_export_stop(event->disconnect.conn.conn_handle);
+
+        /* Sessions and card sync batches never outlive their connection */
+        admin_logout(event->disconnect.conn.conn_handle);
+        credential_sync_disconnect(event->disconnect.conn.conn_handle);
+
+        /* Allow light sleep again once no connection is left */
+        power_release(POWER_LOCK_BLE);
+
         /* Restart advertising */
         start_advertising();
         return rc;
@@ -241,6 +259,31 @@ static int gap_event_handler(struct ble_gap_event *event, void *arg) {
 
         return rc;
 
+    /* Encryption change event */
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        /* Link encrypted with a new or restored bond */
+        ESP_LOGI(GATT_TAG, "encryption change event; conn_handle=%d status=%d",
+                 event->enc_change.conn_handle, event->enc_change.status);
+        return rc;
+
+    /* Repeat pairing event */
+    case BLE_GAP_EVENT_REPEAT_PAIRING:
+        /* A bonded peer wants to pair again, e.g. after it lost its keys */
+        rc = ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc);
+        if (rc != 0) {
+            return BLE_GAP_REPEAT_PAIRING_IGNORE;
+        }
+
+        /* Never let new keys replace an enrolled phone's bond, it has to be revoked first */
+        if (phone_is_enrolled(&desc.peer_id_addr)) {
+            ESP_LOGW(GATT_TAG, "refusing to re-pair an enrolled phone");
+            return BLE_GAP_REPEAT_PAIRING_IGNORE;
+        }
+
+        /* Delete the old bond and continue pairing */
+        ble_store_util_delete_peer(&desc.peer_id_addr);
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+
     /* MTU update event */
     case BLE_GAP_EVENT_MTU:
         /* Print MTU update info to log */
@@ -9,100 +9,288 @@
 #include "config.h"
 #include "gpio.h"
 #include "keypad.h"
+#include "storage.h"
+#include "audit.h"
+#include "ota.h"
+#include "admin.h"
+#include "phone.h"
+#include "power.h"
+#include "credential.h"
+#include "schedule.h"
+#include "otp.h"
+#include "supervisor.h"
+#include "gatt_schema.h"
+
+/* Payloads are checked against the schema before reaching the handlers */
+static_assert(GATT_ACCESS_PIN_MIN_LEN == KEYPAD_PIN_MIN_LEN, "main/gatt.json out of sync with config.h");
+static_assert(GATT_ACCESS_PIN_MAX_LEN == KEYPAD_PIN_MAX_LEN, "main/gatt.json out of sync with config.h");
+static_assert(GATT_OTA_CONTROL_MAX_LEN == OTA_BEGIN_CMD_LEN, "main/gatt.json out of sync with ota.h");
+static_assert(GATT_ADMIN_LOGIN_MAX_LEN == ADMIN_RESPONSE_LEN, "main/gatt.json out of sync with admin.h");
+static_assert(GATT_PHONE_UNLOCK_MAX_LEN == PHONE_RESPONSE_LEN, "main/gatt.json out of sync with phone.h");
+static_assert(GATT_PHONE_ENROLL_MAX_LEN == PHONE_ENROLL_CMD_MAX_LEN, "main/gatt.json out of sync with phone.h");
+static_assert(GATT_SCHEDULE_CONFIG_MAX_LEN == SCHEDULE_CMD_MAX_LEN, "main/gatt.json out of sync with schedule.h");
+static_assert(GATT_OTP_CONFIG_MAX_LEN == OTP_CMD_MAX_LEN, "main/gatt.json out of sync with otp.h");
+static_assert(GATT_POWER_STATS_MAX_LEN == sizeof(power_stats_t), "main/gatt.json out of sync with power.h");
+static_assert(GATT_DEADLINE_STATS_MAX_LEN == DEADLINE_COUNT * sizeof(deadline_stats_t), "main/gatt.json out of sync with supervisor.h");
+static_assert(GATT_CARD_SYNC_MAX_LEN == CARD_SYNC_CMD_MAX_LEN, "main/gatt.json out of sync with credential.h");
+static_assert(GATT_CARD_SYNC_DATA_MAX_LEN == sizeof(uint16_t) + CARD_SYNC_CHUNK_MAX_OPS * sizeof(card_sync_op_t),
+              "main/gatt.json out of sync with credential.h");
+static_assert(CREDENTIAL_MAX_CARDS * sizeof(card_t) <= GATT_CARD_SYNC_DATA_MAX_LEN, "Card list does not fit one read");
+
+/* Characteristic handlers, see main/gatt.json */
+int gatt_access_pin_write(uint16_t conn_handle, uint16_t attr_handle,
+                          const uint8_t *value, uint16_t len) {
+    /* Update access PIN */
+    char pin[KEYPAD_PIN_MAX_LEN + 1] = {0};
+    memcpy(pin, value, len);
+    /* Reachable over HTTP too, a failed NVS write is reported instead of restarting the terminal */
+    esp_err_t err = change_pin((const char *) pin, "access_pin");
+    if (err != ESP_OK) {
+        ESP_LOGE(GATT_TAG, "failed to store access PIN: %s", esp_err_to_name(err));
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    audit_log_event(AUDIT_EVT_PIN_CHANGE, AUDIT_SLOT_ACCESS_PIN, AUDIT_RES_OK, admin_source(conn_handle), 0);
+    return 0;
+}
+
+int gatt_door_open_duration_write(uint16_t conn_handle, uint16_t attr_handle,
+                                  const uint8_t *value, uint16_t len) {
+    /* Update door duration */
+    uint16_t duration = 0;
+    memcpy(&duration, value, len);
+    esp_err_t err = update_door_duration(duration);
+    if (err != ESP_OK) {
+        ESP_LOGE(GATT_TAG, "failed to store door open duration: %s", esp_err_to_name(err));
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, admin_source(conn_handle), duration);
+    return 0;
+}
+
+int gatt_audit_log_write(uint16_t conn_handle, uint16_t attr_handle,
+                         const uint8_t *value, uint16_t len) {
+    /* Start streaming records from the requested cursor */
+    uint32_t from_seq = 0;
+    memcpy(&from_seq, value, len);
+    if (audit_export_start(conn_handle, attr_handle, from_seq) != ESP_OK) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_ota_control_read(uint16_t conn_handle, uint16_t attr_handle,
+                          struct os_mbuf *om) {
+    /* Report firmware update progress */
+    ota_status_t status;
+    ota_get_status(conn_handle, &status);
+    if (os_mbuf_append(om, &status, sizeof(status)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_ota_control_write(uint16_t conn_handle, uint16_t attr_handle,
+                           const uint8_t *value, uint16_t len) {
+    return ota_control_write(conn_handle, attr_handle, value, len);
+}
+
+int gatt_ota_data_write_raw(uint16_t conn_handle, uint16_t attr_handle,
+                            const struct os_mbuf *om) {
+    /* Firmware chunks are covered by the image hash sent in the authenticated begin command */
+    return ota_data_write(conn_handle, om);
+}
+
+int gatt_admin_login_read(uint16_t conn_handle, uint16_t attr_handle,
+                          struct os_mbuf *om) {
+    /* Hand out a fresh login challenge */
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    if (admin_challenge(conn_handle, challenge) != ESP_OK ||
+        os_mbuf_append(om, challenge, sizeof(challenge)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_admin_login_write_raw(uint16_t conn_handle, uint16_t attr_handle,
+                               const struct os_mbuf *om) {
+    /* Length checked against the schema */
+    uint8_t response[ADMIN_RESPONSE_LEN];
+    os_mbuf_copydata(om, 0, sizeof(response), response);
+    return admin_login(conn_handle, response, sizeof(response));
+}
+
+int gatt_phone_unlock_read(uint16_t conn_handle, uint16_t attr_handle,
+                           struct os_mbuf *om) {
+    /* Hand out a fresh unlock challenge to an enrolled phone */
+    uint8_t challenge[PHONE_CHALLENGE_LEN];
+    int rc = phone_challenge(conn_handle, challenge);
+    if (rc != 0) {
+        return rc;
+    }
+    if (os_mbuf_append(om, challenge, sizeof(challenge)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_phone_unlock_write_raw(uint16_t conn_handle, uint16_t attr_handle,
+                                const struct os_mbuf *om) {
+    /* Length checked against the schema */
+    uint8_t response[PHONE_RESPONSE_LEN];
+    os_mbuf_copydata(om, 0, sizeof(response), response);
+    return phone_unlock(conn_handle, response);
+}
+
+int gatt_phone_enroll_write(uint16_t conn_handle, uint16_t attr_handle,
+                            const uint8_t *value, uint16_t len) {
+    return phone_enroll(conn_handle, value, len);
+}
+
+int gatt_card_enroll_write(uint16_t conn_handle, uint16_t attr_handle,
+                           const uint8_t *value, uint16_t len) {
+    return credential_card_command(value, len, admin_source(conn_handle));
+}
+
+int gatt_current_time_read(uint16_t conn_handle, uint16_t attr_handle,
+                           struct os_mbuf *om) {
+    uint32_t now = (uint32_t)time(NULL);
+    if (os_mbuf_append(om, &now, sizeof(now)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_current_time_write(uint16_t conn_handle, uint16_t attr_handle,
+                            const uint8_t *value, uint16_t len) {
+    uint32_t epoch;
+    memcpy(&epoch, value, sizeof(epoch));
+    if (epoch < SCHEDULE_MIN_VALID_TIME) {
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+    return schedule_set_time(epoch, admin_source(conn_handle)) == ESP_OK ? 0 : BLE_ATT_ERR_UNLIKELY;
+}
+
+int gatt_schedule_config_write(uint16_t conn_handle, uint16_t attr_handle,
+                               const uint8_t *value, uint16_t len) {
+    return schedule_command(value, len, admin_source(conn_handle));
+}
+
+int gatt_otp_config_write(uint16_t conn_handle, uint16_t attr_handle,
+                          const uint8_t *value, uint16_t len) {
+    return otp_command(value, len, admin_source(conn_handle));
+}
+
+int gatt_power_stats_read(uint16_t conn_handle, uint16_t attr_handle,
+                          struct os_mbuf *om) {
+    power_stats_t stats;
+    power_get_stats(&stats);
+    if (os_mbuf_append(om, &stats, sizeof(stats)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_deadline_stats_read(uint16_t conn_handle, uint16_t attr_handle,
+                             struct os_mbuf *om) {
+    deadline_stats_t stats[DEADLINE_COUNT];
+    deadline_get_stats(stats);
+    if (os_mbuf_append(om, stats, sizeof(stats)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_card_sync_read(uint16_t conn_handle, uint16_t attr_handle,
+                        struct os_mbuf *om) {
+    card_sync_status_t status;
+    credential_sync_status(conn_handle, &status);
+    if (os_mbuf_append(om, &status, sizeof(status)) != 0) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+int gatt_card_sync_write(uint16_t conn_handle, uint16_t attr_handle,
+                         const uint8_t *value, uint16_t len) {
+    return credential_sync_command(conn_handle, attr_handle, value, len);
+}
+
+int gatt_card_sync_data_read(uint16_t conn_handle, uint16_t attr_handle,
+                             struct os_mbuf *om) {
+    return credential_card_list(om);
+}
+
+int gatt_card_sync_data_write_raw(uint16_t conn_handle, uint16_t attr_handle,
+                                  const struct os_mbuf *om) {
+    /* Chunks only change a staged copy, which is checked against the digest in the authenticated commit */
+    return credential_sync_data(conn_handle, om);
+}
+
+/*
+ *  Single access callback of all characteristics
+ *      The characteristic descriptor comes in as the callback argument,
+ *      so dispatch needs no handle comparisons.
+ */
+int gatt_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle,
+                       struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    /* Local variables */
+    const gatt_chr_t *chr = arg;
+    uint8_t raw[ADMIN_MAX_PAYLOAD_LEN + ADMIN_TRAILER_LEN];
+    uint16_t raw_len;
+    uint8_t value[ADMIN_MAX_PAYLOAD_LEN];
+    uint16_t len = sizeof(value);
+    int rc;
 
-/* Private function declarations */
-static int ble_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle,
-                                 struct ble_gatt_access_ctxt *ctxt, void *arg);
-
-/* Automation IO service */
-static const ble_uuid16_t auto_io_svc_uuid = BLE_UUID16_INIT(0x1815);
-
-/* Access PIN characteristics */
-static uint16_t access_pin_chr_val_handle;
-static const ble_uuid128_t access_pin_chr_uuid =
-    BLE_UUID128_INIT(0x21, 0xc9, 0xa1, 0x6b, 0x7f, 0x9b, 0xd4, 0xbe, 0x5e, 0x42,
-                     0x62, 0x5b, 0xdc, 0x36, 0x60, 0xbf);
-
-/* Door duration characteristics */
-static uint16_t door_duration_chr_val_handle;
-static const ble_uuid128_t door_duration_chr_uuid =
-    BLE_UUID128_INIT(0x55, 0x15, 0xba, 0x07, 0x8a, 0xc9, 0x5a, 0x81, 0x94, 0x48,
-                     0xa0, 0x27, 0x80, 0xe1, 0x3e, 0x4e);
-
-/* GATT services table */
-static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
-    /* Automation IO service */
-    {
-        .type = BLE_GATT_SVC_TYPE_PRIMARY,
-        .uuid = &auto_io_svc_uuid.u,
-        .characteristics =
-            (struct ble_gatt_chr_def[]){/* Access PIN characteristic */
-                                        {.uuid = &access_pin_chr_uuid.u,
-                                         .access_cb = ble_chr_access_cb,
-                                         .flags = BLE_GATT_CHR_F_WRITE,
-                                         .val_handle = &access_pin_chr_val_handle},
-                                        /* Door duration characteristic */
-                                        {.uuid = &door_duration_chr_uuid.u,
-                                         .access_cb = ble_chr_access_cb,
-                                         .flags = BLE_GATT_CHR_F_WRITE,
-                                         .val_handle = &door_duration_chr_val_handle},
-                                        {0}},
-    },
-
-    {
-        0, /* No more services. */
-    },
-};
-
-static int ble_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle,
-                          struct ble_gatt_access_ctxt *ctxt, void *arg) {
     /* Handle access events */
     switch (ctxt->op) {
 
+    /* Read characteristic event */
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        if (chr->read == NULL) {
+            goto error;
+        }
+        return chr->read(conn_handle, attr_handle, ctxt->om);
+
     /* Write characteristic event */
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
         /* Verify connection handle */
         if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-            ESP_LOGI(GATT_TAG, "characteristic write; conn_handle=%d attr_handle=%d",
-                     conn_handle, attr_handle);
+            ESP_LOGI(GATT_TAG, "characteristic %s write; conn_handle=%d attr_handle=%d",
+                     chr->name, conn_handle, attr_handle);
         } else {
             ESP_LOGI(GATT_TAG,
-                     "characteristic write by nimble stack; attr_handle=%d",
-                     attr_handle);
-        }
-
-        /* Check if door is open */
-        if(!is_door_open()) {
-            return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+                     "characteristic %s write by nimble stack; attr_handle=%d",
+                     chr->name, attr_handle);
         }
 
-        /* Verify attribute handle */
-        if (attr_handle == access_pin_chr_val_handle) {
-            /* Verify access buffer length */
-            if (ctxt->om->om_len >= KEYPAD_PIN_MIN_LEN && ctxt->om->om_len <= KEYPAD_PIN_MAX_LEN) {
-                /* Update access PIN */
-                char pin[KEYPAD_PIN_MAX_LEN + 1] = {0};
-                memcpy(pin, ctxt->om->om_data, sizeof(pin));
-                pin[ctxt->om->om_len] = '\0';
-                ESP_ERROR_CHECK(change_pin((const char *) pin, "access_pin"));
-                return ESP_OK;
-            } else {
-                goto error;
-            }
-        } else
-        if (attr_handle == door_duration_chr_val_handle) {
+        if (!chr->auth) {
             /* Verify access buffer length */
-            if (ctxt->om->om_len == 2) {
-                /* Update door duration */
-                uint16_t duration = 0;
-                memcpy(&duration, ctxt->om->om_data, ctxt->om->om_len);
-                ESP_ERROR_CHECK(update_door_duration(duration));
-                return ESP_OK;
-            } else {
-                goto error;
+            len = OS_MBUF_PKTLEN(ctxt->om);
+            if (len < chr->min_len || len > chr->max_len) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
             }
+            return chr->write_raw(conn_handle, attr_handle, ctxt->om);
         }
-        goto error;
+
+        /* Verify admin session and strip the trailer */
+        if (ble_hs_mbuf_to_flat(ctxt->om, raw, sizeof(raw), &raw_len) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        rc = admin_verify_write(conn_handle, chr->uuid128, raw, raw_len, value, &len);
+        if (rc != 0) {
+            return rc;
+        }
+
+        /* Verify access buffer length */
+        if (len < chr->min_len || len > chr->max_len) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+
+        /* HTTP clients write through the same handlers, one at a time */
+        admin_write_begin();
+        rc = chr->write(conn_handle, attr_handle, value, len);
+        admin_write_end();
+        return rc;
 
     /* Unknown event */
     default:
@@ -111,8 +299,8 @@ static int ble_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle,
 
 error:
     ESP_LOGE(GATT_TAG,
-             "unexpected access operation to access pin characteristic, opcode: %d",
-             ctxt->op);
+             "unexpected access operation to %s characteristic, opcode: %d",
+             chr->name, ctxt->op);
     return BLE_ATT_ERR_UNLIKELY;
 }
 
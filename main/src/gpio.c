@@ -9,89 +9,96 @@
 
 #include <esp_log.h>
 #include <esp_check.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
 
 #include <soc/gpio_reg.h>
+#include <soc/gpio_struct.h>
+#include <hal/gpio_ll.h>
 
 #include "config.h"
 #include "gpio.h"
 #include "keypad.h"
+#include "supervisor.h"
 #include "common.h"
 
-static char * gpio_pad_map[][3] =
-{
-    {"1", "2", "3"},
-    {"4", "5", "6"},
-    {"7", "8", "9"},
-    {"*", "0", "#"}
-};
+// Keypad tables, generated at compile time from KEYPADS, KEYPAD_COL_PINS and KEYPAD_ROW_PINS in config.h
+
+// Geometry of each keypad as constant expressions (KEYPAD_ENTRY_COLS...)
+#define X_KEYPAD_GEOMETRY(id, cols, rows, keymap) id##_COLS = cols, id##_ROWS = rows,
+enum { KEYPADS(X_KEYPAD_GEOMETRY) };
+
+#define X_KEYPAD_CHECK(id, cols, rows, keymap) \
+    static_assert(sizeof(keymap) - 1 == (cols) * (rows), #id " keymap does not match its size");
+KEYPADS(X_KEYPAD_CHECK)
+#define X_COL_CHECK(keypad, col, gpio) static_assert((col) < keypad##_COLS, #keypad " has no column " #col);
+KEYPAD_COL_PINS(X_COL_CHECK)
+#define X_ROW_CHECK(keypad, row, gpio) static_assert((row) < keypad##_ROWS, #keypad " has no row " #row);
+KEYPAD_ROW_PINS(X_ROW_CHECK)
+
+typedef struct {
+    uint8_t cols;
+    uint8_t rows;
+    const char * keymap;
+} gpio_keypad_t;
+
+typedef struct {
+    uint8_t keypad;
+    uint8_t index; // Row or column within the keypad
+    gpio_num_t gpio;
+} gpio_keypad_pin_t;
+
+#define X_KEYPAD(id, cols, rows, keymap) [id] = {cols, rows, keymap},
+static const gpio_keypad_t gpio_keypads[KEYPAD_COUNT] = { KEYPADS(X_KEYPAD) };
+
+#define X_KEYPAD_PIN(keypad, index, gpio) {keypad, index, gpio},
+static const gpio_keypad_pin_t gpio_keypad_cols[] = { KEYPAD_COL_PINS(X_KEYPAD_PIN) };
+// Used from the light sleep callbacks, so kept out of flash
+static const DRAM_ATTR gpio_keypad_pin_t gpio_keypad_rows[] = { KEYPAD_ROW_PINS(X_KEYPAD_PIN) };
+
+// Reverse lookup from a row GPIO to its keypad and row
+#define X_ROW_MAP(keypad, row, gpio) [gpio] = {keypad, row, true},
+static const struct {
+    uint8_t keypad;
+    uint8_t row;
+    bool valid;
+} gpio_keypad_row_map[GPIO_NUM_MAX] = { KEYPAD_ROW_PINS(X_ROW_MAP) };
 
-static int gpio_keypad_pin_cols[] = GPIO_KEYPAD_PIN_COLS;
-static int gpio_keypad_pin_rows[] = GPIO_KEYPAD_PIN_ROWS;
+// 64-bit masks, the ESP32 has GPIOs above 31
+#define X_PIN_BIT(keypad, index, gpio) | BIT64(gpio)
+#define X_PIN_COUNT(keypad, index, gpio) + 1
+#define GPIO_KEYPAD_COL_MASK (0 KEYPAD_COL_PINS(X_PIN_BIT))
+#define GPIO_KEYPAD_ROW_MASK (0 KEYPAD_ROW_PINS(X_PIN_BIT))
+static const DRAM_ATTR uint64_t gpio_keypad_col_mask = GPIO_KEYPAD_COL_MASK;
+static const DRAM_ATTR uint64_t gpio_keypad_row_mask = GPIO_KEYPAD_ROW_MASK;
 
-static int gpio_keypad_col_mask;
-static int gpio_keypad_row_mask;
+static_assert(__builtin_popcountll(GPIO_KEYPAD_COL_MASK) == 0 KEYPAD_COL_PINS(X_PIN_COUNT), "Keypad column GPIO used twice");
+static_assert(__builtin_popcountll(GPIO_KEYPAD_ROW_MASK) == 0 KEYPAD_ROW_PINS(X_PIN_COUNT), "Keypad row GPIO used twice");
+static_assert((GPIO_KEYPAD_COL_MASK & GPIO_KEYPAD_ROW_MASK) == 0, "Keypad GPIO used as both row and column");
 
 static volatile uint32_t *gpio_w1ts_reg = (volatile uint32_t *) GPIO_OUT_W1TS_REG;
 static volatile uint32_t *gpio_w1tc_reg = (volatile uint32_t *) GPIO_OUT_W1TC_REG;
+static volatile uint32_t *gpio_w1ts1_reg = (volatile uint32_t *) GPIO_OUT1_W1TS_REG; // GPIO 32 and up
+static volatile uint32_t *gpio_w1tc1_reg = (volatile uint32_t *) GPIO_OUT1_W1TC_REG;
 
 QueueHandle_t gpio_evt_queue;
-
-void gpio_blink_blocking(const uint8_t gpio_num, const uint16_t duration)
-{
-    ESP_ERROR_CHECK(gpio_set_level(gpio_num, GPIO_HIGH));
-    vTaskDelayMSec(duration);
-    ESP_ERROR_CHECK(gpio_set_level(gpio_num, GPIO_LOW));
-}
-
-/*
- * @brief Task to blink a GPIO pin in a non-blocking manner
- * @param param GPIO pin number and duration
- * @note uint32_t param = ((uint16_t) duration << 8 | (uint8_t) gpio_num)
-*/
-static noreturn void gpio_blink_task(void * param)
-{
-    uint32_t num_duration = (uint32_t) param;
-    gpio_blink_blocking(num_duration & 0xFF, num_duration >> 8);
-    vTaskDelete(NULL); // Delete self
-    while(1); // Wait for deletion
-}
-
-void gpio_blink_nonblocking(const uint8_t gpio_num, const uint16_t duration)
-{
-    uint32_t num_duration = duration << 8 | gpio_num;
-    xTaskCreate(&gpio_blink_task, "gpio_blink_nonblocking", 1024, (void*) num_duration, 5, NULL);
-}
-
-void gpio_blink_twice_blocking(const uint32_t gpio_num)
-{
-    gpio_blink_blocking(gpio_num, seconds(0.05));
-    vTaskDelaySec(0.1);
-    gpio_blink_blocking(gpio_num, seconds(0.05));
-}
-
-/*
- * @brief Task to blink a GPIO pin twice in a non-blocking manner
- * @param param GPIO pin number
-*/
-static noreturn void gpio_blink_twice_task(void * param)
-{
-    uint32_t gpio_num = (uint32_t) param;
-    gpio_blink_twice_blocking(gpio_num);
-    vTaskDelete(NULL); // Delete self
-    while(1); // Wait for deletion
-}
-
-void gpio_blink_twice_nonblocking(const uint32_t gpio_num)
-{
-    xTaskCreate(&gpio_blink_twice_task, "gpio_blink_success", 1024, (void*) gpio_num, 5, NULL);
-}
+#if KEYPAD_INJECT
+// Taken while an injected key is in flight; the keypad task resets the queue after
+// each key to drop bounces, a second injected key queued meanwhile would go with them
+static SemaphoreHandle_t inject_idle = NULL;
+// Sequence number of the key in flight, a key that timed out is not reported handled later on
+static uint8_t inject_seq = 0;
+static bool inject_pending = false;
+static portMUX_TYPE inject_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
 
 /*
  * @brief GPIO interrupt handler for keypad
 */
 static void IRAM_ATTR gpio_keypad_interrupt(void* arg)
 {
-    uint32_t gpio_num = (uint32_t) arg;
+    uint32_t gpio_num = (uint32_t) (uintptr_t) arg;
+    deadline_start_from_isr(DEADLINE_KEY);
     xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
 }
 
@@ -116,23 +123,15 @@ void gpio_configure()
     gpio_config_t col_conf = {};
     col_conf.intr_type = GPIO_INTR_DISABLE;
     col_conf.mode = GPIO_MODE_OUTPUT;
-    for(uint8_t col = 0; col < array_len(gpio_keypad_pin_cols); col++) {
-        uint8_t col_pin = map_keypad_col_to_gpio_pin(col);
-        gpio_keypad_col_mask |= (1 << col_pin);
-        gpio_set_level(col_pin, GPIO_HIGH);
-    }
-
     col_conf.pin_bit_mask = gpio_keypad_col_mask;
+    for(uint8_t col = 0; col < array_len(gpio_keypad_cols); col++) {
+        gpio_set_level(gpio_keypad_cols[col].gpio, GPIO_HIGH);
+    }
 
     gpio_config_t row_conf = {};
     row_conf.intr_type = GPIO_INTR_POSEDGE;
     row_conf.mode = GPIO_MODE_INPUT;
     row_conf.pull_down_en = GPIO_PULLDOWN_ENABLE;
-    for(uint8_t row = 0; row < array_len(gpio_keypad_pin_rows); row++) {
-        uint8_t row_pin = map_keypad_row_to_gpio_pin(row);
-        gpio_keypad_row_mask |= (1 << row_pin);
-    }
-
     row_conf.pin_bit_mask = gpio_keypad_row_mask;
 
     ESP_ERROR_CHECK(gpio_config(&col_conf));
@@ -143,42 +142,141 @@ void gpio_configure()
         ESP_LOGE(PROJ_NAME, "Failed to create GPIO event queue");
         abort();
     }
+#if KEYPAD_INJECT
+    inject_idle = xSemaphoreCreateBinary();
+    if(inject_idle == NULL) {
+        ESP_LOGE(PROJ_NAME, "Failed to create key injection semaphore");
+        abort();
+    }
+    xSemaphoreGive(inject_idle);
+#endif
 
     ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT));
-    for(uint8_t row = 0; row < array_len(gpio_keypad_pin_rows); row++) {
-        uint32_t row_pin = map_keypad_row_to_gpio_pin(row);
-        ESP_ERROR_CHECK(gpio_isr_handler_add(row_pin, &gpio_keypad_interrupt, (void*) row_pin));
+    for(uint8_t row = 0; row < array_len(gpio_keypad_rows); row++) {
+        uint32_t row_pin = gpio_keypad_rows[row].gpio;
+        ESP_ERROR_CHECK(gpio_isr_handler_add(row_pin, &gpio_keypad_interrupt, (void*) (uintptr_t) row_pin));
     }
 
-    ESP_LOGI(PROJ_NAME, "GPIO pins configured");
+    ESP_LOGI(PROJ_NAME, "GPIO pins configured, %u keypad(s)", KEYPAD_COUNT);
 }
 
-uint8_t gpio_keypad_key_lookup(uint32_t io_num)
+void IRAM_ATTR gpio_keypad_sleep_prepare()
 {
-    uint8_t key = E_KEYPAD_NO_KEY_FOUND;
-    uint8_t row;
+    // Level wakeup replaces the edge interrupt type, so it is only armed right before sleeping
+    for(uint8_t row = 0; row < array_len(gpio_keypad_rows); row++)
+        gpio_ll_wakeup_enable(&GPIO, gpio_keypad_rows[row].gpio, GPIO_INTR_HIGH_LEVEL);
+}
+
+bool IRAM_ATTR gpio_keypad_sleep_restore()
+{
+    for(uint8_t row = 0; row < array_len(gpio_keypad_rows); row++) {
+        uint32_t row_pin = gpio_keypad_rows[row].gpio;
+        gpio_ll_wakeup_disable(&GPIO, row_pin);
+        gpio_ll_set_intr_type(&GPIO, row_pin, GPIO_INTR_POSEDGE);
+    }
+
+    // Report a row that is already high, its edge happened while asleep
+    uint64_t levels = REG_READ(GPIO_IN_REG) | (uint64_t) REG_READ(GPIO_IN1_REG) << 32;
+    uint64_t pressed = levels & gpio_keypad_row_mask;
+    if(pressed == 0)
+        return false;
+    uint32_t gpio_num = __builtin_ctzll(pressed);
+    deadline_start_from_isr(DEADLINE_KEY);
+    xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
+    return true;
+}
+
+/*
+ * @brief Drive the given keypad columns high (set) or low (clear)
+*/
+static inline void gpio_keypad_cols_set(uint64_t mask)
+{
+    *gpio_w1ts_reg = (uint32_t) mask;
+    *gpio_w1ts1_reg = (uint32_t) (mask >> 32);
+}
 
-    // First find out which row was pressed from GPIO number
-    // TODO rewrite this using reverse lookup table
-    for(uint8_t row_i = 0; row_i < array_len(gpio_keypad_pin_rows); row_i++) {
-        if(io_num == map_keypad_row_to_gpio_pin(row_i))
-            row = row_i;
+static inline void gpio_keypad_cols_clear(uint64_t mask)
+{
+    *gpio_w1tc_reg = (uint32_t) mask;
+    *gpio_w1tc1_reg = (uint32_t) (mask >> 32);
+}
+
+#if KEYPAD_INJECT
+int64_t gpio_keypad_inject_key(uint8_t keypad, char key, TickType_t timeout)
+{
+    if(xSemaphoreTake(inject_idle, timeout) != pdTRUE)
+        return -1; // The previous key is still being handled
+
+    taskENTER_CRITICAL(&inject_lock);
+    uint32_t event = GPIO_KEYPAD_INJECTED | (uint32_t) ++inject_seq << 16 | (uint32_t) keypad << 8 | (uint8_t) key;
+    inject_pending = true;
+    taskEXIT_CRITICAL(&inject_lock);
+
+    int64_t start = esp_timer_get_time();
+    if(xQueueSend(gpio_evt_queue, &event, timeout) != pdTRUE) {
+        inject_pending = false;
+        xSemaphoreGive(inject_idle);
+        return -1;
+    }
+    if(xSemaphoreTake(inject_idle, timeout) != pdTRUE) {
+        // Most likely dropped by a queue reset that followed a real key or an entry timeout,
+        // the token comes back here, a late report of this key is then ignored
+        taskENTER_CRITICAL(&inject_lock);
+        inject_pending = false;
+        taskEXIT_CRITICAL(&inject_lock);
+        xSemaphoreGive(inject_idle); // No-op if the report raced in before the flag was cleared
+        return -1;
     }
+    int64_t latency = esp_timer_get_time() - start;
+    xSemaphoreGive(inject_idle);
+    return latency;
+}
 
-    // Quickly set all columns to LOW
-    *gpio_w1tc_reg = gpio_keypad_col_mask;
+void gpio_keypad_inject_done(uint32_t event)
+{
+    taskENTER_CRITICAL(&inject_lock);
+    bool current = inject_pending && (uint8_t) (event >> 16) == inject_seq;
+    if(current)
+        inject_pending = false;
+    taskEXIT_CRITICAL(&inject_lock);
+    if(current)
+        xSemaphoreGive(inject_idle);
+}
+#endif
 
-    // Iterate over columns setting each to HIGH and checking if the row goes HIGH
-    for(uint8_t col = 0; col < array_len(gpio_keypad_pin_cols); col++) {
-        uint8_t col_pin = map_keypad_col_to_gpio_pin(col);
-        ESP_ERROR_CHECK(gpio_set_level(col_pin, GPIO_HIGH));
+uint8_t gpio_keypad_key_lookup(uint32_t io_num, uint8_t * keypad)
+{
+    uint8_t key = E_KEYPAD_NO_KEY_FOUND;
+
+#if KEYPAD_INJECT
+    if(io_num & GPIO_KEYPAD_INJECTED) {
+        *keypad = (io_num >> 8) & 0xFF;
+        return io_num & 0xFF;
+    }
+#endif
+
+    // First find out which keypad and row was pressed from GPIO number
+    if(io_num >= GPIO_NUM_MAX || !gpio_keypad_row_map[io_num].valid)
+        return key;
+    uint8_t row = gpio_keypad_row_map[io_num].row;
+    *keypad = gpio_keypad_row_map[io_num].keypad;
+    const gpio_keypad_t * pad = &gpio_keypads[*keypad];
+
+    // Quickly set all columns to LOW, a press on another keypad meanwhile shows up as an edge once they are restored
+    gpio_keypad_cols_clear(gpio_keypad_col_mask);
+
+    // Iterate over columns of this keypad setting each to HIGH and checking if the row goes HIGH
+    for(uint8_t col = 0; col < array_len(gpio_keypad_cols); col++) {
+        if(gpio_keypad_cols[col].keypad != *keypad)
+            continue;
+        gpio_keypad_cols_set(BIT64(gpio_keypad_cols[col].gpio));
         if(gpio_get_level(io_num) == GPIO_HIGH) {
-            key = gpio_pad_map[row][col][0];
+            key = pad->keymap[row * pad->cols + gpio_keypad_cols[col].index];
             break;
         }
-        ESP_ERROR_CHECK(gpio_set_level(col_pin, GPIO_LOW));
+        gpio_keypad_cols_clear(BIT64(gpio_keypad_cols[col].gpio));
     }
 
-    *gpio_w1ts_reg = gpio_keypad_col_mask; // Restore original state (all columns HIGH)
+    gpio_keypad_cols_set(gpio_keypad_col_mask); // Restore original state (all columns HIGH)
     return key;
 }
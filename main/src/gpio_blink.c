@@ -0,0 +1,62 @@
+/*
+ * @file main/gpio_blink.c
+ *
+ * @proj imp-term
+ * @brief LED blinking, apart from the keypad matrix so that tools/sim runs it unchanged
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+#include "gpio.h"
+#include "common.h"
+
+void gpio_blink_blocking(const uint8_t gpio_num, const uint16_t duration)
+{
+    ESP_ERROR_CHECK(gpio_set_level(gpio_num, GPIO_HIGH));
+    vTaskDelayMSec(duration);
+    ESP_ERROR_CHECK(gpio_set_level(gpio_num, GPIO_LOW));
+}
+
+/*
+ * @brief Task to blink a GPIO pin in a non-blocking manner
+ * @param param GPIO pin number and duration
+ * @note uint32_t param = ((uint16_t) duration << 8 | (uint8_t) gpio_num)
+*/
+static noreturn void gpio_blink_task(void * param)
+{
+    uint32_t num_duration = (uint32_t) param;
+    gpio_blink_blocking(num_duration & 0xFF, num_duration >> 8);
+    vTaskDelete(NULL); // Delete self
+    while(1); // Wait for deletion
+}
+
+void gpio_blink_nonblocking(const uint8_t gpio_num, const uint16_t duration)
+{
+    uint32_t num_duration = duration << 8 | gpio_num;
+    task_create(&gpio_blink_task, (void*) num_duration, NULL, TASK_GPIO_BLINK);
+}
+
+void gpio_blink_twice_blocking(const uint32_t gpio_num)
+{
+    gpio_blink_blocking(gpio_num, seconds(0.05));
+    vTaskDelaySec(0.1);
+    gpio_blink_blocking(gpio_num, seconds(0.05));
+}
+
+/*
+ * @brief Task to blink a GPIO pin twice in a non-blocking manner
+ * @param param GPIO pin number
+*/
+static noreturn void gpio_blink_twice_task(void * param)
+{
+    uint32_t gpio_num = (uint32_t) param;
+    gpio_blink_twice_blocking(gpio_num);
+    vTaskDelete(NULL); // Delete self
+    while(1); // Wait for deletion
+}
+
+void gpio_blink_twice_nonblocking(const uint32_t gpio_num)
+{
+    task_create(&gpio_blink_twice_task, (void*) gpio_num, NULL, TASK_GPIO_BLINK);
+}
@@ -0,0 +1,551 @@
+/*
+ * @file main/http_server.c
+ *
+ * @proj imp-term
+ * @brief Local configuration server, the web client from flash and a JSON API
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+
+#if HTTP_SERVER
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cJSON.h>
+#include <esp_check.h>
+#include <esp_heap_caps.h>
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <freertos/queue.h>
+#include <lwip/sockets.h>
+
+#include "http_server.h"
+#include "net.h"
+#include "admin.h"
+#include "audit.h"
+#include "keypad.h"
+#include "storage.h"
+#include "supervisor.h"
+#include "common.h"
+#include "gatt_schema.h"
+
+/*
+ * The web client is packed by tools/wwwpack.py into the www partition, already
+ * gzipped, and the partition stays memory mapped: a file is sent straight from
+ * flash through the cache, with no heap copy and no compression on the device.
+ * Browsers get an ETag and revalidate index.html on every load (304 without a
+ * body), the hashed files under static/ are cached for good.
+ *
+ * API, every body is JSON:
+ *   GET  /api/status             clock, door, audit position and deadline misses
+ *   GET  /api/login              {"session": n, "challenge": hex}, see admin.h; 503 while
+ *                                every HTTP handle is logged in or has a fresh challenge,
+ *                                a client asking again gets a new one on its own handle
+ *   POST /api/login              {"session": n, "response": hex}
+ *   POST /api/<characteristic>   {"session": n, "value": hex}, for those marked http in main/gatt.json
+ *   POST /api/audit_log          same, value is the first sequence number to read
+ * The value is exactly what would be written over BLE, payload | counter | tag,
+ * checked by admin_verify_write() and applied by the same handler in gatt_svc.c.
+ *
+ * The server task only parses requests. Each one is handed to a fixed pool of
+ * HTTP_WORKERS tasks through a queue of HTTP_QUEUE_LEN, a request finding the
+ * queue full is answered 503 at once, so a burst of clients costs neither
+ * heap nor tasks. Flash writes behind the API (NVS, audit reads) block a
+ * worker, never the server task.
+*/
+
+#define HTTP_URI_LEN 40
+#define HTTP_HEADER_LEN 64
+#define HTTP_CHUNK_LEN 256
+#define HTTP_FIXED_ROUTES 4
+#define HTTP_ROUTE_COUNT (HTTP_FIXED_ROUTES + GATT_HTTP_CHR_COUNT)
+#define HTTP_STR(x) #x
+#define HTTP_XSTR(x) HTTP_STR(x)
+
+typedef struct {
+    char uri[HTTP_URI_LEN];
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t * req, const void * arg); // Runs in a worker
+    const void * arg;
+} http_route_t;
+
+static httpd_handle_t server = NULL;
+static QueueHandle_t http_queue;
+
+static const uint8_t * www_base = NULL; // Mapped www partition, NULL if it holds no valid image
+static const www_header_t * www_header;
+static const www_entry_t * www_index;
+
+/*
+ * @brief Map the www partition and check its image, once at start
+*/
+static esp_err_t www_map()
+{
+    const esp_partition_t * partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, WWW_PARTITION_NAME);
+    ESP_RETURN_ON_FALSE(partition != NULL, ESP_ERR_NOT_FOUND, PROJ_NAME, "No %s partition", WWW_PARTITION_NAME);
+
+    const void * base;
+    esp_partition_mmap_handle_t handle;
+    ESP_RETURN_ON_ERROR(esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &base, &handle),
+                        PROJ_NAME, "Error mapping %s partition", WWW_PARTITION_NAME);
+
+    const www_header_t * header = base;
+    const www_entry_t * index = (const www_entry_t *) &header[1];
+    size_t index_end = sizeof(*header) + (size_t) header->count * sizeof(*index);
+    if(header->magic != WWW_MAGIC || header->version != WWW_FORMAT_VERSION
+       || header->size > partition->size || index_end > header->size) {
+        esp_partition_munmap(handle);
+        ESP_LOGW(PROJ_NAME, "No web client in %s partition (make http flashes it)", WWW_PARTITION_NAME);
+        return ESP_ERR_NOT_FOUND;
+    }
+    for(uint16_t i = 0; i < header->count; i++) {
+        if(index[i].offset < index_end || index[i].length > header->size - index[i].offset
+           || index[i].path[WWW_PATH_LEN - 1] != '\0' || index[i].type[WWW_TYPE_LEN - 1] != '\0') {
+            esp_partition_munmap(handle);
+            ESP_LOGE(PROJ_NAME, "Corrupt web client image, entry %u", i);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    www_header = header;
+    www_index = index;
+    www_base = base;
+    ESP_LOGI(PROJ_NAME, "Web client mapped, %u files in %lu bytes", header->count, (unsigned long) header->size);
+    return ESP_OK;
+}
+
+/*
+ * @brief Binary search of the index, which wwwpack.py sorts by path
+*/
+static const www_entry_t * www_find(const char * path, size_t len)
+{
+    if(len >= WWW_PATH_LEN)
+        return NULL;
+
+    uint16_t low = 0, high = www_header->count;
+    while(low < high) {
+        uint16_t mid = low + (high - low) / 2;
+        int cmp = strncmp(path, www_index[mid].path, len);
+        if(cmp == 0)
+            cmp = -(www_index[mid].path[len] != '\0'); // Entry is longer, path sorts first
+        if(cmp == 0)
+            return &www_index[mid];
+        if(cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * @brief Answer with a status httpd_resp_send_err() has no code for, and no body
+*/
+static esp_err_t http_send_status(httpd_req_t * req, const char * status)
+{
+    httpd_resp_set_status(req, status);
+    return httpd_resp_send(req, NULL, 0);
+}
+
+static esp_err_t http_asset(httpd_req_t * req, const void * arg)
+{
+    const char * path = req->uri + 1;
+    size_t len = strcspn(path, "?#");
+    if(len == 0) {
+        path = "index.html";
+        len = strlen(path);
+    }
+
+    const www_entry_t * entry = www_base != NULL ? www_find(path, len) : NULL;
+    if(entry == NULL)
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+
+    char header[HTTP_HEADER_LEN];
+    char etag[12];
+    snprintf(etag, sizeof(etag), "\"%08lx\"", (unsigned long) entry->etag);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", (entry->flags & WWW_F_IMMUTABLE) ? "public, max-age=31536000, immutable" : "no-cache");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+
+    if(httpd_req_get_hdr_value_str(req, "If-None-Match", header, sizeof(header)) == ESP_OK && strstr(header, etag) != NULL)
+        return http_send_status(req, "304 Not Modified");
+
+    // Only the gzipped file is stored, every browser takes it; a longer header is only ever a longer list
+    esp_err_t ret = httpd_req_get_hdr_value_str(req, "Accept-Encoding", header, sizeof(header));
+    if((ret != ESP_OK && ret != ESP_ERR_HTTPD_RESULT_TRUNC) || (ret == ESP_OK && strstr(header, "gzip") == NULL))
+        return http_send_status(req, "406 Not Acceptable");
+
+    httpd_resp_set_type(req, entry->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char *) &www_base[entry->offset], entry->length);
+}
+
+/*
+ * @brief Read the whole body and parse it, or answer the request with the reason why not
+ * @return Parsed body to be freed by cJSON_Delete(), NULL if the request was answered
+*/
+static cJSON * http_read_json(httpd_req_t * req)
+{
+    char body[HTTP_MAX_BODY_LEN];
+
+    if(req->content_len > sizeof(body)) {
+        http_send_status(req, "413 Content Too Large");
+        return NULL;
+    }
+    for(size_t received = 0; received < req->content_len; ) {
+        int rc = httpd_req_recv(req, &body[received], req->content_len - received);
+        if(rc <= 0) {
+            if(rc == HTTPD_SOCK_ERR_TIMEOUT)
+                httpd_resp_send_408(req);
+            return NULL;
+        }
+        received += rc;
+    }
+
+    cJSON * json = cJSON_ParseWithLength(body, req->content_len);
+    if(json == NULL || !cJSON_IsObject(json)) {
+        cJSON_Delete(json);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected a JSON object");
+        return NULL;
+    }
+    return json;
+}
+
+/*
+ * @brief Session handle of a request, only the range handed out by GET /api/login
+*/
+static bool http_json_session(const cJSON * json, uint16_t * session)
+{
+    const cJSON * item = cJSON_GetObjectItemCaseSensitive(json, "session");
+    if(!cJSON_IsNumber(item) || item->valueint < ADMIN_HTTP_CONN_BASE || item->valueint >= ADMIN_HTTP_CONN_BASE + HTTP_ADMIN_SESSIONS)
+        return false;
+    *session = item->valueint;
+    return true;
+}
+
+static int http_hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * @brief Decode a hex string member into at most max bytes
+*/
+static bool http_json_hex(const cJSON * json, const char * name, uint8_t * out, size_t max, uint16_t * len)
+{
+    const cJSON * item = cJSON_GetObjectItemCaseSensitive(json, name);
+    if(!cJSON_IsString(item))
+        return false;
+
+    const char * hex = item->valuestring;
+    size_t hex_len = strlen(hex);
+    if(hex_len % 2 != 0 || hex_len / 2 > max)
+        return false;
+    for(size_t i = 0; i < hex_len / 2; i++) {
+        int high = http_hex_digit(hex[2 * i]);
+        int low = http_hex_digit(hex[2 * i + 1]);
+        if(high < 0 || low < 0)
+            return false;
+        out[i] = high << 4 | low;
+    }
+    *len = hex_len / 2;
+    return true;
+}
+
+/*
+ * @brief Answer an admin operation by its BLE ATT result, the web client tells the errors apart by their text
+*/
+static esp_err_t http_send_result(httpd_req_t * req, int rc)
+{
+    switch(rc) {
+        case 0:
+            return http_send_status(req, "204 No Content");
+        case BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN:
+        case BLE_ATT_ERR_VALUE_NOT_ALLOWED:
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Value not allowed");
+        case BLE_ATT_ERR_INSUFFICIENT_AUTHEN:
+            return httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Admin authentication failed");
+        case BLE_ATT_ERR_INSUFFICIENT_AUTHOR:
+        case BLE_ATT_ERR_WRITE_NOT_PERMITTED:
+            return httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Write not authorized, log in first");
+        case BLE_ATT_ERR_INSUFFICIENT_RES:
+            return http_send_status(req, "503 Service Unavailable");
+        default:
+            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+}
+
+/*
+ * @brief Read an admin write ({"session": n, "value": hex}) and verify it against its session
+ * @return 0 or a BLE ATT error code, -1 if the request was already answered
+*/
+static int http_read_admin_write(httpd_req_t * req, const gatt_chr_t * chr, uint16_t * session, uint8_t * payload, uint16_t * len)
+{
+    uint8_t raw[ADMIN_MAX_PAYLOAD_LEN + ADMIN_TRAILER_LEN];
+    uint16_t raw_len;
+    static_assert(HTTP_MAX_BODY_LEN >= 2 * sizeof(raw) + sizeof("{\"session\":65535,\"value\":\"\"}"), "Largest admin write fits the body");
+
+    cJSON * json = http_read_json(req);
+    if(json == NULL)
+        return -1;
+    bool valid = http_json_session(json, session) && http_json_hex(json, "value", raw, sizeof(raw), &raw_len);
+    cJSON_Delete(json);
+    if(!valid) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"session\": n, \"value\": hex}");
+        return -1;
+    }
+
+    int rc = admin_verify_write(*session, chr->uuid128, raw, raw_len, payload, len);
+    if(rc == 0 && (*len < chr->min_len || *len > chr->max_len))
+        rc = BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    return rc;
+}
+
+static esp_err_t http_status(httpd_req_t * req, const void * arg)
+{
+    uint16_t duration = 0;
+    deadline_stats_t stats[DEADLINE_COUNT];
+    char body[HTTP_CHUNK_LEN];
+
+    read_door_duration(&duration);
+    deadline_get_stats(stats);
+    int len = snprintf(body, sizeof(body),
+                       "{\"time\":%lu,\"uptime\":%lu,\"door_open\":%s,\"door_open_duration\":%u,"
+                       "\"audit_seq\":%lu,\"heap_free\":%lu,\"deadline_misses\":[",
+                       (unsigned long) time(NULL), (unsigned long) (esp_timer_get_time() / 1000000),
+                       is_door_open() ? "true" : "false", duration, (unsigned long) audit_last_seq(),
+                       (unsigned long) heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+    for(uint8_t i = 0; i < DEADLINE_COUNT; i++)
+        len += snprintf(&body[len], sizeof(body) - len, "%s%lu", i > 0 ? "," : "", (unsigned long) stats[i].misses);
+    len += snprintf(&body[len], sizeof(body) - len, "]}");
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, body, len);
+}
+
+/*
+ * @brief Address of the client of a request, the IPv4 one also when the server listens on IPv6
+ * @return 0 if the socket has no peer anymore
+*/
+static uint32_t http_client_addr(httpd_req_t * req)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if(getpeername(httpd_req_to_sockfd(req), (struct sockaddr *) &addr, &addr_len) != 0)
+        return 0;
+    if(addr.ss_family == AF_INET)
+        return ((struct sockaddr_in *) &addr)->sin_addr.s_addr;
+    // IPv4-mapped addresses keep the IPv4 one in the last word, for others it is the interface ID's
+    uint32_t last;
+    memcpy(&last, &((struct sockaddr_in6 *) &addr)->sin6_addr.s6_addr[12], sizeof(last));
+    return last;
+}
+
+static esp_err_t http_login_challenge(httpd_req_t * req, const void * arg)
+{
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    char body[HTTP_CHUNK_LEN];
+
+    // Only a handle nobody is logged in or logging in with, anyone on the network can ask,
+    // but each client holds one unanswered challenge at most
+    uint16_t session;
+    if(admin_challenge_free(ADMIN_HTTP_CONN_BASE, HTTP_ADMIN_SESSIONS, http_client_addr(req), &session, challenge) != ESP_OK) {
+        httpd_resp_set_hdr(req, "Retry-After", HTTP_XSTR(ADMIN_CHALLENGE_TIMEOUT_SEC));
+        return http_send_status(req, "503 Service Unavailable");
+    }
+
+    int len = snprintf(body, sizeof(body), "{\"session\":%u,\"challenge\":\"", session);
+    for(uint8_t i = 0; i < sizeof(challenge); i++)
+        len += snprintf(&body[len], sizeof(body) - len, "%02x", challenge[i]);
+    len += snprintf(&body[len], sizeof(body) - len, "\"}");
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, body, len);
+}
+
+static esp_err_t http_login(httpd_req_t * req, const void * arg)
+{
+    uint16_t session;
+    uint8_t response[ADMIN_RESPONSE_LEN];
+    uint16_t len;
+
+    cJSON * json = http_read_json(req);
+    if(json == NULL)
+        return ESP_FAIL;
+    bool valid = http_json_session(json, &session) && http_json_hex(json, "response", response, sizeof(response), &len);
+    cJSON_Delete(json);
+    if(!valid)
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"session\": n, \"response\": hex}");
+
+    return http_send_result(req, admin_login(session, response, len));
+}
+
+static esp_err_t http_chr_write(httpd_req_t * req, const void * arg)
+{
+    const gatt_chr_t * chr = arg;
+    uint16_t session;
+    uint8_t value[ADMIN_MAX_PAYLOAD_LEN];
+    uint16_t len = sizeof(value);
+
+    int rc = http_read_admin_write(req, chr, &session, value, &len);
+    if(rc < 0)
+        return ESP_FAIL;
+    if(rc == 0) {
+        ESP_LOGI(PROJ_NAME, "characteristic %s write; http session %u", chr->name, session);
+        admin_write_begin();
+        rc = chr->write(session, 0, value, len);
+        admin_write_end();
+    }
+    return http_send_result(req, rc);
+}
+
+static esp_err_t http_audit_log(httpd_req_t * req, const void * arg)
+{
+    uint16_t session;
+    uint32_t from_seq;
+    uint16_t len = sizeof(from_seq);
+    audit_record_t records[HTTP_AUDIT_BATCH];
+    char chunk[HTTP_CHUNK_LEN];
+
+    int rc = http_read_admin_write(req, &gatt_audit_log_chr, &session, (uint8_t *) &from_seq, &len);
+    if(rc < 0)
+        return ESP_FAIL;
+    if(rc != 0)
+        return http_send_result(req, rc);
+
+    // Same records as the BLE export, as arrays of seq, time, type, slot, result, source, aux
+    size_t count = audit_read(from_seq, records, array_len(records));
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    int used = snprintf(chunk, sizeof(chunk), "{\"records\":[");
+    for(size_t i = 0; i < count; i++) {
+        if((size_t) used > sizeof(chunk) - 64) {
+            ESP_RETURN_ON_ERROR(httpd_resp_send_chunk(req, chunk, used), PROJ_NAME, "Error sending audit records");
+            used = 0;
+        }
+        used += snprintf(&chunk[used], sizeof(chunk) - used, "%s[%lu,%lu,%u,%u,%u,%u,%u]", i > 0 ? "," : "",
+                         (unsigned long) records[i].seq, (unsigned long) records[i].timestamp, records[i].type,
+                         records[i].slot, records[i].result, records[i].source, records[i].aux);
+    }
+    // Where to continue, the newest record is last
+    used += snprintf(&chunk[used], sizeof(chunk) - used, "],\"next\":%lu}",
+                     (unsigned long) (count > 0 ? records[count - 1].seq + 1 : from_seq));
+    ESP_RETURN_ON_ERROR(httpd_resp_send_chunk(req, chunk, used), PROJ_NAME, "Error sending audit records");
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static http_route_t routes[HTTP_ROUTE_COUNT] = {
+    { "/api/status", HTTP_GET, &http_status, NULL },
+    { "/api/login", HTTP_GET, &http_login_challenge, NULL },
+    { "/api/login", HTTP_POST, &http_login, NULL },
+    { "/api/audit_log", HTTP_POST, &http_audit_log, NULL },
+    // Characteristic routes from main/gatt.json go here, see http_server_start()
+};
+
+// Registered last, wildcard routes match anything the ones before did not
+static const http_route_t asset_route = { "/*", HTTP_GET, &http_asset, NULL };
+
+/*
+ * @brief Handler of every route, in the server task: hand the request over to a worker
+*/
+static esp_err_t http_enqueue(httpd_req_t * req)
+{
+    httpd_req_t * copy;
+
+    // Only this task fills the queue, the space seen here is still there below
+    if(uxQueueSpacesAvailable(http_queue) == 0) {
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        return http_send_status(req, "503 Service Unavailable");
+    }
+    ESP_RETURN_ON_ERROR(httpd_req_async_handler_begin(req, &copy), PROJ_NAME, "Error deferring request");
+    xQueueSend(http_queue, &copy, 0);
+    return ESP_OK;
+}
+
+static noreturn void http_worker_task()
+{
+    httpd_req_t * req;
+
+    while(1) {
+        xQueueReceive(http_queue, &req, portMAX_DELAY);
+        const http_route_t * route = req->user_ctx;
+        if(route->handler(req, route->arg) != ESP_OK)
+            ESP_LOGD(PROJ_NAME, "Request %s failed", req->uri);
+        httpd_req_async_handler_complete(req);
+    }
+}
+
+static esp_err_t http_register(const http_route_t * route)
+{
+    const httpd_uri_t uri = {
+        .uri = route->uri,
+        .method = route->method,
+        .handler = &http_enqueue,
+        .user_ctx = (void *) route,
+    };
+    return httpd_register_uri_handler(server, &uri);
+}
+
+esp_err_t http_server_start()
+{
+    ESP_LOGI(PROJ_NAME, "Configuring HTTP server");
+
+    // Without the web client the API still works, e.g. for tools/http/http_bench.py
+    www_map();
+
+    for(uint8_t i = 0; i < GATT_HTTP_CHR_COUNT; i++) {
+        http_route_t * route = &routes[HTTP_FIXED_ROUTES + i];
+        snprintf(route->uri, sizeof(route->uri), "/api/%s", gatt_http_chrs[i]->name);
+        route->method = HTTP_POST;
+        route->handler = &http_chr_write;
+        route->arg = gatt_http_chrs[i];
+    }
+
+    http_queue = xQueueCreate(HTTP_QUEUE_LEN, sizeof(httpd_req_t *));
+    ESP_RETURN_ON_FALSE(http_queue != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Error creating HTTP request queue");
+    for(uint8_t i = 0; i < HTTP_WORKERS; i++) {
+        if(task_create(&http_worker_task, NULL, NULL, TASK_HTTP_WORKER) != pdPASS) {
+            ESP_LOGE(PROJ_NAME, "Failed to create HTTP worker task");
+            abort();
+        }
+    }
+
+    ESP_RETURN_ON_ERROR(net_start(), PROJ_NAME, "Error starting network");
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = HTTP_PORT;
+    config.task_priority = task_priority(TASK_HTTPD);
+    config.stack_size = task_stack(TASK_HTTPD);
+    config.core_id = task_core(TASK_HTTPD);
+    // A socket stays open while its request waits or runs, so every worker and queue slot has one
+    static_assert(HTTP_MAX_SOCKETS >= HTTP_WORKERS + HTTP_QUEUE_LEN + 1, "Sockets for the queued requests and a new one");
+    config.max_open_sockets = HTTP_MAX_SOCKETS;
+    config.lru_purge_enable = true;
+    config.max_uri_handlers = HTTP_ROUTE_COUNT + 1;
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    ESP_RETURN_ON_ERROR(httpd_start(&server, &config), PROJ_NAME, "Error starting HTTP server");
+
+    for(uint8_t i = 0; i < HTTP_ROUTE_COUNT; i++)
+        ESP_RETURN_ON_ERROR(http_register(&routes[i]), PROJ_NAME, "Error registering %s", routes[i].uri);
+    ESP_RETURN_ON_ERROR(http_register(&asset_route), PROJ_NAME, "Error registering %s", asset_route.uri);
+
+    ESP_LOGI(PROJ_NAME, "HTTP server listening on port %u, %u workers", HTTP_PORT, HTTP_WORKERS);
+    return ESP_OK;
+}
+
+#endif // HTTP_SERVER
@@ -2,7 +2,7 @@
  * @file main/keypad.c
  *
  * @proj imp-term
- * @brief PIN checking and memory access related functions
+ * @brief PIN entry on the keypads, access lockout and door control
  * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
  * @year 2024
 */
@@ -10,125 +10,103 @@
 #include "config.h"
 #include "gpio.h"
 #include "keypad.h"
+#include "storage.h"
+#include "audit.h"
+#include "credential.h"
+#include "power.h"
+#include "perf.h"
+#include "supervisor.h"
+#include "door_io.h"
+#include "snapshot.h"
 #include "common.h"
 
 #include <string.h>
 
 #include <esp_log.h>
 #include <esp_check.h>
-#include <nvs.h>
-#include <nvs_flash.h>
-
-nvs_handle_t keypad_nvs_handle;
 
 QueueHandle_t door_evt_queue;
 
 enum DoorState {
     DOOR_OPEN,
-    DOOR_CLOSE
+    DOOR_CLOSE,
+    DOOR_SHUT // Door contact closed again after an opening, lock before the duration is up
 };
 
 enum DoorState door_state = DOOR_CLOSE;
 
-void nvs_set_defaults()
-{
-    char access_pin[] = KEYPAD_DEFAULT_ACCESS_PIN;
-    char admin_pin[] = KEYPAD_DEFAULT_ADMIN_PIN;
-    ESP_ERROR_CHECK(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle));
-    ESP_ERROR_CHECK(nvs_set_str(keypad_nvs_handle, "access_pin", access_pin));
-    ESP_ERROR_CHECK(nvs_set_str(keypad_nvs_handle, "admin_pin", admin_pin));
-    ESP_ERROR_CHECK(nvs_set_u16(keypad_nvs_handle, "door_duration", DEFAULT_OPEN_DURATION_SEC));
-    ESP_ERROR_CHECK(nvs_commit(keypad_nvs_handle));
-    nvs_close(keypad_nvs_handle);
-    ESP_LOGE(PROJ_NAME, "Defaults set:\n\tAccess PIN: %s\n\tAdmin PIN: %s\n\tDoor open duration: %u", access_pin, admin_pin, DEFAULT_OPEN_DURATION_SEC);
-}
+// Passed to keypad_keypress_handler() when an unfinished PIN times out, never produced by the keypad
+#define KEYPAD_ENTRY_TIMEOUT_KEY '\0'
+
+// PIN entry in progress, one per keypad so that keypads on both sides of a door do not mix keys
+typedef struct {
+    char pin[KEYPAD_PIN_MAX_LEN];
+    uint8_t pin_index;
+    enum {
+        PIN_AUTH,
+        PIN_CHANGE_AUTH,
+        PIN_CHANGE_ENTER_NEW,
+        PIN_CHANGE_CONFIRM
+    } state;
+    bool active;         // Keys were pressed since the last submit, the device stays awake until it is finished or times out
+    TickType_t last_key; // Tick of the last key, for the entry timeout
+} keypad_entry_t;
 
-void nvs_configure()
+static keypad_entry_t keypad_entries[KEYPAD_COUNT];
+
+// End of the lockout after a failed attempt, shared by all credential sources
+static volatile TickType_t lockout_until = 0;
+
+void keypad_clear_pin(char * pin, uint8_t * pin_index)
 {
-    ESP_LOGI(PROJ_NAME, "Configuring NVS");
-    // Initialize NVS
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        // NVS partition was truncated and needs to be erased
-        // Retry nvs_flash_init
-        ESP_LOGE(PROJ_NAME, "Storage truncated, erasing...");
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(err);
-
-    // Set defaults if storage is empty
-    err = nvs_open(KEYPAD_STORAGE_NAME, NVS_READONLY, &keypad_nvs_handle);
-    if(err == ESP_ERR_NVS_NOT_FOUND) {
-        vTaskDelaySec(2); // Wait for serial monitor to connect
-        ESP_LOGE(PROJ_NAME, "Storage not initialized, setting defaults");
-        nvs_close(keypad_nvs_handle);
-        nvs_set_defaults();
-    } else {
-        nvs_close(keypad_nvs_handle);
+    if(strlen(pin) == 0) {
+        ESP_LOGD(PROJ_NAME, "PIN already empty");
+        return;
     }
-
-    ESP_LOGI(PROJ_NAME, "NVS configured");
+    ESP_LOGD(PROJ_NAME, "Clearing sequence: %s", pin);
+    memset(pin, 0, strlen(pin));
+    ESP_LOGD(PROJ_NAME, "Sequence cleared, new length: %d", strlen(pin));
+    *pin_index = 0;
 }
 
-static esp_err_t check_pin(const char * pin_to_check, const char * pin_name, bool * is_correct)
+bool access_locked_out()
 {
-    *is_correct = false;
-    char pin_set[KEYPAD_PIN_MAX_LEN + 1] = {0}; // +1 for null terminator
-    size_t len = sizeof(pin_set);
-    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READONLY, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_get_str(keypad_nvs_handle, pin_name, pin_set, &len), "Error reading PIN from NVS", PROJ_NAME);
-
-    if(strcmp(pin_to_check, pin_set) == 0) {
-        ESP_LOGI(PROJ_NAME, "PIN correct");
-        *is_correct = true;
-    } else {
-        ESP_LOGI(PROJ_NAME, "PIN incorrect");
-        *is_correct = false;
-    }
+    return (int32_t) (lockout_until - xTaskGetTickCount()) > 0;
+}
 
-    nvs_close(keypad_nvs_handle);
-    return ESP_OK;
+void access_register_failure()
+{
+    lockout_until = xTaskGetTickCount() + pdMS_TO_TICKS(seconds(KEYPAD_SECURITY_DELAY_SEC));
+    snapshot_save_lockout(seconds(KEYPAD_SECURITY_DELAY_SEC));
 }
 
-esp_err_t change_pin(const char * new_pin, const char * pin_name)
+void access_restore_lockout(uint32_t left_ms)
 {
-    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_set_str(keypad_nvs_handle, pin_name, new_pin), "Error writing PIN to NVS", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_commit(keypad_nvs_handle), "Error committing changes", PROJ_NAME);
-    nvs_close(keypad_nvs_handle);
-    ESP_LOGI(PROJ_NAME, "%s updated to %s", pin_name, new_pin);
-    return ESP_OK;
+    if(left_ms > 0)
+        lockout_until = xTaskGetTickCount() + pdMS_TO_TICKS(left_ms);
 }
 
-esp_err_t update_door_duration(uint16_t duration)
+bool door_request_open()
 {
-    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_set_u16(keypad_nvs_handle, "door_duration", duration), "Error writing duration to NVS", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_commit(keypad_nvs_handle), "Error committing changes", PROJ_NAME);
-    nvs_close(keypad_nvs_handle);
-    ESP_LOGI(PROJ_NAME, "Door duration updated to %d seconds", duration);
-    return ESP_OK;
+    enum DoorState evt = DOOR_OPEN;
+    // Started first, the door task may take the event before xQueueSend() returns
+    deadline_start(DEADLINE_DOOR_EVENT, 0);
+    return xQueueSend(door_evt_queue, &evt, 0) == pdTRUE;
 }
 
-esp_err_t read_door_duration(uint16_t * duration)
+bool IRAM_ATTR door_request_open_from_isr(BaseType_t * woken)
 {
-    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READONLY, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
-    ESP_RETURN_ON_ERROR(nvs_get_u16(keypad_nvs_handle, "door_duration", duration), "Error reading duration from NVS", PROJ_NAME);
-    nvs_close(keypad_nvs_handle);
-    return ESP_OK;
+    enum DoorState evt = DOOR_OPEN;
+    // Expected by the door task whenever it waits, so this starts it with its default limit
+    deadline_start_from_isr(DEADLINE_DOOR_EVENT);
+    return xQueueSendFromISR(door_evt_queue, &evt, woken) == pdTRUE;
 }
 
-void keypad_clear_pin(char * pin, uint8_t * pin_index)
+bool door_request_shut()
 {
-    if(strlen(pin) == 0) {
-        ESP_LOGD(PROJ_NAME, "PIN already empty");
-        return;
-    }
-    ESP_LOGD(PROJ_NAME, "Clearing sequence: %s", pin);
-    memset(pin, 0, strlen(pin));
-    ESP_LOGD(PROJ_NAME, "Sequence cleared, new length: %d", strlen(pin));
-    *pin_index = 0;
+    enum DoorState evt = DOOR_SHUT;
+    deadline_start(DEADLINE_DOOR_EVENT, 0);
+    return xQueueSend(door_evt_queue, &evt, 0) == pdTRUE;
 }
 
 /*
@@ -137,6 +115,7 @@ void keypad_clear_pin(char * pin, uint8_t * pin_index)
  */
 void wait_security_delay()
 {
+    deadline_done(DEADLINE_KEY); // The delay is intended, not a slow key
     gpio_set_level(DOOR_CLOSED_LED, GPIO_LOW);
     vTaskDelaySec(0.1);
     gpio_blink_twice_blocking(DOOR_CLOSED_LED);
@@ -145,19 +124,12 @@ void wait_security_delay()
     gpio_set_level(DOOR_CLOSED_LED, GPIO_HIGH);
 }
 
-void keypad_keypress_handler(char key_pressed)
+void keypad_keypress_handler(uint8_t keypad, char key_pressed)
 {
-    ESP_LOGI(PROJ_NAME, "Key %c pressed", key_pressed);
+    if(key_pressed != KEYPAD_ENTRY_TIMEOUT_KEY)
+        ESP_LOGI(PROJ_NAME, "Key %c pressed on keypad %u", key_pressed, keypad);
 
-    static char pin[KEYPAD_PIN_MAX_LEN] = {0};
-    static uint8_t pin_index = 0;
-
-    static enum {
-        PIN_AUTH,
-        PIN_CHANGE_AUTH,
-        PIN_CHANGE_ENTER_NEW,
-        PIN_CHANGE_CONFIRM
-    } pin_state = PIN_AUTH;
+    keypad_entry_t * entry = &keypad_entries[keypad];
 
     enum {
         NONE,
@@ -167,70 +139,90 @@ void keypad_keypress_handler(char key_pressed)
 
     bool is_correct = false;
 
-    if(door_state == DOOR_OPEN) {
+    if(door_state == DOOR_OPEN && key_pressed != KEYPAD_ENTRY_TIMEOUT_KEY) {
         // Immediately close the door
         ESP_LOGI(PROJ_NAME, "Requested immediate door close");
         enum DoorState evt = DOOR_CLOSE;
+        deadline_start(DEADLINE_DOOR_EVENT, 0);
         xQueueSend(door_evt_queue, &evt, portMAX_DELAY);
         return;
     }
 
+    if(!entry->active) {
+        power_acquire(POWER_LOCK_PIN_ENTRY);
+        entry->active = true;
+    }
+    entry->last_key = xTaskGetTickCount();
+
     switch(key_pressed) {
+        case KEYPAD_ENTRY_TIMEOUT_KEY:
+            ESP_LOGI(PROJ_NAME, "PIN entry on keypad %u timed out", keypad);
+            if(entry->state != PIN_AUTH) {
+                entry->state = PIN_AUTH;
+                gpio_set_level(DOOR_CLOSED_LED, GPIO_HIGH);
+            }
+            break;
+
         case KEYPAD_PIN_SUBMIT_KEY:
             ESP_LOGI(PROJ_NAME, "Requested submit");
-            switch(pin_state) {
-                case PIN_AUTH:
+            switch(entry->state) {
+                case PIN_AUTH: {
+                    // Lookup, lockout and the door request are shared with the other credential sources
                     ESP_LOGI(PROJ_NAME, "Checking access PIN");
-                    ESP_ERROR_CHECK(check_pin(pin, "access_pin", &is_correct));
-                    if(is_correct) {
-                        ESP_LOGI(PROJ_NAME, "Access granted");
-                        enum DoorState evt = DOOR_OPEN;
-                        xQueueSend(door_evt_queue, (void*) &evt, portMAX_DELAY);
-                    } else {
-                        ESP_LOGI(PROJ_NAME, "Access denied");
+                    credential_t credential = {
+                        .type = CREDENTIAL_PIN,
+                        .source = AUDIT_SOURCE_KEYPAD,
+                        .reader = keypad,
+                        .pin = entry->pin,
+                    };
+                    if(!credential_submit(&credential))
                         error_state = FAIL;
-                    }
                     break;
+                }
 
                 case PIN_CHANGE_AUTH:
                     ESP_LOGI(PROJ_NAME, "Checking admin PIN");
-                    ESP_ERROR_CHECK(check_pin(pin, "admin_pin", &is_correct));
+                    ESP_ERROR_CHECK(check_pin(entry->pin, "admin_pin", &is_correct));
+                    audit_log_event(AUDIT_EVT_ADMIN_AUTH, AUDIT_SLOT_ADMIN_PIN, is_correct ? AUDIT_RES_GRANTED : AUDIT_RES_DENIED, AUDIT_SOURCE_KEYPAD, keypad);
                     if(is_correct) {
                         ESP_LOGI(PROJ_NAME, "Admin access granted");
                         ESP_LOGI(PROJ_NAME, "Enter new PIN");
-                        pin_state = PIN_CHANGE_ENTER_NEW;
+                        entry->state = PIN_CHANGE_ENTER_NEW;
                         gpio_set_level(DOOR_CLOSED_LED, GPIO_LOW);
                         error_state = SUCCESS;
                     } else {
                         ESP_LOGI(PROJ_NAME, "Admin access denied");
-                        pin_state = PIN_AUTH; // Return to normal state
+                        access_register_failure();
+                        entry->state = PIN_AUTH; // Return to normal state
                         error_state = FAIL;
                     }
                     break;
 
                 case PIN_CHANGE_ENTER_NEW:
-                    if(strlen(pin) < KEYPAD_PIN_MIN_LEN) {
+                    if(strlen(entry->pin) < KEYPAD_PIN_MIN_LEN) {
                         ESP_LOGI(PROJ_NAME, "PIN too short (minimum %u), try again", KEYPAD_PIN_MIN_LEN);
                         error_state = FAIL;
                         break;
                     }
-                    ESP_ERROR_CHECK(change_pin(pin, "new_pin"));
+                    ESP_ERROR_CHECK(change_pin(entry->pin, "new_pin"));
                     ESP_LOGI(PROJ_NAME, "Confirm new PIN");
-                    pin_state = PIN_CHANGE_CONFIRM;
+                    entry->state = PIN_CHANGE_CONFIRM;
                     error_state = SUCCESS;
                     break;
 
                 case PIN_CHANGE_CONFIRM:
-                    ESP_ERROR_CHECK(check_pin(pin, "new_pin", &is_correct));
+                    ESP_ERROR_CHECK(check_pin(entry->pin, "new_pin", &is_correct));
                     if(is_correct) {
                         ESP_LOGI(PROJ_NAME, "PIN change confirmed");
-                        ESP_ERROR_CHECK(change_pin(pin, "access_pin"));
-                        pin_state = PIN_AUTH;
+                        ESP_ERROR_CHECK(change_pin(entry->pin, "access_pin"));
+                        audit_log_event(AUDIT_EVT_PIN_CHANGE, AUDIT_SLOT_ACCESS_PIN, AUDIT_RES_OK, AUDIT_SOURCE_KEYPAD, keypad);
+                        entry->state = PIN_AUTH;
                         gpio_set_level(DOOR_CLOSED_LED, GPIO_HIGH);
                         error_state = SUCCESS;
                     } else {
                         ESP_LOGI(PROJ_NAME, "PINs do not match, try again");
-                        pin_state = PIN_CHANGE_ENTER_NEW;
+                        audit_log_event(AUDIT_EVT_PIN_CHANGE, AUDIT_SLOT_ACCESS_PIN, AUDIT_RES_FAIL, AUDIT_SOURCE_KEYPAD, keypad);
+                        entry->state = PIN_CHANGE_ENTER_NEW;
                         error_state = FAIL;
                     }
                     break;
@@ -241,13 +233,13 @@ void keypad_keypress_handler(char key_pressed)
             gpio_blink_nonblocking(DOOR_OPEN_LED, 20);
             ESP_LOGI(PROJ_NAME, "Requested pin change");
             ESP_LOGI(PROJ_NAME, "Enter admin PIN");
-            pin_state = PIN_CHANGE_AUTH;
+            entry->state = PIN_CHANGE_AUTH;
             break;
 
         default:
             gpio_blink_nonblocking(DOOR_OPEN_LED, 20);
-            pin[pin_index++] = key_pressed;
-            if(pin_index >= sizeof(pin)) {
+            entry->pin[entry->pin_index++] = key_pressed;
+            if(entry->pin_index >= sizeof(entry->pin)) {
                 ESP_LOGE(PROJ_NAME, "PIN too long, resetting");
                 error_state = FAIL;
                 break;
@@ -260,22 +252,69 @@ void keypad_keypress_handler(char key_pressed)
     } else if(error_state == FAIL) {
         wait_security_delay();
     }
-    keypad_clear_pin(pin, &pin_index);
+    keypad_clear_pin(entry->pin, &entry->pin_index);
+
+    // A PIN change spans several submits, stay awake until it is done
+    if(entry->state == PIN_AUTH) {
+        entry->active = false;
+        power_release(POWER_LOCK_PIN_ENTRY);
+    }
+}
+
+/*
+ * @brief Time left until an unfinished PIN entry times out
+*/
+static TickType_t keypad_entry_left(uint8_t keypad)
+{
+    TickType_t elapsed = xTaskGetTickCount() - keypad_entries[keypad].last_key;
+    TickType_t limit = pdMS_TO_TICKS(seconds(POWER_PIN_ENTRY_TIMEOUT_SEC));
+    return elapsed < limit ? limit - elapsed : 0;
+}
+
+/*
+ * @brief Time until the oldest unfinished PIN entry times out
+ * @return portMAX_DELAY if no entry is in progress
+*/
+static TickType_t keypad_entry_timeout()
+{
+    TickType_t timeout = portMAX_DELAY;
+    for(uint8_t keypad = 0; keypad < KEYPAD_COUNT; keypad++) {
+        if(keypad_entries[keypad].active && keypad_entry_left(keypad) < timeout)
+            timeout = keypad_entry_left(keypad);
+    }
+    return timeout;
 }
 
 noreturn void keypad_handler_task()
 {
     uint8_t key;
+    uint8_t keypad;
     uint32_t io_num;
 
+    supervisor_watch_task();
     while(1) {
-        if (xQueueReceive(gpio_evt_queue, &io_num, portMAX_DELAY)) {
+        bool received;
+        supervisor_feed();
+        deadline_expect(DEADLINE_KEY);
+        // Only woken to feed the watchdog while idle, an unfinished PIN is dropped after a while
+        if ((received = xQueueReceive(gpio_evt_queue, &io_num, supervisor_wait(keypad_entry_timeout())))) {
             // ESP_LOGI(PROJ_NAME, "GPIO[%"PRIu32"] intr, val: %d\n", io_num, gpio_get_level(io_num));
-            if((key = gpio_keypad_key_lookup(io_num)) != E_KEYPAD_NO_KEY_FOUND) { // A key was pressed
-                keypad_keypress_handler(key);
+            if((key = gpio_keypad_key_lookup(io_num, &keypad)) != E_KEYPAD_NO_KEY_FOUND) { // A key was pressed
+                keypad_keypress_handler(keypad, key);
+            }
+            deadline_done(DEADLINE_KEY);
+        } else {
+            for(keypad = 0; keypad < KEYPAD_COUNT; keypad++) {
+                if(keypad_entries[keypad].active && keypad_entry_left(keypad) == 0)
+                    keypad_keypress_handler(keypad, KEYPAD_ENTRY_TIMEOUT_KEY);
             }
         }
         xQueueReset(gpio_evt_queue);
+#if KEYPAD_INJECT
+        // Only now, a key injected before the reset would be dropped with the bounces
+        if(received && (io_num & GPIO_KEYPAD_INJECTED))
+            gpio_keypad_inject_done(io_num);
+#endif
     }
 }
 
@@ -284,11 +323,21 @@ bool is_door_open()
     return door_state == DOOR_OPEN;
 }
 
+/*
+ * @brief Pass a lock change on to the door inputs and the restart snapshot
+*/
+static void door_state_changed()
+{
+    door_io_lock_changed();
+    snapshot_save_door(door_state == DOOR_OPEN);
+}
+
 void door_open()
 {
     ESP_LOGI(PROJ_NAME, "Opening door");
     gpio_set_level(DOOR_CLOSED_LED, GPIO_LOW);
     gpio_set_level(DOOR_OPEN_LED, GPIO_HIGH);
+    perf_door_opened();
 }
 
 void door_close()
@@ -302,39 +351,56 @@ noreturn void door_open_for_defined_time_task()
     door_open();
     uint16_t duration;
     ESP_ERROR_CHECK(read_door_duration(&duration));
+    deadline_start(DEADLINE_DOOR_CLOSE, seconds(duration) + SUPERVISOR_DOOR_CLOSE_SLACK_MS);
     vTaskDelaySec(duration); // Leave open for DEFAULT_OPEN_DURATION_SEC seconds
     ESP_LOGI(PROJ_NAME, "Closing door");
+    power_release(POWER_LOCK_DOOR); // Before the state change, a premature close releases it otherwise
     door_state = DOOR_CLOSE;
     door_close();
+    door_state_changed();
+    deadline_done(DEADLINE_DOOR_CLOSE);
+    audit_log_event(AUDIT_EVT_DOOR_CLOSE, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, 0);
     vTaskDelete(NULL); // Delete self
     while(1); // Wait for deletion
 }
 
-noreturn void door_handler_task()
+void door_configure()
 {
+    // Created before any task runs, so an early keypress or BLE unlock never sees a NULL queue
     door_evt_queue = xQueueCreate(1, sizeof(enum DoorState));
     if(door_evt_queue == NULL) {
         ESP_LOGE(PROJ_NAME, "Failed to create door event queue");
         abort();
     }
+}
 
+noreturn void door_handler_task()
+{
     enum DoorState evt;
     TaskHandle_t door_open_task_handle = NULL;
 
+    supervisor_watch_task();
     while(1) {
-        if(xQueueReceive(door_evt_queue, &evt, portMAX_DELAY)) {
+        supervisor_feed();
+        deadline_expect(DEADLINE_DOOR_EVENT);
+        if(xQueueReceive(door_evt_queue, &evt, supervisor_wait(portMAX_DELAY))) {
+            deadline_done(DEADLINE_DOOR_EVENT);
             switch(evt) {
                 case DOOR_OPEN:
                     if(door_state == DOOR_CLOSE) {
-                        xTaskCreate(&door_open_for_defined_time_task, "door_open", 2048, NULL, tskIDLE_PRIORITY, &door_open_task_handle);
+                        power_acquire(POWER_LOCK_DOOR);
+                        task_create(&door_open_for_defined_time_task, NULL, &door_open_task_handle, TASK_DOOR_OPEN);
                         door_state = DOOR_OPEN;
+                        door_state_changed();
+                        audit_log_event(AUDIT_EVT_DOOR_OPEN, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, 0);
                     } else {
                         ESP_LOGE(PROJ_NAME, "Door already open");
                     }
                     break;
                 case DOOR_CLOSE:
+                case DOOR_SHUT:
                     if(door_state == DOOR_OPEN) {
-                        ESP_LOGI(PROJ_NAME, "Closing door prematurely");
+                        ESP_LOGI(PROJ_NAME, evt == DOOR_SHUT ? "Door shut, locking early" : "Closing door prematurely");
                         // Prevent race condition when both tasks reach deletion state
                         static portMUX_TYPE task_delete_spinlock = portMUX_INITIALIZER_UNLOCKED;
                         taskENTER_CRITICAL(&task_delete_spinlock);
@@ -342,11 +408,16 @@ noreturn void door_handler_task()
                             vTaskDelete(door_open_task_handle);
                         }
                         taskEXIT_CRITICAL(&task_delete_spinlock);
+                        power_release(POWER_LOCK_DOOR);
                         door_close();
-                    } else {
+                        deadline_done(DEADLINE_DOOR_CLOSE);
+                        audit_log_event(AUDIT_EVT_DOOR_CLOSE, AUDIT_SLOT_NONE, AUDIT_RES_OK,
+                                        evt == DOOR_SHUT ? AUDIT_SOURCE_SYSTEM : AUDIT_SOURCE_KEYPAD, 0);
+                    } else if(evt == DOOR_CLOSE) {
                         ESP_LOGE(PROJ_NAME, "Door already closed");
                     }
                     door_state = DOOR_CLOSE;
+                    door_state_changed();
                     break;
             }
         }
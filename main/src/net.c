@@ -0,0 +1,98 @@
+/*
+ * @file main/net.c
+ *
+ * @proj imp-term
+ * @brief Network interface shared by the uplink and the HTTP server
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+
+#if NET
+
+#include <string.h>
+
+#include <esp_check.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#if CONFIG_ETH_USE_OPENETH
+#include <esp_eth.h>
+#else
+#include <esp_wifi.h>
+#endif
+
+#include "net.h"
+#include "common.h"
+
+#if CONFIG_ETH_USE_OPENETH
+
+/*
+ * @brief Ethernet of QEMU (OpenCores MAC), the address comes from its DHCP
+*/
+static esp_err_t net_interface_start()
+{
+    esp_netif_config_t netif_config = ESP_NETIF_DEFAULT_ETH();
+    esp_netif_t * netif = esp_netif_new(&netif_config);
+    eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
+    eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+    phy_config.autonego_timeout_ms = 100;
+    esp_eth_mac_t * mac = esp_eth_mac_new_openeth(&mac_config);
+    esp_eth_phy_t * phy = esp_eth_phy_new_dp83848(&phy_config);
+    esp_eth_config_t eth_config = ETH_DEFAULT_CONFIG(mac, phy);
+    esp_eth_handle_t eth_handle;
+
+    ESP_RETURN_ON_FALSE(netif != NULL && mac != NULL && phy != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Error creating Ethernet interface");
+    ESP_RETURN_ON_ERROR(esp_eth_driver_install(&eth_config, &eth_handle), PROJ_NAME, "Error installing Ethernet driver");
+    ESP_RETURN_ON_ERROR(esp_netif_attach(netif, esp_eth_new_netif_glue(eth_handle)), PROJ_NAME, "Error attaching Ethernet");
+    return esp_eth_start(eth_handle);
+}
+
+#else
+
+static void net_wifi_event(void * arg, esp_event_base_t base, int32_t event_id, void * event_data)
+{
+    // Also after a lost connection, the driver retries its scan until the network is back
+    if(event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)
+        esp_wifi_connect();
+}
+
+/*
+ * @brief Wi-Fi station on NET_WIFI_SSID, sharing the radio with BLE
+*/
+static esp_err_t net_interface_start()
+{
+    ESP_RETURN_ON_FALSE(strlen(NET_WIFI_SSID) > 0, ESP_ERR_INVALID_ARG, PROJ_NAME, "No Wi-Fi network set (NET_WIFI_SSID)");
+    ESP_RETURN_ON_FALSE(esp_netif_create_default_wifi_sta() != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Error creating Wi-Fi interface");
+
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_RETURN_ON_ERROR(esp_wifi_init(&init_config), PROJ_NAME, "Error initializing Wi-Fi");
+    ESP_RETURN_ON_ERROR(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &net_wifi_event, NULL), PROJ_NAME, "Error registering Wi-Fi events");
+
+    wifi_config_t wifi_config = {0};
+    strncpy((char *) wifi_config.sta.ssid, NET_WIFI_SSID, sizeof(wifi_config.sta.ssid));
+    strncpy((char *) wifi_config.sta.password, NET_WIFI_PASSWORD, sizeof(wifi_config.sta.password));
+    ESP_RETURN_ON_ERROR(esp_wifi_set_storage(WIFI_STORAGE_RAM), PROJ_NAME, "Error setting Wi-Fi storage");
+    ESP_RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_STA), PROJ_NAME, "Error setting Wi-Fi mode");
+    ESP_RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), PROJ_NAME, "Error setting Wi-Fi network");
+    return esp_wifi_start();
+}
+
+#endif // CONFIG_ETH_USE_OPENETH
+
+esp_err_t net_start()
+{
+    // Both users start from app_main, one after the other
+    static bool started = false;
+    if(started)
+        return ESP_OK;
+
+    ESP_RETURN_ON_ERROR(esp_netif_init(), PROJ_NAME, "Error initializing network interfaces");
+    ESP_RETURN_ON_ERROR(esp_event_loop_create_default(), PROJ_NAME, "Error creating event loop");
+    ESP_RETURN_ON_ERROR(net_interface_start(), PROJ_NAME, "Error starting network");
+    started = true;
+    return ESP_OK;
+}
+
+#endif // NET
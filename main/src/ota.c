@@ -0,0 +1,414 @@
+/*
+ * @file main/ota.c
+ *
+ * @proj imp-term
+ * @brief Firmware update streamed over BLE
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_ota_ops.h>
+#include <esp_system.h>
+#include <mbedtls/sha256.h>
+
+#include <freertos/queue.h>
+
+#include "config.h"
+#include "ota.h"
+#include "common.h"
+
+/*
+ * Data flow: the NimBLE host copies each chunk into the buffer being filled
+ * and hands full buffers to ota_flash_task through `job_queue`. The flash task
+ * erases/writes the partition and returns buffers through `free_queue`, so the
+ * host never waits on flash. The client keeps at most `window` bytes in flight
+ * ahead of `committed`, which guarantees a free buffer for every chunk.
+*/
+
+enum OtaJobOp {
+    OTA_JOB_BEGIN,
+    OTA_JOB_WRITE,
+    OTA_JOB_FINISH,
+    OTA_JOB_ABORT,
+};
+
+typedef struct {
+    uint8_t op;  // enum OtaJobOp
+    uint8_t buf; // Buffer index for OTA_JOB_WRITE
+    uint16_t len;
+} ota_job_t;
+
+static uint8_t ota_bufs[OTA_BUF_COUNT][OTA_BUF_SIZE];
+static QueueHandle_t free_queue;
+static QueueHandle_t job_queue;
+
+// Transfer state shared by the NimBLE host and the flash task
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+    volatile uint8_t state;
+    uint8_t error;
+    uint32_t size;
+    uint8_t sha256[32];
+    uint32_t received;
+    volatile uint32_t committed;
+    int fill_buf; // -1 when no buffer is being filled
+    uint16_t fill_len;
+    uint16_t conn_handle;
+    uint16_t ctrl_handle;
+} ota = {
+    .state = OTA_STATE_IDLE,
+    .fill_buf = -1,
+    .conn_handle = BLE_HS_CONN_HANDLE_NONE,
+};
+
+// Owned by the flash task
+static esp_ota_handle_t ota_handle;
+static const esp_partition_t * ota_partition;
+static mbedtls_sha256_context ota_sha;
+
+esp_err_t ota_init()
+{
+    free_queue = xQueueCreate(OTA_BUF_COUNT, sizeof(uint8_t));
+    job_queue = xQueueCreate(OTA_BUF_COUNT + 2, sizeof(ota_job_t)); // + BEGIN/ABORT and FINISH
+    ESP_RETURN_ON_FALSE(free_queue != NULL && job_queue != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create OTA queues");
+
+    for(uint8_t i = 0; i < OTA_BUF_COUNT; i++)
+        xQueueSend(free_queue, &i, 0);
+    return ESP_OK;
+}
+
+void ota_confirm_image()
+{
+    esp_ota_img_states_t state;
+    const esp_partition_t * running = esp_ota_get_running_partition();
+    if(esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGI(PROJ_NAME, "New firmware booted fine, cancelling rollback");
+        ESP_ERROR_CHECK(esp_ota_mark_app_valid_cancel_rollback());
+    }
+}
+
+bool ota_in_progress()
+{
+    return ota.state == OTA_STATE_STARTING || ota.state == OTA_STATE_RECEIVING;
+}
+
+void ota_get_status(uint16_t conn_handle, ota_status_t * status)
+{
+    uint16_t mtu = ble_att_mtu(conn_handle);
+
+    taskENTER_CRITICAL(&ota_lock);
+    status->state = ota.state;
+    status->error = ota.error;
+    status->size = ota.size;
+    status->received = ota.received;
+    status->committed = ota.committed;
+    taskEXIT_CRITICAL(&ota_lock);
+
+    // ATT write header is 3 bytes, the chunk offset another 4
+    status->max_chunk = mtu > 7 ? mtu - 7 : 0;
+    status->window = (OTA_BUF_COUNT - 1) * OTA_BUF_SIZE;
+}
+
+/*
+ * @brief Tell the client about progress (committed offset, state changes)
+*/
+static void ota_notify_status()
+{
+    uint16_t conn_handle = ota.conn_handle;
+    if(conn_handle == BLE_HS_CONN_HANDLE_NONE)
+        return;
+
+    ota_status_t status;
+    ota_get_status(conn_handle, &status);
+    struct os_mbuf * om = ble_hs_mbuf_from_flat(&status, sizeof(status));
+    if(om != NULL)
+        ble_gatts_notify_custom(conn_handle, ota.ctrl_handle, om);
+}
+
+static void ota_fail(esp_err_t err)
+{
+    ESP_LOGE(PROJ_NAME, "Firmware update failed: %s", esp_err_to_name(err));
+    taskENTER_CRITICAL(&ota_lock);
+    ota.state = OTA_STATE_ERROR;
+    ota.error = err & 0xFF;
+    taskEXIT_CRITICAL(&ota_lock);
+    ota_notify_status();
+}
+
+/*
+ * @brief Ask for the fastest link the central allows while a transfer runs
+*/
+static void ota_request_fast_link(uint16_t conn_handle)
+{
+    struct ble_gap_conn_desc desc;
+    if(ble_gap_conn_find(conn_handle, &desc) != 0)
+        return;
+
+    struct ble_gap_upd_params params = {.itvl_min = OTA_CONN_ITVL_MIN,
+                                        .itvl_max = OTA_CONN_ITVL_MAX,
+                                        .latency = 0,
+                                        .supervision_timeout = desc.supervision_timeout};
+    if(ble_gap_update_params(conn_handle, &params) != 0)
+        ESP_LOGW(PROJ_NAME, "Could not request faster connection interval");
+
+    // Longest link layer packets, so one ATT write does not get fragmented
+    ble_gap_set_data_len(conn_handle, 251, 2120);
+}
+
+int ota_control_write(uint16_t conn_handle, uint16_t attr_handle, const uint8_t * cmd, uint16_t len)
+{
+    if(len == 0)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    ota_job_t job = {0};
+
+    switch(cmd[0]) {
+        case OTA_CMD_BEGIN: {
+            if(len != OTA_BEGIN_CMD_LEN)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+            uint32_t size;
+            memcpy(&size, &cmd[1], sizeof(size));
+            if(size == 0)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+
+            int stale_buf = -1;
+            taskENTER_CRITICAL(&ota_lock);
+            bool resume = ota_in_progress() && ota.size == size && memcmp(ota.sha256, &cmd[5], 32) == 0;
+            ota.conn_handle = conn_handle;
+            ota.ctrl_handle = attr_handle;
+            if(!resume) {
+                ota.state = OTA_STATE_STARTING;
+                ota.error = 0;
+                ota.size = size;
+                memcpy(ota.sha256, &cmd[5], 32);
+                ota.received = 0;
+                stale_buf = ota.fill_buf;
+                ota.fill_buf = -1;
+                ota.fill_len = 0;
+            }
+            taskEXIT_CRITICAL(&ota_lock);
+
+            if(stale_buf >= 0) {
+                uint8_t buf = stale_buf;
+                xQueueSend(free_queue, &buf, 0);
+            }
+
+            ota_request_fast_link(conn_handle);
+
+            if(resume) {
+                ESP_LOGI(PROJ_NAME, "Resuming firmware update at offset %lu", (unsigned long) ota.received);
+                ota_notify_status();
+                return 0;
+            }
+
+            ESP_LOGI(PROJ_NAME, "Starting firmware update, %lu bytes", (unsigned long) size);
+            // Erase happens on the flash task, progress is notified from there
+            job.op = OTA_JOB_ABORT;
+            xQueueSend(job_queue, &job, 0);
+            job.op = OTA_JOB_BEGIN;
+            if(xQueueSend(job_queue, &job, 0) != pdPASS)
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            return 0;
+        }
+
+        case OTA_CMD_END:
+            if(ota.state != OTA_STATE_RECEIVING || ota.received != ota.size)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            taskENTER_CRITICAL(&ota_lock);
+            ota.state = OTA_STATE_VERIFYING;
+            taskEXIT_CRITICAL(&ota_lock);
+            job.op = OTA_JOB_FINISH;
+            if(xQueueSend(job_queue, &job, 0) != pdPASS)
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            return 0;
+
+        case OTA_CMD_ABORT:
+            ESP_LOGI(PROJ_NAME, "Firmware update aborted by client");
+            taskENTER_CRITICAL(&ota_lock);
+            ota.state = OTA_STATE_IDLE;
+            taskEXIT_CRITICAL(&ota_lock);
+            job.op = OTA_JOB_ABORT;
+            xQueueSend(job_queue, &job, 0);
+            return 0;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+}
+
+int ota_data_write(uint16_t conn_handle, const struct os_mbuf * om)
+{
+    uint16_t len = OS_MBUF_PKTLEN(om);
+    uint32_t offset;
+
+    // Only the connection that began the update sends its image
+    if(ota.state != OTA_STATE_RECEIVING || conn_handle != ota.conn_handle || len <= sizeof(offset))
+        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    os_mbuf_copydata(om, 0, sizeof(offset), &offset);
+
+    uint16_t payload_len = len - sizeof(offset);
+    int rc = 0;
+
+    UBaseType_t free_bufs = uxQueueMessagesWaiting(free_queue);
+
+    taskENTER_CRITICAL(&ota_lock);
+    uint16_t room = ota.fill_buf >= 0 ? OTA_BUF_SIZE - ota.fill_len : 0;
+    if(offset != ota.received || ota.received + payload_len > ota.size) {
+        // Lost or repeated chunk, the client resends from `received`
+        rc = BLE_ATT_ERR_INVALID_OFFSET;
+    } else if(room < payload_len && free_bufs == 0) {
+        rc = BLE_ATT_ERR_PREPARE_QUEUE_FULL; // Client ignored the window
+    }
+    taskEXIT_CRITICAL(&ota_lock);
+    if(rc != 0)
+        return rc;
+
+    // Only this function fills buffers, so the state checked above still holds
+    uint16_t copied = 0;
+    while(copied < payload_len) {
+        if(ota.fill_buf < 0) {
+            uint8_t buf;
+            xQueueReceive(free_queue, &buf, 0);
+            ota.fill_buf = buf;
+            ota.fill_len = 0;
+        }
+
+        uint16_t n = payload_len - copied;
+        if(n > OTA_BUF_SIZE - ota.fill_len)
+            n = OTA_BUF_SIZE - ota.fill_len;
+        os_mbuf_copydata(om, sizeof(offset) + copied, n, &ota_bufs[ota.fill_buf][ota.fill_len]);
+        copied += n;
+
+        taskENTER_CRITICAL(&ota_lock);
+        ota.fill_len += n;
+        ota.received += n;
+        bool flush = ota.fill_len == OTA_BUF_SIZE || ota.received == ota.size;
+        taskEXIT_CRITICAL(&ota_lock);
+
+        if(flush) {
+            ota_job_t job = {.op = OTA_JOB_WRITE, .buf = ota.fill_buf, .len = ota.fill_len};
+            xQueueSend(job_queue, &job, 0); // Queue has room for every buffer
+            ota.fill_buf = -1;
+        }
+    }
+    return 0;
+}
+
+static void ota_job_begin()
+{
+    ota_partition = esp_ota_get_next_update_partition(NULL);
+    if(ota_partition == NULL) {
+        ota_fail(ESP_ERR_NOT_FOUND);
+        return;
+    }
+    if(ota.size > ota_partition->size) {
+        ota_fail(ESP_ERR_INVALID_SIZE);
+        return;
+    }
+
+    // Sectors get erased as they are written, keeping every flash operation short
+    esp_err_t err = esp_ota_begin(ota_partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle);
+    if(err != ESP_OK) {
+        ota_handle = 0;
+        ota_fail(err);
+        return;
+    }
+
+    mbedtls_sha256_init(&ota_sha);
+    mbedtls_sha256_starts(&ota_sha, 0);
+
+    taskENTER_CRITICAL(&ota_lock);
+    ota.committed = 0;
+    if(ota.state == OTA_STATE_STARTING)
+        ota.state = OTA_STATE_RECEIVING;
+    taskEXIT_CRITICAL(&ota_lock);
+
+    ESP_LOGI(PROJ_NAME, "Writing firmware to partition %s", ota_partition->label);
+    ota_notify_status();
+}
+
+static void ota_job_write(const ota_job_t * job)
+{
+    // Writes queued before OTA_CMD_END still belong to the image being verified
+    if(ota_handle != 0 && (ota.state == OTA_STATE_RECEIVING || ota.state == OTA_STATE_VERIFYING)) {
+        esp_err_t err = esp_ota_write(ota_handle, ota_bufs[job->buf], job->len);
+        if(err == ESP_OK) {
+            mbedtls_sha256_update(&ota_sha, ota_bufs[job->buf], job->len);
+            taskENTER_CRITICAL(&ota_lock);
+            ota.committed += job->len;
+            taskEXIT_CRITICAL(&ota_lock);
+        } else {
+            ota_fail(err);
+        }
+    }
+
+    uint8_t buf = job->buf;
+    xQueueSend(free_queue, &buf, 0);
+    ota_notify_status();
+}
+
+static void ota_job_finish()
+{
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&ota_sha, digest);
+    mbedtls_sha256_free(&ota_sha);
+
+    if(ota.committed != ota.size || memcmp(digest, ota.sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(PROJ_NAME, "Firmware image checksum mismatch");
+        esp_ota_abort(ota_handle);
+        ota_handle = 0;
+        ota_fail(ESP_ERR_INVALID_CRC);
+        return;
+    }
+
+    // esp_ota_end also validates the image header and segments
+    esp_err_t err = esp_ota_end(ota_handle);
+    ota_handle = 0;
+    if(err == ESP_OK)
+        err = esp_ota_set_boot_partition(ota_partition);
+    if(err != ESP_OK) {
+        ota_fail(err);
+        return;
+    }
+
+    taskENTER_CRITICAL(&ota_lock);
+    ota.state = OTA_STATE_DONE;
+    taskEXIT_CRITICAL(&ota_lock);
+    ota_notify_status();
+
+    ESP_LOGI(PROJ_NAME, "Firmware update complete, restarting");
+    vTaskDelayMSec(OTA_REBOOT_DELAY_MS);
+    esp_restart();
+}
+
+noreturn void ota_flash_task()
+{
+    ota_job_t job;
+
+    while(1) {
+        if(!xQueueReceive(job_queue, &job, portMAX_DELAY))
+            continue;
+
+        switch(job.op) {
+            case OTA_JOB_BEGIN:
+                ota_job_begin();
+                break;
+            case OTA_JOB_WRITE:
+                ota_job_write(&job);
+                break;
+            case OTA_JOB_FINISH:
+                ota_job_finish();
+                break;
+            case OTA_JOB_ABORT:
+                if(ota_handle != 0) {
+                    esp_ota_abort(ota_handle);
+                    mbedtls_sha256_free(&ota_sha);
+                    ota_handle = 0;
+                }
+                break;
+        }
+    }
+}
@@ -0,0 +1,506 @@
+/*
+ * @file main/otp.c
+ *
+ * @proj imp-term
+ * @brief Time-based (RFC 6238) and single-use visitor codes typed on the keypad
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+#include <sys/time.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <nvs.h>
+#include <mbedtls/md.h>
+
+#include "host/ble_hs.h"
+
+#include "config.h"
+#include "otp.h"
+#include "audit.h"
+#include "schedule.h"
+#include "snapshot.h"
+#include "common.h"
+
+#define OTP_WINDOW_CODES (2 * OTP_WINDOW + 1)
+#define OTP_TOTP_MODULO 1000000 // 10^OTP_TOTP_DIGITS
+#define OTP_REFRESH_DELAY_US 10000 // Past the step boundary, so the timer never fires a step early
+
+static_assert(OTP_MAX_SECRETS <= AUDIT_SLOT_CARD(0) - AUDIT_SLOT_TOTP(0), "Too many TOTP secrets for audit slots");
+static_assert(AUDIT_SLOT_CARD(CREDENTIAL_MAX_CARDS) <= AUDIT_SLOT_VISITOR(0), "Too many cards for audit slots");
+static_assert(AUDIT_SLOT_VISITOR(OTP_MAX_VISITOR_CODES - 1) < AUDIT_SLOT_NONE, "Too many visitor codes for audit slots");
+static_assert(OTP_TOTP_DIGITS <= KEYPAD_PIN_MAX_LEN && OTP_VISITOR_DIGITS <= KEYPAD_PIN_MAX_LEN, "Codes must fit a keypad entry");
+static_assert(OTP_TOTP_DIGITS != OTP_VISITOR_DIGITS, "Code kinds are told apart by length");
+
+typedef struct __attribute__((packed)) {
+    uint8_t key[OTP_SECRET_LEN];
+    uint8_t schedule;
+    uint8_t enrolled;
+} otp_secret_t;
+
+// Secrets and visitor codes, mirrored in NVS. Written by the NimBLE host task, read by
+// the keypad task and the refresh timer, so all of it goes through the spinlock.
+static otp_secret_t secrets[OTP_MAX_SECRETS];
+static uint32_t secrets_gen = 0; // Bumped on every change, drops tables computed from old secrets
+static uint32_t visitors[OTP_MAX_VISITOR_CODES];
+static uint32_t visitors_used[OTP_USED_WORDS]; // Bit set = code used or slot empty
+static bool used_dirty = false; // Used bits not in NVS yet, written in batches by the refresh timer
+static portMUX_TYPE otp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Codes of every secret for the steps around the current one, so checking an entry is
+// a table compare instead of an HMAC per secret and step
+static struct {
+    int64_t step; // Step of the middle column, 0 while the clock is not set
+    uint32_t codes[OTP_MAX_SECRETS][OTP_WINDOW_CODES];
+    int64_t last_step[OTP_MAX_SECRETS]; // Last accepted step, each code is accepted once
+    int64_t claimed_from[OTP_MAX_SECRETS]; // last_step before the pending claim
+} totp = {0};
+
+static esp_timer_handle_t refresh_timer;
+static TaskHandle_t otp_task_handle = NULL;
+
+static inline bool visitor_is_used(uint8_t i)
+{
+    return visitors_used[i / 32] & BIT(i % 32);
+}
+
+/*
+ * @brief Mirror the used bits into the restart snapshot, they only reach NVS in batches
+*/
+static void otp_snapshot_used()
+{
+    uint32_t used[OTP_USED_WORDS];
+
+    taskENTER_CRITICAL(&otp_lock);
+    memcpy(used, visitors_used, sizeof(used));
+    taskEXIT_CRITICAL(&otp_lock);
+    snapshot_save_otp_used(used);
+}
+
+/*
+ * @brief TOTP code of a secret for a time step (RFC 6238 with HMAC-SHA1)
+*/
+static uint32_t otp_totp(const uint8_t * key, int64_t step)
+{
+    uint8_t counter[8];
+    uint8_t mac[20];
+
+    for(int8_t i = sizeof(counter) - 1; i >= 0; i--) {
+        counter[i] = step & 0xFF; // Big endian
+        step >>= 8;
+    }
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), key, OTP_SECRET_LEN, counter, sizeof(counter), mac);
+
+    // Dynamic truncation, RFC 4226 section 5.3
+    uint8_t offset = mac[sizeof(mac) - 1] & 0x0F;
+    uint32_t binary = (uint32_t) (mac[offset] & 0x7F) << 24 | (uint32_t) mac[offset + 1] << 16 |
+                      (uint32_t) mac[offset + 2] << 8 | mac[offset + 3];
+    return binary % OTP_TOTP_MODULO;
+}
+
+/*
+ * @brief Bring the code table to the time step of now
+ * @note Normally one step has passed, so only the newest column is computed
+*/
+static void otp_refresh(time_t now)
+{
+    otp_secret_t keys[OTP_MAX_SECRETS];
+    uint32_t codes[OTP_MAX_SECRETS][OTP_WINDOW_CODES];
+    int64_t step = now >= SCHEDULE_MIN_VALID_TIME ? now / OTP_STEP_SEC : 0;
+    int64_t shift;
+    uint32_t gen;
+
+    taskENTER_CRITICAL(&otp_lock);
+    memcpy(keys, secrets, sizeof(keys));
+    memcpy(codes, totp.codes, sizeof(codes));
+    shift = totp.step != 0 ? step - totp.step : OTP_WINDOW_CODES;
+    gen = secrets_gen;
+    if(step == 0)
+        totp.step = 0; // No codes are accepted until the clock is set
+    taskEXIT_CRITICAL(&otp_lock);
+    if(step == 0 || shift == 0)
+        return;
+
+    // HMACs are computed outside of the spinlock
+    for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++) {
+        if(!keys[i].enrolled)
+            continue;
+        for(uint8_t w = 0; w < OTP_WINDOW_CODES; w++) {
+            if(shift > 0 && w + shift < OTP_WINDOW_CODES)
+                codes[i][w] = codes[i][w + shift];
+            else
+                codes[i][w] = otp_totp(keys[i].key, step - OTP_WINDOW + w);
+        }
+    }
+
+    taskENTER_CRITICAL(&otp_lock);
+    if(gen == secrets_gen) {
+        memcpy(totp.codes, codes, sizeof(codes));
+        totp.step = step;
+    }
+    taskEXIT_CRITICAL(&otp_lock);
+}
+
+static esp_err_t otp_save_used()
+{
+    uint32_t used[OTP_USED_WORDS];
+
+    taskENTER_CRITICAL(&otp_lock);
+    memcpy(used, visitors_used, sizeof(used));
+    used_dirty = false;
+    taskEXIT_CRITICAL(&otp_lock);
+
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(OTP_STORAGE_NAME, NVS_READWRITE, &handle);
+    if(ret == ESP_OK) {
+        ret = nvs_set_blob(handle, "used", used, sizeof(used));
+        if(ret == ESP_OK)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if(ret != ESP_OK) {
+        taskENTER_CRITICAL(&otp_lock);
+        used_dirty = true; // Retried with the next batch
+        taskEXIT_CRITICAL(&otp_lock);
+    }
+    return ret;
+}
+
+static esp_err_t otp_save()
+{
+    otp_secret_t secrets_copy[OTP_MAX_SECRETS];
+    uint32_t visitors_copy[OTP_MAX_VISITOR_CODES];
+    uint32_t used[OTP_USED_WORDS];
+
+    taskENTER_CRITICAL(&otp_lock);
+    memcpy(secrets_copy, secrets, sizeof(secrets));
+    memcpy(visitors_copy, visitors, sizeof(visitors));
+    memcpy(used, visitors_used, sizeof(used));
+    used_dirty = false;
+    taskEXIT_CRITICAL(&otp_lock);
+
+    // One commit, visitor codes never reach NVS without their used bits
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(OTP_STORAGE_NAME, NVS_READWRITE, &handle);
+    if(ret == ESP_OK) {
+        ret = nvs_set_blob(handle, "totp", secrets_copy, sizeof(secrets_copy));
+        if(ret == ESP_OK)
+            ret = nvs_set_blob(handle, "visitors", visitors_copy, sizeof(visitors_copy));
+        if(ret == ESP_OK)
+            ret = nvs_set_blob(handle, "used", used, sizeof(used));
+        if(ret == ESP_OK)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if(ret != ESP_OK) {
+        taskENTER_CRITICAL(&otp_lock);
+        used_dirty = true;
+        taskEXIT_CRITICAL(&otp_lock);
+    }
+    ESP_RETURN_ON_ERROR(ret, PROJ_NAME, "Error writing one-time codes");
+    return ESP_OK;
+}
+
+/*
+ * @brief Schedule the next refresh right after the next step boundary
+ * @note The timer only runs while there is something to do, so it does not
+ *       wake the CPU from light sleep on a terminal without one-time codes
+*/
+static void otp_arm_timer()
+{
+    bool needed;
+
+    taskENTER_CRITICAL(&otp_lock);
+    needed = used_dirty;
+    for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++)
+        needed |= secrets[i].enrolled;
+    taskEXIT_CRITICAL(&otp_lock);
+    if(!needed || esp_timer_is_active(refresh_timer))
+        return;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t delay_us = (uint64_t) (OTP_STEP_SEC - tv.tv_sec % OTP_STEP_SEC) * 1000 * 1000 - tv.tv_usec;
+    esp_timer_start_once(refresh_timer, delay_us + OTP_REFRESH_DELAY_US); // Fails harmlessly if armed meanwhile
+}
+
+static void otp_refresh_timer_cb(void * arg)
+{
+    // Flash writes would hold up every other esp_timer callback
+    xTaskNotifyGive(otp_task_handle);
+}
+
+static noreturn void otp_task()
+{
+    bool dirty;
+
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        otp_refresh(time(NULL));
+
+        taskENTER_CRITICAL(&otp_lock);
+        dirty = used_dirty;
+        taskEXIT_CRITICAL(&otp_lock);
+        if(dirty && otp_save_used() != ESP_OK)
+            ESP_LOGE(PROJ_NAME, "Error writing used visitor codes");
+
+        otp_arm_timer();
+    }
+}
+
+/*
+ * @brief Read a blob of exactly the given size
+ * @return ESP_ERR_NVS_NOT_FOUND if it was never written
+*/
+static esp_err_t otp_load_blob(nvs_handle_t handle, const char * key, void * out, size_t size)
+{
+    size_t len = size;
+    esp_err_t ret = nvs_get_blob(handle, key, out, &len);
+    if(ret == ESP_OK && len != size)
+        ret = ESP_ERR_INVALID_SIZE;
+    return ret;
+}
+
+esp_err_t otp_init()
+{
+    esp_timer_create_args_t timer_args = {
+        .callback = &otp_refresh_timer_cb,
+        .name = "otp_refresh",
+    };
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &refresh_timer), PROJ_NAME, "Failed to create refresh timer");
+    ESP_RETURN_ON_FALSE(task_create(&otp_task, NULL, &otp_task_handle, TASK_OTP) == pdPASS,
+                        ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create OTP task");
+
+    memset(visitors_used, 0xFF, sizeof(visitors_used)); // All slots empty
+
+    // Each blob that was never written is empty, the others still load
+    nvs_handle_t handle;
+    ESP_RETURN_ON_ERROR(nvs_open(OTP_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    esp_err_t ret = otp_load_blob(handle, "totp", secrets, sizeof(secrets));
+    if(ret == ESP_ERR_NVS_NOT_FOUND) {
+        memset(secrets, 0, sizeof(secrets));
+        ret = ESP_OK;
+    }
+    if(ret == ESP_OK) {
+        ret = otp_load_blob(handle, "visitors", visitors, sizeof(visitors));
+        if(ret == ESP_ERR_NVS_NOT_FOUND) {
+            memset(visitors, 0, sizeof(visitors));
+            ret = ESP_OK;
+        }
+    }
+    if(ret == ESP_OK) {
+        // Without the bits every visitor slot counts as used, a code is never accepted twice
+        ret = otp_load_blob(handle, "used", visitors_used, sizeof(visitors_used));
+        if(ret == ESP_ERR_NVS_NOT_FOUND) {
+            memset(visitors_used, 0xFF, sizeof(visitors_used));
+            ret = ESP_OK;
+        }
+    }
+    nvs_close(handle);
+    ESP_RETURN_ON_ERROR(ret, PROJ_NAME, "Error reading one-time codes");
+
+    uint8_t enrolled = 0, unused = 0;
+    for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++)
+        enrolled += secrets[i].enrolled;
+    for(uint8_t i = 0; i < OTP_MAX_VISITOR_CODES; i++)
+        unused += !visitor_is_used(i);
+    ESP_LOGI(PROJ_NAME, "%u TOTP secret(s), %u unused visitor code(s)", enrolled, unused);
+
+    otp_snapshot_used();
+    otp_refresh(time(NULL));
+    otp_arm_timer();
+    return ESP_OK;
+}
+
+void otp_restore_used(const uint32_t * used)
+{
+    bool changed = false;
+
+    taskENTER_CRITICAL(&otp_lock);
+    for(uint8_t i = 0; i < OTP_USED_WORDS; i++) {
+        changed |= (used[i] & ~visitors_used[i]) != 0;
+        visitors_used[i] |= used[i];
+    }
+    used_dirty |= changed;
+    taskEXIT_CRITICAL(&otp_lock);
+
+    if(changed) {
+        ESP_LOGI(PROJ_NAME, "Visitor codes used before the restart marked again");
+        otp_snapshot_used();
+        otp_arm_timer();
+    }
+}
+
+/*
+ * @brief Parse a keypad entry of exactly the given number of digits
+*/
+static bool otp_parse(const char * code, size_t digits, uint32_t * value)
+{
+    if(strlen(code) != digits)
+        return false;
+
+    *value = 0;
+    for(size_t i = 0; i < digits; i++) {
+        if(code[i] < '0' || code[i] > '9')
+            return false;
+        *value = *value * 10 + (code[i] - '0');
+    }
+    return true;
+}
+
+int otp_claim(const char * code, uint8_t * schedule)
+{
+    uint32_t value;
+    int slot = -1;
+
+    if(otp_parse(code, OTP_TOTP_DIGITS, &value)) {
+        time_t now = time(NULL);
+        taskENTER_CRITICAL(&otp_lock);
+        bool fresh = totp.step == now / OTP_STEP_SEC;
+        taskEXIT_CRITICAL(&otp_lock);
+        // Only when the timer is a bit late or the clock was just set
+        if(!fresh)
+            otp_refresh(now);
+
+        taskENTER_CRITICAL(&otp_lock);
+        for(uint8_t i = 0; totp.step != 0 && i < OTP_MAX_SECRETS && slot < 0; i++) {
+            if(!secrets[i].enrolled)
+                continue;
+            for(uint8_t w = 0; w < OTP_WINDOW_CODES; w++) {
+                int64_t step = totp.step - OTP_WINDOW + w;
+                if(totp.codes[i][w] == value && step > totp.last_step[i]) {
+                    totp.claimed_from[i] = totp.last_step[i];
+                    totp.last_step[i] = step;
+                    *schedule = secrets[i].schedule;
+                    slot = AUDIT_SLOT_TOTP(i);
+                    break;
+                }
+            }
+        }
+        taskEXIT_CRITICAL(&otp_lock);
+    } else if(otp_parse(code, OTP_VISITOR_DIGITS, &value)) {
+        taskENTER_CRITICAL(&otp_lock);
+        for(uint8_t i = 0; i < OTP_MAX_VISITOR_CODES; i++) {
+            if(visitors[i] == value && !visitor_is_used(i)) {
+                visitors_used[i / 32] |= BIT(i % 32);
+                used_dirty = true;
+                *schedule = SCHEDULE_ALWAYS;
+                slot = AUDIT_SLOT_VISITOR(i);
+                break;
+            }
+        }
+        taskEXIT_CRITICAL(&otp_lock);
+        if(slot >= 0) {
+            otp_snapshot_used(); // Survives a restart before the batch is written
+            otp_arm_timer(); // The used bit goes to NVS with the next batch
+        }
+    }
+    return slot;
+}
+
+void otp_release(int slot)
+{
+    bool visitor = slot >= AUDIT_SLOT_VISITOR(0) && slot < AUDIT_SLOT_VISITOR(OTP_MAX_VISITOR_CODES);
+
+    taskENTER_CRITICAL(&otp_lock);
+    if(slot >= AUDIT_SLOT_TOTP(0) && slot < AUDIT_SLOT_TOTP(OTP_MAX_SECRETS)) {
+        uint8_t i = slot - AUDIT_SLOT_TOTP(0);
+        totp.last_step[i] = totp.claimed_from[i];
+    } else if(visitor) {
+        uint8_t i = slot - AUDIT_SLOT_VISITOR(0);
+        visitors_used[i / 32] &= ~BIT(i % 32);
+    }
+    taskEXIT_CRITICAL(&otp_lock);
+    if(visitor)
+        otp_snapshot_used();
+}
+
+int otp_command(const uint8_t * cmd, uint16_t len, uint8_t source)
+{
+    uint32_t codes[OTP_CMD_MAX_CODES];
+    uint8_t slot, count, unused;
+    int rc = 0;
+
+    switch(cmd[0]) {
+        case OTP_CMD_TOTP_SET:
+            if(len != 3 + OTP_SECRET_LEN)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            slot = cmd[1];
+            if(slot >= OTP_MAX_SECRETS || cmd[2] >= SCHEDULE_COUNT)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            taskENTER_CRITICAL(&otp_lock);
+            memcpy(secrets[slot].key, &cmd[3], OTP_SECRET_LEN);
+            secrets[slot].schedule = cmd[2];
+            secrets[slot].enrolled = 1;
+            totp.last_step[slot] = 0;
+            totp.step = 0; // Recompute the whole table
+            secrets_gen++;
+            taskEXIT_CRITICAL(&otp_lock);
+            break;
+
+        case OTP_CMD_TOTP_REMOVE:
+            if(len != 2)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            slot = cmd[1];
+            if(slot >= OTP_MAX_SECRETS)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            taskENTER_CRITICAL(&otp_lock);
+            memset(&secrets[slot], 0, sizeof(secrets[slot]));
+            secrets_gen++;
+            taskEXIT_CRITICAL(&otp_lock);
+            break;
+
+        case OTP_CMD_VISITOR_ADD:
+            if(len < 1 + sizeof(uint32_t) || (len - 1) % sizeof(uint32_t) != 0)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            count = (len - 1) / sizeof(uint32_t);
+            memcpy(codes, &cmd[1], len - 1); // Little endian, same as the CPU
+            for(uint8_t i = 0; i < count; i++) {
+                if(codes[i] > OTP_VISITOR_MAX)
+                    return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            }
+            taskENTER_CRITICAL(&otp_lock);
+            unused = 0;
+            for(uint8_t i = 0; i < OTP_MAX_VISITOR_CODES; i++)
+                unused += visitor_is_used(i);
+            if(unused < count) {
+                rc = BLE_ATT_ERR_INSUFFICIENT_RES;
+            } else {
+                // New codes take the slots of used ones
+                for(uint8_t i = 0, j = 0; j < count; i++) {
+                    if(visitor_is_used(i)) {
+                        visitors[i] = codes[j++];
+                        visitors_used[i / 32] &= ~BIT(i % 32);
+                    }
+                }
+            }
+            taskEXIT_CRITICAL(&otp_lock);
+            break;
+
+        case OTP_CMD_VISITOR_CLEAR:
+            taskENTER_CRITICAL(&otp_lock);
+            memset(visitors, 0, sizeof(visitors));
+            memset(visitors_used, 0xFF, sizeof(visitors_used));
+            taskEXIT_CRITICAL(&otp_lock);
+            break;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+    if(rc != 0)
+        return rc;
+
+    otp_snapshot_used();
+    if(otp_save() != ESP_OK)
+        return BLE_ATT_ERR_UNLIKELY;
+    otp_refresh(time(NULL));
+    otp_arm_timer();
+    audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, source, cmd[0]);
+    ESP_LOGI(PROJ_NAME, "One-time codes updated (command %u)", cmd[0]);
+    return 0;
+}
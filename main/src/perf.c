@@ -0,0 +1,113 @@
+/*
+ * @file main/perf.c
+ *
+ * @proj imp-term
+ * @brief Scripted workload and metrics report for the QEMU performance regression run
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+
+#if PERF_HOOKS
+
+#include <stdio.h>
+
+#include <esp_system.h>
+#include <esp_timer.h>
+
+#include "perf.h"
+#include "boot.h"
+#include "gpio.h"
+#include "common.h"
+
+#define PERF_SETTLE_MS 3000 // Boot, audit recovery and the first heartbeat are over by then
+#define PERF_KEY_INTERVAL_MS 100 // Typing speed; no real keys or entry timeouts here, so no key is dropped
+#define PERF_DOOR_TIMEOUT_MS 1000
+#define PERF_MAX_TASKS 32
+
+static TaskHandle_t perf_task_handle = NULL;
+static volatile int64_t door_opened_at;
+
+void perf_door_opened()
+{
+    door_opened_at = esp_timer_get_time();
+    if(perf_task_handle != NULL)
+        xTaskNotifyGive(perf_task_handle);
+}
+
+static void perf_type(const char * keys)
+{
+    for(; *keys; keys++) {
+        if(gpio_keypad_inject_key(0, *keys, pdMS_TO_TICKS(KEYPAD_INJECT_TIMEOUT_MS)) < 0)
+            printf("PERF error.key_timeout %c\n", *keys);
+        vTaskDelayMSec(PERF_KEY_INTERVAL_MS);
+    }
+}
+
+static void perf_report_latency()
+{
+    static int64_t latency[PERF_SAMPLES];
+    uint8_t samples = 0;
+
+    for(uint8_t i = 0; i < PERF_SAMPLES; i++) {
+        // The measurement starts with the submit key, the freshly erased flash holds the default PIN
+        perf_type(KEYPAD_DEFAULT_ACCESS_PIN);
+        ulTaskNotifyTake(pdTRUE, 0);
+        int64_t start = esp_timer_get_time();
+        gpio_keypad_inject_key(0, KEYPAD_PIN_SUBMIT_KEY, pdMS_TO_TICKS(KEYPAD_INJECT_TIMEOUT_MS));
+        if(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PERF_DOOR_TIMEOUT_MS)) == 0) {
+            printf("PERF error.door_not_opened %u\n", i);
+            continue;
+        }
+        latency[samples++] = door_opened_at - start;
+
+        // Any key closes the door again
+        vTaskDelayMSec(PERF_KEY_INTERVAL_MS);
+        perf_type("0");
+    }
+    printf("PERF keypress_to_door.samples %u\n", samples);
+    if(samples == 0)
+        return;
+
+    for(uint8_t i = 1; i < samples; i++) {
+        int64_t value = latency[i];
+        uint8_t j = i;
+        for(; j > 0 && latency[j - 1] > value; j--)
+            latency[j] = latency[j - 1];
+        latency[j] = value;
+    }
+    printf("PERF keypress_to_door.p50_us %lld\n", latency[(samples - 1) / 2]);
+    printf("PERF keypress_to_door.p90_us %lld\n", latency[(samples - 1) * 9 / 10]);
+    printf("PERF keypress_to_door.max_us %lld\n", latency[samples - 1]);
+}
+
+noreturn void perf_task()
+{
+    perf_task_handle = xTaskGetCurrentTaskHandle();
+    vTaskDelayMSec(PERF_SETTLE_MS);
+
+    for(uint8_t stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        if(boot_time(stage) != 0)
+            printf("PERF boot.%s_us %lld\n", boot_stage_id(stage), boot_time(stage));
+    }
+
+    perf_report_latency();
+
+    printf("PERF heap.free %lu\n", (unsigned long) esp_get_free_heap_size());
+    printf("PERF heap.min_free %lu\n", (unsigned long) esp_get_minimum_free_heap_size());
+
+#if configUSE_TRACE_FACILITY
+    // Stack high water marks are in bytes on ESP-IDF
+    static TaskStatus_t tasks[PERF_MAX_TASKS];
+    UBaseType_t count = uxTaskGetSystemState(tasks, PERF_MAX_TASKS, NULL);
+    for(UBaseType_t i = 0; i < count; i++)
+        printf("PERF stack.%s %lu\n", tasks[i].pcTaskName, (unsigned long) tasks[i].usStackHighWaterMark);
+#endif
+
+    printf("PERF done\n");
+    vTaskDelete(NULL);
+    while(1); // Wait for deletion
+}
+
+#endif // PERF_HOOKS
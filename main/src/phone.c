@@ -0,0 +1,283 @@
+/*
+ * @file main/phone.c
+ *
+ * @proj imp-term
+ * @brief Bonded phones as access credentials (tap-to-unlock over BLE)
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <mbedtls/md.h>
+
+#include "host/ble_store.h"
+#include "store/config/ble_store_config.h"
+
+#include "config.h"
+#include "phone.h"
+#include "audit.h"
+#include "credential.h"
+#include "common.h"
+
+// Enrolled phone as stored in NVS
+typedef struct {
+    ble_addr_t id_addr;
+    uint8_t key[PHONE_KEY_LEN];
+} phone_t;
+
+// Identity addresses and keys of enrolled phones, mirrored in NVS. Only the NimBLE
+// host task touches them after phone_init(), so an unlock is a short scan of RAM.
+static phone_t allowlist[PHONE_ALLOWLIST_LEN];
+static uint8_t allowlist_len = 0;
+
+// Outstanding unlock challenge of each enrolled phone, by allowlist index
+static struct {
+    uint8_t challenge[PHONE_CHALLENGE_LEN];
+    int64_t issued_at;
+    bool pending;
+} challenges[PHONE_ALLOWLIST_LEN];
+
+int phone_find(const ble_addr_t * id_addr)
+{
+    for(uint8_t i = 0; i < allowlist_len; i++) {
+        if(ble_addr_cmp(&allowlist[i].id_addr, id_addr) == 0)
+            return i;
+    }
+    return -1;
+}
+
+bool phone_is_enrolled(const ble_addr_t * id_addr)
+{
+    return phone_find(id_addr) >= 0;
+}
+
+static esp_err_t phone_save()
+{
+    nvs_handle_t handle;
+    ESP_RETURN_ON_ERROR(nvs_open(PHONE_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    esp_err_t ret = nvs_set_blob(handle, "phones", allowlist, allowlist_len * sizeof(allowlist[0]));
+    if(ret == ESP_OK)
+        ret = nvs_commit(handle);
+    nvs_close(handle);
+    return ret;
+}
+
+esp_err_t phone_init()
+{
+    phone_t stored[PHONE_ALLOWLIST_LEN];
+    size_t len = sizeof(stored);
+    nvs_handle_t handle;
+
+    ESP_RETURN_ON_ERROR(nvs_open(PHONE_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    // Phones enrolled before the unlock keys have no key to sign with, they have to be enrolled again
+    if(nvs_erase_key(handle, "allowlist") == ESP_OK) {
+        ESP_LOGW(PROJ_NAME, "Dropping phones enrolled without an unlock key");
+        nvs_commit(handle);
+    }
+    esp_err_t ret = nvs_get_blob(handle, "phones", stored, &len);
+    nvs_close(handle);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(PROJ_NAME, "No phones enrolled");
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_ERROR(ret, PROJ_NAME, "Error reading phone allowlist");
+
+    ble_addr_t bonded[CONFIG_BT_NIMBLE_MAX_BONDS];
+    int bonded_len = 0;
+    ESP_RETURN_ON_FALSE(ble_store_util_bonded_peers(bonded, &bonded_len, CONFIG_BT_NIMBLE_MAX_BONDS) == 0,
+                        ESP_FAIL, PROJ_NAME, "Error reading bonded peers");
+
+    // A phone whose bond is gone has to be enrolled again
+    for(uint8_t i = 0; i < len / sizeof(stored[0]); i++) {
+        for(int j = 0; j < bonded_len; j++) {
+            if(ble_addr_cmp(&stored[i].id_addr, &bonded[j]) == 0) {
+                allowlist[allowlist_len++] = stored[i];
+                break;
+            }
+        }
+    }
+
+    if(allowlist_len != len / sizeof(stored[0])) {
+        ESP_LOGW(PROJ_NAME, "Dropping %u phone(s) without a bond", len / sizeof(stored[0]) - allowlist_len);
+        ESP_RETURN_ON_ERROR(phone_save(), PROJ_NAME, "Error writing phone allowlist");
+    }
+    ESP_LOGI(PROJ_NAME, "%u phone(s) enrolled", allowlist_len);
+    return ESP_OK;
+}
+
+/*
+ * @brief Identity address of a connection's peer, if the link is encrypted with a bond
+*/
+static int phone_bonded_peer(uint16_t conn_handle, ble_addr_t * id_addr)
+{
+    struct ble_gap_conn_desc desc;
+    if(ble_gap_conn_find(conn_handle, &desc) != 0)
+        return BLE_ATT_ERR_UNLIKELY;
+    // Also enforced by the stack through BLE_GATT_CHR_F_WRITE_ENC
+    if(!desc.sec_state.encrypted || !desc.sec_state.bonded)
+        return BLE_ATT_ERR_INSUFFICIENT_ENC;
+    *id_addr = desc.peer_id_addr;
+    return 0;
+}
+
+int phone_challenge(uint16_t conn_handle, uint8_t * challenge)
+{
+    ble_addr_t id_addr;
+    int rc;
+    int slot;
+
+    if((rc = phone_bonded_peer(conn_handle, &id_addr)) != 0)
+        return rc;
+    if((slot = phone_find(&id_addr)) < 0)
+        return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+
+    esp_fill_random(challenges[slot].challenge, PHONE_CHALLENGE_LEN);
+    challenges[slot].issued_at = esp_timer_get_time();
+    challenges[slot].pending = true;
+    memcpy(challenge, challenges[slot].challenge, PHONE_CHALLENGE_LEN);
+    return 0;
+}
+
+int phone_verify(const ble_addr_t * id_addr, const uint8_t * response)
+{
+    int slot = phone_find(id_addr);
+    if(slot < 0)
+        return -1;
+
+    // A challenge signs one request only, a replayed or late response is refused
+    bool pending = challenges[slot].pending &&
+                   esp_timer_get_time() - challenges[slot].issued_at < seconds((int64_t) PHONE_CHALLENGE_TIMEOUT_SEC) * 1000;
+    challenges[slot].pending = false;
+    if(!pending)
+        return -1;
+
+    static const char label[] = "unlock";
+    uint8_t msg[sizeof(label) - 1 + PHONE_CHALLENGE_LEN];
+    uint8_t expected[PHONE_RESPONSE_LEN];
+    memcpy(msg, label, sizeof(label) - 1);
+    memcpy(&msg[sizeof(label) - 1], challenges[slot].challenge, PHONE_CHALLENGE_LEN);
+    if(mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), allowlist[slot].key, PHONE_KEY_LEN,
+                       msg, sizeof(msg), expected) != 0)
+        return -1;
+
+    uint8_t diff = 0;
+    for(size_t i = 0; i < PHONE_RESPONSE_LEN; i++)
+        diff |= expected[i] ^ response[i];
+    return diff == 0 ? slot : -1;
+}
+
+int phone_unlock(uint16_t conn_handle, const uint8_t * response)
+{
+    ble_addr_t id_addr;
+    int rc;
+
+    // The bond identifies the phone, the response to its challenge proves it holds
+    // the key it was enrolled with; both are checked in the credential pipeline
+    if((rc = phone_bonded_peer(conn_handle, &id_addr)) != 0)
+        return rc;
+
+    credential_t credential = {
+        .type = CREDENTIAL_PHONE,
+        .source = AUDIT_SOURCE_BLE,
+        .phone = { .addr = &id_addr, .response = response },
+    };
+    return credential_submit(&credential) ? 0 : BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+}
+
+int phone_enroll(uint16_t conn_handle, const uint8_t * cmd, uint16_t len)
+{
+    ble_addr_t id_addr;
+    int rc;
+    int slot;
+
+    if(len != (cmd[0] == PHONE_CMD_ENROLL ? 1 + PHONE_KEY_LEN : 1))
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    switch(cmd[0]) {
+        case PHONE_CMD_ENROLL:
+            if((rc = phone_bonded_peer(conn_handle, &id_addr)) != 0)
+                return rc;
+            // Enrolling again replaces the key, e.g. after the browser lost it
+            if((slot = phone_find(&id_addr)) < 0) {
+                if(allowlist_len >= PHONE_ALLOWLIST_LEN)
+                    return BLE_ATT_ERR_INSUFFICIENT_RES;
+                slot = allowlist_len++;
+                allowlist[slot].id_addr = id_addr;
+            }
+            memcpy(allowlist[slot].key, &cmd[1], PHONE_KEY_LEN);
+            challenges[slot].pending = false;
+            break;
+
+        case PHONE_CMD_REVOKE:
+            if((rc = phone_bonded_peer(conn_handle, &id_addr)) != 0)
+                return rc;
+            if((slot = phone_find(&id_addr)) < 0)
+                return 0;
+            allowlist[slot] = allowlist[--allowlist_len];
+            challenges[slot] = challenges[allowlist_len];
+            break;
+
+        case PHONE_CMD_CLEAR:
+            allowlist_len = 0;
+            break;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    if(phone_save() != ESP_OK)
+        return BLE_ATT_ERR_UNLIKELY;
+    audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_BLE, cmd[0]);
+    ESP_LOGI(PROJ_NAME, "Phone allowlist updated (command %u), %u phone(s) enrolled", cmd[0], allowlist_len);
+
+    // Drop the keys too, the bond of a revoked phone must not be reused; the
+    // current link stays up until the peer disconnects
+    if(cmd[0] == PHONE_CMD_REVOKE)
+        ble_store_util_delete_peer(&id_addr);
+    else if(cmd[0] == PHONE_CMD_CLEAR)
+        ble_store_clear();
+    return 0;
+}
+
+/*
+ * @brief Unpair the oldest bonded peer that is neither enrolled nor excluded
+*/
+static int phone_unpair_oldest_except(const ble_addr_t * except)
+{
+    ble_addr_t bonded[CONFIG_BT_NIMBLE_MAX_BONDS];
+    int bonded_len = 0;
+    int rc = ble_store_util_bonded_peers(bonded, &bonded_len, CONFIG_BT_NIMBLE_MAX_BONDS);
+    if(rc != 0)
+        return rc;
+
+    // Bonds are kept in the order they were made
+    for(int i = 0; i < bonded_len; i++) {
+        if(phone_is_enrolled(&bonded[i]) || (except && ble_addr_cmp(&bonded[i], except) == 0))
+            continue;
+        return ble_gap_unpair(&bonded[i]);
+    }
+    ESP_LOGW(PROJ_NAME, "Bond store full of enrolled phones, refusing new bond");
+    return BLE_HS_ESTORE_CAP;
+}
+
+int phone_store_status_cb(struct ble_store_status_event * event, void * arg)
+{
+    // Same as ble_store_util_status_rr(), except that enrolled phones are never evicted
+    if(event->event_code == BLE_STORE_EVENT_OVERFLOW) {
+        switch(event->overflow.obj_type) {
+            case BLE_STORE_OBJ_TYPE_OUR_SEC:
+            case BLE_STORE_OBJ_TYPE_PEER_SEC:
+            case BLE_STORE_OBJ_TYPE_PEER_ADDR:
+                return phone_unpair_oldest_except(NULL);
+            case BLE_STORE_OBJ_TYPE_CCCD:
+                return phone_unpair_oldest_except(&event->overflow.value->cccd.peer_addr);
+        }
+    }
+    return ble_store_util_status_rr(event, arg);
+}
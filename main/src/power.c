@@ -0,0 +1,112 @@
+/*
+ * @file main/power.c
+ *
+ * @proj imp-term
+ * @brief Power management (automatic light sleep) and sleep time accounting
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+
+#include "config.h"
+#include "power.h"
+#include "gpio.h"
+#include "door_io.h"
+#include "common.h"
+
+static esp_pm_lock_handle_t power_locks[POWER_LOCK_COUNT];
+static const char * power_lock_names[POWER_LOCK_COUNT] = {
+    [POWER_LOCK_PIN_ENTRY] = "pin_entry",
+    [POWER_LOCK_DOOR] = "door",
+    [POWER_LOCK_BLE] = "ble",
+    [POWER_LOCK_READER] = "reader",
+};
+
+// Updated from the light sleep exit callback (idle task, interrupts disabled)
+static volatile uint64_t sleep_us = 0;
+static volatile uint32_t wakeups = 0;
+static volatile uint32_t key_wakeups = 0;
+
+#if POWER_SAVE
+
+static esp_err_t IRAM_ATTR power_sleep_enter_cb(int64_t sleep_time_us, void * arg)
+{
+    gpio_keypad_sleep_prepare();
+    door_io_sleep_prepare();
+    return ESP_OK;
+}
+
+static esp_err_t IRAM_ATTR power_sleep_exit_cb(int64_t slept_us, void * arg)
+{
+    sleep_us += slept_us;
+    wakeups++;
+    // The edge interrupt of the key that woke us may not have been latched while
+    // the GPIO clock was gated, so hand the pressed row to the keypad task here;
+    // a duplicate event from the edge interrupt is dropped by the keypad task
+    if(gpio_keypad_sleep_restore())
+        key_wakeups++;
+    door_io_sleep_restore();
+    return ESP_OK;
+}
+
+esp_err_t power_init()
+{
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    ESP_RETURN_ON_ERROR(esp_pm_configure(&pm_config), PROJ_NAME, "Failed to configure power management");
+
+    // Light sleep keeps the columns driven, a key pulls its row high and wakes the CPU
+    ESP_RETURN_ON_ERROR(esp_sleep_enable_gpio_wakeup(), PROJ_NAME, "Failed to enable GPIO wakeup");
+
+    esp_pm_sleep_cbs_register_config_t cbs = {
+        .enter_cb = power_sleep_enter_cb,
+        .exit_cb = power_sleep_exit_cb,
+    };
+    ESP_RETURN_ON_ERROR(esp_pm_light_sleep_register_cbs(&cbs), PROJ_NAME, "Failed to register sleep callbacks");
+
+    for(uint8_t i = 0; i < POWER_LOCK_COUNT; i++) {
+        ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, power_lock_names[i], &power_locks[i]),
+                            PROJ_NAME, "Failed to create PM lock");
+    }
+
+    ESP_LOGI(PROJ_NAME, "Power management enabled (%d-%d MHz, light sleep)", POWER_MIN_FREQ_MHZ, POWER_MAX_FREQ_MHZ);
+    return ESP_OK;
+}
+
+void power_acquire(enum PowerLock lock)
+{
+    esp_pm_lock_acquire(power_locks[lock]);
+}
+
+void power_release(enum PowerLock lock)
+{
+    esp_pm_lock_release(power_locks[lock]);
+}
+
+#else // POWER_SAVE
+
+esp_err_t power_init()
+{
+    return ESP_OK;
+}
+
+void power_acquire(enum PowerLock lock) {}
+void power_release(enum PowerLock lock) {}
+
+#endif // POWER_SAVE
+
+void power_get_stats(power_stats_t * stats)
+{
+    stats->uptime_ms = esp_timer_get_time() / 1000;
+    stats->sleep_ms = sleep_us / 1000;
+    stats->wakeups = wakeups;
+    stats->key_wakeups = key_wakeups;
+}
@@ -0,0 +1,242 @@
+/*
+ * @file main/schedule.c
+ *
+ * @proj imp-term
+ * @brief Weekly access schedules, holidays and wall clock time
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <nvs.h>
+
+#include "host/ble_hs.h"
+
+#include "config.h"
+#include "schedule.h"
+#include "audit.h"
+#include "common.h"
+
+static_assert(SCHEDULE_WEEK_HOURS % 8 == 0, "Week bitmap must fill whole bytes");
+
+// Schedules and holidays, mirrored in NVS. Read by every credential decision and
+// written by the NimBLE host task, so both go through the spinlock.
+static schedule_t schedules[SCHEDULE_COUNT];
+static uint8_t pin_schedule = SCHEDULE_ALWAYS;
+static uint16_t holidays[SCHEDULE_MAX_HOLIDAYS];
+static uint8_t holidays_len = 0;
+static portMUX_TYPE schedule_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Local hour of week and holiday flag of the current hour, so that a decision is a
+// bit test; refreshed from the calendar (time zone, DST) once the hour is over
+static struct {
+    time_t from;
+    time_t until;
+    uint8_t hour_of_week;
+    bool holiday;
+} now_cache = {0};
+
+int32_t schedule_days_from_civil(int32_t year, uint32_t month, uint32_t day)
+{
+    // Howard Hinnant's days_from_civil
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t yoe = year - era * 400;
+    uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t) doe - 719468;
+}
+
+static bool schedule_is_holiday(int32_t day)
+{
+    for(uint8_t i = 0; i < holidays_len; i++) {
+        if(holidays[i] == day)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * @brief Recompute the cached hour of week for the current local hour
+*/
+static void schedule_refresh(time_t now)
+{
+    struct tm tm;
+    localtime_r(&now, &tm); // May take the newlib locks, so not under the spinlock
+    int32_t today = schedule_days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+    taskENTER_CRITICAL(&schedule_lock);
+    now_cache.hour_of_week = tm.tm_wday * 24 + tm.tm_hour;
+    now_cache.holiday = schedule_is_holiday(today);
+    // DST transitions happen on a local hour boundary, so the cache never spans one
+    now_cache.from = now - tm.tm_min * 60 - tm.tm_sec;
+    now_cache.until = now_cache.from + 3600;
+    taskEXIT_CRITICAL(&schedule_lock);
+}
+
+static void schedule_invalidate()
+{
+    taskENTER_CRITICAL(&schedule_lock);
+    now_cache.until = 0;
+    taskEXIT_CRITICAL(&schedule_lock);
+}
+
+bool schedule_allows(uint8_t schedule)
+{
+    if(schedule == SCHEDULE_ALWAYS)
+        return true;
+    if(schedule >= SCHEDULE_COUNT)
+        return false;
+
+    time_t now = time(NULL);
+    if(now < SCHEDULE_MIN_VALID_TIME) {
+        ESP_LOGW(PROJ_NAME, "Clock not set, denying scheduled access");
+        return false;
+    }
+
+    taskENTER_CRITICAL(&schedule_lock);
+    bool fresh = now >= now_cache.from && now < now_cache.until;
+    taskEXIT_CRITICAL(&schedule_lock);
+    if(!fresh)
+        schedule_refresh(now);
+
+    taskENTER_CRITICAL(&schedule_lock);
+    uint8_t hour = now_cache.hour_of_week;
+    bool allowed = schedules[schedule].week[hour / 8] & BIT(hour % 8);
+    if(now_cache.holiday && !(schedules[schedule].flags & SCHEDULE_F_HOLIDAYS))
+        allowed = false;
+    taskEXIT_CRITICAL(&schedule_lock);
+    return allowed;
+}
+
+uint8_t schedule_pin()
+{
+    return pin_schedule;
+}
+
+esp_err_t schedule_set_time(uint32_t epoch, uint8_t source)
+{
+    struct timeval tv = { .tv_sec = epoch, .tv_usec = 0 };
+    ESP_RETURN_ON_FALSE(settimeofday(&tv, NULL) == 0, ESP_FAIL, PROJ_NAME, "Failed to set time");
+    schedule_invalidate();
+
+    struct tm tm;
+    char buf[32];
+    time_t now = epoch;
+    localtime_r(&now, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S %Z", &tm);
+    ESP_LOGI(PROJ_NAME, "Time set to %s", buf);
+    audit_log_event(AUDIT_EVT_TIME_SET, AUDIT_SLOT_NONE, AUDIT_RES_OK, source, 0);
+    return ESP_OK;
+}
+
+static esp_err_t schedule_save()
+{
+    schedule_t schedules_copy[SCHEDULE_COUNT];
+    uint16_t holidays_copy[SCHEDULE_MAX_HOLIDAYS];
+    uint8_t pin, len;
+
+    taskENTER_CRITICAL(&schedule_lock);
+    memcpy(schedules_copy, schedules, sizeof(schedules));
+    memcpy(holidays_copy, holidays, sizeof(holidays));
+    len = holidays_len;
+    pin = pin_schedule;
+    taskEXIT_CRITICAL(&schedule_lock);
+
+    nvs_handle_t handle;
+    ESP_RETURN_ON_ERROR(nvs_open(SCHEDULE_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    esp_err_t ret = nvs_set_blob(handle, "schedules", schedules_copy, sizeof(schedules_copy));
+    if(ret == ESP_OK)
+        ret = nvs_set_blob(handle, "holidays", holidays_copy, len * sizeof(holidays_copy[0]));
+    if(ret == ESP_OK)
+        ret = nvs_set_u8(handle, "pin", pin);
+    if(ret == ESP_OK)
+        ret = nvs_commit(handle);
+    nvs_close(handle);
+    return ret;
+}
+
+esp_err_t schedule_init()
+{
+    setenv("TZ", TIME_ZONE, 1);
+    tzset();
+
+    // Nothing is allowed until a schedule is pushed, except the built-in one
+    memset(schedules, 0, sizeof(schedules));
+    memset(schedules[SCHEDULE_ALWAYS].week, 0xFF, SCHEDULE_WEEK_BYTES);
+    schedules[SCHEDULE_ALWAYS].flags = SCHEDULE_F_HOLIDAYS;
+
+    nvs_handle_t handle;
+    ESP_RETURN_ON_ERROR(nvs_open(SCHEDULE_STORAGE_NAME, NVS_READWRITE, &handle), PROJ_NAME, "Error opening handle");
+    size_t len = sizeof(schedules);
+    esp_err_t ret = nvs_get_blob(handle, "schedules", schedules, &len);
+    if(ret == ESP_OK) {
+        len = sizeof(holidays);
+        if(nvs_get_blob(handle, "holidays", holidays, &len) == ESP_OK)
+            holidays_len = len / sizeof(holidays[0]);
+        nvs_get_u8(handle, "pin", &pin_schedule);
+    }
+    nvs_close(handle);
+    memset(schedules[SCHEDULE_ALWAYS].week, 0xFF, SCHEDULE_WEEK_BYTES);
+    schedules[SCHEDULE_ALWAYS].flags = SCHEDULE_F_HOLIDAYS;
+    if(ret == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(PROJ_NAME, "No schedules configured");
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_ERROR(ret, PROJ_NAME, "Error reading schedules");
+
+    ESP_LOGI(PROJ_NAME, "Schedules loaded, access PIN uses schedule %u, %u holiday(s)", pin_schedule, holidays_len);
+    return ESP_OK;
+}
+
+int schedule_command(const uint8_t * cmd, uint16_t len, uint8_t source)
+{
+    uint8_t id;
+    schedule_t schedule;
+
+    switch(cmd[0]) {
+        case SCHEDULE_CMD_SET:
+            if(len != 2 + sizeof(schedule_t))
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            id = cmd[1];
+            memcpy(&schedule, &cmd[2], sizeof(schedule));
+            if(id == SCHEDULE_ALWAYS || id >= SCHEDULE_COUNT || (schedule.flags & ~SCHEDULE_F_HOLIDAYS))
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            taskENTER_CRITICAL(&schedule_lock);
+            schedules[id] = schedule;
+            taskEXIT_CRITICAL(&schedule_lock);
+            break;
+
+        case SCHEDULE_CMD_PIN:
+            if(len != 2)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            if(cmd[1] >= SCHEDULE_COUNT)
+                return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+            pin_schedule = cmd[1];
+            break;
+
+        case SCHEDULE_CMD_HOLIDAYS:
+            if((len - 1) % sizeof(uint16_t) != 0 || (len - 1) / sizeof(uint16_t) > SCHEDULE_MAX_HOLIDAYS)
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            taskENTER_CRITICAL(&schedule_lock);
+            holidays_len = (len - 1) / sizeof(uint16_t);
+            memcpy(holidays, &cmd[1], len - 1); // Little endian, same as the CPU
+            taskEXIT_CRITICAL(&schedule_lock);
+            break;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    schedule_invalidate();
+    if(schedule_save() != ESP_OK)
+        return BLE_ATT_ERR_UNLIKELY;
+    audit_log_event(AUDIT_EVT_CONFIG_CHANGE, AUDIT_SLOT_NONE, AUDIT_RES_OK, source, cmd[0]);
+    ESP_LOGI(PROJ_NAME, "Schedules updated (command %u)", cmd[0]);
+    return 0;
+}
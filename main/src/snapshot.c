@@ -0,0 +1,135 @@
+/*
+ * @file main/snapshot.c
+ *
+ * @proj imp-term
+ * @brief Runtime state kept in RTC memory across software and watchdog restarts
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_rom_crc.h>
+#include <esp_private/esp_clk.h>
+
+#include "config.h"
+#include "snapshot.h"
+#include "common.h"
+
+/*
+ * RTC slow memory is left alone by every reset except power-on and brownout,
+ * and so is the RTC timer, so a security delay is kept as the RTC time it ends
+ * at. Each save rewrites the CRC, a restart in the middle of one leaves a CRC
+ * mismatch and the next boot falls back to a full init from NVS.
+*/
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t len;
+    keypad_config_t config;
+    uint64_t lockout_until_us; // RTC time, 0 if none
+    bool door_open;
+    uint32_t otp_used[OTP_USED_WORDS];
+    uint32_t crc;
+} rtc_snapshot_t;
+
+static RTC_NOINIT_ATTR rtc_snapshot_t rtc_snapshot;
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool snapshot_has_config = false; // A restart before the config is saved must not restore an empty PIN
+
+static uint32_t snapshot_crc()
+{
+    return esp_rom_crc32_le(0, (const uint8_t *) &rtc_snapshot, offsetof(rtc_snapshot_t, crc));
+}
+
+/*
+ * @brief Make the snapshot valid again after a change, call with snapshot_lock held
+*/
+static void snapshot_seal()
+{
+    uint32_t crc = snapshot_crc();
+    rtc_snapshot.crc = snapshot_has_config ? crc : ~crc;
+}
+
+/*
+ * @brief Resets that keep RTC memory intact
+*/
+static bool snapshot_reset_is_warm(esp_reset_reason_t reason)
+{
+    switch(reason) {
+        case ESP_RST_SW:
+        case ESP_RST_PANIC:
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool snapshot_load(snapshot_t * snapshot)
+{
+    bool valid = snapshot_reset_is_warm(esp_reset_reason())
+                 && rtc_snapshot.magic == SNAPSHOT_MAGIC
+                 && rtc_snapshot.version == SNAPSHOT_VERSION
+                 && rtc_snapshot.len == sizeof(rtc_snapshot)
+                 && rtc_snapshot.crc == snapshot_crc();
+
+    if(valid) {
+        uint64_t now = esp_clk_rtc_time();
+        snapshot->config = rtc_snapshot.config;
+        snapshot->lockout_left_ms = rtc_snapshot.lockout_until_us > now ? (rtc_snapshot.lockout_until_us - now) / 1000 : 0;
+        snapshot->door_open = rtc_snapshot.door_open;
+        memcpy(snapshot->otp_used, rtc_snapshot.otp_used, sizeof(snapshot->otp_used));
+        ESP_LOGI(PROJ_NAME, "Warm restart, state restored from RTC memory");
+    } else {
+        // Start over, the fields are filled in as the modules load
+        memset(&rtc_snapshot, 0, sizeof(rtc_snapshot));
+        rtc_snapshot.magic = SNAPSHOT_MAGIC;
+        rtc_snapshot.version = SNAPSHOT_VERSION;
+        rtc_snapshot.len = sizeof(rtc_snapshot);
+    }
+
+    snapshot_has_config = valid;
+    snapshot_seal();
+    return valid;
+}
+
+void snapshot_save_config(const keypad_config_t * config)
+{
+    taskENTER_CRITICAL(&snapshot_lock);
+    rtc_snapshot.config = *config;
+    snapshot_has_config = true;
+    snapshot_seal();
+    taskEXIT_CRITICAL(&snapshot_lock);
+}
+
+void snapshot_save_lockout(uint32_t duration_ms)
+{
+    uint64_t until = esp_clk_rtc_time() + (uint64_t) duration_ms * 1000;
+    taskENTER_CRITICAL(&snapshot_lock);
+    rtc_snapshot.lockout_until_us = until;
+    snapshot_seal();
+    taskEXIT_CRITICAL(&snapshot_lock);
+}
+
+void snapshot_save_door(bool open)
+{
+    taskENTER_CRITICAL(&snapshot_lock);
+    rtc_snapshot.door_open = open;
+    snapshot_seal();
+    taskEXIT_CRITICAL(&snapshot_lock);
+}
+
+void snapshot_save_otp_used(const uint32_t * used)
+{
+    taskENTER_CRITICAL(&snapshot_lock);
+    memcpy(rtc_snapshot.otp_used, used, sizeof(rtc_snapshot.otp_used));
+    snapshot_seal();
+    taskEXIT_CRITICAL(&snapshot_lock);
+}
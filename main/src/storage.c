@@ -0,0 +1,226 @@
+/*
+ * @file main/storage.c
+ *
+ * @proj imp-term
+ * @brief Keypad configuration (PINs, door open duration) kept in NVS and cached in RAM
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+#include "storage.h"
+#include "common.h"
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+
+#if !CONFIG_IDF_TARGET_LINUX // The storage benchmark has no RTC memory
+#include "snapshot.h"
+#endif
+
+static nvs_handle_t keypad_nvs_handle;
+
+// RAM copy of the keypad config, loaded once at boot so that checking a PIN
+// never waits on flash; writes go to NVS first and then update the copy
+static keypad_config_t config_cache;
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * @brief Mirror the config cache into the warm restart snapshot
+*/
+static void config_cache_changed()
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    keypad_config_t copy;
+    taskENTER_CRITICAL(&config_lock);
+    copy = config_cache;
+    taskEXIT_CRITICAL(&config_lock);
+    snapshot_save_config(&copy);
+#endif
+}
+
+static char * cached_pin(const char * pin_name)
+{
+    if(strcmp(pin_name, "access_pin") == 0)
+        return config_cache.access_pin;
+    if(strcmp(pin_name, "admin_pin") == 0)
+        return config_cache.admin_pin;
+    if(strcmp(pin_name, "new_pin") == 0)
+        return config_cache.new_pin;
+    return NULL;
+}
+
+static esp_err_t config_read(keypad_config_t * config)
+{
+    size_t len;
+    memset(config, 0, sizeof(*config));
+    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READONLY, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
+    len = sizeof(config->access_pin);
+    ESP_RETURN_ON_ERROR(nvs_get_str(keypad_nvs_handle, "access_pin", config->access_pin, &len), "Error reading PIN from NVS", PROJ_NAME);
+    len = sizeof(config->admin_pin);
+    ESP_RETURN_ON_ERROR(nvs_get_str(keypad_nvs_handle, "admin_pin", config->admin_pin, &len), "Error reading PIN from NVS", PROJ_NAME);
+    len = sizeof(config->new_pin);
+    if(nvs_get_str(keypad_nvs_handle, "new_pin", config->new_pin, &len) != ESP_OK)
+        config->new_pin[0] = '\0'; // Only exists after a PIN change was started
+    ESP_RETURN_ON_ERROR(nvs_get_u16(keypad_nvs_handle, "door_duration", &config->door_duration), "Error reading duration from NVS", PROJ_NAME);
+    nvs_close(keypad_nvs_handle);
+    return ESP_OK;
+}
+
+static esp_err_t config_cache_load()
+{
+    ESP_RETURN_ON_ERROR(config_read(&config_cache), "Error reading config", PROJ_NAME);
+    config_cache_changed();
+    return ESP_OK;
+}
+
+void nvs_set_defaults()
+{
+    char access_pin[] = KEYPAD_DEFAULT_ACCESS_PIN;
+    char admin_pin[] = KEYPAD_DEFAULT_ADMIN_PIN;
+    ESP_ERROR_CHECK(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle));
+    ESP_ERROR_CHECK(nvs_set_str(keypad_nvs_handle, "access_pin", access_pin));
+    ESP_ERROR_CHECK(nvs_set_str(keypad_nvs_handle, "admin_pin", admin_pin));
+    ESP_ERROR_CHECK(nvs_set_u16(keypad_nvs_handle, "door_duration", DEFAULT_OPEN_DURATION_SEC));
+    ESP_ERROR_CHECK(nvs_commit(keypad_nvs_handle));
+    nvs_close(keypad_nvs_handle);
+    ESP_LOGE(PROJ_NAME, "Defaults set:\n\tAccess PIN: %s\n\tAdmin PIN: %s\n\tDoor open duration: %u", access_pin, admin_pin, DEFAULT_OPEN_DURATION_SEC);
+}
+
+/*
+ * @brief Initialize NVS, erasing it if it cannot be used as is
+*/
+static void nvs_init()
+{
+    // Initialize NVS
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        // NVS partition was truncated and needs to be erased
+        // Retry nvs_flash_init
+        ESP_LOGE(PROJ_NAME, "Storage truncated, erasing...");
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+}
+
+void nvs_configure()
+{
+    ESP_LOGI(PROJ_NAME, "Configuring NVS");
+    nvs_init();
+
+    // Set defaults if storage is empty
+    esp_err_t err = nvs_open(KEYPAD_STORAGE_NAME, NVS_READONLY, &keypad_nvs_handle);
+    if(err == ESP_ERR_NVS_NOT_FOUND) {
+#if CONFIG_LOG_DEFAULT_LEVEL_DEBUG || CONFIG_LOG_DEFAULT_LEVEL_VERBOSE
+        vTaskDelaySec(2); // Wait for serial monitor to connect, debug builds only
+#endif
+        ESP_LOGE(PROJ_NAME, "Storage not initialized, setting defaults");
+        nvs_close(keypad_nvs_handle);
+        nvs_set_defaults();
+    } else {
+        nvs_close(keypad_nvs_handle);
+    }
+
+    ESP_ERROR_CHECK(config_cache_load());
+    ESP_LOGI(PROJ_NAME, "NVS configured");
+}
+
+void nvs_configure_warm(const keypad_config_t * config)
+{
+    ESP_LOGI(PROJ_NAME, "Configuring NVS, config from the restart snapshot");
+    nvs_init();
+    config_cache = *config;
+}
+
+esp_err_t storage_reconcile()
+{
+    keypad_config_t stored;
+    ESP_RETURN_ON_ERROR(config_read(&stored), "Error reading config", PROJ_NAME);
+
+    taskENTER_CRITICAL(&config_lock);
+    bool differs = memcmp(&stored, &config_cache, sizeof(stored)) != 0;
+    if(differs)
+        config_cache = stored;
+    taskEXIT_CRITICAL(&config_lock);
+
+    if(differs) {
+        ESP_LOGW(PROJ_NAME, "Restart snapshot out of date, config reloaded from NVS");
+        config_cache_changed();
+    }
+    return ESP_OK;
+}
+
+esp_err_t check_pin(const char * pin_to_check, const char * pin_name, bool * is_correct)
+{
+    *is_correct = false;
+    char pin_set[KEYPAD_PIN_MAX_LEN + 1] = {0}; // +1 for null terminator
+    ESP_RETURN_ON_ERROR(read_pin(pin_name, pin_set, sizeof(pin_set)), "Error reading PIN", PROJ_NAME);
+
+    if(strcmp(pin_to_check, pin_set) == 0) {
+        ESP_LOGI(PROJ_NAME, "PIN correct");
+        *is_correct = true;
+    } else {
+        ESP_LOGI(PROJ_NAME, "PIN incorrect");
+        *is_correct = false;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t read_pin(const char * pin_name, char * pin, size_t len)
+{
+    const char * cached = cached_pin(pin_name);
+    if(cached == NULL)
+        return ESP_ERR_NOT_FOUND;
+    if(len < KEYPAD_PIN_MAX_LEN + 1)
+        return ESP_ERR_INVALID_SIZE;
+
+    taskENTER_CRITICAL(&config_lock);
+    memcpy(pin, cached, KEYPAD_PIN_MAX_LEN + 1);
+    taskEXIT_CRITICAL(&config_lock);
+    return ESP_OK;
+}
+
+esp_err_t change_pin(const char * new_pin, const char * pin_name)
+{
+    char * cached = cached_pin(pin_name);
+    if(cached == NULL || strlen(new_pin) > KEYPAD_PIN_MAX_LEN)
+        return ESP_ERR_INVALID_ARG;
+
+    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
+    ESP_RETURN_ON_ERROR(nvs_set_str(keypad_nvs_handle, pin_name, new_pin), "Error writing PIN to NVS", PROJ_NAME);
+    ESP_RETURN_ON_ERROR(nvs_commit(keypad_nvs_handle), "Error committing changes", PROJ_NAME);
+    nvs_close(keypad_nvs_handle);
+
+    taskENTER_CRITICAL(&config_lock);
+    memset(cached, 0, KEYPAD_PIN_MAX_LEN + 1);
+    memcpy(cached, new_pin, strlen(new_pin));
+    taskEXIT_CRITICAL(&config_lock);
+    config_cache_changed();
+
+    ESP_LOGI(PROJ_NAME, "%s updated to %s", pin_name, new_pin);
+    return ESP_OK;
+}
+
+esp_err_t update_door_duration(uint16_t duration)
+{
+    ESP_RETURN_ON_ERROR(nvs_open(KEYPAD_STORAGE_NAME, NVS_READWRITE, &keypad_nvs_handle), "Error opening handle", PROJ_NAME);
+    ESP_RETURN_ON_ERROR(nvs_set_u16(keypad_nvs_handle, "door_duration", duration), "Error writing duration to NVS", PROJ_NAME);
+    ESP_RETURN_ON_ERROR(nvs_commit(keypad_nvs_handle), "Error committing changes", PROJ_NAME);
+    nvs_close(keypad_nvs_handle);
+    config_cache.door_duration = duration; // Single aligned store, no lock needed
+    config_cache_changed();
+    ESP_LOGI(PROJ_NAME, "Door duration updated to %d seconds", duration);
+    return ESP_OK;
+}
+
+esp_err_t read_door_duration(uint16_t * duration)
+{
+    *duration = config_cache.door_duration;
+    return ESP_OK;
+}
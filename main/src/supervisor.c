@@ -0,0 +1,192 @@
+/*
+ * @file main/supervisor.c
+ *
+ * @proj imp-term
+ * @brief Deadlines of the access path, task watchdog and restart of a hung terminal
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+
+#include "config.h"
+#include "supervisor.h"
+#include "audit.h"
+#include "common.h"
+
+/*
+ * Tasks on the access path start a deadline when an event comes in and stop
+ * it once the event is handled. A deadline that finishes late, or that the
+ * supervisor finds overdue, counts as one miss. One still running
+ * SUPERVISOR_HANG_MS after its limit means a hung task, the supervisor records
+ * it and restarts the terminal, which also drops the door lock. The task
+ * watchdog covers what the deadlines do not: a watched task that spins
+ * without blocking, or the supervisor itself.
+*/
+
+static_assert(SUPERVISOR_FEED_MS < CONFIG_ESP_TASK_WDT_TIMEOUT_S * 1000, "Watched tasks would starve the watchdog");
+
+static const uint32_t default_limits_us[DEADLINE_COUNT] = {
+    [DEADLINE_KEY] = SUPERVISOR_KEY_MS * 1000,
+    [DEADLINE_DOOR_EVENT] = SUPERVISOR_DOOR_EVENT_MS * 1000,
+    [DEADLINE_DOOR_CLOSE] = SUPERVISOR_DOOR_CLOSE_SLACK_MS * 1000,
+};
+
+static portMUX_TYPE deadline_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+    bool expected;    // deadline_start_from_isr() may start it
+    bool missed;      // Current run already counted as a miss
+    int64_t started;  // 0 when not running
+    uint32_t limit_us;
+    deadline_stats_t stats;
+} deadlines[DEADLINE_COUNT];
+
+static TaskHandle_t supervisor_task_handle = NULL;
+
+void deadline_expect(enum Deadline deadline)
+{
+    taskENTER_CRITICAL(&deadline_lock);
+    deadlines[deadline].expected = true;
+    taskEXIT_CRITICAL(&deadline_lock);
+}
+
+void IRAM_ATTR deadline_start_from_isr(enum Deadline deadline)
+{
+    bool started = false;
+
+    taskENTER_CRITICAL_ISR(&deadline_lock);
+    if(deadlines[deadline].expected && deadlines[deadline].started == 0) {
+        deadlines[deadline].expected = false;
+        deadlines[deadline].missed = false;
+        deadlines[deadline].limit_us = default_limits_us[deadline];
+        deadlines[deadline].started = esp_timer_get_time();
+        started = true;
+    }
+    taskEXIT_CRITICAL_ISR(&deadline_lock);
+
+    if(started && supervisor_task_handle != NULL) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(supervisor_task_handle, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+void deadline_start(enum Deadline deadline, uint32_t limit_ms)
+{
+    taskENTER_CRITICAL(&deadline_lock);
+    deadlines[deadline].missed = false;
+    deadlines[deadline].limit_us = limit_ms ? limit_ms * 1000 : default_limits_us[deadline];
+    deadlines[deadline].started = esp_timer_get_time();
+    taskEXIT_CRITICAL(&deadline_lock);
+
+    // Let the supervisor pick the new deadline up
+    if(supervisor_task_handle != NULL)
+        xTaskNotifyGive(supervisor_task_handle);
+}
+
+void deadline_done(enum Deadline deadline)
+{
+    int64_t now = esp_timer_get_time();
+    bool late = false;
+    uint32_t elapsed = 0;
+
+    taskENTER_CRITICAL(&deadline_lock);
+    if(deadlines[deadline].started != 0) {
+        elapsed = now - deadlines[deadline].started;
+        deadlines[deadline].started = 0;
+        if(elapsed > deadlines[deadline].stats.worst_us)
+            deadlines[deadline].stats.worst_us = elapsed;
+        if(elapsed > deadlines[deadline].limit_us && !deadlines[deadline].missed) {
+            deadlines[deadline].stats.misses++;
+            deadlines[deadline].stats.last_miss = now / 1000000;
+            late = true;
+        }
+    }
+    deadlines[deadline].expected = false;
+    taskEXIT_CRITICAL(&deadline_lock);
+
+    if(late)
+        ESP_LOGW(PROJ_NAME, "Deadline %u missed, took %lu us", deadline, (unsigned long) elapsed);
+}
+
+void deadline_get_stats(deadline_stats_t stats[DEADLINE_COUNT])
+{
+    taskENTER_CRITICAL(&deadline_lock);
+    for(uint8_t i = 0; i < DEADLINE_COUNT; i++)
+        stats[i] = deadlines[i].stats;
+    taskEXIT_CRITICAL(&deadline_lock);
+}
+
+void supervisor_watch_task()
+{
+    esp_err_t ret = esp_task_wdt_add(NULL);
+    if(ret != ESP_OK)
+        ESP_LOGW(PROJ_NAME, "Task %s not watched: %s", pcTaskGetName(NULL), esp_err_to_name(ret));
+}
+
+void supervisor_feed()
+{
+    esp_task_wdt_reset();
+}
+
+static noreturn void supervisor_restart(enum Deadline deadline)
+{
+    ESP_LOGE(PROJ_NAME, "Deadline %u overdue by %u ms, restarting", deadline, SUPERVISOR_HANG_MS);
+    audit_log_event(AUDIT_EVT_HANG, AUDIT_SLOT_NONE, AUDIT_RES_FAIL, AUDIT_SOURCE_SYSTEM, deadline);
+    audit_flush_request();
+    vTaskDelayMSec(SUPERVISOR_RESTART_DELAY_MS);
+    esp_restart();
+}
+
+/*
+ * @brief Count overdue deadlines and restart on a hang
+ * @return Time until the next deadline check is due
+*/
+static TickType_t supervisor_check()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next = INT64_MAX;
+
+    for(uint8_t i = 0; i < DEADLINE_COUNT; i++) {
+        bool missed = false;
+        bool hung = false;
+
+        taskENTER_CRITICAL(&deadline_lock);
+        if(deadlines[i].started != 0) {
+            int64_t due = deadlines[i].started + deadlines[i].limit_us;
+            if(!deadlines[i].missed && now >= due) {
+                deadlines[i].missed = missed = true;
+                deadlines[i].stats.misses++;
+                deadlines[i].stats.last_miss = now / 1000000;
+            }
+            int64_t check = deadlines[i].missed ? due + SUPERVISOR_HANG_MS * 1000 : due;
+            hung = now >= check;
+            if(check < next)
+                next = check;
+        }
+        taskEXIT_CRITICAL(&deadline_lock);
+
+        if(missed)
+            ESP_LOGW(PROJ_NAME, "Deadline %u missed, still running", i);
+        if(hung)
+            supervisor_restart(i);
+    }
+
+    if(next == INT64_MAX)
+        return portMAX_DELAY;
+    return pdMS_TO_TICKS((next - now) / 1000) + 1;
+}
+
+noreturn void supervisor_task()
+{
+    supervisor_task_handle = xTaskGetCurrentTaskHandle();
+    supervisor_watch_task();
+
+    while(1) {
+        supervisor_feed();
+        ulTaskNotifyTake(pdTRUE, supervisor_wait(supervisor_check()));
+    }
+}
@@ -0,0 +1,282 @@
+/*
+ * @file main/uplink.c
+ *
+ * @proj imp-term
+ * @brief Batched upload of audit events and metrics to an MQTT broker
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include "config.h"
+
+#if UPLINK
+
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <mqtt_client.h>
+#include <nvs.h>
+
+#include "uplink.h"
+#include "net.h"
+#include "common.h"
+
+/*
+ * The audit log is the send queue: events are read back from the flash ring
+ * from the last position the broker acknowledged, so nothing on the access
+ * path waits for the network and an outage is buffered for as long as the
+ * ring holds (16k events). Once the ring laps the position, the oldest
+ * events are gone and the next batch says how many. One events message is
+ * in flight at a time and the next is only read once the broker has it, so
+ * the MQTT outbox never grows either. The position is saved to NVS every
+ * UPLINK_CURSOR_SAVE_SEC, after a restart the receiver sees the events
+ * since then twice and can drop them by their sequence number.
+*/
+
+#define UPLINK_TOPIC_LEN 48
+
+static esp_mqtt_client_handle_t client;
+static TaskHandle_t uplink_task_handle = NULL;
+static char events_topic[UPLINK_TOPIC_LEN];
+static char metrics_topic[UPLINK_TOPIC_LEN];
+static char status_topic[UPLINK_TOPIC_LEN];
+static char client_id[13]; // MAC address in hex
+
+// Written by the MQTT event handler, read by the uplink task
+static portMUX_TYPE uplink_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool connected = false;
+static int acked_msg_id = -1;
+static uint32_t reconnects = 0;
+
+// Private to the uplink task
+static uint32_t acked_seq = 0; // Newest event the broker has
+static uint32_t lost = 0;
+
+static void uplink_cursor_load()
+{
+    nvs_handle_t handle;
+    if(nvs_open(UPLINK_STORAGE_NAME, NVS_READWRITE, &handle) != ESP_OK)
+        return;
+    nvs_get_u32(handle, "acked_seq", &acked_seq);
+    nvs_close(handle);
+
+    // The audit partition was erased, its sequence numbers started over
+    if(acked_seq > audit_last_seq())
+        acked_seq = 0;
+}
+
+static void uplink_cursor_save()
+{
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(UPLINK_STORAGE_NAME, NVS_READWRITE, &handle);
+    if(ret == ESP_OK) {
+        ret = nvs_set_u32(handle, "acked_seq", acked_seq);
+        if(ret == ESP_OK)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if(ret != ESP_OK)
+        ESP_LOGE(PROJ_NAME, "Error saving uplink position: %s", esp_err_to_name(ret));
+}
+
+static void uplink_mqtt_event(void * arg, esp_event_base_t base, int32_t event_id, void * event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+
+    switch(event_id) {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(PROJ_NAME, "Uplink connected to %s", UPLINK_BROKER_URI);
+            esp_mqtt_client_publish(client, status_topic, "online", 0, 1, 1); // Replaces the last will
+            taskENTER_CRITICAL(&uplink_lock);
+            connected = true;
+            reconnects++;
+            taskEXIT_CRITICAL(&uplink_lock);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGW(PROJ_NAME, "Uplink disconnected, buffering events in the audit log");
+            taskENTER_CRITICAL(&uplink_lock);
+            connected = false;
+            taskEXIT_CRITICAL(&uplink_lock);
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            taskENTER_CRITICAL(&uplink_lock);
+            acked_msg_id = event->msg_id;
+            taskEXIT_CRITICAL(&uplink_lock);
+            break;
+        default:
+            return;
+    }
+    xTaskNotifyGive(uplink_task_handle);
+}
+
+static bool uplink_connected()
+{
+    taskENTER_CRITICAL(&uplink_lock);
+    bool ret = connected;
+    taskEXIT_CRITICAL(&uplink_lock);
+    return ret;
+}
+
+/*
+ * @brief Wait for the broker to acknowledge a message
+ * @return false on a timeout or a lost connection, the message is sent again
+*/
+static bool uplink_wait_ack(int msg_id)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    while(xTaskGetTickCount() - start < pdMS_TO_TICKS(UPLINK_ACK_TIMEOUT_MS)) {
+        taskENTER_CRITICAL(&uplink_lock);
+        bool acked = acked_msg_id == msg_id;
+        bool up = connected;
+        taskEXIT_CRITICAL(&uplink_lock);
+        if(acked)
+            return true;
+        if(!up)
+            return false;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UPLINK_POLL_MS));
+    }
+    ESP_LOGW(PROJ_NAME, "Uplink batch not acknowledged, sending it again");
+    return false;
+}
+
+/*
+ * @brief Send the events after the acknowledged position, one batch
+ * @return Events sent and acknowledged, 0 if none are in flash yet or the send failed
+*/
+static size_t uplink_send_batch()
+{
+    static uint8_t msg[sizeof(uplink_batch_header_t) + UPLINK_BATCH_RECORDS * sizeof(audit_record_t)];
+    uplink_batch_header_t * header = (uplink_batch_header_t *) msg;
+    audit_record_t * records = (audit_record_t *) (msg + sizeof(*header));
+
+    size_t count = audit_read(acked_seq + 1, records, UPLINK_BATCH_RECORDS);
+    if(count == 0) {
+        audit_flush_request(); // Still in RAM, sent on the next poll
+        return 0;
+    }
+
+    *header = (uplink_batch_header_t) {
+        .version = UPLINK_FORMAT_VERSION,
+        .count = count,
+        .lost = records[0].seq - (acked_seq + 1),
+    };
+    int msg_id = esp_mqtt_client_publish(client, events_topic, (const char *) msg,
+                                         sizeof(*header) + count * sizeof(audit_record_t), 1, 0);
+    if(msg_id < 0 || !uplink_wait_ack(msg_id))
+        return 0;
+
+    if(header->lost != 0)
+        ESP_LOGW(PROJ_NAME, "Uplink lost %lu events to the audit ring", (unsigned long) header->lost);
+    lost += header->lost;
+    acked_seq = records[count - 1].seq;
+    return count;
+}
+
+static void uplink_send_metrics()
+{
+    uplink_metrics_t metrics = {
+        .version = UPLINK_FORMAT_VERSION,
+        .uptime_sec = esp_timer_get_time() / 1000000,
+        .heap_free = esp_get_free_heap_size(),
+        .heap_min_free = esp_get_minimum_free_heap_size(),
+        .last_seq = audit_last_seq(),
+        .acked_seq = acked_seq,
+        .lost = lost,
+    };
+    deadline_stats_t deadlines[DEADLINE_COUNT];
+
+    taskENTER_CRITICAL(&uplink_lock);
+    metrics.reconnects = reconnects;
+    taskEXIT_CRITICAL(&uplink_lock);
+    deadline_get_stats(deadlines);
+    for(uint8_t i = 0; i < DEADLINE_COUNT; i++)
+        metrics.deadline_misses[i] = deadlines[i].misses;
+
+    esp_mqtt_client_publish(client, metrics_topic, (const char *) &metrics, sizeof(metrics), 0, 0);
+}
+
+static noreturn void uplink_task()
+{
+    int64_t pending_since = 0; // Oldest event waiting for its batch to fill, 0 if none
+    int64_t metrics_at = 0;
+    int64_t saved_at = esp_timer_get_time();
+    uint32_t saved_seq = acked_seq;
+
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UPLINK_POLL_MS));
+        if(!uplink_connected())
+            continue;
+        int64_t now = esp_timer_get_time();
+
+        if(now - metrics_at >= seconds(UPLINK_METRICS_INTERVAL_SEC) * 1000) {
+            uplink_send_metrics();
+            metrics_at = now;
+        }
+
+        // Full batches go right away (e.g. catching up after an outage), the rest waits a bit for company
+        uint32_t pending = audit_last_seq() - acked_seq;
+        if(pending == 0) {
+            pending_since = 0;
+        } else if(pending_since == 0) {
+            pending_since = now;
+        }
+        while(pending >= UPLINK_BATCH_RECORDS
+              || (pending > 0 && now - pending_since >= seconds(UPLINK_BATCH_DELAY_SEC) * 1000)) {
+            if(uplink_send_batch() == 0)
+                break;
+            pending = audit_last_seq() - acked_seq;
+            pending_since = pending > 0 ? esp_timer_get_time() : 0;
+        }
+
+        if(acked_seq != saved_seq && now - saved_at >= seconds(UPLINK_CURSOR_SAVE_SEC) * 1000) {
+            uplink_cursor_save();
+            saved_seq = acked_seq;
+            saved_at = now;
+        }
+    }
+}
+
+esp_err_t uplink_start()
+{
+    ESP_LOGI(PROJ_NAME, "Configuring uplink");
+
+    uint8_t mac[6];
+    ESP_RETURN_ON_ERROR(esp_efuse_mac_get_default(mac), PROJ_NAME, "Error reading MAC address");
+    snprintf(client_id, sizeof(client_id), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(events_topic, sizeof(events_topic), "%s/%s/events", UPLINK_TOPIC_PREFIX, client_id);
+    snprintf(metrics_topic, sizeof(metrics_topic), "%s/%s/metrics", UPLINK_TOPIC_PREFIX, client_id);
+    snprintf(status_topic, sizeof(status_topic), "%s/%s/status", UPLINK_TOPIC_PREFIX, client_id);
+    uplink_cursor_load();
+
+    ESP_RETURN_ON_ERROR(net_start(), PROJ_NAME, "Error starting network");
+
+    // The client keeps reconnecting on its own, until the network is up too
+    const esp_mqtt_client_config_t mqtt_config = {
+        .broker.address.uri = UPLINK_BROKER_URI,
+        .credentials.client_id = client_id,
+        .session.last_will = {
+            .topic = status_topic,
+            .msg = "offline",
+            .qos = 1,
+            .retain = 1,
+        },
+    };
+    client = esp_mqtt_client_init(&mqtt_config);
+    ESP_RETURN_ON_FALSE(client != NULL, ESP_ERR_NO_MEM, PROJ_NAME, "Error creating MQTT client");
+
+    if(task_create(&uplink_task, NULL, &uplink_task_handle, TASK_UPLINK) != pdPASS) {
+        ESP_LOGE(PROJ_NAME, "Failed to create uplink task");
+        abort();
+    }
+    ESP_RETURN_ON_ERROR(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, &uplink_mqtt_event, NULL), PROJ_NAME, "Error registering MQTT events");
+    ESP_LOGI(PROJ_NAME, "Uplink configured (%s, from seq %lu)", events_topic, (unsigned long) acked_seq + 1);
+    return esp_mqtt_client_start(client);
+}
+
+#endif // UPLINK
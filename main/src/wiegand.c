@@ -0,0 +1,177 @@
+/*
+ * @file main/wiegand.c
+ *
+ * @proj imp-term
+ * @brief Wiegand 26/34-bit card reader input
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+
+#include "config.h"
+#include "wiegand.h"
+#include "credential.h"
+#include "audit.h"
+#include "power.h"
+#include "gpio.h"
+#include "common.h"
+
+static_assert((WIEGAND_PULSE_BUF_LEN & (WIEGAND_PULSE_BUF_LEN - 1)) == 0, "Pulse buffer length must be a power of two");
+
+// One falling edge on D0 (bit 0) or D1 (bit 1)
+typedef struct {
+    uint32_t time_us;
+    uint8_t bit;
+} wiegand_pulse_t;
+
+// Single producer (ISR), single consumer (decoder task) ring
+static wiegand_pulse_t pulses[WIEGAND_PULSE_BUF_LEN];
+static volatile uint32_t pulse_head = 0;
+static volatile uint32_t pulse_tail = 0;
+
+static TaskHandle_t wiegand_task_handle;
+
+/*
+ * @brief Record a pulse with its timestamp, decoding is left to the task
+*/
+static void IRAM_ATTR wiegand_interrupt(void * arg)
+{
+    uint32_t head = pulse_head;
+    if(head - pulse_tail < WIEGAND_PULSE_BUF_LEN) { // Drop pulses on overflow, the frame fails parity
+        pulses[head % WIEGAND_PULSE_BUF_LEN] = (wiegand_pulse_t) {
+            .time_us = (uint32_t) esp_timer_get_time(),
+            .bit = (uint32_t) (uintptr_t) arg,
+        };
+        pulse_head = head + 1;
+    }
+
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(wiegand_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+esp_err_t wiegand_decode(uint64_t bits, uint8_t count, uint32_t * card)
+{
+    if(count != 26 && count != 34)
+        return ESP_ERR_INVALID_SIZE;
+
+    // Leading bit is even parity over the first half, trailing bit odd parity over the second half
+    uint8_t half = count / 2;
+    uint64_t first = bits >> half;
+    uint64_t second = bits & (BIT64(half) - 1);
+    if(__builtin_popcountll(first) % 2 != 0 || __builtin_popcountll(second) % 2 != 1)
+        return ESP_ERR_INVALID_CRC;
+
+    *card = (bits >> 1) & (BIT64(count - 2) - 1);
+    return ESP_OK;
+}
+
+bool wiegand_frame_pulse(wiegand_frame_t * frame, uint8_t bit, uint32_t time_us, wiegand_frame_t * done)
+{
+    bool completed = false;
+    uint32_t gap_us = time_us - frame->last_us;
+
+    if(frame->count > 0 && gap_us >= WIEGAND_FRAME_GAP_MS * 1000) {
+        *done = *frame; // Previous frame ended while the decoder was busy
+        *frame = (wiegand_frame_t) { 0 };
+        completed = true;
+    } else if(frame->count > 0 && gap_us < WIEGAND_MIN_BIT_GAP_US) {
+        return false; // Glitch or ringing on the line
+    }
+
+    frame->bits = frame->bits << 1 | bit;
+    if(frame->count < UINT8_MAX)
+        frame->count++;
+    frame->last_us = time_us;
+    return completed;
+}
+
+bool wiegand_frame_idle(wiegand_frame_t * frame, uint32_t now_us, wiegand_frame_t * done)
+{
+    if(frame->count == 0 || now_us - frame->last_us < WIEGAND_FRAME_GAP_MS * 1000)
+        return false;
+    *done = *frame;
+    *frame = (wiegand_frame_t) { 0 };
+    return true;
+}
+
+/*
+ * @brief Decode a complete frame and pass the card to the credential pipeline
+*/
+static void wiegand_frame_end(const wiegand_frame_t * frame)
+{
+    uint32_t card;
+    esp_err_t err = wiegand_decode(frame->bits, frame->count, &card);
+    if(err != ESP_OK) {
+        ESP_LOGW(PROJ_NAME, "Invalid Wiegand frame (%u bits): %s", frame->count, esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(PROJ_NAME, "Card read (%u bits), decoded %lu us after the last bit",
+             frame->count, (uint32_t) esp_timer_get_time() - frame->last_us);
+
+    credential_t credential = {
+        .type = CREDENTIAL_CARD,
+        .source = AUDIT_SOURCE_CARD,
+        .reader = 0,
+        .card = card,
+    };
+    if(credential_submit(&credential))
+        gpio_blink_twice_nonblocking(DOOR_OPEN_LED);
+    else
+        gpio_blink_twice_nonblocking(DOOR_CLOSED_LED);
+}
+
+static noreturn void wiegand_task()
+{
+    wiegand_frame_t frame = { 0 };
+    wiegand_frame_t done;
+
+    while(1) {
+        // Sleep until a pulse comes, or until the frame in progress has been idle long enough
+        TickType_t timeout = portMAX_DELAY;
+        if(frame.count > 0) {
+            uint32_t idle_ms = ((uint32_t) esp_timer_get_time() - frame.last_us) / 1000;
+            timeout = idle_ms < WIEGAND_FRAME_GAP_MS ? pdMS_TO_TICKS(WIEGAND_FRAME_GAP_MS - idle_ms) + 1 : 0;
+        }
+        ulTaskNotifyTake(pdTRUE, timeout);
+
+        while(pulse_tail != pulse_head) {
+            wiegand_pulse_t pulse = pulses[pulse_tail % WIEGAND_PULSE_BUF_LEN];
+            pulse_tail++;
+            if(wiegand_frame_pulse(&frame, pulse.bit, pulse.time_us, &done))
+                wiegand_frame_end(&done);
+        }
+
+        if(wiegand_frame_idle(&frame, (uint32_t) esp_timer_get_time(), &done))
+            wiegand_frame_end(&done);
+    }
+}
+
+esp_err_t wiegand_init()
+{
+    if(!WIEGAND_ENABLE)
+        return ESP_OK;
+
+    ESP_RETURN_ON_FALSE(task_create(&wiegand_task, NULL, &wiegand_task_handle, TASK_WIEGAND) == pdPASS,
+                        ESP_ERR_NO_MEM, PROJ_NAME, "Failed to create Wiegand task");
+
+    // Both lines idle high, the reader pulls one low for each bit
+    gpio_config_t conf = {
+        .pin_bit_mask = BIT64(WIEGAND_PIN_D0) | BIT64(WIEGAND_PIN_D1),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .intr_type = GPIO_INTR_NEGEDGE,
+    };
+    ESP_RETURN_ON_ERROR(gpio_config(&conf), PROJ_NAME, "Failed to configure Wiegand pins");
+    ESP_RETURN_ON_ERROR(gpio_isr_handler_add(WIEGAND_PIN_D0, &wiegand_interrupt, (void*) 0), PROJ_NAME, "Failed to add D0 ISR");
+    ESP_RETURN_ON_ERROR(gpio_isr_handler_add(WIEGAND_PIN_D1, &wiegand_interrupt, (void*) 1), PROJ_NAME, "Failed to add D1 ISR");
+
+    // Waking up from light sleep takes longer than a pulse
+    power_acquire(POWER_LOCK_READER);
+
+    ESP_LOGI(PROJ_NAME, "Wiegand reader ready");
+    return ESP_OK;
+}
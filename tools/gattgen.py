@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+#
+# @file tools/gattgen.py
+#
+# @proj imp-term
+# @brief Generate the NimBLE GATT table and the web client UUIDs/codecs from main/gatt.json
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   gattgen.py --schema main/gatt.json --c-out <dir>              -> gatt_schema.h, gatt_schema.c
+#   gattgen.py --schema main/gatt.json --js-out <file>            -> ES module
+#
+
+import argparse
+import json
+import os
+import re
+import sys
+
+HEADER = "Generated from main/gatt.json by tools/gattgen.py, do not edit"
+
+# type -> (fixed length or None)
+TYPES = {
+    "string": None,
+    "bytes": None,
+    "u8": 1,
+    "u16": 2,
+    "u32": 4,
+}
+
+WRITE_MODES = (None, "auth", "raw")
+
+
+def fail(msg):
+    sys.exit(f"gattgen: {msg}")
+
+
+def camel(name):
+    head, *rest = name.split("_")
+    return head + "".join(part.capitalize() for part in rest)
+
+
+def uuid_bytes_le(uuid):
+    if not re.fullmatch(r"[0-9a-f]{8}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{12}", uuid):
+        fail(f"invalid UUID {uuid}")
+    raw = bytes.fromhex(uuid.replace("-", ""))
+    return raw[::-1]
+
+
+def load(path):
+    with open(path) as f:
+        schema = json.load(f)
+
+    names = set()
+    uuids = set()
+    for ch in schema["characteristics"]:
+        name = ch["name"]
+        if not re.fullmatch(r"[a-z][a-z0-9_]*", name):
+            fail(f"invalid characteristic name {name}")
+        if name in names:
+            fail(f"duplicate characteristic name {name}")
+        if ch["uuid"] in uuids:
+            fail(f"duplicate UUID {ch['uuid']}")
+        names.add(name)
+        uuids.add(ch["uuid"])
+
+        if ch.get("type") not in TYPES:
+            fail(f"{name}: unknown type {ch.get('type')}")
+        if ch.get("write") not in WRITE_MODES:
+            fail(f"{name}: write must be one of {WRITE_MODES}")
+        if ch.get("no_rsp") and ch.get("write") != "raw":
+            fail(f"{name}: write without response cannot be authenticated")
+        if ch.get("http") and ch.get("write") != "auth":
+            fail(f"{name}: only authenticated writes are offered over HTTP")
+
+        fixed = TYPES[ch["type"]]
+        if fixed is not None:
+            ch.setdefault("min_len", fixed)
+            ch.setdefault("max_len", fixed)
+            if ch["min_len"] != fixed or ch["max_len"] != fixed:
+                fail(f"{name}: {ch['type']} is always {fixed} bytes")
+        ch.setdefault("min_len", 0)
+        ch.setdefault("max_len", 512)
+        if not 0 <= ch["min_len"] <= ch["max_len"] <= 512:
+            fail(f"{name}: invalid length range")
+    return schema
+
+
+def gen_c_header(schema):
+    out = [f"/* {HEADER} */",
+           "#ifndef GATT_SCHEMA_H",
+           "#define GATT_SCHEMA_H",
+           "",
+           "/* Includes */",
+           "#include <stdbool.h>",
+           "#include <stdint.h>",
+           '#include "host/ble_gatt.h"',
+           "",
+           "/* Characteristic descriptor, passed to the access callback as its argument */",
+           "typedef struct {",
+           "    const char *name;",
+           "    const uint8_t *uuid128; /* Least significant byte first, as admin write tags cover it */",
+           "    uint16_t min_len;",
+           "    uint16_t max_len;",
+           "    bool auth; /* Value carries an admin session trailer, see admin.h */",
+           "    int (*read)(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om);",
+           "    int (*write)(uint16_t conn_handle, uint16_t attr_handle, const uint8_t *value, uint16_t len);",
+           "    int (*write_raw)(uint16_t conn_handle, uint16_t attr_handle, const struct os_mbuf *om);",
+           "} gatt_chr_t;",
+           ""]
+
+    for ch in schema["characteristics"]:
+        upper = ch["name"].upper()
+        out.append(f"/* {ch['comment']} */")
+        out.append(f"#define GATT_{upper}_MIN_LEN {ch['min_len']}")
+        out.append(f"#define GATT_{upper}_MAX_LEN {ch['max_len']}")
+        out.append(f"extern uint16_t gatt_{ch['name']}_val_handle;")
+        out.append(f"extern const gatt_chr_t gatt_{ch['name']}_chr;")
+        if ch.get("read"):
+            out.append(f"int gatt_{ch['name']}_read(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om);")
+        if ch.get("write") == "auth":
+            out.append(f"int gatt_{ch['name']}_write(uint16_t conn_handle, uint16_t attr_handle, const uint8_t *value, uint16_t len);")
+        elif ch.get("write") == "raw":
+            out.append(f"int gatt_{ch['name']}_write_raw(uint16_t conn_handle, uint16_t attr_handle, const struct os_mbuf *om);")
+        out.append("")
+
+    http = [ch for ch in schema["characteristics"] if ch.get("http")]
+    out += ["/* Characteristics the HTTP server offers, their write handlers do not depend on the BLE connection */",
+            f"#define GATT_HTTP_CHR_COUNT {len(http)}",
+            "extern const gatt_chr_t *const gatt_http_chrs[GATT_HTTP_CHR_COUNT];",
+            "",
+            "/* Services table and its single access callback */",
+            "extern const struct ble_gatt_svc_def gatt_svr_svcs[];",
+            "int gatt_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle,",
+            "                       struct ble_gatt_access_ctxt *ctxt, void *arg);",
+            "",
+            "#endif // GATT_SCHEMA_H",
+            ""]
+    return "\n".join(out)
+
+
+def gen_c_source(schema):
+    svc = schema["service"]
+    out = [f"/* {HEADER} */",
+           '#include "gatt_schema.h"',
+           '#include "admin.h"',
+           "",
+           f"/* {svc['comment']} */",
+           f"static const ble_uuid16_t svc_uuid = BLE_UUID16_INIT({svc['uuid16']});",
+           ""]
+
+    for ch in schema["characteristics"]:
+        name = ch["name"]
+        raw = ", ".join(f"0x{b:02x}" for b in uuid_bytes_le(ch["uuid"]))
+        read = f"gatt_{name}_read" if ch.get("read") else "NULL"
+        write = f"gatt_{name}_write" if ch.get("write") == "auth" else "NULL"
+        write_raw = f"gatt_{name}_write_raw" if ch.get("write") == "raw" else "NULL"
+        out += [f"/* {ch['comment']} */",
+                f"uint16_t gatt_{name}_val_handle;",
+                f"static const ble_uuid128_t {name}_uuid =",
+                f"    BLE_UUID128_INIT({raw});",
+                f"const gatt_chr_t gatt_{name}_chr = {{",
+                f'    .name = "{name}",',
+                f"    .uuid128 = {name}_uuid.value,",
+                f"    .min_len = GATT_{name.upper()}_MIN_LEN,",
+                f"    .max_len = GATT_{name.upper()}_MAX_LEN,",
+                f"    .auth = {'true' if ch.get('write') == 'auth' else 'false'},",
+                f"    .read = {read},",
+                f"    .write = {write},",
+                f"    .write_raw = {write_raw},",
+                "};"]
+        if ch.get("write") == "auth":
+            # The access callback flattens authenticated writes into fixed buffers
+            out.append(f"_Static_assert(GATT_{name.upper()}_MAX_LEN <= ADMIN_MAX_PAYLOAD_LEN, "
+                       f'"{name}: max_len exceeds ADMIN_MAX_PAYLOAD_LEN");')
+        out.append("")
+
+    out.append("const gatt_chr_t *const gatt_http_chrs[GATT_HTTP_CHR_COUNT] = {")
+    out += [f"    &gatt_{ch['name']}_chr," for ch in schema["characteristics"] if ch.get("http")]
+    out += ["};",
+            ""]
+
+    out += ["/* GATT services table */",
+            "const struct ble_gatt_svc_def gatt_svr_svcs[] = {",
+            "    {",
+            "        .type = BLE_GATT_SVC_TYPE_PRIMARY,",
+            "        .uuid = &svc_uuid.u,",
+            "        .characteristics = (struct ble_gatt_chr_def[]){"]
+    for ch in schema["characteristics"]:
+        name = ch["name"]
+        flags = []
+        if ch.get("read"):
+            flags.append("BLE_GATT_CHR_F_READ")
+            if ch.get("encrypted"):
+                flags.append("BLE_GATT_CHR_F_READ_ENC")
+        if ch.get("write"):
+            flags.append("BLE_GATT_CHR_F_WRITE_NO_RSP" if ch.get("no_rsp") else "BLE_GATT_CHR_F_WRITE")
+            if ch.get("encrypted"):
+                # Stack rejects the write until the link is encrypted, which makes the client pair
+                flags.append("BLE_GATT_CHR_F_WRITE_ENC")
+        if ch.get("notify"):
+            flags.append("BLE_GATT_CHR_F_NOTIFY")
+        out += ["            {",
+                f"                .uuid = &{name}_uuid.u,",
+                "                .access_cb = gatt_chr_access_cb,",
+                f"                .arg = (void *) &gatt_{name}_chr,",
+                f"                .flags = {' | '.join(flags)},",
+                f"                .val_handle = &gatt_{name}_val_handle,",
+                "            },"]
+    out += ["            {0}, /* No more characteristics */",
+            "        },",
+            "    },",
+            "    {0}, /* No more services */",
+            "};",
+            ""]
+    return "\n".join(out)
+
+
+def gen_js(schema):
+    out = [f"// {HEADER}",
+           "",
+           "const textEncoder = new TextEncoder();",
+           "const textDecoder = new TextDecoder();",
+           "",
+           "const toBytes = (value) =>",
+           "  value instanceof Uint8Array ? value : new Uint8Array(value.buffer ?? value, value.byteOffset ?? 0, value.byteLength);",
+           "",
+           "const uint = (bytes, setter, getter, max) => ({",
+           "  encode: (value) => {",
+           "    if (!Number.isInteger(value) || value < 0 || value > max)",
+           "      throw new RangeError(`${value} does not fit in ${bytes} bytes`);",
+           "    let view = new DataView(new ArrayBuffer(bytes));",
+           "    view[setter](0, value, true);",
+           "    return new Uint8Array(view.buffer);",
+           "  },",
+           "  decode: (view) => view[getter](0, true),",
+           "});",
+           "",
+           "// Value codecs by schema type, all multi-byte numbers are little endian",
+           "const codecs = {",
+           "  string: { encode: (value) => textEncoder.encode(value), decode: (view) => textDecoder.decode(view) },",
+           "  bytes: { encode: toBytes, decode: (view) => toBytes(view) },",
+           "  u8: uint(1, 'setUint8', 'getUint8', 0xFF),",
+           "  u16: uint(2, 'setUint16', 'getUint16', 0xFFFF),",
+           "  u32: uint(4, 'setUint32', 'getUint32', 0xFFFFFFFF),",
+           "};",
+           "",
+           "// api is the path of the HTTP server route, for characteristics marked http",
+           "const characteristic = (name, uuid, type, minLen, maxLen, auth, api) => ({",
+           "  name, uuid, minLen, maxLen, auth, api,",
+           "  encode: (value) => {",
+           "    const bytes = codecs[type].encode(value);",
+           "    if (bytes.byteLength < minLen || bytes.byteLength > maxLen)",
+           "      throw new RangeError(`${name} must be ${minLen}-${maxLen} bytes long`);",
+           "    return bytes;",
+           "  },",
+           "  decode: codecs[type].decode,",
+           "});",
+           "",
+           f"export const impTermSvcUuid = {schema['service']['uuid16']};",
+           ""]
+    for ch in schema["characteristics"]:
+        name = camel(ch["name"])
+        auth = "true" if ch.get("write") == "auth" else "false"
+        api = f"'/api/{ch['name']}'" if ch.get("http") else "null"
+        out += [f"// {ch['comment']}",
+                f"export const {name}Chr = characteristic('{name}', '{ch['uuid']}', '{ch['type']}', "
+                f"{ch['min_len']}, {ch['max_len']}, {auth}, {api});",
+                f"export const {name}ChrUuid = {name}Chr.uuid;"]
+    out.append("")
+    return "\n".join(out)
+
+
+def write_if_changed(path, content):
+    # Keep timestamps stable so unchanged output does not trigger rebuilds
+    if os.path.exists(path):
+        with open(path) as f:
+            if f.read() == content:
+                return
+    with open(path, "w") as f:
+        f.write(content)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate GATT tables from main/gatt.json")
+    parser.add_argument("--schema", required=True)
+    parser.add_argument("--c-out", help="directory for gatt_schema.h and gatt_schema.c")
+    parser.add_argument("--js-out", help="path of the generated ES module")
+    args = parser.parse_args()
+
+    schema = load(args.schema)
+    if args.c_out:
+        os.makedirs(args.c_out, exist_ok=True)
+        write_if_changed(os.path.join(args.c_out, "gatt_schema.h"), gen_c_header(schema))
+        write_if_changed(os.path.join(args.c_out, "gatt_schema.c"), gen_c_source(schema))
+    if args.js_out:
+        write_if_changed(args.js_out, gen_js(schema))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+#
+# @file tools/http/http_bench.py
+#
+# @proj imp-term
+# @brief Boot an HTTP_SERVER image in QEMU and measure page loads and API throughput
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   http_bench.py --build build-http-qemu [--thresholds tools/http/thresholds.json] [--duration 10] [--clients 4]
+#
+# QEMU forwards host port 8080 to the terminal's port 80 over its Ethernet (openeth).
+# Measured like a browser would load the page: index.html, then the files it links,
+# six at a time, cold and revalidated (304). Then the API: GET /api/status from
+# several clients at once, and admin writes of the door duration one after another.
+# The metrics are written to <build>/http_bench.json, the exit code is nonzero on
+# a failed request, a page that does not unpack or a metric out of its thresholds.
+#
+
+import argparse
+import concurrent.futures
+import fnmatch
+import gzip
+import hashlib
+import hmac
+import http.client
+import json
+import os
+import re
+import statistics
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+FLASH_SIZE = "4MB"  # CONFIG_ESPTOOLPY_FLASHSIZE_4MB
+HOST_PORT = 8080
+READY_LINE = "HTTP server listening"
+BROWSER_CONNECTIONS = 6  # Per host, as browsers open
+ADMIN_PIN = "00000000"   # KEYPAD_DEFAULT_ADMIN_PIN
+ADMIN_TAG_LEN = 8
+SCHEMA = os.path.join(os.path.dirname(__file__), "..", "..", "main", "gatt.json")
+
+
+def fail(msg):
+    sys.exit(f"http_bench: {msg}")
+
+
+def merge_flash(build):
+    # QEMU boots from a whole flash image, esptool knows the offsets (www partition too) from flash_args
+    image = os.path.join(build, "flash.bin")
+    subprocess.run([sys.executable, "-m", "esptool", "--chip", "esp32", "merge_bin",
+                    "--fill-flash-size", FLASH_SIZE, "-o", "flash.bin", "@flash_args"],
+                   cwd=build, check=True)
+    return image
+
+
+def start_qemu(image, timeout):
+    cmd = ["qemu-system-xtensa", "-nographic", "-machine", "esp32",
+           "-drive", f"file={image},if=mtd,format=raw",
+           "-nic", f"user,model=open_eth,hostfwd=tcp::{HOST_PORT}-:80"]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True, errors="replace")
+    ready = threading.Event()
+
+    # Keep draining the console, a full pipe would stall the emulator
+    def console():
+        for line in proc.stdout:
+            print(line.rstrip())
+            if READY_LINE in line:
+                ready.set()
+    threading.Thread(target=console, daemon=True).start()
+
+    if not ready.wait(timeout):
+        proc.kill()
+        fail(f"server did not start within {timeout} s")
+    # DHCP of the QEMU network may still be running
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            request("GET", "/api/status")
+            return proc
+        except OSError:
+            time.sleep(0.5)
+    proc.kill()
+    fail(f"server not reachable on port {HOST_PORT} within {timeout} s")
+
+
+def request(method, path, body=None, headers=None, conn=None):
+    own = conn is None
+    if own:
+        conn = http.client.HTTPConnection("localhost", HOST_PORT, timeout=30)
+    try:
+        conn.request(method, path, body=body, headers=headers or {})
+        response = conn.getresponse()
+        return response.status, dict(response.getheaders()), response.read()
+    finally:
+        if own:
+            conn.close()
+
+
+def percentile(values, pct):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def page_load(etags=None):
+    """Load index.html and everything it links, return (ms, bytes, etags)"""
+    start = time.monotonic()
+    headers = {"Accept-Encoding": "gzip"}
+    if etags:
+        headers["If-None-Match"] = etags["/"]
+    status, response_headers, body = request("GET", "/", headers=headers)
+    if status not in (200, 304):
+        fail(f"GET / answered {status}")
+    total = len(body)
+    seen = {"/": response_headers.get("ETag")}
+    if status == 200:
+        html = gzip.decompress(body).decode()
+        assets = sorted(set(re.findall(r'(?:src|href)="(/[^"]+)"', html)))
+    else:
+        assets = [path for path in etags if path != "/"]
+
+    def fetch(path):
+        asset_headers = {"Accept-Encoding": "gzip"}
+        if etags and path in etags:
+            asset_headers["If-None-Match"] = etags[path]
+        status, response_headers, body = request("GET", path, headers=asset_headers)
+        if status not in (200, 304):
+            fail(f"GET {path} answered {status}")
+        if status == 200:
+            gzip.decompress(body)  # Fails on a broken file
+        return path, response_headers.get("ETag"), len(body)
+
+    with concurrent.futures.ThreadPoolExecutor(BROWSER_CONNECTIONS) as pool:
+        for path, etag, size in pool.map(fetch, assets):
+            seen[path] = etag
+            total += size
+    return (time.monotonic() - start) * 1000, total, seen
+
+
+def status_throughput(clients, duration):
+    latencies = []
+    codes = {}
+    lock = threading.Lock()
+    stop = time.monotonic() + duration
+
+    def client():
+        conn = http.client.HTTPConnection("localhost", HOST_PORT, timeout=30)
+        while time.monotonic() < stop:
+            start = time.monotonic()
+            status, _, _ = request("GET", "/api/status", conn=conn)
+            with lock:
+                latencies.append((time.monotonic() - start) * 1000)
+                codes[status] = codes.get(status, 0) + 1
+        conn.close()
+
+    threads = [threading.Thread(target=client) for _ in range(clients)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return latencies, codes
+
+
+def admin_session():
+    status, _, body = request("GET", "/api/login")
+    if status != 200:
+        fail(f"GET /api/login answered {status}")
+    login = json.loads(body)
+    challenge = bytes.fromhex(login["challenge"])
+    pin = ADMIN_PIN.encode()
+    response = hmac.new(pin, b"login" + challenge, hashlib.sha256).hexdigest()
+    status, _, _ = request("POST", "/api/login", json.dumps({"session": login["session"], "response": response}))
+    if status != 204:
+        fail(f"admin login answered {status}, is the admin PIN the default one?")
+    return login["session"], hmac.new(pin, b"session" + challenge, hashlib.sha256).digest()
+
+
+def write_throughput(duration):
+    with open(SCHEMA) as f:
+        chr_uuid = next(ch["uuid"] for ch in json.load(f)["characteristics"] if ch["name"] == "door_open_duration")
+    uuid = bytes.fromhex(chr_uuid.replace("-", ""))[::-1]
+    session, key = admin_session()
+    conn = http.client.HTTPConnection("localhost", HOST_PORT, timeout=30)
+    latencies = []
+    counter = 0
+    stop = time.monotonic() + duration
+    while time.monotonic() < stop:
+        counter += 1
+        payload = struct.pack("<H", 3 + counter % 2)  # Between two durations, each write changes NVS
+        trailer = struct.pack("<I", counter)
+        tag = hmac.new(key, uuid + trailer + payload, hashlib.sha256).digest()[:ADMIN_TAG_LEN]
+        body = json.dumps({"session": session, "value": (payload + trailer + tag).hex()})
+        start = time.monotonic()
+        status, _, _ = request("POST", "/api/door_open_duration", body, conn=conn)
+        latencies.append((time.monotonic() - start) * 1000)
+        if status != 204:
+            fail(f"door duration write answered {status}")
+    conn.close()
+    return latencies
+
+
+def check(metrics, thresholds):
+    failures = []
+    for pattern, limit in thresholds["limits"].items():
+        matched = [name for name in metrics if fnmatch.fnmatchcase(name, pattern)]
+        if not matched:
+            failures.append(f"{pattern}: not reported")
+        for name in matched:
+            value = metrics[name]
+            if "max" in limit and value > limit["max"]:
+                failures.append(f"{name}: {value} > {limit['max']}")
+            if "min" in limit and value < limit["min"]:
+                failures.append(f"{name}: {value} < {limit['min']}")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="QEMU HTTP server benchmark")
+    parser.add_argument("--build", required=True, help="build directory of an HTTP_SERVER=1 QEMU image")
+    parser.add_argument("--thresholds", help="limits of the metrics, as tools/http/thresholds.json")
+    parser.add_argument("--duration", type=int, default=10, help="seconds of each API run")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent API clients")
+    parser.add_argument("--timeout", type=int, default=60, help="seconds to wait for the server")
+    args = parser.parse_args()
+
+    thresholds = {"limits": {}}
+    if args.thresholds:
+        with open(args.thresholds) as f:
+            thresholds = json.load(f)
+
+    proc = start_qemu(merge_flash(args.build), args.timeout)
+    try:
+        cold_ms, cold_bytes, etags = page_load()
+        warm_ms, warm_bytes, _ = page_load(etags)
+        status_latencies, codes = status_throughput(args.clients, args.duration)
+        write_latencies = write_throughput(args.duration)
+    finally:
+        proc.kill()
+        proc.wait()
+
+    served = codes.get(200, 0)
+    metrics = {
+        "page.cold_ms": round(cold_ms),
+        "page.cold_bytes": cold_bytes,
+        "page.revalidated_ms": round(warm_ms),
+        "page.revalidated_bytes": warm_bytes,
+        "api.status.rps": round(served / args.duration, 1),
+        "api.status.p50_ms": round(statistics.median(status_latencies), 1),
+        "api.status.p99_ms": round(percentile(status_latencies, 99), 1),
+        "api.status.busy": codes.get(503, 0),
+        "api.write.rps": round(len(write_latencies) / args.duration, 1),
+        "api.write.p50_ms": round(statistics.median(write_latencies), 1),
+        "api.write.p99_ms": round(percentile(write_latencies, 99), 1),
+    }
+    with open(os.path.join(args.build, "http_bench.json"), "w") as f:
+        json.dump(metrics, f, indent=2, sort_keys=True)
+    for name, value in metrics.items():
+        print(f"HTTP {name} {value}")
+
+    errors = {code: count for code, count in codes.items() if code not in (200, 503)}
+    if errors:
+        fail(f"status requests failed: {errors}")
+    failures = check(metrics, thresholds)
+    for failure in failures:
+        print(f"http_bench: REGRESSION {failure}", file=sys.stderr)
+    if failures:
+        sys.exit(1)
+    if args.thresholds:
+        print(f"http_bench: {len(metrics)} metrics within thresholds")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# @file tools/perf/perf.py
+#
+# @proj imp-term
+# @brief Run a PERF_HOOKS firmware image in QEMU and check its report against thresholds
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   perf.py --build build-perf --thresholds tools/perf/thresholds.json
+#
+# The image prints "PERF <metric> <value>" lines (main/src/perf.c) and "PERF done" at the end.
+# The metrics are written to <build>/perf.json, the exit code is nonzero on a regression.
+#
+
+import argparse
+import fnmatch
+import json
+import os
+import subprocess
+import sys
+import time
+
+FLASH_SIZE = "4MB"  # CONFIG_ESPTOOLPY_FLASHSIZE_4MB
+
+
+def fail(msg):
+    sys.exit(f"perf: {msg}")
+
+
+def merge_flash(build):
+    # QEMU boots from a whole flash image, esptool knows the offsets from flash_args
+    image = os.path.join(build, "flash.bin")
+    subprocess.run([sys.executable, "-m", "esptool", "--chip", "esp32", "merge_bin",
+                    "--fill-flash-size", FLASH_SIZE, "-o", "flash.bin", "@flash_args"],
+                   cwd=build, check=True)
+    return image
+
+
+def run_qemu(image, timeout):
+    cmd = ["qemu-system-xtensa", "-nographic", "-machine", "esp32",
+           "-drive", f"file={image},if=mtd,format=raw"]
+    metrics = {}
+    errors = []
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True, errors="replace")
+    deadline = time.monotonic() + timeout
+    done = False
+    try:
+        for line in proc.stdout:
+            line = line.rstrip()
+            print(line)
+            if line.startswith("PERF "):
+                parts = line.split()
+                if parts[1] == "done":
+                    done = True
+                    break
+                if parts[1].startswith("error."):
+                    errors.append(parts[1])
+                metrics[parts[1]] = int(parts[2])
+            if time.monotonic() > deadline:
+                break
+    finally:
+        proc.kill()
+        proc.wait()
+    if not done:
+        fail(f"no complete report within {timeout} s")
+    return metrics, errors
+
+
+def check(metrics, thresholds):
+    failures = []
+    for pattern, limit in thresholds["limits"].items():
+        matched = [name for name in metrics if fnmatch.fnmatchcase(name, pattern)]
+        if not matched:
+            failures.append(f"{pattern}: not reported")
+        for name in matched:
+            value = metrics[name]
+            if "max" in limit and value > limit["max"]:
+                failures.append(f"{name}: {value} > {limit['max']}")
+            if "min" in limit and value < limit["min"]:
+                failures.append(f"{name}: {value} < {limit['min']}")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="QEMU performance regression check")
+    parser.add_argument("--build", required=True, help="build directory of a PERF_HOOKS=1 image")
+    parser.add_argument("--thresholds", required=True)
+    parser.add_argument("--timeout", type=int, default=120, help="seconds to wait for the report")
+    args = parser.parse_args()
+
+    with open(args.thresholds) as f:
+        thresholds = json.load(f)
+
+    metrics, errors = run_qemu(merge_flash(args.build), args.timeout)
+    with open(os.path.join(args.build, "perf.json"), "w") as f:
+        json.dump(metrics, f, indent=2, sort_keys=True)
+
+    failures = errors + check(metrics, thresholds)
+    for failure in failures:
+        print(f"perf: REGRESSION {failure}", file=sys.stderr)
+    if failures:
+        sys.exit(1)
+    print(f"perf: {len(metrics)} metrics within thresholds")
+
+
+if __name__ == "__main__":
+    main()
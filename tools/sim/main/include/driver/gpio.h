@@ -0,0 +1,44 @@
+/*
+ * @file tools/sim/main/include/driver/gpio.h
+ *
+ * @proj imp-term
+ * @brief Simulated GPIO driver, the part of the ESP-IDF API that the firmware uses outside main/gpio.c
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SIM_DRIVER_GPIO_H
+#define IMP_TERM_SIM_DRIVER_GPIO_H
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+typedef enum {
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_0, GPIO_NUM_1, GPIO_NUM_2, GPIO_NUM_3, GPIO_NUM_4, GPIO_NUM_5, GPIO_NUM_6, GPIO_NUM_7,
+    GPIO_NUM_8, GPIO_NUM_9, GPIO_NUM_10, GPIO_NUM_11, GPIO_NUM_12, GPIO_NUM_13, GPIO_NUM_14, GPIO_NUM_15,
+    GPIO_NUM_16, GPIO_NUM_17, GPIO_NUM_18, GPIO_NUM_19, GPIO_NUM_20, GPIO_NUM_21, GPIO_NUM_22, GPIO_NUM_23,
+    GPIO_NUM_24, GPIO_NUM_25, GPIO_NUM_26, GPIO_NUM_27, GPIO_NUM_28, GPIO_NUM_29, GPIO_NUM_30, GPIO_NUM_31,
+    GPIO_NUM_32, GPIO_NUM_33, GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_36, GPIO_NUM_37, GPIO_NUM_38, GPIO_NUM_39,
+    GPIO_NUM_MAX
+} gpio_num_t;
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Drive an output
+*/
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
+
+/*
+ * @brief Level of an output as last driven, or of a keypad row as set by the pressed key
+*/
+int gpio_get_level(gpio_num_t gpio_num);
+
+
+#endif // IMP_TERM_SIM_DRIVER_GPIO_H
@@ -0,0 +1,35 @@
+/*
+ * @file tools/sim/main/include/esp_task_wdt.h
+ *
+ * @proj imp-term
+ * @brief Simulated task watchdog, checked on the virtual clock by the simulator's monitor task
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SIM_ESP_TASK_WDT_H
+#define IMP_TERM_SIM_ESP_TASK_WDT_H
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <sdkconfig.h>
+
+// The linux target has no task watchdog options, same timeout as the firmware's sdkconfig.defaults
+#ifndef CONFIG_ESP_TASK_WDT_TIMEOUT_S
+#define CONFIG_ESP_TASK_WDT_TIMEOUT_S 5
+#endif
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @param task_handle Task to watch, NULL for the calling task
+*/
+esp_err_t esp_task_wdt_add(TaskHandle_t task_handle);
+
+esp_err_t esp_task_wdt_reset(void);
+
+
+#endif // IMP_TERM_SIM_ESP_TASK_WDT_H
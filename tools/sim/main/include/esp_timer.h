@@ -0,0 +1,64 @@
+/*
+ * @file tools/sim/main/include/esp_timer.h
+ *
+ * @proj imp-term
+ * @brief esp_timer on the virtual clock of the simulator, the calls the firmware makes
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Time is the FreeRTOS tick count, so it has the tick resolution and stands
+ * still while the firmware computes (see sim_clock.c). Callbacks run in the
+ * FreeRTOS timer task, as ESP_TIMER_TASK callbacks run in the esp_timer task.
+*/
+
+#ifndef IMP_TERM_SIM_ESP_TIMER_H
+#define IMP_TERM_SIM_ESP_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+typedef struct esp_timer * esp_timer_handle_t;
+
+typedef void (*esp_timer_cb_t)(void * arg);
+
+typedef enum {
+    ESP_TIMER_TASK
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void * arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char * name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+
+// EXPORTED SYMBOLS
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t * create_args, esp_timer_handle_t * out_handle);
+
+/*
+ * @return ESP_ERR_INVALID_STATE if the timer is already running
+*/
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+
+/*
+ * @return ESP_ERR_INVALID_STATE if the timer is not running
+*/
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+
+bool esp_timer_is_active(esp_timer_handle_t timer);
+
+/*
+ * @brief Virtual microseconds since boot
+*/
+int64_t esp_timer_get_time(void);
+
+
+#endif // IMP_TERM_SIM_ESP_TIMER_H
@@ -0,0 +1,2 @@
+/* NimBLE stand-in of the simulator, see sim_nimble.h */
+#include "sim_nimble.h"
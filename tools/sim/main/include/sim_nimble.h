@@ -0,0 +1,289 @@
+/*
+ * @file tools/sim/main/include/sim_nimble.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the part of the NimBLE host API that the firmware uses outside its GAP module
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The linux target has no NimBLE. The NimBLE headers the firmware includes all
+ * lead here; names and values are NimBLE's. The GATT table of gatt_svc.c is
+ * registered as on the device, the simulated admin client calls its access
+ * callback directly. There is no radio, so notifications report a missing
+ * connection (see sim_ble.c). The host tests implement the same declarations
+ * with a fake stack of their own (tools/test/main/test_ble.c).
+*/
+
+#ifndef IMP_TERM_SIM_NIMBLE_H
+#define IMP_TERM_SIM_NIMBLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <esp_err.h>
+#include <sdkconfig.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+// Without the bt component there are no NimBLE options, these are the firmware's (NimBLE default, sdkconfig.defaults)
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#endif
+#ifndef CONFIG_BT_NIMBLE_MAX_BONDS
+#define CONFIG_BT_NIMBLE_MAX_BONDS 8
+#endif
+
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+#define BLE_HS_ENOENT 5
+#define BLE_HS_ENOMEM 6
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_EMSGSIZE 4
+#define BLE_HS_ESTORE_CAP 27
+
+#define BLE_ATT_MTU_DFLT 23
+#define BLE_ATT_MTU_MAX 527
+
+#define BLE_ATT_ERR_WRITE_NOT_PERMITTED 0x03
+#define BLE_ATT_ERR_INSUFFICIENT_AUTHEN 0x05
+#define BLE_ATT_ERR_INVALID_OFFSET 0x07
+#define BLE_ATT_ERR_INSUFFICIENT_AUTHOR 0x08
+#define BLE_ATT_ERR_PREPARE_QUEUE_FULL 0x09
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN 0x0d
+#define BLE_ATT_ERR_UNLIKELY 0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_ENC 0x0f
+#define BLE_ATT_ERR_INSUFFICIENT_RES 0x11
+#define BLE_ATT_ERR_VALUE_NOT_ALLOWED 0x13
+
+#define BLE_HS_IO_NO_INPUT_OUTPUT 0x03
+#define BLE_SM_PAIR_KEY_DIST_ENC 0x01
+#define BLE_SM_PAIR_KEY_DIST_ID 0x02
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+static inline int ble_addr_cmp(const ble_addr_t * a, const ble_addr_t * b)
+{
+    int type_diff = a->type - b->type;
+    return type_diff != 0 ? type_diff : memcmp(a->val, b->val, sizeof(a->val));
+}
+
+struct ble_gap_sec_state {
+    unsigned encrypted:1;
+    unsigned authenticated:1;
+    unsigned bonded:1;
+    unsigned key_size:5;
+};
+
+struct ble_gap_conn_desc {
+    struct ble_gap_sec_state sec_state;
+    ble_addr_t peer_id_addr;
+    uint16_t conn_handle;
+    uint16_t conn_itvl;
+    uint16_t conn_latency;
+    uint16_t supervision_timeout;
+};
+
+struct ble_gap_upd_params {
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
+// A flat buffer, om_size is its capacity (NimBLE chains pool blocks instead)
+struct os_mbuf {
+    uint8_t * om_data;
+    uint16_t om_len;
+    uint16_t om_size;
+};
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+#define BLE_UUID_TYPE_16 16
+#define BLE_UUID_TYPE_128 128
+#define BLE_UUID_STR_LEN 37
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+#define BLE_UUID16_INIT(uuid16) { .u = { .type = BLE_UUID_TYPE_16 }, .value = (uuid16) }
+#define BLE_UUID128_INIT(uuid128...) { .u = { .type = BLE_UUID_TYPE_128 }, .value = { uuid128 } }
+
+#define BLE_GATT_ACCESS_OP_READ_CHR 0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR 1
+
+#define BLE_GATT_SVC_TYPE_PRIMARY 1
+
+#define BLE_GATT_CHR_F_READ 0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP 0x0004
+#define BLE_GATT_CHR_F_WRITE 0x0008
+#define BLE_GATT_CHR_F_NOTIFY 0x0010
+#define BLE_GATT_CHR_F_READ_ENC 0x0200
+#define BLE_GATT_CHR_F_WRITE_ENC 0x1000
+
+#define BLE_GATT_REGISTER_OP_SVC 1
+#define BLE_GATT_REGISTER_OP_CHR 2
+#define BLE_GATT_REGISTER_OP_DSC 3
+
+struct ble_gatt_access_ctxt {
+    uint8_t op;
+    struct os_mbuf * om;
+};
+
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt * ctxt, void * arg);
+
+struct ble_gatt_chr_def {
+    const ble_uuid_t * uuid;
+    ble_gatt_access_fn * access_cb;
+    void * arg;
+    uint16_t flags;
+    uint16_t * val_handle;
+};
+
+struct ble_gatt_dsc_def {
+    const ble_uuid_t * uuid;
+};
+
+struct ble_gatt_svc_def {
+    uint8_t type;
+    const ble_uuid_t * uuid;
+    const struct ble_gatt_chr_def * characteristics;
+};
+
+struct ble_gatt_register_ctxt {
+    uint8_t op;
+    union {
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_svc_def * svc_def;
+        } svc;
+        struct {
+            uint16_t def_handle;
+            uint16_t val_handle;
+            const struct ble_gatt_chr_def * chr_def;
+            const struct ble_gatt_svc_def * svc_def;
+        } chr;
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_dsc_def * dsc_def;
+        } dsc;
+    };
+};
+
+#define BLE_STORE_OBJ_TYPE_OUR_SEC 1
+#define BLE_STORE_OBJ_TYPE_PEER_SEC 2
+#define BLE_STORE_OBJ_TYPE_CCCD 3
+#define BLE_STORE_OBJ_TYPE_PEER_ADDR 4
+
+#define BLE_STORE_EVENT_OVERFLOW 1
+#define BLE_STORE_EVENT_FULL 2
+
+struct ble_store_value_cccd {
+    ble_addr_t peer_addr;
+    uint16_t chr_val_handle;
+    uint16_t flags;
+    unsigned value_changed:1;
+};
+
+union ble_store_value {
+    struct ble_store_value_cccd cccd;
+};
+
+struct ble_store_status_event {
+    int event_code;
+    union {
+        struct {
+            int obj_type;
+            const union ble_store_value * value;
+        } overflow;
+        struct {
+            int obj_type;
+            uint16_t conn_handle;
+        } full;
+    };
+};
+
+// Host configuration, filled in by main.c as on the device
+struct ble_hs_cfg {
+    void (*reset_cb)(int reason);
+    void (*sync_cb)(void);
+    void (*gatts_register_cb)(struct ble_gatt_register_ctxt * ctxt, void * arg);
+    void * gatts_register_arg;
+    int (*store_status_cb)(struct ble_store_status_event * event, void * arg);
+    void * store_status_arg;
+    uint8_t sm_io_cap;
+    unsigned sm_bonding:1;
+    unsigned sm_sc:1;
+    uint8_t sm_our_key_dist;
+    uint8_t sm_their_key_dist;
+};
+
+
+// EXPORTED SYMBOLS
+
+extern struct ble_hs_cfg ble_hs_cfg;
+
+esp_err_t nimble_port_init(void);
+
+/*
+ * @brief Host task body, runs the simulated BLE client instead of the host (see sim_ble.c)
+*/
+void nimble_port_run(void);
+
+int nimble_port_stop(void);
+
+/*
+ * @return 0, there is never a connection
+*/
+uint16_t ble_att_mtu(uint16_t conn_handle);
+
+/*
+ * @return NULL, notifications are the only users and there is no one to notify
+*/
+struct os_mbuf * ble_hs_mbuf_from_flat(const void * buf, uint16_t len);
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf * om, void * flat, uint16_t max_len, uint16_t * out_copy_len);
+int os_mbuf_append(struct os_mbuf * om, const void * data, uint16_t len);
+int os_mbuf_copydata(const struct os_mbuf * om, int off, int len, void * dst);
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf * om);
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc * out_desc);
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params * params);
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time);
+
+int ble_gap_unpair(const ble_addr_t * peer_addr);
+
+void ble_store_config_init(void);
+int ble_store_util_bonded_peers(ble_addr_t * out_peer_id_addrs, int * out_num_peers, int max_peers);
+int ble_store_util_delete_peer(const ble_addr_t * peer_id_addr);
+int ble_store_util_status_rr(struct ble_store_status_event * event, void * arg);
+int ble_store_clear(void);
+
+void ble_svc_gatt_init(void);
+
+/*
+ * @brief Give the characteristics their value handles and report them to ble_hs_cfg.gatts_register_cb
+*/
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def * defs);
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def * svcs);
+
+char * ble_uuid_to_str(const ble_uuid_t * uuid, char * dst);
+
+
+#endif // IMP_TERM_SIM_NIMBLE_H
@@ -0,0 +1,330 @@
+/*
+ * @file tools/sim/main/sim.c
+ *
+ * @proj imp-term
+ * @brief Whole-firmware simulator: boots the firmware on the linux target and sends people to the door for weeks
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The firmware's app_main() runs unchanged, the link wraps it (see CMakeLists.txt)
+ * to start the virtual clock first and the traffic after it. People arrive at
+ * random, type the access PIN (sometimes wrong) and wait for the door to lock
+ * again; the admin client in sim_ble.c changes the PIN meanwhile, through the
+ * GATT table. At the end,
+ * one JSON document goes to stdout and the exit status tells whether the run
+ * found anything wrong.
+*/
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "config.h"
+#include "gpio.h"
+#include "keypad.h"
+#include "supervisor.h"
+#include "common.h"
+#include "sim.h"
+
+sim_options_t sim_options;
+
+static struct {
+    uint32_t visits;
+    uint32_t keys;
+    uint32_t valid;           // Correct PINs typed
+    uint32_t denied;          // Correct PINs that did not unlock
+    uint32_t invalid;         // Wrong PINs typed
+    uint32_t invalid_granted; // Wrong PINs that unlocked
+    uint32_t opens;
+    uint32_t closes;
+    uint32_t pin_rotations;
+    uint32_t ble_operations;  // Reads and writes of the admin client through the GATT table
+    uint32_t ble_failures;
+    int64_t unlocked_us;      // Virtual time of the last unlock
+
+    uint32_t latency_len;
+    uint32_t latency_ms[SIM_MAX_SAMPLES]; // Submit key pressed to door unlocked
+
+    bool baseline_taken;
+    size_t heap_baseline;
+    size_t heap_peak;
+    UBaseType_t tasks_baseline;
+} stats;
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t visit_mutex;
+static char access_pin[KEYPAD_PIN_MAX_LEN + 1] = KEYPAD_DEFAULT_ACCESS_PIN;
+static unsigned int rand_state;
+
+static const char * deadline_names[DEADLINE_COUNT] = {
+    [DEADLINE_KEY] = "key", [DEADLINE_DOOR_EVENT] = "door_event", [DEADLINE_DOOR_CLOSE] = "door_close",
+};
+
+// mallinfo2() only counts the main arena, keep the allocations of every task (thread) there
+static void __attribute__((constructor)) sim_single_arena()
+{
+    mallopt(M_ARENA_MAX, 1);
+}
+
+static size_t heap_in_use()
+{
+    return mallinfo2().uordblks;
+}
+
+static uint32_t env_u32(const char * name, uint32_t fallback)
+{
+    const char * value = getenv(name);
+    return value != NULL && *value != '\0' ? strtoul(value, NULL, 10) : fallback;
+}
+
+uint32_t sim_rand()
+{
+    return rand_r(&rand_state);
+}
+
+void sim_visit_lock()
+{
+    xSemaphoreTake(visit_mutex, portMAX_DELAY);
+}
+
+void sim_visit_unlock()
+{
+    xSemaphoreGive(visit_mutex);
+}
+
+void sim_access_pin_changed(const char * pin)
+{
+    snprintf(access_pin, sizeof(access_pin), "%s", pin);
+    taskENTER_CRITICAL(&stats_lock);
+    stats.pin_rotations++;
+    taskEXIT_CRITICAL(&stats_lock);
+}
+
+void sim_ble_result(const char * operation, int rc)
+{
+    if(rc != 0)
+        fprintf(stderr, "Admin client: %s failed with %d\n", operation, rc);
+    taskENTER_CRITICAL(&stats_lock);
+    stats.ble_operations++;
+    stats.ble_failures += rc != 0;
+    taskEXIT_CRITICAL(&stats_lock);
+}
+
+void sim_lock_changed(bool open)
+{
+    taskENTER_CRITICAL(&stats_lock);
+    if(open) {
+        stats.opens++;
+        stats.unlocked_us = esp_timer_get_time();
+    } else {
+        stats.closes++;
+    }
+    taskEXIT_CRITICAL(&stats_lock);
+}
+
+static int compare_u32(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile_ms(uint8_t percent)
+{
+    return stats.latency_len ? stats.latency_ms[(stats.latency_len - 1) * percent / 100] : 0;
+}
+
+void sim_finish(const char * restart)
+{
+    deadline_stats_t deadlines[DEADLINE_COUNT];
+    deadline_get_stats(deadlines);
+    size_t heap_end = heap_in_use();
+    UBaseType_t tasks_end = uxTaskGetNumberOfTasks();
+    int32_t power_locks = sim_power_locks_held();
+    int64_t virtual_us = esp_timer_get_time();
+    int64_t real_us = sim_clock_real_us();
+
+    vTaskSuspendAll(); // The report is read from a frozen firmware
+    qsort(stats.latency_ms, stats.latency_len, sizeof(stats.latency_ms[0]), compare_u32);
+
+    uint32_t misses = 0;
+    for(uint8_t d = 0; d < DEADLINE_COUNT; d++)
+        misses += deadlines[d].misses;
+    int64_t heap_growth = stats.baseline_taken ? (int64_t) heap_end - stats.heap_baseline : 0;
+    bool ok = restart == NULL && stats.denied == 0 && stats.invalid_granted == 0 && misses == 0 && stats.ble_failures == 0
+              && percentile_ms(100) <= sim_options.max_unlock_ms
+              && heap_growth <= sim_options.max_heap_growth && power_locks == 0
+              && (!stats.baseline_taken || tasks_end == stats.tasks_baseline);
+
+    printf("{\n  \"simulated_days\": %.2f,\n  \"real_s\": %.1f,\n  \"speedup\": %.0f,\n",
+           virtual_us / 86400e6, real_us / 1e6, real_us > 0 ? (double) virtual_us / real_us : 0);
+    printf("  \"restart\": %s%s%s,\n", restart ? "\"" : "", restart ? restart : "null", restart ? "\"" : "");
+    printf("  \"visits\": %" PRIu32 ",\n  \"keys\": %" PRIu32 ",\n  \"key_queue_overflows\": %" PRIu32 ",\n",
+           stats.visits, stats.keys, sim_gpio_overflows());
+    printf("  \"pins\": {\"valid\": %" PRIu32 ", \"denied\": %" PRIu32 ", \"invalid\": %" PRIu32 ", \"invalid_granted\": %" PRIu32 "},\n",
+           stats.valid, stats.denied, stats.invalid, stats.invalid_granted);
+    printf("  \"pin_rotations\": %" PRIu32 ",\n  \"door\": {\"opens\": %" PRIu32 ", \"closes\": %" PRIu32 "},\n",
+           stats.pin_rotations, stats.opens, stats.closes);
+    printf("  \"ble\": {\"load_pct\": %" PRIu32 ", \"operations\": %" PRIu32 ", \"failures\": %" PRIu32 "},\n",
+           sim_options.ble_load_pct, stats.ble_operations, stats.ble_failures);
+    printf("  \"unlock_latency_ms\": {\"samples\": %" PRIu32 ", \"p50\": %" PRIu32 ", \"p90\": %" PRIu32 ", \"p99\": %" PRIu32 ", \"max\": %" PRIu32 "},\n",
+           stats.latency_len, percentile_ms(50), percentile_ms(90), percentile_ms(99), percentile_ms(100));
+    printf("  \"deadlines\": {");
+    for(uint8_t d = 0; d < DEADLINE_COUNT; d++)
+        printf("\"%s\": {\"misses\": %" PRIu32 ", \"worst_us\": %" PRIu32 "}%s", deadline_names[d],
+               deadlines[d].misses, deadlines[d].worst_us, d + 1 < DEADLINE_COUNT ? ", " : "");
+    printf("},\n");
+    printf("  \"heap\": {\"baseline\": %zu, \"end\": %zu, \"peak\": %zu, \"growth\": %" PRId64 "},\n",
+           stats.heap_baseline, heap_end, stats.heap_peak, heap_growth);
+    printf("  \"tasks\": {\"baseline\": %u, \"end\": %u},\n", (unsigned) stats.tasks_baseline, (unsigned) tasks_end);
+    printf("  \"power_locks_held\": %" PRId32 ",\n", power_locks);
+    printf("  \"ok\": %s\n}\n", ok ? "true" : "false");
+    fflush(stdout);
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void __wrap_esp_restart(void)
+{
+    sim_finish("supervisor"); // A restart would hide what led to it, end the run instead
+}
+
+/*
+ * @brief One person at the door: waits for it to lock, types a PIN and waits for the result
+*/
+static void sim_visit()
+{
+    while(is_door_open())
+        vTaskDelayMSec(100);
+
+    uint8_t keypad = sim_rand() % KEYPAD_COUNT;
+    bool valid = sim_rand() % 100 >= sim_options.wrong_pin_pct;
+    char keys[KEYPAD_PIN_MAX_LEN + 2];
+    snprintf(keys, sizeof(keys), "%s%c", access_pin, KEYPAD_PIN_SUBMIT_KEY);
+    if(!valid)
+        keys[0] = keys[0] == '9' ? '0' : keys[0] + 1; // One digit off
+
+    taskENTER_CRITICAL(&stats_lock);
+    uint32_t opens_before = stats.opens;
+    taskEXIT_CRITICAL(&stats_lock);
+
+    int64_t submitted_us = 0;
+    for(const char * key = keys; *key; key++) {
+        submitted_us = esp_timer_get_time();
+        sim_gpio_press(keypad, *key, sim_options.bounces, SIM_KEY_PRESS_MS);
+        if(key[1] != '\0')
+            vTaskDelayMSec((SIM_KEY_GAP_MIN_MS + sim_rand() % (SIM_KEY_GAP_MAX_MS - SIM_KEY_GAP_MIN_MS + 1)));
+    }
+
+    bool granted = false;
+    int64_t unlocked_us = 0;
+    while(!granted && esp_timer_get_time() - submitted_us < SIM_UNLOCK_TIMEOUT_MS * 1000) {
+        vTaskDelay(1);
+        taskENTER_CRITICAL(&stats_lock);
+        granted = stats.opens != opens_before;
+        unlocked_us = stats.unlocked_us;
+        taskEXIT_CRITICAL(&stats_lock);
+    }
+
+    taskENTER_CRITICAL(&stats_lock);
+    stats.visits++;
+    stats.keys += strlen(keys);
+    if(valid) {
+        stats.valid++;
+        if(!granted)
+            stats.denied++;
+        else if(stats.latency_len < SIM_MAX_SAMPLES)
+            stats.latency_ms[stats.latency_len++] = (unlocked_us - submitted_us) / 1000;
+    } else {
+        stats.invalid++;
+        stats.invalid_granted += granted;
+    }
+    taskEXIT_CRITICAL(&stats_lock);
+
+    // The LEDs show the failure, the person tries again only after the security delay
+    if(!granted)
+        vTaskDelaySec((KEYPAD_SECURITY_DELAY_SEC + 1));
+}
+
+static void sim_visitors_task(void * param)
+{
+    const int64_t end_us = (int64_t) sim_options.days * 86400 * 1000000;
+
+    while(esp_timer_get_time() < end_us) {
+        vTaskDelayMSec((sim_rand() % (2 * sim_options.visit_interval_sec * 1000 + 1))); // Uniform around the mean
+
+        if(!stats.baseline_taken && esp_timer_get_time() >= (int64_t) SIM_WARMUP_SEC * 1000000) {
+            vTaskDelaySec(SIM_SETTLE_SEC);
+            stats.heap_baseline = stats.heap_peak = heap_in_use();
+            stats.tasks_baseline = uxTaskGetNumberOfTasks();
+            stats.baseline_taken = true;
+        }
+
+        sim_visit_lock();
+        sim_visit();
+        sim_visit_unlock();
+    }
+
+    vTaskDelaySec(SIM_SETTLE_SEC);
+    sim_finish(NULL);
+}
+
+static void sim_monitor_task(void * param)
+{
+    while(1) {
+        vTaskDelaySec(1);
+        const char * starved = sim_wdt_starved();
+        if(starved != NULL) {
+            fprintf(stderr, "Task watchdog: %s did not feed it\n", starved);
+            sim_finish("task_wdt"); // CONFIG_ESP_TASK_WDT_PANIC in the firmware's sdkconfig.defaults
+        }
+        if(stats.baseline_taken) {
+            size_t heap = heap_in_use();
+            if(heap > stats.heap_peak)
+                stats.heap_peak = heap;
+        }
+    }
+}
+
+void __real_app_main(void);
+
+void __wrap_app_main(void)
+{
+    sim_options.days = env_u32("SIM_DAYS", SIM_DEFAULT_DAYS);
+    sim_options.speed = env_u32("SIM_SPEED", SIM_DEFAULT_SPEED);
+    sim_options.visit_interval_sec = env_u32("SIM_VISIT_INTERVAL_SEC", SIM_DEFAULT_VISIT_INTERVAL_SEC);
+    sim_options.wrong_pin_pct = env_u32("SIM_WRONG_PIN_PCT", SIM_DEFAULT_WRONG_PIN_PCT);
+    sim_options.bounces = env_u32("SIM_BOUNCES", SIM_DEFAULT_BOUNCES);
+    sim_options.pin_rotate_hours = env_u32("SIM_PIN_ROTATE_HOURS", SIM_DEFAULT_PIN_ROTATE_HOURS);
+    sim_options.max_heap_growth = env_u32("SIM_MAX_HEAP_GROWTH", SIM_DEFAULT_MAX_HEAP_GROWTH);
+    sim_options.ble_load_pct = env_u32("SIM_BLE_LOAD_PCT", SIM_DEFAULT_BLE_LOAD_PCT);
+    sim_options.max_unlock_ms = env_u32("SIM_MAX_UNLOCK_MS", SIM_DEFAULT_MAX_UNLOCK_MS);
+    sim_options.seed = env_u32("SIM_SEED", SIM_DEFAULT_SEED);
+    if(sim_options.days == 0 || sim_options.days > SIM_MAX_DAYS || sim_options.visit_interval_sec == 0
+       || sim_options.wrong_pin_pct > 100 || sim_options.bounces > UINT8_MAX || sim_options.pin_rotate_hours == 0
+       || sim_options.ble_load_pct > 100) {
+        fprintf(stderr, "SIM_DAYS must be 1-%u, SIM_VISIT_INTERVAL_SEC and SIM_PIN_ROTATE_HOURS at least 1, "
+                "SIM_WRONG_PIN_PCT and SIM_BLE_LOAD_PCT at most 100 and SIM_BOUNCES at most 255\n", SIM_MAX_DAYS);
+        exit(EXIT_FAILURE);
+    }
+    rand_state = sim_options.seed;
+
+    // stdout carries the report, SIM_LOG=3 shows the firmware's info logs on it too
+    esp_log_level_set("*", env_u32("SIM_LOG", ESP_LOG_NONE));
+    visit_mutex = xSemaphoreCreateMutex();
+    sim_clock_start(sim_options.speed);
+
+    __real_app_main();
+
+    if(task_create(&sim_monitor_task, NULL, NULL, TASK_SIM_MONITOR) != pdPASS
+       || task_create(&sim_visitors_task, NULL, NULL, TASK_SIM_VISITORS) != pdPASS) {
+        fprintf(stderr, "Failed to create simulator tasks\n");
+        exit(EXIT_FAILURE);
+    }
+}
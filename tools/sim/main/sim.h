@@ -0,0 +1,145 @@
+/*
+ * @file tools/sim/main/sim.h
+ *
+ * @proj imp-term
+ * @brief Whole-firmware simulator on the linux target, shared between its backends
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_SIM_H
+#define IMP_TERM_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+// CONFIGURABLE OPTIONS
+
+// Defaults of the SIM_* environment variables
+#define SIM_DEFAULT_DAYS 14               // Simulated time the traffic runs for
+#define SIM_DEFAULT_SPEED 0               // Virtual seconds per real second at most, 0 as fast as the host allows
+#define SIM_DEFAULT_VISIT_INTERVAL_SEC 120 // Mean time between two people at the door
+#define SIM_DEFAULT_WRONG_PIN_PCT 5       // People who mistype their PIN
+#define SIM_DEFAULT_BOUNCES 2             // Extra row edges per key press from a bouncing contact
+#define SIM_DEFAULT_PIN_ROTATE_HOURS 24   // The access PIN is changed over BLE this often
+#define SIM_DEFAULT_MAX_HEAP_GROWTH 4096  // Bytes the heap may grow between the warmup and the end
+#define SIM_DEFAULT_BLE_LOAD_PCT 0        // Share of the time the NimBLE host task is busy serving a peer
+#define SIM_DEFAULT_MAX_UNLOCK_MS 100     // Slowest unlock after the submit key that still passes
+#define SIM_DEFAULT_SEED 1
+
+#define SIM_MAX_DAYS 365 // The 32-bit tick count wraps after 497 days at 100 Hz
+#define SIM_WARMUP_SEC 3600 // Traffic before the heap baseline, first use allocations are not leaks
+#define SIM_SETTLE_SEC 60 // Quiet time before a heap reading, blink and door tasks are gone by then
+#define SIM_KEY_PRESS_MS 80
+#define SIM_KEY_GAP_MIN_MS 150 // Pause between releasing a key and pressing the next one
+#define SIM_KEY_GAP_MAX_MS 500
+#define SIM_UNLOCK_TIMEOUT_MS 2000 // A valid PIN that does not unlock within this counts as denied
+#define SIM_BLE_LOAD_PERIOD_MS 200 // SIM_BLE_LOAD_PCT of each period is spent serving reads, without blocking
+#define SIM_MAX_SAMPLES 100000 // Unlock latencies kept for the percentiles
+#define SIM_EPOCH 1704067200 // Wall clock at boot, 2024-01-01 00:00 UTC
+#define SIM_MIN_STACK_SIZE (16 * 1024) // Tasks are host threads, glibc needs more stack than the device code
+#define SIM_WDT_MAX_TASKS 8
+
+//                          name            stack   prio core
+#define TASK_SIM_MONITOR    "sim_monitor",  4*1024, 13,  TASK_CORE_ANY // Watchdog and heap samples, above all firmware tasks
+#define TASK_SIM_VISITORS   "sim_visitors", 4*1024, 12,  TASK_CORE_ACCESS // Key presses are interrupts, they come whatever the firmware runs
+
+
+// CONVENIENCE DEFINITIONS
+
+typedef struct {
+    uint32_t days;
+    uint32_t speed;
+    uint32_t visit_interval_sec;
+    uint32_t wrong_pin_pct;
+    uint32_t bounces;
+    uint32_t pin_rotate_hours;
+    uint32_t max_heap_growth;
+    uint32_t ble_load_pct;
+    uint32_t max_unlock_ms;
+    uint32_t seed;
+} sim_options_t;
+
+
+// EXPORTED SYMBOLS
+
+extern sim_options_t sim_options;
+
+/*
+ * @brief Pseudo-random number from the SIM_SEED sequence
+*/
+uint32_t sim_rand();
+
+/*
+ * @brief Keep PIN changes over BLE from happening while someone types the PIN
+*/
+void sim_visit_lock();
+void sim_visit_unlock();
+
+/*
+ * @brief The access PIN was changed over BLE, people type the new one from now on
+*/
+void sim_access_pin_changed(const char * pin);
+
+/*
+ * @brief Record the outcome of one operation of the simulated admin client, nonzero fails the run
+*/
+void sim_ble_result(const char * operation, int rc);
+
+/*
+ * @brief The door task locked or unlocked the door
+*/
+void sim_lock_changed(bool open);
+
+/*
+ * @brief Print the report and end the run
+ * @param restart Why the firmware asked for a restart, NULL at the end of the traffic
+*/
+void sim_finish(const char * restart);
+
+/*
+ * @brief Start the virtual clock
+ * @param speed Virtual seconds per real second at most, 0 for no limit
+*/
+void sim_clock_start(uint32_t speed);
+
+/*
+ * @brief Real microseconds since sim_clock_start()
+*/
+int64_t sim_clock_real_us();
+
+/*
+ * @brief Keep the CPU busy for a stretch of virtual time without blocking
+ *
+ * The clock moves on one tick at a time and tasks of a higher priority that
+ * wake meanwhile preempt the caller, as they would a task computing on the device.
+*/
+void sim_clock_busy(uint32_t ms);
+
+/*
+ * @brief Press a key like a person would, the contact bounces and is held for a while
+ * @return Edges that did not fit the keypad queue, -1 if the keypad has no such key
+*/
+int sim_gpio_press(uint8_t keypad, char key, uint8_t bounces, uint32_t press_ms);
+
+/*
+ * @brief Edges dropped by a full keypad queue since boot
+*/
+uint32_t sim_gpio_overflows();
+
+/*
+ * @brief Holds of all power management locks, the firmware drops them all when idle
+*/
+int32_t sim_power_locks_held();
+
+/*
+ * @brief Find a watched task that has not fed the task watchdog for CONFIG_ESP_TASK_WDT_TIMEOUT_S
+ * @return Task name or NULL
+*/
+const char * sim_wdt_starved();
+
+
+#endif // IMP_TERM_SIM_H
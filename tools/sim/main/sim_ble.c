@@ -0,0 +1,372 @@
+/*
+ * @file tools/sim/main/sim_ble.c
+ *
+ * @proj imp-term
+ * @brief Simulated BLE: the NimBLE stand-in and an admin client changing the config over time
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * main.c brings BLE up as on the device and gatt_svc.c registers its table; the
+ * stack underneath is empty and the NimBLE host task runs the admin client
+ * instead. The client logs in and writes like the web client does, through
+ * gatt_chr_access_cb(), so the schema checks, admin.c and the handlers all run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/md.h>
+
+#include "config.h"
+#include "storage.h"
+#include "audit.h"
+#include "ota.h"
+#include "admin.h"
+#include "phone.h"
+#include "common.h"
+#include "gap.h"
+#include "gatt_svc.h"
+#include "gatt_schema.h"
+#include "power.h"
+#include "sim.h"
+
+#define SIM_CONN_HANDLE 1 // Connection of the admin client
+
+struct ble_hs_cfg ble_hs_cfg;
+
+esp_err_t nimble_port_init(void)
+{
+    return ESP_OK;
+}
+
+int nimble_port_stop(void)
+{
+    return 0;
+}
+
+void ble_store_config_init(void)
+{
+}
+
+int gap_init(void)
+{
+    return 0;
+}
+
+void adv_init(void)
+{
+}
+
+void ble_svc_gatt_init(void)
+{
+}
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def * defs)
+{
+    return 0;
+}
+
+static const struct ble_gatt_svc_def * sim_svcs;
+
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def * svcs)
+{
+    sim_svcs = svcs; // Registered once the host starts, as NimBLE does
+    return 0;
+}
+
+/*
+ * @brief Hand out attribute handles and report them to gatts_register_cb, as the host does on startup
+*/
+static void sim_gatts_start()
+{
+    uint16_t handle = 1;
+
+    // Handles are laid out as NimBLE does: service, then declaration and value of each characteristic
+    for(const struct ble_gatt_svc_def * svc = sim_svcs; svc->type != 0; svc++) {
+        struct ble_gatt_register_ctxt ctxt = { .op = BLE_GATT_REGISTER_OP_SVC, .svc = { handle++, svc } };
+        ble_hs_cfg.gatts_register_cb(&ctxt, ble_hs_cfg.gatts_register_arg);
+        for(const struct ble_gatt_chr_def * chr = svc->characteristics; chr->uuid != NULL; chr++) {
+            *chr->val_handle = handle + 1;
+            ctxt = (struct ble_gatt_register_ctxt) { .op = BLE_GATT_REGISTER_OP_CHR, .chr = { handle, handle + 1, chr, svc } };
+            ble_hs_cfg.gatts_register_cb(&ctxt, ble_hs_cfg.gatts_register_arg);
+            handle += 2;
+        }
+    }
+}
+
+char * ble_uuid_to_str(const ble_uuid_t * uuid, char * dst)
+{
+    if(uuid->type == BLE_UUID_TYPE_16) {
+        snprintf(dst, BLE_UUID_STR_LEN, "0x%04x", ((const ble_uuid16_t *) uuid)->value);
+    } else {
+        const uint8_t * u = ((const ble_uuid128_t *) uuid)->value;
+        snprintf(dst, BLE_UUID_STR_LEN, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                 u[15], u[14], u[13], u[12], u[11], u[10], u[9], u[8], u[7], u[6], u[5], u[4], u[3], u[2], u[1], u[0]);
+    }
+    return dst;
+}
+
+esp_err_t ota_init()
+{
+    return ESP_OK;
+}
+
+noreturn void ota_flash_task()
+{
+    while(1)
+        vTaskSuspend(NULL); // No update ever arrives
+}
+
+void ota_confirm_image()
+{
+}
+
+int ota_control_write(uint16_t conn_handle, uint16_t attr_handle, const uint8_t * cmd, uint16_t len)
+{
+    return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+}
+
+int ota_data_write(uint16_t conn_handle, const struct os_mbuf * om)
+{
+    return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+}
+
+void ota_get_status(uint16_t conn_handle, ota_status_t * status)
+{
+    memset(status, 0, sizeof(*status));
+}
+
+esp_err_t phone_init()
+{
+    return ESP_OK;
+}
+
+int phone_challenge(uint16_t conn_handle, uint8_t * challenge)
+{
+    return BLE_ATT_ERR_INSUFFICIENT_AUTHOR; // The admin client is not a phone
+}
+
+int phone_unlock(uint16_t conn_handle, const uint8_t * response)
+{
+    return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+}
+
+int phone_enroll(uint16_t conn_handle, const uint8_t * cmd, uint16_t len)
+{
+    return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+}
+
+int phone_verify(const ble_addr_t * id_addr, const uint8_t * response)
+{
+    return -1; // No phones enrolled
+}
+
+int phone_store_status_cb(struct ble_store_status_event * event, void * arg)
+{
+    return 0;
+}
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    return 0;
+}
+
+struct os_mbuf * ble_hs_mbuf_from_flat(const void * buf, uint16_t len)
+{
+    return NULL;
+}
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf * om, void * flat, uint16_t max_len, uint16_t * out_copy_len)
+{
+    uint16_t len = om->om_len < max_len ? om->om_len : max_len;
+    memcpy(flat, om->om_data, len);
+    if(out_copy_len != NULL)
+        *out_copy_len = len;
+    return om->om_len > max_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+int os_mbuf_append(struct os_mbuf * om, const void * data, uint16_t len)
+{
+    if(om->om_len + len > om->om_size)
+        return BLE_HS_ENOMEM;
+    memcpy(&om->om_data[om->om_len], data, len);
+    om->om_len += len;
+    return 0;
+}
+
+int os_mbuf_copydata(const struct os_mbuf * om, int off, int len, void * dst)
+{
+    if(off < 0 || len < 0 || off + len > om->om_len)
+        return -1;
+    memcpy(dst, &om->om_data[off], len);
+    return 0;
+}
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf * om)
+{
+    return BLE_HS_ENOTCONN;
+}
+
+/*
+ * @brief Read a characteristic through the access callback, as the stack does for a peer
+ * @return 0 or the ATT error code of the read
+*/
+static int sim_gatt_read(const gatt_chr_t * chr, uint16_t attr_handle, uint8_t * value, uint16_t size)
+{
+    struct os_mbuf om = { .om_data = value, .om_len = 0, .om_size = size };
+    struct ble_gatt_access_ctxt ctxt = { .op = BLE_GATT_ACCESS_OP_READ_CHR, .om = &om };
+    return gatt_chr_access_cb(SIM_CONN_HANDLE, attr_handle, &ctxt, (void *) chr);
+}
+
+/*
+ * @brief Write a characteristic through the access callback, as the stack does for a peer
+ * @return 0 or the ATT error code of the write
+*/
+static int sim_gatt_write(const gatt_chr_t * chr, uint16_t attr_handle, uint8_t * value, uint16_t len)
+{
+    struct os_mbuf om = { .om_data = value, .om_len = len, .om_size = len };
+    struct ble_gatt_access_ctxt ctxt = { .op = BLE_GATT_ACCESS_OP_WRITE_CHR, .om = &om };
+    return gatt_chr_access_cb(SIM_CONN_HANDLE, attr_handle, &ctxt, (void *) chr);
+}
+
+static void sim_hmac(const void * key, size_t key_len, const uint8_t * msg, size_t msg_len, uint8_t * out)
+{
+    if(mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, key_len, msg, msg_len, out) != 0) {
+        fprintf(stderr, "HMAC of the admin client failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Admin session of the client, see admin.h for the protocol
+static uint8_t session_key[ADMIN_RESPONSE_LEN];
+static uint32_t session_counter;
+
+/*
+ * @brief HMAC(admin PIN, label | challenge), as admin.c derives it
+*/
+static void sim_admin_derive(const char * label, const uint8_t * challenge, uint8_t * out)
+{
+    static const char pin[] = KEYPAD_DEFAULT_ADMIN_PIN; // The simulation never changes the admin PIN
+    uint8_t msg[16 + ADMIN_CHALLENGE_LEN];
+    size_t label_len = strlen(label);
+    memcpy(msg, label, label_len);
+    memcpy(&msg[label_len], challenge, ADMIN_CHALLENGE_LEN);
+    sim_hmac(pin, strlen(pin), msg, label_len + ADMIN_CHALLENGE_LEN, out);
+}
+
+static int sim_admin_login()
+{
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint8_t response[ADMIN_RESPONSE_LEN];
+    int rc;
+
+    if((rc = sim_gatt_read(&gatt_admin_login_chr, gatt_admin_login_val_handle, challenge, sizeof(challenge))) != 0)
+        return rc;
+    sim_admin_derive("login", challenge, response);
+    if((rc = sim_gatt_write(&gatt_admin_login_chr, gatt_admin_login_val_handle, response, sizeof(response))) != 0)
+        return rc;
+    sim_admin_derive("session", challenge, session_key);
+    session_counter = 0;
+    return 0;
+}
+
+/*
+ * @brief Write a value with the admin trailer: counter and truncated HMAC over UUID, counter and value
+*/
+static int sim_admin_write(const gatt_chr_t * chr, uint16_t attr_handle, const void * value, uint16_t len)
+{
+    uint8_t msg[16 + sizeof(uint32_t) + ADMIN_MAX_PAYLOAD_LEN];
+    uint8_t raw[ADMIN_MAX_PAYLOAD_LEN + ADMIN_TRAILER_LEN];
+    uint8_t tag[ADMIN_RESPONSE_LEN];
+    uint32_t counter = ++session_counter;
+
+    memcpy(msg, chr->uuid128, 16);
+    memcpy(&msg[16], &counter, sizeof(counter)); // Little endian, same as the CPU
+    memcpy(&msg[16 + sizeof(counter)], value, len);
+    sim_hmac(session_key, sizeof(session_key), msg, 16 + sizeof(counter) + len, tag);
+
+    memcpy(raw, &msg[16 + sizeof(counter)], len);
+    memcpy(&raw[len], &counter, sizeof(counter));
+    memcpy(&raw[len + sizeof(counter)], tag, ADMIN_TAG_LEN);
+    return sim_gatt_write(chr, attr_handle, raw, len + ADMIN_TRAILER_LEN);
+}
+
+/*
+ * @brief Let a stretch of virtual time pass, serving a peer that polls the statistics meanwhile
+ *
+ * For SIM_BLE_LOAD_PCT of every SIM_BLE_LOAD_PERIOD_MS the host task reads
+ * without blocking, as it would under a flood of requests. The keypad and door
+ * tasks above it have to get through regardless.
+*/
+static void sim_ble_serve(uint32_t sec)
+{
+    static const struct {
+        const gatt_chr_t * chr;
+        const uint16_t * handle;
+    } polled[] = {
+        { &gatt_deadline_stats_chr, &gatt_deadline_stats_val_handle },
+        { &gatt_power_stats_chr, &gatt_power_stats_val_handle },
+    };
+    uint8_t value[GATT_DEADLINE_STATS_MAX_LEN + GATT_POWER_STATS_MAX_LEN]; // Fits either
+    const uint32_t busy_ms = SIM_BLE_LOAD_PERIOD_MS * sim_options.ble_load_pct / 100;
+
+    if(busy_ms == 0) {
+        vTaskDelaySec(sec);
+        return;
+    }
+    for(uint32_t period = 0; period < sec * 1000 / SIM_BLE_LOAD_PERIOD_MS; period++) {
+        for(uint32_t ms = 0; ms < busy_ms; ms += portTICK_PERIOD_MS) {
+            for(uint8_t i = 0; i < array_len(polled); i++)
+                sim_ble_result("load_read", sim_gatt_read(polled[i].chr, *polled[i].handle, value, sizeof(value)));
+            sim_clock_busy(portTICK_PERIOD_MS);
+        }
+        if(busy_ms < SIM_BLE_LOAD_PERIOD_MS)
+            vTaskDelayMSec((SIM_BLE_LOAD_PERIOD_MS - busy_ms));
+    }
+}
+
+void nimble_port_run(void)
+{
+    sim_gatts_start();
+    ESP_LOGI(GATT_TAG, "Simulated admin client started");
+    for(uint32_t rotation = 1; ; rotation++) {
+        for(uint32_t hour = 0; hour < sim_options.pin_rotate_hours; hour++)
+            sim_ble_serve(3600);
+
+        // New access PIN of 4 to 6 digits, in a session of its own as an admin would do it
+        static const uint32_t pin_range[] = {10000, 100000, 1000000};
+        uint8_t extra = sim_rand() % array_len(pin_range);
+        char pin[KEYPAD_PIN_MAX_LEN + 1];
+        snprintf(pin, sizeof(pin), "%0*lu", KEYPAD_PIN_MIN_LEN + extra, (unsigned long) (sim_rand() % pin_range[extra]));
+        int rc = sim_admin_login();
+        sim_ble_result("admin_login", rc);
+        if(rc != 0)
+            continue;
+
+        sim_visit_lock();
+        rc = sim_admin_write(&gatt_access_pin_chr, gatt_access_pin_val_handle, pin, strlen(pin));
+        sim_ble_result("access_pin", rc);
+        if(rc == 0)
+            sim_access_pin_changed(pin);
+        sim_visit_unlock();
+
+        // And the door duration
+        uint16_t duration = DEFAULT_OPEN_DURATION_SEC + rotation % 2;
+        rc = sim_admin_write(&gatt_door_open_duration_chr, gatt_door_open_duration_val_handle, &duration, sizeof(duration));
+        sim_ble_result("door_open_duration", rc);
+
+        // A replayed write has to be refused
+        session_counter--;
+        rc = sim_admin_write(&gatt_door_open_duration_chr, gatt_door_open_duration_val_handle, &duration, sizeof(duration));
+        sim_ble_result("replay_refused", rc == BLE_ATT_ERR_INSUFFICIENT_AUTHEN ? 0 : -1);
+
+        // And so has a read of a characteristic without a read handler
+        uint8_t scratch[4];
+        rc = sim_gatt_read(&gatt_access_pin_chr, gatt_access_pin_val_handle, scratch, sizeof(scratch));
+        sim_ble_result("read_refused", rc != 0 ? 0 : -1);
+    }
+}
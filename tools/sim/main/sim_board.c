@@ -0,0 +1,178 @@
+/*
+ * @file tools/sim/main/sim_board.c
+ *
+ * @proj imp-term
+ * @brief Simulated board: power management, door inputs, card reader, RTC snapshot, task watchdog and RNG
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The simulated terminal has the keypad and LEDs only, as in the default
+ * config.h. What the firmware's hardware modules would report back is
+ * recorded here for the end of run checks.
+*/
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "config.h"
+#include "keypad.h"
+#include "power.h"
+#include "door_io.h"
+#include "wiegand.h"
+#include "snapshot.h"
+#include "common.h"
+#include "sim.h"
+
+static int32_t power_holds[POWER_LOCK_COUNT];
+
+static struct {
+    TaskHandle_t task;
+    int64_t fed_us;
+} watched[SIM_WDT_MAX_TASKS];
+static uint8_t watched_len = 0;
+
+static portMUX_TYPE board_lock = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t power_init()
+{
+    return ESP_ERR_NOT_SUPPORTED; // The host never sleeps, main.c carries on awake
+}
+
+void power_acquire(enum PowerLock lock)
+{
+    taskENTER_CRITICAL(&board_lock);
+    power_holds[lock]++;
+    taskEXIT_CRITICAL(&board_lock);
+}
+
+void power_release(enum PowerLock lock)
+{
+    taskENTER_CRITICAL(&board_lock);
+    power_holds[lock]--;
+    taskEXIT_CRITICAL(&board_lock);
+}
+
+int32_t sim_power_locks_held()
+{
+    int32_t held = 0;
+
+    taskENTER_CRITICAL(&board_lock);
+    for(uint8_t lock = 0; lock < POWER_LOCK_COUNT; lock++)
+        held += power_holds[lock];
+    taskEXIT_CRITICAL(&board_lock);
+    return held;
+}
+
+void power_get_stats(power_stats_t * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+esp_err_t door_io_init()
+{
+    return ESP_OK; // No contact and no exit button
+}
+
+void door_io_lock_changed()
+{
+    sim_lock_changed(is_door_open());
+}
+
+esp_err_t wiegand_init()
+{
+    return ESP_OK; // No card reader
+}
+
+bool snapshot_load(snapshot_t * snapshot)
+{
+    return false; // Every run is a power-on
+}
+
+void snapshot_save_lockout(uint32_t duration_ms)
+{
+}
+
+void snapshot_save_door(bool open)
+{
+}
+
+void snapshot_save_otp_used(const uint32_t * used)
+{
+}
+
+esp_err_t esp_task_wdt_add(TaskHandle_t task_handle)
+{
+    esp_err_t ret = ESP_OK;
+
+    taskENTER_CRITICAL(&board_lock);
+    if(watched_len < SIM_WDT_MAX_TASKS) {
+        watched[watched_len].task = task_handle != NULL ? task_handle : xTaskGetCurrentTaskHandle();
+        watched[watched_len].fed_us = esp_timer_get_time();
+        watched_len++;
+    } else {
+        ret = ESP_ERR_NO_MEM;
+    }
+    taskEXIT_CRITICAL(&board_lock);
+    return ret;
+}
+
+esp_err_t esp_task_wdt_reset(void)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    taskENTER_CRITICAL(&board_lock);
+    for(uint8_t i = 0; i < watched_len; i++) {
+        if(watched[i].task == task) {
+            watched[i].fed_us = esp_timer_get_time();
+            ret = ESP_OK;
+        }
+    }
+    taskEXIT_CRITICAL(&board_lock);
+    return ret;
+}
+
+const char * sim_wdt_starved()
+{
+    TaskHandle_t starved = NULL;
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&board_lock);
+    for(uint8_t i = 0; i < watched_len; i++) {
+        if(now - watched[i].fed_us > (int64_t) CONFIG_ESP_TASK_WDT_TIMEOUT_S * 1000000)
+            starved = watched[i].task;
+    }
+    taskEXIT_CRITICAL(&board_lock);
+    return starved != NULL ? pcTaskGetName(starved) : NULL;
+}
+
+// Tasks are host threads, the stack sizes in config.h are too small for them
+// (the link wraps task creation, see CMakeLists.txt)
+BaseType_t __real_xTaskCreatePinnedToCore(TaskFunction_t fn, const char * const name, const uint32_t stack,
+                                          void * const param, UBaseType_t prio, TaskHandle_t * const handle, const BaseType_t core);
+
+BaseType_t __wrap_xTaskCreatePinnedToCore(TaskFunction_t fn, const char * const name, const uint32_t stack,
+                                          void * const param, UBaseType_t prio, TaskHandle_t * const handle, const BaseType_t core)
+{
+    return __real_xTaskCreatePinnedToCore(fn, name, stack < SIM_MIN_STACK_SIZE ? SIM_MIN_STACK_SIZE : stack,
+                                          param, prio, handle, core);
+}
+
+// Wrapped rather than defined, the linux target may or may not have its own
+esp_reset_reason_t __wrap_esp_reset_reason(void)
+{
+    return ESP_RST_POWERON; // As snapshot_load() says, every run is a power-on
+}
+
+// Admin challenges come from the SIM_SEED sequence too, so a run can be repeated
+void __wrap_esp_fill_random(void * buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        ((uint8_t *) buf)[i] = sim_rand();
+}
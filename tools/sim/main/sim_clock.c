@@ -0,0 +1,156 @@
+/*
+ * @file tools/sim/main/sim_clock.c
+ *
+ * @proj imp-term
+ * @brief Virtual clock of the simulator: esp_timer and the wall clock on the FreeRTOS tick count
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Whenever every task is blocked, the idle hook moves the tick count on by
+ * one, so simulated time passes as fast as the firmware can run out of work.
+ * Time spent computing is not counted, the clock only shows waiting, unless
+ * a task asks for it with sim_clock_busy().
+*/
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include "sim.h"
+
+static uint32_t clock_speed = 0;
+static int64_t real_start_us = 0;
+static volatile int64_t wall_offset_us = (int64_t) SIM_EPOCH * 1000000; // Wall clock less virtual time
+
+static int64_t real_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sim_clock_start(uint32_t speed)
+{
+    real_start_us = real_now_us();
+    clock_speed = speed;
+}
+
+int64_t sim_clock_real_us()
+{
+    return real_now_us() - real_start_us;
+}
+
+static bool ahead_of_speed()
+{
+    return clock_speed != 0 && esp_timer_get_time() >= sim_clock_real_us() * clock_speed;
+}
+
+void vApplicationIdleHook(void)
+{
+    // Nothing runs until the next tick, skip to it unless ahead of the speed limit
+    if(ahead_of_speed())
+        return;
+    xTaskCatchUpTicks(1);
+}
+
+void sim_clock_busy(uint32_t ms)
+{
+    for(TickType_t tick = 0; tick < pdMS_TO_TICKS(ms); tick++) {
+        while(ahead_of_speed())
+            ;
+        xTaskCatchUpTicks(1); // Yields to whatever the tick woke up above the caller
+    }
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t) xTaskGetTickCount() * portTICK_PERIOD_MS * 1000;
+}
+
+struct esp_timer {
+    TimerHandle_t timer;
+    esp_timer_cb_t callback;
+    void * arg;
+};
+
+static void esp_timer_dispatch(TimerHandle_t timer)
+{
+    struct esp_timer * t = pvTimerGetTimerID(timer);
+    t->callback(t->arg);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t * create_args, esp_timer_handle_t * out_handle)
+{
+    struct esp_timer * t = calloc(1, sizeof(*t));
+    if(t == NULL)
+        return ESP_ERR_NO_MEM;
+    t->callback = create_args->callback;
+    t->arg = create_args->arg;
+    t->timer = xTimerCreate(create_args->name ? create_args->name : "esp_timer", 1, pdFALSE, t, &esp_timer_dispatch);
+    if(t->timer == NULL) {
+        free(t);
+        return ESP_ERR_NO_MEM;
+    }
+    *out_handle = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if(xTimerIsTimerActive(timer->timer))
+        return ESP_ERR_INVALID_STATE;
+
+    // Rounded up, a timer never fires early
+    const uint64_t tick_us = portTICK_PERIOD_MS * 1000;
+    uint64_t ticks = (timeout_us + tick_us - 1) / tick_us;
+    if(ticks == 0)
+        ticks = 1;
+    if(ticks > portMAX_DELAY / 2)
+        ticks = portMAX_DELAY / 2;
+    return xTimerChangePeriod(timer->timer, ticks, 0) == pdPASS ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if(!xTimerIsTimerActive(timer->timer))
+        return ESP_ERR_INVALID_STATE;
+    return xTimerStop(timer->timer, 0) == pdPASS ? ESP_OK : ESP_FAIL;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    return xTimerIsTimerActive(timer->timer) != pdFALSE;
+}
+
+// The wall clock follows the virtual one (the link wraps these, see CMakeLists.txt),
+// so schedules and one-time codes see the simulated days go by
+
+int __wrap_gettimeofday(struct timeval * tv, void * tz)
+{
+    if(tv != NULL) {
+        int64_t now = wall_offset_us + esp_timer_get_time();
+        tv->tv_sec = now / 1000000;
+        tv->tv_usec = now % 1000000;
+    }
+    return 0;
+}
+
+int __wrap_settimeofday(const struct timeval * tv, const struct timezone * tz)
+{
+    if(tv != NULL)
+        wall_offset_us = (int64_t) tv->tv_sec * 1000000 + tv->tv_usec - esp_timer_get_time();
+    return 0;
+}
+
+time_t __wrap_time(time_t * t)
+{
+    time_t now = (wall_offset_us + esp_timer_get_time()) / 1000000;
+    if(t != NULL)
+        *t = now;
+    return now;
+}
@@ -0,0 +1,142 @@
+/*
+ * @file tools/sim/main/sim_gpio.c
+ *
+ * @proj imp-term
+ * @brief Simulated GPIO: LED outputs and keypads pressed by the simulator, in place of main/gpio.c
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "config.h"
+#include "gpio.h"
+#include "supervisor.h"
+#include "common.h"
+#include "sim.h"
+
+typedef struct {
+    uint8_t cols;
+    const char * keymap;
+} sim_keypad_t;
+
+typedef struct {
+    uint8_t keypad;
+    uint8_t row;
+    gpio_num_t gpio;
+} sim_row_t;
+
+#define X_KEYPAD(id, cols, rows, keymap) [id] = {cols, keymap},
+static const sim_keypad_t keypads[KEYPAD_COUNT] = { KEYPADS(X_KEYPAD) };
+
+#define X_ROW(keypad, row, gpio) {keypad, row, gpio},
+static const sim_row_t rows[] = { KEYPAD_ROW_PINS(X_ROW) };
+
+static uint8_t levels[GPIO_NUM_MAX];
+
+// Key held down, its row reads high until it is released
+static struct {
+    bool down;
+    uint8_t keypad;
+    char key;
+    gpio_num_t row;
+} pressed;
+
+static uint32_t overflows = 0;
+static portMUX_TYPE gpio_lock = portMUX_INITIALIZER_UNLOCKED;
+
+QueueHandle_t gpio_evt_queue;
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    levels[gpio_num] = level != 0;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    int level;
+
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return 0;
+    taskENTER_CRITICAL(&gpio_lock);
+    level = (pressed.down && pressed.row == gpio_num) || levels[gpio_num];
+    taskEXIT_CRITICAL(&gpio_lock);
+    return level;
+}
+
+void gpio_configure()
+{
+    ESP_LOGI(PROJ_NAME, "Configuring simulated GPIO");
+    gpio_set_level(DOOR_CLOSED_LED, GPIO_HIGH);
+
+    gpio_evt_queue = xQueueCreate(3, sizeof(uint32_t)); // Same length as in main/gpio.c
+    if(gpio_evt_queue == NULL) {
+        ESP_LOGE(PROJ_NAME, "Failed to create GPIO event queue");
+        abort();
+    }
+}
+
+uint8_t gpio_keypad_key_lookup(uint32_t io_num, uint8_t * keypad)
+{
+    uint8_t key = E_KEYPAD_NO_KEY_FOUND;
+
+    // The scan of main/gpio.c finds the held key on its row, nothing once it is released
+    taskENTER_CRITICAL(&gpio_lock);
+    if(pressed.down && pressed.row == io_num) {
+        *keypad = pressed.keypad;
+        key = pressed.key;
+    }
+    taskEXIT_CRITICAL(&gpio_lock);
+    return key;
+}
+
+int sim_gpio_press(uint8_t keypad, char key, uint8_t bounces, uint32_t press_ms)
+{
+    const char * pos = key != '\0' ? strchr(keypads[keypad].keymap, key) : NULL;
+    if(pos == NULL)
+        return -1;
+    uint8_t row = (pos - keypads[keypad].keymap) / keypads[keypad].cols;
+
+    gpio_num_t row_pin = GPIO_NUM_NC;
+    for(uint8_t i = 0; i < array_len(rows); i++) {
+        if(rows[i].keypad == keypad && rows[i].row == row)
+            row_pin = rows[i].gpio;
+    }
+    if(row_pin == GPIO_NUM_NC)
+        return -1;
+
+    taskENTER_CRITICAL(&gpio_lock);
+    pressed.down = true;
+    pressed.keypad = keypad;
+    pressed.key = key;
+    pressed.row = row_pin;
+    taskEXIT_CRITICAL(&gpio_lock);
+
+    // What the row interrupt of main/gpio.c does on each edge, the bounces come faster than the keypad task
+    int dropped = 0;
+    uint32_t gpio_num = row_pin;
+    for(uint8_t edge = 0; edge <= bounces; edge++) {
+        deadline_start_from_isr(DEADLINE_KEY);
+        if(xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL) != pdTRUE)
+            dropped++;
+    }
+    vTaskDelayMSec(press_ms);
+
+    taskENTER_CRITICAL(&gpio_lock);
+    pressed.down = false;
+    overflows += dropped;
+    taskEXIT_CRITICAL(&gpio_lock);
+    return dropped;
+}
+
+uint32_t sim_gpio_overflows()
+{
+    return overflows;
+}
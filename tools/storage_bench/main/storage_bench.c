@@ -0,0 +1,189 @@
+/*
+ * @file tools/storage_bench/main/storage_bench.c
+ *
+ * @proj imp-term
+ * @brief Latency and flash wear of the keypad config storage paths at varying NVS occupancy
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Built for the linux target, where the flash is emulated in RAM and counts its
+ * operations (CONFIG_ESP_PARTITION_ENABLE_STATS). Prints one JSON document to stdout.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_private/partition_linux.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+
+#include "config.h"
+#include "storage.h"
+#include "common.h"
+
+#define BENCH_ITERATIONS 1000 // Operations per storage path and occupancy level
+#define BENCH_FILL_NAMESPACE "bench_fill"
+#define BENCH_FILL_BLOB_LEN 64 // Filler entries, about the size of the card and schedule blobs
+#define BENCH_FLASH_ENDURANCE 100000 // Erase cycles per sector guaranteed by the SPI flash datasheets
+
+// Share of NVS entries in use before a run, 100 fills the partition until NVS refuses more
+static const uint8_t occupancy_levels[] = {0, 25, 50, 75, 100};
+
+static esp_err_t op_change_pin(uint32_t i)
+{
+    char pin[KEYPAD_PIN_MAX_LEN + 1];
+    snprintf(pin, sizeof(pin), "%04" PRIu32, i % 10000); // A PIN rotation every time
+    return change_pin(pin, "access_pin");
+}
+
+static esp_err_t op_check_pin(uint32_t i)
+{
+    bool is_correct;
+    return check_pin(i % 2 ? KEYPAD_DEFAULT_ACCESS_PIN : "0000", "access_pin", &is_correct);
+}
+
+static esp_err_t op_update_door_duration(uint32_t i)
+{
+    return update_door_duration(DEFAULT_OPEN_DURATION_SEC + i % 2);
+}
+
+static esp_err_t op_read_door_duration(uint32_t i)
+{
+    uint16_t duration;
+    return read_door_duration(&duration);
+}
+
+static const struct {
+    const char * name;
+    esp_err_t (*run)(uint32_t i);
+} ops[] = {
+    {"change_pin", op_change_pin},
+    {"check_pin", op_check_pin},
+    {"update_door_duration", op_update_door_duration},
+    {"read_door_duration", op_read_door_duration},
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t * sorted, size_t len, uint8_t percent)
+{
+    return sorted[(len - 1) * percent / 100] / 1000.0;
+}
+
+/*
+ * @brief Share of NVS entries in use, in percent
+*/
+static double nvs_occupancy()
+{
+    nvs_stats_t stats;
+    ESP_ERROR_CHECK(nvs_get_stats(NULL, &stats));
+    return 100.0 * stats.used_entries / stats.total_entries;
+}
+
+/*
+ * @brief Write filler blobs into a namespace of their own until the occupancy is reached
+*/
+static void nvs_fill(uint8_t percent)
+{
+    uint8_t blob[BENCH_FILL_BLOB_LEN];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_handle_t handle;
+
+    memset(blob, 0xA5, sizeof(blob));
+    ESP_ERROR_CHECK(nvs_open(BENCH_FILL_NAMESPACE, NVS_READWRITE, &handle));
+    for(uint32_t i = 0; nvs_occupancy() < percent; i++) {
+        snprintf(key, sizeof(key), "f%" PRIu32, i);
+        if(nvs_set_blob(handle, key, blob, sizeof(blob)) != ESP_OK)
+            break; // Full
+    }
+    ESP_ERROR_CHECK(nvs_commit(handle));
+    nvs_close(handle);
+}
+
+static void bench_op(uint8_t op, const esp_partition_t * nvs, uint64_t * latency)
+{
+    uint32_t errors = 0;
+
+    esp_partition_clear_stats();
+    for(uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t start = now_ns();
+        errors += ops[op].run(i) != ESP_OK;
+        latency[i] = now_ns() - start;
+    }
+    qsort(latency, BENCH_ITERATIONS, sizeof(latency[0]), compare_u64);
+
+    // Wear is decided by the most erased sector, NVS spreads erases over its pages
+    size_t max_sector_erases = 0;
+    for(size_t sector = nvs->address / ESP_PARTITION_EMULATED_SECTOR_SIZE;
+        sector < (nvs->address + nvs->size) / ESP_PARTITION_EMULATED_SECTOR_SIZE; sector++) {
+        size_t erases = esp_partition_get_sector_erase_count(sector);
+        if(erases > max_sector_erases)
+            max_sector_erases = erases;
+    }
+
+    printf("        {\"name\": \"%s\", \"errors\": %" PRIu32 ", "
+           "\"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}, "
+           "\"bytes_written_per_op\": %.2f, \"write_ops_per_op\": %.2f, \"erases_per_op\": %.4f, "
+           "\"max_sector_erases\": %zu, ",
+           ops[op].name, errors,
+           percentile_us(latency, BENCH_ITERATIONS, 50), percentile_us(latency, BENCH_ITERATIONS, 90),
+           percentile_us(latency, BENCH_ITERATIONS, 99), latency[BENCH_ITERATIONS - 1] / 1000.0,
+           (double) esp_partition_get_write_bytes() / BENCH_ITERATIONS,
+           (double) esp_partition_get_write_ops() / BENCH_ITERATIONS,
+           (double) esp_partition_get_erase_ops() / BENCH_ITERATIONS,
+           max_sector_erases);
+    if(max_sector_erases > 0)
+        printf("\"ops_to_wearout\": %.0f}", (double) BENCH_FLASH_ENDURANCE * BENCH_ITERATIONS / max_sector_erases);
+    else
+        printf("\"ops_to_wearout\": null}");
+}
+
+void app_main(void)
+{
+    static uint64_t latency[BENCH_ITERATIONS];
+
+    esp_log_level_set("*", ESP_LOG_NONE); // stdout carries the JSON only
+
+    const esp_partition_t * nvs = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+    if(nvs == NULL) {
+        fprintf(stderr, "No NVS partition, check CONFIG_PARTITION_TABLE_CUSTOM_FILENAME\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"iterations\": %u,\n  \"nvs_size\": %" PRIu32 ",\n  \"flash_endurance\": %u,\n  \"levels\": [\n",
+           BENCH_ITERATIONS, nvs->size, BENCH_FLASH_ENDURANCE);
+    for(uint8_t level = 0; level < array_len(occupancy_levels); level++) {
+        // Fresh partition with the defaults, as on a first boot
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        nvs_configure();
+        nvs_fill(occupancy_levels[level]);
+
+        printf("    {\"target_occupancy\": %u, \"occupancy\": %.1f, \"ops\": [\n",
+               occupancy_levels[level], nvs_occupancy());
+        for(uint8_t op = 0; op < array_len(ops); op++) {
+            bench_op(op, nvs, latency);
+            printf(op + 1 < array_len(ops) ? ",\n" : "\n");
+        }
+        printf("    ]}%s\n", level + 1 < array_len(occupancy_levels) ? "," : "");
+    }
+    printf("  ]\n}\n");
+
+    ESP_ERROR_CHECK(nvs_flash_deinit());
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,72 @@
+/*
+ * @file tools/test/main/include/driver/gpio.h
+ *
+ * @proj imp-term
+ * @brief Fake GPIO driver, the simulator's declarations and the configuration calls main/gpio.c makes on top of them
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_DRIVER_GPIO_H
+#define IMP_TERM_TEST_DRIVER_GPIO_H
+
+#include_next <driver/gpio.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+#ifndef ESP_INTR_FLAG_DEFAULT
+#define ESP_INTR_FLAG_DEFAULT 0
+#endif
+
+typedef enum {
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+    GPIO_MODE_INPUT_OUTPUT = 3,
+} gpio_mode_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE = 0,
+    GPIO_INTR_POSEDGE = 1,
+    GPIO_INTR_NEGEDGE = 2,
+    GPIO_INTR_ANYEDGE = 3,
+    GPIO_INTR_LOW_LEVEL = 4,
+    GPIO_INTR_HIGH_LEVEL = 5,
+} gpio_int_type_t;
+
+typedef enum {
+    GPIO_PULLUP_DISABLE = 0,
+    GPIO_PULLUP_ENABLE = 1,
+} gpio_pullup_t;
+
+typedef enum {
+    GPIO_PULLDOWN_DISABLE = 0,
+    GPIO_PULLDOWN_ENABLE = 1,
+} gpio_pulldown_t;
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+typedef void (*gpio_isr_t)(void * arg);
+
+
+// EXPORTED SYMBOLS
+
+esp_err_t gpio_config(const gpio_config_t * config);
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num);
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode);
+esp_err_t gpio_install_isr_service(int intr_alloc_flags);
+
+/*
+ * @brief Call an interrupt handler on the edges of a pin, from the task making the edge
+*/
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void * args);
+
+
+#endif // IMP_TERM_TEST_DRIVER_GPIO_H
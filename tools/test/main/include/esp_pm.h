@@ -0,0 +1,60 @@
+/*
+ * @file tools/test/main/include/esp_pm.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the ESP-IDF power management API on the linux target, the calls power.c makes
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The linux target has no esp_pm component and never sleeps. test_board.c keeps
+ * the locks and the light sleep callbacks, the tests put the chip to sleep
+ * themselves; names and values are ESP-IDF's.
+*/
+
+#ifndef IMP_TERM_TEST_ESP_PM_H
+#define IMP_TERM_TEST_ESP_PM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+typedef enum {
+    ESP_PM_CPU_FREQ_MAX,
+    ESP_PM_APB_FREQ_MAX,
+    ESP_PM_NO_LIGHT_SLEEP,
+} esp_pm_lock_type_t;
+
+typedef struct esp_pm_lock * esp_pm_lock_handle_t;
+
+typedef struct {
+    int max_freq_mhz;
+    int min_freq_mhz;
+    bool light_sleep_enable;
+} esp_pm_config_t;
+
+typedef esp_err_t (*esp_pm_light_sleep_cb_t)(int64_t sleep_time_us, void * arg);
+
+typedef struct {
+    esp_pm_light_sleep_cb_t enter_cb;
+    esp_pm_light_sleep_cb_t exit_cb;
+    void * enter_cb_user_arg;
+    void * exit_cb_user_arg;
+    uint32_t enter_cb_prior;
+    uint32_t exit_cb_prior;
+} esp_pm_sleep_cbs_register_config_t;
+
+
+// EXPORTED SYMBOLS
+
+esp_err_t esp_pm_configure(const void * config);
+esp_err_t esp_pm_light_sleep_register_cbs(esp_pm_sleep_cbs_register_config_t * cbs_conf);
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char * name, esp_pm_lock_handle_t * out_handle);
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle);
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle);
+
+
+#endif // IMP_TERM_TEST_ESP_PM_H
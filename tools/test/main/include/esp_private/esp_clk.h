@@ -0,0 +1,24 @@
+/*
+ * @file tools/test/main/include/esp_private/esp_clk.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the ESP-IDF clock API on the linux target, the RTC timer snapshot.c reads
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_ESP_CLK_H
+#define IMP_TERM_TEST_ESP_CLK_H
+
+#include <stdint.h>
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Microseconds of the RTC timer, which runs on through a restart
+*/
+uint64_t esp_clk_rtc_time(void);
+
+
+#endif // IMP_TERM_TEST_ESP_CLK_H
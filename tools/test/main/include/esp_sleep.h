@@ -0,0 +1,24 @@
+/*
+ * @file tools/test/main/include/esp_sleep.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the ESP-IDF sleep API on the linux target, the calls power.c makes (see esp_pm.h)
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_ESP_SLEEP_H
+#define IMP_TERM_TEST_ESP_SLEEP_H
+
+#include <esp_err.h>
+
+
+// EXPORTED SYMBOLS
+
+/*
+ * @brief Let the GPIOs armed with gpio_ll_wakeup_enable() end a light sleep
+*/
+esp_err_t esp_sleep_enable_gpio_wakeup(void);
+
+
+#endif // IMP_TERM_TEST_ESP_SLEEP_H
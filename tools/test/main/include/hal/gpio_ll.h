@@ -0,0 +1,45 @@
+/*
+ * @file tools/test/main/include/hal/gpio_ll.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the GPIO low level calls main/gpio.c and main/door_io.c make from the light sleep callbacks
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_HAL_GPIO_LL_H
+#define IMP_TERM_TEST_HAL_GPIO_LL_H
+
+#include <stdint.h>
+
+#include <driver/gpio.h>
+#include <soc/gpio_struct.h>
+
+
+// EXPORTED SYMBOLS
+
+// The input levels test_gpio.c holds
+static inline int gpio_ll_get_level(gpio_dev_t * hw, uint32_t gpio_num)
+{
+    return gpio_get_level(gpio_num);
+}
+
+static inline void gpio_ll_set_intr_type(gpio_dev_t * hw, uint32_t gpio_num, gpio_int_type_t intr_type)
+{
+    hw->pin[gpio_num].int_type = intr_type;
+}
+
+// As on the ESP32, the wakeup level takes the place of the interrupt type
+static inline void gpio_ll_wakeup_enable(gpio_dev_t * hw, uint32_t gpio_num, gpio_int_type_t intr_type)
+{
+    hw->pin[gpio_num].int_type = intr_type;
+    hw->pin[gpio_num].wakeup_enable = 1;
+}
+
+static inline void gpio_ll_wakeup_disable(gpio_dev_t * hw, uint32_t gpio_num)
+{
+    hw->pin[gpio_num].wakeup_enable = 0;
+}
+
+
+#endif // IMP_TERM_TEST_HAL_GPIO_LL_H
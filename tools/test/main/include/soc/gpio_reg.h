@@ -0,0 +1,50 @@
+/*
+ * @file tools/test/main/include/soc/gpio_reg.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the GPIO registers of the ESP32 that main/gpio.c reads and writes directly
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The registers are plain memory of test_gpio.c, which sets the input levels
+ * from the keys held down; names are ESP-IDF's.
+*/
+
+#ifndef IMP_TERM_TEST_SOC_GPIO_REG_H
+#define IMP_TERM_TEST_SOC_GPIO_REG_H
+
+#include <stdint.h>
+
+#include <esp_bit_defs.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+// GPIO 0-31 in the first register of each pair, 32 and up in the second
+typedef struct {
+    uint32_t out_w1ts;
+    uint32_t out_w1tc;
+    uint32_t out1_w1ts;
+    uint32_t out1_w1tc;
+    uint32_t in;
+    uint32_t in1;
+} test_gpio_regs_t;
+
+#define GPIO_OUT_W1TS_REG (&test_gpio_regs.out_w1ts)
+#define GPIO_OUT_W1TC_REG (&test_gpio_regs.out_w1tc)
+#define GPIO_OUT1_W1TS_REG (&test_gpio_regs.out1_w1ts)
+#define GPIO_OUT1_W1TC_REG (&test_gpio_regs.out1_w1tc)
+#define GPIO_IN_REG (&test_gpio_regs.in)
+#define GPIO_IN1_REG (&test_gpio_regs.in1)
+
+#ifndef REG_READ
+#define REG_READ(reg) (*(volatile uint32_t *) (reg))
+#endif
+
+
+// EXPORTED SYMBOLS
+
+extern volatile test_gpio_regs_t test_gpio_regs;
+
+
+#endif // IMP_TERM_TEST_SOC_GPIO_REG_H
@@ -0,0 +1,31 @@
+/*
+ * @file tools/test/main/include/soc/gpio_struct.h
+ *
+ * @proj imp-term
+ * @brief Stand-in for the GPIO peripheral of the ESP32, the pin configuration the HAL calls of main/gpio.c change
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_SOC_GPIO_STRUCT_H
+#define IMP_TERM_TEST_SOC_GPIO_STRUCT_H
+
+#include <stdint.h>
+
+
+// CONVENIENCE DEFINITIONS
+
+typedef struct {
+    struct {
+        uint32_t int_type;      // gpio_int_type_t
+        uint32_t wakeup_enable; // Level interrupt ends a light sleep
+    } pin[40];
+} gpio_dev_t;
+
+
+// EXPORTED SYMBOLS
+
+extern gpio_dev_t GPIO; // test_gpio.c
+
+
+#endif // IMP_TERM_TEST_SOC_GPIO_STRUCT_H
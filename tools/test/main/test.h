@@ -0,0 +1,150 @@
+/*
+ * @file tools/test/main/test.h
+ *
+ * @proj imp-term
+ * @brief Host tests of the firmware modules, shared between the test files and the fakes
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#ifndef IMP_TERM_TEST_H
+#define IMP_TERM_TEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_pm.h>
+#include <driver/gpio.h>
+
+#include "host/ble_hs.h"
+
+
+// CONFIGURABLE OPTIONS
+
+#define TEST_BLE_MAX_CONN 4 // Connection handles 0..3
+#define TEST_BLE_NOTIFY_BYTES (256 * 1024) // Notification payloads kept, a whole audit log fits
+
+
+// CONVENIENCE DEFINITIONS
+
+// What the firmware has notified since test_ble_reset()
+typedef struct {
+    uint32_t count;
+    uint32_t empty;       // Notifications without a payload
+    uint16_t conn_handle; // Of the last one
+    uint16_t attr_handle;
+    size_t len;           // Payload bytes, all notifications back to back
+    uint8_t data[TEST_BLE_NOTIFY_BYTES];
+} test_ble_notify_t;
+
+// Link parameters the firmware asked for since test_ble_reset()
+typedef struct {
+    uint32_t updates;
+    uint16_t itvl_min; // 1.25 ms units
+    uint16_t itvl_max;
+    uint16_t tx_octets; // Data length
+} test_ble_link_t;
+
+// Bond store use since test_ble_reset()
+typedef struct {
+    uint32_t reads;    // ble_store_util_bonded_peers() calls, each a scan of the bonds in flash on the device
+    uint32_t unpaired; // Bonds deleted
+} test_ble_store_t;
+
+// The door of keypad.c is not linked in, the credential pipeline and the exit button open this one
+typedef struct {
+    bool locked_out;     // Set by the test, what access_locked_out() reports
+    bool unlocked;       // What is_door_open() reports, set by the requests, relocked by the test
+    uint32_t opens;      // door_request_open() and door_request_open_from_isr() calls
+    uint32_t opened_at;  // Tick of the last one
+    uint32_t shuts;      // door_request_shut() calls
+    uint32_t failures;   // access_register_failure() calls
+} test_door_t;
+
+// HMAC work done by the firmware since boot (the link wraps these, see CMakeLists.txt)
+typedef struct {
+    uint32_t oneshot;    // mbedtls_md_hmac(): a whole HMAC including its key schedule
+    uint32_t key_setups; // mbedtls_md_hmac_starts(): key schedule of a reusable context
+} test_crypto_t;
+
+// Power management as power.c configured it
+typedef struct {
+    bool light_sleep;                       // Automatic light sleep enabled
+    bool gpio_wakeup;                       // Armed GPIOs end a light sleep
+    esp_pm_sleep_cbs_register_config_t cbs; // Run around each light sleep
+    int32_t held;                           // PM locks held, the chip only sleeps at 0
+} test_pm_t;
+
+
+// EXPORTED SYMBOLS
+
+extern test_ble_notify_t test_ble_notify;
+extern test_ble_link_t test_ble_link;
+extern test_ble_store_t test_ble_store;
+extern test_door_t test_door;
+extern test_pm_t test_pm;
+extern test_crypto_t test_crypto;
+
+/*
+ * @brief Drop all connections and notifications, the stack takes any number of notifications again
+*/
+void test_ble_reset();
+
+/*
+ * @brief Open a connection
+ * @param mtu Negotiated ATT MTU
+*/
+void test_ble_connect(uint16_t conn_handle, uint16_t mtu);
+
+void test_ble_disconnect(uint16_t conn_handle);
+
+/*
+ * @brief Pair an open connection with a peer, bonding with it if it is not yet bonded
+ * @return 0 or BLE_HS_ESTORE_CAP if the bond store is full
+*/
+int test_ble_pair(uint16_t conn_handle, const ble_addr_t * id_addr);
+
+/*
+ * @brief Let the stack take this many more notifications, then report it is out of buffers
+ * @param credits -1 for no limit
+*/
+void test_ble_set_credits(int32_t credits);
+
+/*
+ * @brief Hold a key down, main/gpio.c sees its row go high
+ * @return 0 or -1 if the keypad has no such key
+ * @note The row interrupt runs in the calling task if the row is armed for an edge
+*/
+int test_gpio_press(uint8_t keypad, char key);
+
+void test_gpio_release();
+
+/*
+ * @brief Drive an input other than a keypad row, main/gpio.c or main/door_io.c reads it
+ * @note The pin's interrupt runs in the calling task if it is armed for this edge
+*/
+void test_gpio_input(gpio_num_t gpio, uint32_t level);
+
+/*
+ * @brief Restarts the firmware asked for since boot, the task asking is suspended for good
+*/
+uint32_t test_board_restarts();
+
+/*
+ * @brief Run the test cases of one module, each in test_<module>.c
+*/
+void test_audit();
+void test_ota();
+void test_admin();
+void test_phone();
+void test_power();
+void test_wiegand();
+void test_schedule();
+void test_otp();
+void test_door_io();
+void test_snapshot();
+void test_supervisor();
+
+
+#endif // IMP_TERM_TEST_H
@@ -0,0 +1,364 @@
+/*
+ * @file tools/test/main/test_admin.c
+ *
+ * @proj imp-term
+ * @brief Admin session tests: login handshake and backoff, write tags, replays, expiry and the cost of each
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The test is the client of main/include/admin.h: it answers the challenge and
+ * tags its writes with the session key as the web configuration does. The HMAC
+ * calls of admin.c are counted (the link wraps them, see CMakeLists.txt), so
+ * the tests can tell the expensive key derivation from the per-write check.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <mbedtls/md.h>
+
+#include "unity.h"
+
+#include "admin.h"
+#include "storage.h"
+#include "common.h"
+#include "test.h"
+
+#define TEST_ADMIN_CONN 0
+#define TEST_ADMIN_CLIENT 0x0f02000a // HTTP client address, 10.0.2.15 as s_addr holds it
+#define TEST_ADMIN_TIMING_ROUNDS 5
+#define TEST_ADMIN_TIMING_CALLS 100
+
+static const uint8_t test_uuid[16] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+                                      0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0x00};
+
+test_crypto_t test_crypto;
+
+// What the client keeps of its session
+static struct {
+    uint8_t key[32];
+    uint32_t counter;
+} client;
+
+int __real_mbedtls_md_hmac(const mbedtls_md_info_t * md_info, const unsigned char * key, size_t keylen,
+                           const unsigned char * input, size_t ilen, unsigned char * output);
+int __real_mbedtls_md_hmac_starts(mbedtls_md_context_t * ctx, const unsigned char * key, size_t keylen);
+
+int __wrap_mbedtls_md_hmac(const mbedtls_md_info_t * md_info, const unsigned char * key, size_t keylen,
+                           const unsigned char * input, size_t ilen, unsigned char * output)
+{
+    test_crypto.oneshot++;
+    return __real_mbedtls_md_hmac(md_info, key, keylen, input, ilen, output);
+}
+
+int __wrap_mbedtls_md_hmac_starts(mbedtls_md_context_t * ctx, const unsigned char * key, size_t keylen)
+{
+    test_crypto.key_setups++;
+    return __real_mbedtls_md_hmac_starts(ctx, key, keylen);
+}
+
+// HMAC-SHA256(key, label | challenge), as the client computes it
+static void admin_client_hmac(const char * key, const char * label, const uint8_t * challenge, uint8_t * out)
+{
+    uint8_t msg[16 + ADMIN_CHALLENGE_LEN];
+    memcpy(msg, label, strlen(label));
+    memcpy(&msg[strlen(label)], challenge, ADMIN_CHALLENGE_LEN);
+    TEST_ASSERT_EQUAL(0, __real_mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t *) key,
+                                                strlen(key), msg, strlen(label) + ADMIN_CHALLENGE_LEN, out));
+}
+
+/*
+ * @brief Read a challenge and answer it with a PIN
+ * @return What admin_login() returned
+*/
+static int admin_client_login(uint16_t conn_handle, const char * pin)
+{
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint8_t response[ADMIN_RESPONSE_LEN];
+
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge(conn_handle, challenge));
+    admin_client_hmac(pin, "login", challenge, response);
+    admin_client_hmac(pin, "session", challenge, client.key);
+    client.counter = 0;
+    return admin_login(conn_handle, response, sizeof(response));
+}
+
+/*
+ * @brief Build an admin write: payload | counter | tag
+ * @return Length of the write
+*/
+static uint16_t admin_client_value(const uint8_t * uuid128, const char * payload, uint32_t counter, uint8_t * value)
+{
+    size_t len = strlen(payload);
+    uint8_t msg[16 + sizeof(counter) + ADMIN_MAX_PAYLOAD_LEN];
+    uint8_t tag[32];
+
+    memcpy(value, payload, len);
+    memcpy(&value[len], &counter, sizeof(counter));
+    memcpy(msg, uuid128, 16);
+    memcpy(&msg[16], &counter, sizeof(counter));
+    memcpy(&msg[16 + sizeof(counter)], payload, len);
+    TEST_ASSERT_EQUAL(0, __real_mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), client.key, sizeof(client.key),
+                                                msg, 16 + sizeof(counter) + len, tag));
+    memcpy(&value[len + sizeof(counter)], tag, ADMIN_TAG_LEN);
+    return len + ADMIN_TRAILER_LEN;
+}
+
+// Write the next value of the session
+static int admin_client_write(uint16_t conn_handle, const char * payload)
+{
+    uint8_t value[ADMIN_MAX_PAYLOAD_LEN + ADMIN_TRAILER_LEN];
+    uint8_t out[ADMIN_MAX_PAYLOAD_LEN];
+    uint16_t out_len = sizeof(out);
+
+    uint16_t len = admin_client_value(test_uuid, payload, ++client.counter, value);
+    int rc = admin_verify_write(conn_handle, test_uuid, value, len, out, &out_len);
+    if(rc == 0) {
+        TEST_ASSERT_EQUAL(strlen(payload), out_len);
+        TEST_ASSERT_EQUAL_MEMORY(payload, out, out_len);
+    }
+    return rc;
+}
+
+static int64_t admin_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_admin_login_opens_session()
+{
+    uint32_t oneshot = test_crypto.oneshot;
+    uint32_t key_setups = test_crypto.key_setups;
+
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, admin_client_write(TEST_ADMIN_CONN, "1234"));
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL(0, admin_client_write(TEST_ADMIN_CONN, "1234"));
+    TEST_ASSERT_EQUAL(0, admin_client_write(TEST_ADMIN_CONN, "123456"));
+
+    // The response and the session key, then the key schedule of the session's context
+    TEST_ASSERT_EQUAL_UINT32(oneshot + 2, test_crypto.oneshot);
+    TEST_ASSERT_EQUAL_UINT32(key_setups + 1, test_crypto.key_setups);
+}
+
+// One attempt per challenge, a wrong PIN opens nothing
+static void test_admin_rejects_wrong_response()
+{
+    const uint32_t wait = ADMIN_LOGIN_BACKOFF_SEC;
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint8_t response[ADMIN_RESPONSE_LEN];
+
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_client_login(TEST_ADMIN_CONN, "99999999"));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, admin_client_write(TEST_ADMIN_CONN, "1234"));
+
+    // The right answer to the challenge already used is too late
+    vTaskDelaySec(wait);
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge(TEST_ADMIN_CONN, challenge));
+    admin_client_hmac(KEYPAD_DEFAULT_ADMIN_PIN, "login", challenge, response);
+    response[0] ^= 0x01;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_login(TEST_ADMIN_CONN, response, sizeof(response)));
+    response[0] ^= 0x01;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_WRITE_NOT_PERMITTED, admin_login(TEST_ADMIN_CONN, response, sizeof(response)));
+
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, admin_login(TEST_ADMIN_CONN, response, sizeof(response) - 1));
+
+    // Two failures in a row, the next test logs in after the doubled wait
+    vTaskDelaySec(wait * 2);
+}
+
+// Failed logins wait longer each time, per source and on top of the lockout shared with the keypads
+static void test_admin_login_backoff()
+{
+    const uint32_t wait = ADMIN_LOGIN_BACKOFF_SEC;
+    const uint32_t almost_ms = ADMIN_LOGIN_BACKOFF_SEC * 1000 - 100;
+    uint32_t failures = test_door.failures;
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint8_t response[ADMIN_RESPONSE_LEN];
+    uint16_t http;
+
+    // Every failure starts the shared lockout, the right PIN is refused unchecked until the wait is over
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_client_login(TEST_ADMIN_CONN, "99999999"));
+    TEST_ASSERT_EQUAL_UINT32(failures + 1, test_door.failures);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_RES, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    vTaskDelaySec(wait);
+
+    // The wait doubles with each failure in a row, also when the attacker reconnects
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_client_login(TEST_ADMIN_CONN + 1, "99999999"));
+    vTaskDelaySec(wait);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_RES, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_RES, admin_client_login(TEST_ADMIN_CONN, "99999999"));
+    TEST_ASSERT_EQUAL_UINT32(failures + 2, test_door.failures);
+
+    // HTTP clients are another source, a failure of theirs does not add to the BLE wait
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge_free(ADMIN_HTTP_CONN_BASE, HTTP_ADMIN_SESSIONS, TEST_ADMIN_CLIENT, &http, challenge));
+    admin_client_hmac("99999999", "login", challenge, response);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_login(http, response, sizeof(response)));
+    TEST_ASSERT_EQUAL_UINT32(failures + 3, test_door.failures);
+    admin_logout(http);
+    vTaskDelaySec(wait);
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+
+    // A login clears the count, while the keypads are locked out no one logs in
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_client_login(TEST_ADMIN_CONN, "99999999"));
+    vTaskDelayMSec(almost_ms);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_RES, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    vTaskDelayMSec(200);
+    test_door.locked_out = true;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_RES, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    test_door.locked_out = false;
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL_UINT32(failures + 4, test_door.failures);
+    admin_logout(TEST_ADMIN_CONN + 1);
+}
+
+// Replayed, reordered, altered and misaddressed writes are refused, the session goes on
+static void test_admin_rejects_bad_writes()
+{
+    uint8_t value[ADMIN_MAX_PAYLOAD_LEN + ADMIN_TRAILER_LEN];
+    uint8_t out[ADMIN_MAX_PAYLOAD_LEN];
+    uint16_t out_len;
+    uint16_t len;
+
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+
+    len = admin_client_value(test_uuid, "1234", 5, value);
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(0, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+
+    // The same write again, and an older one
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+    len = admin_client_value(test_uuid, "1234", 4, value);
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+
+    // Payload altered on the way
+    len = admin_client_value(test_uuid, "1234", 6, value);
+    value[0] = '9';
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+
+    // Tagged for another characteristic
+    uint8_t other_uuid[16];
+    memcpy(other_uuid, test_uuid, sizeof(other_uuid));
+    other_uuid[0] ^= 0xFF;
+    len = admin_client_value(other_uuid, "1234", 7, value);
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+
+    // Too short for a trailer, too long for the buffer
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, ADMIN_TRAILER_LEN - 1, out, &out_len));
+    len = admin_client_value(test_uuid, "123456", 8, value);
+    out_len = 5;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+
+    // A later counter still goes through, the gap is fine
+    len = admin_client_value(test_uuid, "1234", 10, value);
+    out_len = sizeof(out);
+    TEST_ASSERT_EQUAL(0, admin_verify_write(TEST_ADMIN_CONN, test_uuid, value, len, out, &out_len));
+}
+
+// A session ends with its timer, on a new challenge and on a disconnect
+static void test_admin_session_ends()
+{
+    const uint32_t almost = ADMIN_SESSION_TIMEOUT_SEC - 1; // vTaskDelaySec() takes a plain value, not an expression
+
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    vTaskDelaySec(almost);
+    TEST_ASSERT_EQUAL(0, admin_client_write(TEST_ADMIN_CONN, "1234"));
+    vTaskDelaySec(2);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, admin_client_write(TEST_ADMIN_CONN, "1234"));
+
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge(TEST_ADMIN_CONN, challenge));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, admin_client_write(TEST_ADMIN_CONN, "1234"));
+
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    admin_logout(TEST_ADMIN_CONN);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, admin_client_write(TEST_ADMIN_CONN, "1234"));
+}
+
+// Clients without a connection of their own never end another login
+static void test_admin_challenge_free()
+{
+    uint8_t challenge[ADMIN_CHALLENGE_LEN];
+    uint8_t again[ADMIN_CHALLENGE_LEN];
+    uint16_t first, second, third;
+
+    TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge_free(ADMIN_HTTP_CONN_BASE, 2, TEST_ADMIN_CLIENT, &first, challenge));
+
+    // Asking again replaces the client's own challenge instead of taking the other handle
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge_free(ADMIN_HTTP_CONN_BASE, 2, TEST_ADMIN_CLIENT, &third, again));
+    TEST_ASSERT_EQUAL(first, third);
+    TEST_ASSERT_NOT_EQUAL(0, memcmp(challenge, again, sizeof(challenge)));
+
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge_free(ADMIN_HTTP_CONN_BASE, 2, TEST_ADMIN_CLIENT + 1, &second, challenge));
+    TEST_ASSERT_NOT_EQUAL(first, second);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, admin_challenge_free(ADMIN_HTTP_CONN_BASE, 2, TEST_ADMIN_CLIENT + 2, &third, challenge));
+    TEST_ASSERT_EQUAL(0, admin_client_write(TEST_ADMIN_CONN, "1234"));
+
+    // An unanswered challenge gives its handle back after a while
+    const uint32_t timeout = ADMIN_CHALLENGE_TIMEOUT_SEC + 1;
+    vTaskDelaySec(timeout);
+    TEST_ASSERT_EQUAL(ESP_OK, admin_challenge_free(ADMIN_HTTP_CONN_BASE, 2, TEST_ADMIN_CLIENT + 2, &third, challenge));
+    TEST_ASSERT_EQUAL(first, third);
+
+    admin_logout(first);
+    admin_logout(second);
+}
+
+// The key derivation is paid once per session: a verified write costs no key schedule and a fraction of a login
+static void test_admin_write_cheaper_than_login()
+{
+    int64_t login_ns = INT64_MAX;
+    int64_t write_ns = INT64_MAX;
+
+    for(int round = 0; round < TEST_ADMIN_TIMING_ROUNDS; round++) {
+        int64_t start = admin_now_ns();
+        for(int i = 0; i < TEST_ADMIN_TIMING_CALLS; i++)
+            TEST_ASSERT_EQUAL(0, admin_client_login(TEST_ADMIN_CONN, KEYPAD_DEFAULT_ADMIN_PIN));
+        int64_t elapsed = admin_now_ns() - start;
+        if(elapsed < login_ns)
+            login_ns = elapsed;
+
+        uint32_t oneshot = test_crypto.oneshot;
+        uint32_t key_setups = test_crypto.key_setups;
+        start = admin_now_ns();
+        for(int i = 0; i < TEST_ADMIN_TIMING_CALLS; i++)
+            TEST_ASSERT_EQUAL(0, admin_client_write(TEST_ADMIN_CONN, "12345678"));
+        elapsed = admin_now_ns() - start;
+        if(elapsed < write_ns)
+            write_ns = elapsed;
+        TEST_ASSERT_EQUAL_UINT32(oneshot, test_crypto.oneshot);
+        TEST_ASSERT_EQUAL_UINT32(key_setups, test_crypto.key_setups);
+    }
+
+    // The client's own HMACs are in both, a login still costs more than twice a write
+    uint32_t login_call_ns = login_ns / TEST_ADMIN_TIMING_CALLS;
+    uint32_t write_call_ns = write_ns / TEST_ADMIN_TIMING_CALLS;
+    printf("admin: login %lu ns, write %lu ns\n", (unsigned long) login_call_ns, (unsigned long) write_call_ns);
+    TEST_ASSERT_LESS_THAN_UINT32(login_call_ns, write_call_ns * 2);
+}
+
+void test_admin()
+{
+    // Default PINs in the emulated NVS
+    nvs_configure();
+    TEST_ASSERT_EQUAL(ESP_OK, admin_init());
+
+    // Each test logs in afresh, a new challenge ends the session of the one before
+    RUN_TEST(test_admin_login_opens_session);
+    RUN_TEST(test_admin_rejects_wrong_response);
+    RUN_TEST(test_admin_login_backoff);
+    RUN_TEST(test_admin_rejects_bad_writes);
+    RUN_TEST(test_admin_session_ends);
+    RUN_TEST(test_admin_challenge_free);
+    RUN_TEST(test_admin_write_cheaper_than_login);
+    admin_logout(TEST_ADMIN_CONN);
+}
@@ -0,0 +1,276 @@
+/*
+ * @file tools/test/main/test_audit.c
+ *
+ * @proj imp-term
+ * @brief Audit log tests: power loss during writes and erases, resumed BLE export
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The module's source is included to reach its state: a power cut loses what
+ * was only buffered in RAM, and the writer task's flush is called directly.
+ * The flash is the emulated audit partition of the linux target, writes and
+ * erases to it can be cut short (the link wraps them, see CMakeLists.txt).
+*/
+
+#include <string.h>
+
+#include "unity.h"
+
+#include "audit.c"
+#include "test.h"
+
+#define TEST_AUDIT_MAX_RECORDS (AUDIT_MAX_SECTORS * AUDIT_RECORDS_PER_SECTOR)
+
+// Records the ring holds, as sized by audit_init()
+#define audit_capacity() (audit_size / AUDIT_RECORD_SIZE)
+
+static struct {
+    int32_t write_cut; // Bytes of the next audit partition write that reach the flash, -1 for all
+    bool erase_cut;    // The next audit sector erase stops half way
+    uint32_t writes;
+    uint32_t erases;
+} power = { .write_cut = -1 };
+
+static audit_record_t records[TEST_AUDIT_MAX_RECORDS];
+
+esp_err_t __real_esp_partition_write(const esp_partition_t * partition, size_t dst_offset, const void * src, size_t size);
+esp_err_t __real_esp_partition_erase_range(const esp_partition_t * partition, size_t offset, size_t size);
+
+esp_err_t __wrap_esp_partition_write(const esp_partition_t * partition, size_t dst_offset, const void * src, size_t size)
+{
+    if(partition != audit_part)
+        return __real_esp_partition_write(partition, dst_offset, src, size);
+
+    power.writes++;
+    if(power.write_cut < 0)
+        return __real_esp_partition_write(partition, dst_offset, src, size);
+
+    size_t done = (size_t) power.write_cut < size ? (size_t) power.write_cut : size;
+    power.write_cut = -1;
+    if(done > 0)
+        __real_esp_partition_write(partition, dst_offset, src, done);
+    return ESP_FAIL;
+}
+
+esp_err_t __wrap_esp_partition_erase_range(const esp_partition_t * partition, size_t offset, size_t size)
+{
+    if(partition != audit_part)
+        return __real_esp_partition_erase_range(partition, offset, size);
+
+    power.erases++;
+    if(!power.erase_cut)
+        return __real_esp_partition_erase_range(partition, offset, size);
+
+    // Only the first half of the sector is back to 0xFF, the rest keeps the old records
+    power.erase_cut = false;
+    uint8_t old[AUDIT_SECTOR_SIZE / 2];
+    ESP_ERROR_CHECK(esp_partition_read(partition, offset + sizeof(old), old, sizeof(old)));
+    ESP_ERROR_CHECK(__real_esp_partition_erase_range(partition, offset, size));
+    ESP_ERROR_CHECK(__real_esp_partition_write(partition, offset + sizeof(old), old, sizeof(old)));
+    return ESP_FAIL;
+}
+
+/*
+ * @brief Cut the power and boot again: the RAM ring and any export are gone, the flash stays
+*/
+static void audit_power_cycle()
+{
+    ram_head = 0;
+    ram_tail = 0;
+    ram_dropped = 0;
+    memset(&export_req, 0, sizeof(export_req));
+    export_generation = 0;
+    if(flash_lock != NULL)
+        vSemaphoreDelete(flash_lock);
+    TEST_ASSERT_EQUAL(ESP_OK, audit_init());
+}
+
+// Erase the whole partition and boot on it
+static void audit_format()
+{
+    const esp_partition_t * part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, AUDIT_PARTITION_LABEL);
+    TEST_ASSERT_NOT_NULL(part);
+    TEST_ASSERT_EQUAL(ESP_OK, __real_esp_partition_erase_range(part, 0, part->size));
+    audit_power_cycle();
+}
+
+// Log events with the aux field numbering them, flushing whenever a page is ready as the writer task would
+static void audit_log_flushed(uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++) {
+        audit_log_event(AUDIT_EVT_ACCESS, AUDIT_SLOT_ACCESS_PIN, AUDIT_RES_GRANTED, AUDIT_SOURCE_KEYPAD, (uint16_t) i);
+        if(ram_head - ram_tail >= AUDIT_RECORDS_PER_PAGE)
+            audit_flush();
+    }
+    audit_flush();
+}
+
+/*
+ * @brief Read the whole log and check the sequence numbers run without a gap or a repeat
+ * @return Records read
+*/
+static size_t audit_check_sequence(uint32_t first_seq, uint32_t last_seq)
+{
+    size_t count = audit_read(0, records, array_len(records));
+    TEST_ASSERT_EQUAL_UINT32(last_seq - first_seq + 1, count);
+    for(size_t i = 0; i < count; i++)
+        TEST_ASSERT_EQUAL_UINT32(first_seq + i, records[i].seq);
+    return count;
+}
+
+// Logging is a RAM append, nothing reaches the flash until a page is full or the writer is asked
+static void test_audit_log_is_ram_append()
+{
+    audit_format();
+    uint32_t writes = power.writes;
+
+    for(uint32_t i = 0; i < AUDIT_RECORDS_PER_PAGE - 1; i++)
+        audit_log_event(AUDIT_EVT_ACCESS, AUDIT_SLOT_ACCESS_PIN, AUDIT_RES_GRANTED, AUDIT_SOURCE_KEYPAD, 0);
+    TEST_ASSERT_EQUAL_UINT32(writes, power.writes);
+    TEST_ASSERT_EQUAL_UINT32(AUDIT_RECORDS_PER_PAGE - 1, audit_last_seq());
+    TEST_ASSERT_EQUAL(0, audit_read(0, records, array_len(records)));
+
+    audit_flush();
+    TEST_ASSERT_EQUAL_UINT32(writes + 1, power.writes); // One page, one write
+    audit_check_sequence(1, AUDIT_RECORDS_PER_PAGE - 1);
+}
+
+// Power lost in the middle of a page write, at several points inside a record
+static void test_audit_recovers_torn_write()
+{
+    const uint32_t before = 10;
+    const uint32_t whole = 5; // Records of the cut page that made it
+
+    for(int32_t cut = 0; cut < (int32_t) AUDIT_RECORD_SIZE; cut += 3) {
+        audit_format();
+        audit_log_flushed(before);
+
+        for(uint32_t i = 0; i < AUDIT_RECORDS_PER_PAGE; i++)
+            audit_log_event(AUDIT_EVT_DOOR_OPEN, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, 0);
+        power.write_cut = whole * AUDIT_RECORD_SIZE + cut;
+        audit_flush();
+
+        // Bytes still 0xFF need no programming, a cut in front of them only leaves the record whole
+        audit_record_t torn = ram_ring[(ram_tail + whole) % AUDIT_RAM_RECORDS];
+        torn.crc = audit_crc(&torn);
+        uint32_t kept = before + whole + 1;
+        for(size_t i = cut; i < AUDIT_RECORD_SIZE; i++) {
+            if(((uint8_t *) &torn)[i] != 0xFF)
+                kept = before + whole;
+        }
+
+        audit_power_cycle();
+        TEST_ASSERT_EQUAL_UINT32(kept, audit_last_seq());
+
+        // A torn record is skipped, the log carries on from the last whole one
+        audit_log_flushed(3);
+        audit_check_sequence(1, kept + 3);
+    }
+}
+
+// Power lost while a full ring erases its oldest sector
+static void test_audit_recovers_torn_erase()
+{
+    audit_format();
+    audit_log_flushed(audit_capacity());
+    uint32_t last = audit_last_seq();
+
+    // The ring is full, the next page erases the oldest sector first
+    power.erase_cut = true;
+    audit_log_flushed(1);
+    TEST_ASSERT_FALSE(power.erase_cut);
+
+    audit_power_cycle();
+    TEST_ASSERT_EQUAL_UINT32(last, audit_last_seq());
+
+    // The half erased sector is erased again, one sector of the oldest records is gone
+    audit_log_flushed(20);
+    uint32_t newest = last + 20;
+    audit_check_sequence(AUDIT_RECORDS_PER_SECTOR + 1, newest);
+}
+
+// Records survive a restart with and without a flush, only the unflushed ones are lost
+static void test_audit_power_cycle_keeps_flushed()
+{
+    audit_format();
+    audit_log_flushed(40);
+    for(uint32_t i = 0; i < 5; i++)
+        audit_log_event(AUDIT_EVT_DOOR_CLOSE, AUDIT_SLOT_NONE, AUDIT_RES_OK, AUDIT_SOURCE_SYSTEM, 0);
+
+    audit_power_cycle();
+    TEST_ASSERT_EQUAL_UINT32(40, audit_last_seq());
+    audit_log_flushed(AUDIT_RECORDS_PER_SECTOR); // Across a sector boundary
+    audit_check_sequence(1, 40 + AUDIT_RECORDS_PER_SECTOR);
+}
+
+// Export over notifications, cut off by a disconnect and resumed from the client's cursor
+static void test_audit_export_resumes()
+{
+    const uint16_t conn = 1, attr = 42;
+    const uint16_t mtu = 3 + 4 * AUDIT_RECORD_SIZE + 10; // Four whole records per notification
+    const uint32_t total = 100;
+
+    audit_format();
+    audit_log_flushed(total);
+    test_ble_connect(conn, mtu);
+
+    // The stack runs out of buffers after five notifications, the export waits
+    test_ble_set_credits(5);
+    TEST_ASSERT_EQUAL(ESP_OK, audit_export_start(conn, attr, 1));
+    TEST_ASSERT_TRUE(audit_export_step());
+    TEST_ASSERT_EQUAL_UINT32(5, test_ble_notify.count);
+    TEST_ASSERT_EQUAL(5 * 4 * AUDIT_RECORD_SIZE, test_ble_notify.len);
+    TEST_ASSERT_EQUAL(attr, test_ble_notify.attr_handle);
+
+    // Another client has to wait for this one
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, audit_export_start(conn + 1, attr, 1));
+
+    // The client disconnects, the export notices and stops
+    test_ble_disconnect(conn);
+    test_ble_set_credits(-1);
+    TEST_ASSERT_FALSE(audit_export_step());
+    TEST_ASSERT_EQUAL_UINT32(5, test_ble_notify.count);
+
+    // It reconnects and asks for what comes after the last record it got
+    const audit_record_t * got = (const audit_record_t *) test_ble_notify.data;
+    uint32_t cursor = got[test_ble_notify.len / AUDIT_RECORD_SIZE - 1].seq + 1;
+    TEST_ASSERT_EQUAL_UINT32(21, cursor);
+    test_ble_connect(conn, mtu);
+    TEST_ASSERT_EQUAL(ESP_OK, audit_export_start(conn, attr, cursor));
+    TEST_ASSERT_FALSE(audit_export_step());
+
+    // Every record once, in order, and an empty notification at the end
+    TEST_ASSERT_EQUAL(total * AUDIT_RECORD_SIZE, test_ble_notify.len);
+    for(uint32_t i = 0; i < total; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i + 1, got[i].seq);
+        TEST_ASSERT_TRUE(audit_record_valid(&got[i]));
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, test_ble_notify.empty);
+}
+
+// A cursor the ring has already overwritten starts the export at the oldest record
+static void test_audit_export_from_overwritten()
+{
+    audit_format();
+    audit_log_flushed(audit_capacity() + AUDIT_RECORDS_PER_PAGE);
+    test_ble_connect(0, BLE_ATT_MTU_MAX);
+
+    TEST_ASSERT_EQUAL(ESP_OK, audit_export_start(0, 1, 1));
+    TEST_ASSERT_FALSE(audit_export_step());
+
+    const audit_record_t * got = (const audit_record_t *) test_ble_notify.data;
+    size_t count = test_ble_notify.len / AUDIT_RECORD_SIZE;
+    TEST_ASSERT_EQUAL(audit_capacity() - AUDIT_RECORDS_PER_SECTOR + AUDIT_RECORDS_PER_PAGE, count);
+    TEST_ASSERT_EQUAL_UINT32(AUDIT_RECORDS_PER_SECTOR + 1, got[0].seq);
+    TEST_ASSERT_EQUAL_UINT32(audit_capacity() + AUDIT_RECORDS_PER_PAGE, got[count - 1].seq);
+}
+
+void test_audit()
+{
+    RUN_TEST(test_audit_log_is_ram_append);
+    RUN_TEST(test_audit_recovers_torn_write);
+    RUN_TEST(test_audit_recovers_torn_erase);
+    RUN_TEST(test_audit_power_cycle_keeps_flushed);
+    RUN_TEST(test_audit_export_resumes);
+    RUN_TEST(test_audit_export_from_overwritten);
+}
@@ -0,0 +1,216 @@
+/*
+ * @file tools/test/main/test_ble.c
+ *
+ * @proj imp-term
+ * @brief Fake NimBLE stack underneath the firmware's BLE code, declared by tools/sim/main/include/sim_nimble.h
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Connections are just a negotiated MTU per handle, and the peer's identity once
+ * it is paired. Bonds are a list of identity addresses in the order they were
+ * made. Notifications are kept for the tests to check, and the stack can be made
+ * to run out of buffers.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+
+#include "test.h"
+
+test_ble_notify_t test_ble_notify;
+test_ble_link_t test_ble_link;
+test_ble_store_t test_ble_store;
+
+static struct {
+    uint16_t mtu[TEST_BLE_MAX_CONN]; // 0 if not connected
+    ble_addr_t peer[TEST_BLE_MAX_CONN];
+    bool bonded[TEST_BLE_MAX_CONN]; // Link encrypted with the bond of peer
+    int32_t credits;
+    ble_addr_t bonds[CONFIG_BT_NIMBLE_MAX_BONDS];
+    int bonds_len;
+} ble;
+
+void test_ble_reset()
+{
+    memset(&ble, 0, sizeof(ble));
+    ble.credits = -1;
+    memset(&test_ble_notify, 0, sizeof(test_ble_notify));
+    memset(&test_ble_link, 0, sizeof(test_ble_link));
+    memset(&test_ble_store, 0, sizeof(test_ble_store));
+}
+
+void test_ble_connect(uint16_t conn_handle, uint16_t mtu)
+{
+    ble.mtu[conn_handle] = mtu;
+}
+
+void test_ble_disconnect(uint16_t conn_handle)
+{
+    ble.mtu[conn_handle] = 0;
+    ble.bonded[conn_handle] = false;
+}
+
+static int test_ble_bond_find(const ble_addr_t * id_addr)
+{
+    for(int i = 0; i < ble.bonds_len; i++) {
+        if(ble_addr_cmp(&ble.bonds[i], id_addr) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int test_ble_pair(uint16_t conn_handle, const ble_addr_t * id_addr)
+{
+    if(test_ble_bond_find(id_addr) < 0) {
+        if(ble.bonds_len >= CONFIG_BT_NIMBLE_MAX_BONDS)
+            return BLE_HS_ESTORE_CAP;
+        ble.bonds[ble.bonds_len++] = *id_addr;
+    }
+    ble.peer[conn_handle] = *id_addr;
+    ble.bonded[conn_handle] = true;
+    return 0;
+}
+
+void test_ble_set_credits(int32_t credits)
+{
+    ble.credits = credits;
+}
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    return conn_handle < TEST_BLE_MAX_CONN ? ble.mtu[conn_handle] : 0;
+}
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc * out_desc)
+{
+    if(ble_att_mtu(handle) == 0)
+        return BLE_HS_ENOTCONN;
+    memset(out_desc, 0, sizeof(*out_desc));
+    out_desc->conn_handle = handle;
+    out_desc->sec_state.encrypted = ble.bonded[handle];
+    out_desc->sec_state.bonded = ble.bonded[handle];
+    out_desc->peer_id_addr = ble.peer[handle];
+    out_desc->conn_itvl = 24; // 30 ms, what phones start with
+    out_desc->supervision_timeout = 500;
+    return 0;
+}
+
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params * params)
+{
+    if(ble_att_mtu(conn_handle) == 0)
+        return BLE_HS_ENOTCONN;
+    test_ble_link.updates++;
+    test_ble_link.itvl_min = params->itvl_min;
+    test_ble_link.itvl_max = params->itvl_max;
+    return 0;
+}
+
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time)
+{
+    if(ble_att_mtu(conn_handle) == 0)
+        return BLE_HS_ENOTCONN;
+    test_ble_link.tx_octets = tx_octets;
+    return 0;
+}
+
+int ble_gap_unpair(const ble_addr_t * peer_addr)
+{
+    int i = test_ble_bond_find(peer_addr);
+    if(i < 0)
+        return BLE_HS_ENOENT;
+    test_ble_store.unpaired++;
+    // The order of the remaining bonds is kept, as the store keeps it
+    memmove(&ble.bonds[i], &ble.bonds[i + 1], (ble.bonds_len - i - 1) * sizeof(ble.bonds[0]));
+    ble.bonds_len--;
+    for(uint16_t conn = 0; conn < TEST_BLE_MAX_CONN; conn++) {
+        if(ble.bonded[conn] && ble_addr_cmp(&ble.peer[conn], peer_addr) == 0)
+            ble.bonded[conn] = false;
+    }
+    return 0;
+}
+
+int ble_store_util_bonded_peers(ble_addr_t * out_peer_id_addrs, int * out_num_peers, int max_peers)
+{
+    test_ble_store.reads++;
+    if(ble.bonds_len > max_peers)
+        return BLE_HS_ENOMEM;
+    memcpy(out_peer_id_addrs, ble.bonds, ble.bonds_len * sizeof(ble.bonds[0]));
+    *out_num_peers = ble.bonds_len;
+    return 0;
+}
+
+int ble_store_util_delete_peer(const ble_addr_t * peer_id_addr)
+{
+    return ble_gap_unpair(peer_id_addr);
+}
+
+int ble_store_util_status_rr(struct ble_store_status_event * event, void * arg)
+{
+    return event->event_code == BLE_STORE_EVENT_OVERFLOW && ble.bonds_len > 0 ? ble_gap_unpair(&ble.bonds[0]) : 0;
+}
+
+int ble_store_clear(void)
+{
+    ble.bonds_len = 0;
+    memset(ble.bonded, 0, sizeof(ble.bonded));
+    return 0;
+}
+
+struct os_mbuf * ble_hs_mbuf_from_flat(const void * buf, uint16_t len)
+{
+    struct os_mbuf * om = calloc(1, sizeof(*om) + len);
+    if(om == NULL)
+        return NULL;
+    om->om_data = (uint8_t *) (om + 1);
+    om->om_len = len;
+    om->om_size = len;
+    memcpy(om->om_data, buf, len);
+    return om;
+}
+
+int os_mbuf_append(struct os_mbuf * om, const void * data, uint16_t len)
+{
+    if(om->om_len + len > om->om_size)
+        return BLE_HS_ENOMEM;
+    memcpy(om->om_data + om->om_len, data, len);
+    om->om_len += len;
+    return 0;
+}
+
+int os_mbuf_copydata(const struct os_mbuf * om, int off, int len, void * dst)
+{
+    if(off < 0 || len < 0 || off + len > om->om_len)
+        return -1;
+    memcpy(dst, om->om_data + off, len);
+    return 0;
+}
+
+// Consumes the buffer whatever the outcome, as NimBLE does
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf * om)
+{
+    int rc = 0;
+
+    if(ble_att_mtu(conn_handle) == 0) {
+        rc = BLE_HS_ENOTCONN;
+    } else if(ble.credits == 0) {
+        rc = BLE_HS_ENOMEM;
+    } else if(om->om_len > ble_att_mtu(conn_handle) - 3) {
+        rc = BLE_HS_EMSGSIZE;
+    } else if(test_ble_notify.len + om->om_len > sizeof(test_ble_notify.data)) {
+        rc = BLE_HS_ENOMEM;
+    } else {
+        if(ble.credits > 0)
+            ble.credits--;
+        memcpy(&test_ble_notify.data[test_ble_notify.len], om->om_data, om->om_len);
+        test_ble_notify.len += om->om_len;
+        test_ble_notify.count++;
+        if(om->om_len == 0)
+            test_ble_notify.empty++;
+        test_ble_notify.conn_handle = conn_handle;
+        test_ble_notify.attr_handle = att_handle;
+    }
+    free(om);
+    return rc;
+}
@@ -0,0 +1,164 @@
+/*
+ * @file tools/test/main/test_board.c
+ *
+ * @proj imp-term
+ * @brief Fake board under the modules being tested: restarts, task stacks, the door, power management and watchdog
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+*/
+
+#include <stdlib.h>
+
+#include <esp_system.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <esp_private/esp_clk.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "keypad.h"
+#include "gpio.h"
+#include "door_io.h"
+#include "sim.h"
+#include "test.h"
+
+static volatile uint32_t restarts;
+static portMUX_TYPE board_lock = portMUX_INITIALIZER_UNLOCKED;
+
+test_door_t test_door;
+test_pm_t test_pm;
+
+struct esp_pm_lock {
+    int32_t count;
+};
+
+bool access_locked_out()
+{
+    return test_door.locked_out;
+}
+
+void access_register_failure()
+{
+    test_door.failures++;
+}
+
+bool door_request_open()
+{
+    test_door.opens++;
+    test_door.opened_at = xTaskGetTickCount();
+    test_door.unlocked = true;
+    return true;
+}
+
+bool door_request_open_from_isr(BaseType_t * woken)
+{
+    return door_request_open();
+}
+
+bool door_request_shut()
+{
+    test_door.shuts++;
+    test_door.unlocked = false;
+    return true;
+}
+
+bool is_door_open()
+{
+    return test_door.unlocked;
+}
+
+// The LEDs of gpio_blink.c are not under test
+void gpio_blink_twice_nonblocking(const uint32_t gpio_num)
+{
+}
+
+esp_err_t esp_pm_configure(const void * config)
+{
+    test_pm.light_sleep = ((const esp_pm_config_t *) config)->light_sleep_enable;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_light_sleep_register_cbs(esp_pm_sleep_cbs_register_config_t * cbs_conf)
+{
+    test_pm.cbs = *cbs_conf;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char * name, esp_pm_lock_handle_t * out_handle)
+{
+    *out_handle = calloc(1, sizeof(**out_handle));
+    return *out_handle != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    taskENTER_CRITICAL(&board_lock);
+    handle->count++;
+    test_pm.held++;
+    taskEXIT_CRITICAL(&board_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+
+    taskENTER_CRITICAL(&board_lock);
+    if(handle->count > 0) {
+        handle->count--;
+        test_pm.held--;
+        ret = ESP_OK;
+    }
+    taskEXIT_CRITICAL(&board_lock);
+    return ret;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup(void)
+{
+    test_pm.gpio_wakeup = true;
+    return ESP_OK;
+}
+
+// There is no task watchdog, the deadlines of supervisor.c are what the tests check
+esp_err_t esp_task_wdt_add(TaskHandle_t task_handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_reset(void)
+{
+    return ESP_OK;
+}
+
+// The RTC timer of snapshot.c, a restart in the tests does not stop the virtual clock either
+uint64_t esp_clk_rtc_time(void)
+{
+    return esp_timer_get_time();
+}
+
+uint32_t test_board_restarts()
+{
+    return restarts;
+}
+
+// A restart ends the test run of the module only: the calling task stops for good
+// (the link wraps esp_restart, see CMakeLists.txt)
+void __wrap_esp_restart(void)
+{
+    restarts++;
+    while(1)
+        vTaskSuspend(NULL);
+}
+
+// Tasks are host threads, the stack sizes in config.h are too small for them, as in the simulator
+BaseType_t __real_xTaskCreatePinnedToCore(TaskFunction_t fn, const char * const name, const uint32_t stack,
+                                          void * const param, UBaseType_t prio, TaskHandle_t * const handle, const BaseType_t core);
+
+BaseType_t __wrap_xTaskCreatePinnedToCore(TaskFunction_t fn, const char * const name, const uint32_t stack,
+                                          void * const param, UBaseType_t prio, TaskHandle_t * const handle, const BaseType_t core)
+{
+    return __real_xTaskCreatePinnedToCore(fn, name, stack < SIM_MIN_STACK_SIZE ? SIM_MIN_STACK_SIZE : stack,
+                                          param, prio, handle, core);
+}
@@ -0,0 +1,220 @@
+/*
+ * @file tools/test/main/test_door_io.c
+ *
+ * @proj imp-term
+ * @brief Door input tests: contact and exit button traces replayed into door_io.c
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * A trace is a list of timed edges on the contact and exit button inputs, with
+ * the bounces of dry contacts, and of lock changes the door task would report.
+ * The edges run the interrupts of door_io.c as the pins would, its task
+ * debounces and tracks the door as on the device. The door itself is the fake
+ * of test_board.c: an open request unlocks it, the trace relocks it. Events
+ * are checked in the audit log, the writer flushes them to flash.
+*/
+
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "unity.h"
+
+#include "config.h"
+#include "door_io.h"
+#include "audit.h"
+#include "common.h"
+#include "test.h"
+
+#define TEST_DOOR_IO_LOCK GPIO_NUM_NC // Trace entry of a lock change instead of an input, level 1 = unlocked
+#define TEST_DOOR_IO_REX_MAX_MS 10 // Exit button press to the door request
+#define TEST_DOOR_IO_MAX_RECORDS 32
+
+// Inputs at rest: contact low (door shut), exit button high (released)
+#define OPEN 1
+#define SHUT 0
+#define PRESS 0
+#define RELEASE 1
+
+typedef struct {
+    uint32_t at_ms; // Since the start of the trace
+    gpio_num_t gpio;
+    uint8_t level;
+} door_io_edge_t;
+
+// Door events logged since a sequence number
+typedef struct {
+    uint32_t exits;
+    uint32_t forced;
+    uint32_t held;
+} door_io_events_t;
+
+static audit_record_t records[TEST_DOOR_IO_MAX_RECORDS];
+
+// An exit with the door opened and shut again, both inputs bouncing
+static const door_io_edge_t trace_exit[] = {
+    {0, DOOR_REX_PIN, PRESS}, {10, DOOR_REX_PIN, RELEASE}, {20, DOOR_REX_PIN, PRESS},
+    {200, DOOR_REX_PIN, RELEASE}, {210, DOOR_REX_PIN, PRESS}, {220, DOOR_REX_PIN, RELEASE},
+    {800, DOOR_CONTACT_PIN, OPEN}, {810, DOOR_CONTACT_PIN, SHUT}, {830, DOOR_CONTACT_PIN, OPEN},
+    {3000, DOOR_CONTACT_PIN, SHUT}, {3010, DOOR_CONTACT_PIN, OPEN}, {3020, DOOR_CONTACT_PIN, SHUT},
+};
+
+// Two presses further apart than the button's debounce
+static const door_io_edge_t trace_two_exits[] = {
+    {0, DOOR_REX_PIN, PRESS}, {100, DOOR_REX_PIN, RELEASE},
+    {DOOR_REX_DEBOUNCE_MS + 50, DOOR_REX_PIN, PRESS}, {DOOR_REX_DEBOUNCE_MS + 150, DOOR_REX_PIN, RELEASE},
+    {DOOR_REX_DEBOUNCE_MS + 200, TEST_DOOR_IO_LOCK, 0},
+};
+
+// The door is let open past the unlock time
+static const door_io_edge_t trace_held[] = {
+    {0, DOOR_REX_PIN, PRESS}, {100, DOOR_REX_PIN, RELEASE},
+    {500, DOOR_CONTACT_PIN, OPEN},
+    {5000, TEST_DOOR_IO_LOCK, 0},
+    {5000 + seconds(DOOR_HELD_OPEN_SEC) + 5000, DOOR_CONTACT_PIN, SHUT},
+};
+
+// Opened while locked, a spike shorter than the debounce before
+static const door_io_edge_t trace_forced[] = {
+    {0, DOOR_CONTACT_PIN, OPEN}, {DOOR_CONTACT_DEBOUNCE_MS - 20, DOOR_CONTACT_PIN, SHUT},
+    {1000, DOOR_CONTACT_PIN, OPEN}, {1010, DOOR_CONTACT_PIN, SHUT}, {1020, DOOR_CONTACT_PIN, OPEN},
+    {4000, DOOR_CONTACT_PIN, SHUT},
+};
+
+/*
+ * @brief Wait until a time of the trace
+*/
+static void door_io_wait_until(TickType_t start, uint32_t at_ms)
+{
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if(elapsed < pdMS_TO_TICKS(at_ms))
+        vTaskDelay(pdMS_TO_TICKS(at_ms) - elapsed);
+}
+
+/*
+ * @brief Replay the edges of a trace before until_ms and wait until then
+ * @return Index of the next edge
+*/
+static size_t door_io_replay(const door_io_edge_t * trace, size_t len, size_t from, uint32_t until_ms, TickType_t start)
+{
+    size_t i;
+    for(i = from; i < len && trace[i].at_ms < until_ms; i++) {
+        door_io_wait_until(start, trace[i].at_ms);
+        if(trace[i].gpio == TEST_DOOR_IO_LOCK) {
+            test_door.unlocked = trace[i].level;
+            door_io_lock_changed();
+        } else {
+            test_gpio_input(trace[i].gpio, trace[i].level);
+        }
+    }
+    if(until_ms != UINT32_MAX)
+        door_io_wait_until(start, until_ms);
+    return i;
+}
+
+/*
+ * @brief Replay a whole trace and let the inputs settle
+*/
+static void door_io_replay_all(const door_io_edge_t * trace, size_t len)
+{
+    door_io_replay(trace, len, 0, UINT32_MAX, xTaskGetTickCount());
+    vTaskDelayMSec(DOOR_REX_DEBOUNCE_MS);
+}
+
+static door_io_events_t door_io_events(uint32_t from_seq)
+{
+    door_io_events_t events = {0};
+
+    audit_flush_request();
+    vTaskDelayMSec(100);
+    size_t len = audit_read(from_seq + 1, records, array_len(records));
+    for(size_t i = 0; i < len; i++) {
+        events.exits += records[i].type == AUDIT_EVT_ACCESS && records[i].source == AUDIT_SOURCE_REX;
+        events.forced += records[i].type == AUDIT_EVT_DOOR_FORCED;
+        events.held += records[i].type == AUDIT_EVT_DOOR_HELD;
+    }
+    return events;
+}
+
+static void test_door_io_exit()
+{
+    uint32_t seq = audit_last_seq();
+    TickType_t start = xTaskGetTickCount();
+
+    // Opened from the interrupt of the first edge, the bounces and the release open nothing
+    size_t next = door_io_replay(trace_exit, array_len(trace_exit), 0, 1, start);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(pdMS_TO_TICKS(TEST_DOOR_IO_REX_MAX_MS), test_door.opened_at - start);
+    next = door_io_replay(trace_exit, array_len(trace_exit), next, 3000, start);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+    TEST_ASSERT_FALSE(door_io_is_shut());
+
+    // Shut again: once the contact settles the lock closes, without waiting out the unlock time
+    door_io_replay(trace_exit, array_len(trace_exit), next, UINT32_MAX, start);
+    vTaskDelayMSec((DOOR_CONTACT_DEBOUNCE_MS - 10));
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.shuts);
+    vTaskDelayMSec(30);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.shuts);
+    TEST_ASSERT_TRUE(door_io_is_shut());
+
+    door_io_events_t events = door_io_events(seq);
+    TEST_ASSERT_EQUAL_UINT32(1, events.exits);
+    TEST_ASSERT_EQUAL_UINT32(0, events.forced);
+    TEST_ASSERT_EQUAL_UINT32(0, events.held);
+}
+
+static void test_door_io_two_exits()
+{
+    uint32_t seq = audit_last_seq();
+
+    // Nobody went through, the door relocks on its own time
+    door_io_replay_all(trace_two_exits, array_len(trace_two_exits));
+    TEST_ASSERT_EQUAL_UINT32(2, test_door.opens);
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.shuts);
+    TEST_ASSERT_EQUAL_UINT32(2, door_io_events(seq).exits);
+}
+
+static void test_door_io_held_open()
+{
+    uint32_t seq = audit_last_seq();
+    TickType_t start = xTaskGetTickCount();
+    const uint32_t held_ms = 5000 + seconds(DOOR_HELD_OPEN_SEC);
+
+    size_t next = door_io_replay(trace_held, array_len(trace_held), 0, held_ms - 200, start);
+    TEST_ASSERT_EQUAL_UINT32(0, door_io_events(seq).held);
+    door_io_replay(trace_held, array_len(trace_held), next, UINT32_MAX, start);
+    vTaskDelayMSec(DOOR_CONTACT_DEBOUNCE_MS * 2);
+
+    // Reported once, and the door shut after relocking needs no early close
+    door_io_events_t events = door_io_events(seq);
+    TEST_ASSERT_EQUAL_UINT32(1, events.held);
+    TEST_ASSERT_EQUAL_UINT32(0, events.forced);
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.shuts);
+    TEST_ASSERT_TRUE(door_io_is_shut());
+}
+
+static void test_door_io_forced()
+{
+    uint32_t seq = audit_last_seq();
+
+    door_io_replay_all(trace_forced, array_len(trace_forced));
+    door_io_events_t events = door_io_events(seq);
+    TEST_ASSERT_EQUAL_UINT32(1, events.forced);
+    TEST_ASSERT_EQUAL_UINT32(0, events.exits);
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.opens);
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.shuts);
+}
+
+void test_door_io()
+{
+    test_gpio_input(DOOR_CONTACT_PIN, SHUT);
+    test_gpio_input(DOOR_REX_PIN, RELEASE);
+    TEST_ASSERT_EQUAL(ESP_OK, door_io_init());
+    TEST_ASSERT_TRUE(door_io_is_shut());
+
+    RUN_TEST(test_door_io_exit);
+    RUN_TEST(test_door_io_two_exits);
+    RUN_TEST(test_door_io_held_open);
+    RUN_TEST(test_door_io_forced);
+}
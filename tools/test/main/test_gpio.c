@@ -0,0 +1,165 @@
+/*
+ * @file tools/test/main/test_gpio.c
+ *
+ * @proj imp-term
+ * @brief Fake GPIO underneath main/gpio.c: driver, registers and keypads pressed by the tests
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * A held key connects its column to its row. At rest all columns are driven
+ * high, so the row reads high in the input register. main/gpio.c scans by
+ * clearing the columns and setting them back one at a time through the set
+ * registers; the last value written there is the column being driven when it
+ * reads the row. A press calls the row's interrupt handler if the row is
+ * armed for an edge; armed as a wakeup level instead, the chip is asleep and
+ * the edge is lost, as it can be on the device. The door contact and the exit
+ * button are plain inputs the tests drive, with the same interrupts.
+*/
+
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include <soc/gpio_reg.h>
+#include <soc/gpio_struct.h>
+
+#include "config.h"
+#include "gpio.h"
+#include "common.h"
+#include "test.h"
+
+volatile test_gpio_regs_t test_gpio_regs;
+gpio_dev_t GPIO;
+
+typedef struct {
+    uint8_t keypad;
+    uint8_t index;
+    gpio_num_t gpio;
+} test_gpio_pin_t;
+
+#define X_KEYPAD(id, cols, rows, keymap) [id] = {cols, keymap},
+static const struct {
+    uint8_t cols;
+    const char * keymap;
+} keypads[KEYPAD_COUNT] = { KEYPADS(X_KEYPAD) };
+
+#define X_PIN(keypad, index, gpio) {keypad, index, gpio},
+static const test_gpio_pin_t cols[] = { KEYPAD_COL_PINS(X_PIN) };
+static const test_gpio_pin_t rows[] = { KEYPAD_ROW_PINS(X_PIN) };
+
+static uint8_t levels[GPIO_NUM_MAX];
+static gpio_isr_t isr_handlers[GPIO_NUM_MAX];
+static void * isr_args[GPIO_NUM_MAX];
+
+static struct {
+    bool down;
+    gpio_num_t row;
+    gpio_num_t col;
+} pressed;
+
+static gpio_num_t test_gpio_find(const test_gpio_pin_t * pins, size_t len, uint8_t keypad, uint8_t index)
+{
+    for(size_t i = 0; i < len; i++) {
+        if(pins[i].keypad == keypad && pins[i].index == index)
+            return pins[i].gpio;
+    }
+    return GPIO_NUM_NC;
+}
+
+static void test_gpio_set_row(bool high)
+{
+    uint64_t in = (uint64_t) test_gpio_regs.in1 << 32 | test_gpio_regs.in;
+    in = high ? in | BIT64(pressed.row) : in & ~BIT64(pressed.row);
+    test_gpio_regs.in = (uint32_t) in;
+    test_gpio_regs.in1 = (uint32_t) (in >> 32);
+}
+
+int test_gpio_press(uint8_t keypad, char key)
+{
+    const char * pos = key != '\0' ? strchr(keypads[keypad].keymap, key) : NULL;
+    if(pos == NULL)
+        return -1;
+    uint8_t index = pos - keypads[keypad].keymap;
+    gpio_num_t row = test_gpio_find(rows, array_len(rows), keypad, index / keypads[keypad].cols);
+    gpio_num_t col = test_gpio_find(cols, array_len(cols), keypad, index % keypads[keypad].cols);
+    if(row == GPIO_NUM_NC || col == GPIO_NUM_NC)
+        return -1;
+
+    pressed.down = true;
+    pressed.row = row;
+    pressed.col = col;
+    test_gpio_set_row(true);
+
+    if(GPIO.pin[row].int_type == GPIO_INTR_POSEDGE && isr_handlers[row] != NULL)
+        isr_handlers[row](isr_args[row]);
+    return 0;
+}
+
+void test_gpio_release()
+{
+    test_gpio_set_row(false);
+    pressed.down = false;
+}
+
+void test_gpio_input(gpio_num_t gpio, uint32_t level)
+{
+    bool changed = levels[gpio] != (level != 0);
+    levels[gpio] = level != 0;
+
+    gpio_int_type_t type = GPIO.pin[gpio].int_type;
+    bool edge = type == GPIO_INTR_ANYEDGE || (type == GPIO_INTR_POSEDGE && level) || (type == GPIO_INTR_NEGEDGE && !level);
+    if(changed && edge && isr_handlers[gpio] != NULL)
+        isr_handlers[gpio](isr_args[gpio]);
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    levels[gpio_num] = level != 0;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return 0;
+    if(pressed.down && pressed.row == gpio_num) {
+        uint64_t driven = (uint64_t) test_gpio_regs.out1_w1ts << 32 | test_gpio_regs.out_w1ts;
+        return (driven & BIT64(pressed.col)) != 0;
+    }
+    return levels[gpio_num];
+}
+
+esp_err_t gpio_config(const gpio_config_t * config)
+{
+    for(uint8_t gpio = 0; gpio < GPIO_NUM_MAX; gpio++) {
+        if(config->pin_bit_mask & BIT64(gpio))
+            GPIO.pin[gpio].int_type = config->intr_type;
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void * args)
+{
+    if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    isr_handlers[gpio_num] = isr_handler;
+    isr_args[gpio_num] = args;
+    return ESP_OK;
+}
@@ -0,0 +1,52 @@
+/*
+ * @file tools/test/main/test_main.c
+ *
+ * @proj imp-term
+ * @brief Host tests of the firmware modules, run on the linux target
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The modules are the firmware's own sources, only the hardware and the NimBLE
+ * stack underneath them are fakes. Time is the simulator's virtual clock
+ * (tools/sim/main/sim_clock.c): it moves on whenever every task is blocked, so
+ * the timing of a test is the same on every run and host.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "config.h"
+#include "audit.h"
+#include "common.h"
+#include "test.h"
+
+void setUp(void)
+{
+    test_ble_reset();
+    memset(&test_door, 0, sizeof(test_door));
+}
+
+void tearDown(void)
+{
+}
+
+void app_main(void)
+{
+    UNITY_BEGIN();
+    test_audit();
+    // From here on the audit writer runs as on the device, the other modules' events reach flash
+    TEST_ASSERT_EQUAL(pdPASS, task_create(&audit_writer_task, NULL, NULL, TASK_AUDIT_WRITER));
+    test_ota();
+    test_admin();
+    test_phone();
+    test_power();
+    test_wiegand();
+    test_schedule();
+    test_otp();
+    test_door_io();
+    test_snapshot();
+    test_supervisor(); // Last, its restart leaves the supervisor suspended
+    exit(UNITY_END());
+}
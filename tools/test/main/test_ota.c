@@ -0,0 +1,450 @@
+/*
+ * @file tools/test/main/test_ota.c
+ *
+ * @proj imp-term
+ * @brief Firmware update tests: chunk pipeline, resume, window and image verification
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The module's source is included to boot it again between the tests. The
+ * inactive OTA partition is a temporary file behind the esp_ota_* stand-in
+ * (include/esp_ota_ops.h), writing it takes as long as erasing and programming
+ * the sectors on the chip would. The test task is the client and the NimBLE
+ * host at once: it writes chunks at the pace of a fast connection interval and
+ * follows the window the module reports.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "ota.c"
+#include "test.h"
+
+#define TEST_OTA_CONN 0
+#define TEST_OTA_MTU 247
+#define TEST_OTA_IMAGE_SIZE (100 * 1024 + 123) // Not a whole number of buffers
+#define TEST_OTA_CHUNKS_PER_TICK 5 // Writes without response one 10 ms tick of 7.5 ms connection events carries
+#define TEST_OTA_ERASE_MS 40 // Flash sector erase
+#define TEST_OTA_PROGRAM_MS 10 // Programming one 4 KiB sector
+#define TEST_OTA_SECTOR_SIZE 4096
+
+// The ESP image header starts with this, esp_ota_end() checks it
+#define TEST_OTA_IMAGE_MAGIC 0xE9
+
+static const esp_partition_t ota_parts[] = {
+    {.type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0, .address = 0x20000, .size = 0x180000, .label = "ota_0"},
+    {.type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1, .address = 0x1a0000, .size = 0x180000, .label = "ota_1"},
+};
+
+// The inactive partition and what the firmware did with it
+static struct {
+    FILE * file;
+    bool open;             // Between esp_ota_begin() and esp_ota_end()/esp_ota_abort()
+    volatile bool writing; // The flash task is inside esp_ota_write()
+    size_t written;
+    uint32_t begins;
+    uint32_t aborts;
+    const esp_partition_t * boot;
+    esp_ota_img_states_t running_state;
+    bool confirmed;
+} flash;
+
+// Client side of the transfer
+static struct {
+    uint32_t overlap; // Chunks accepted while the flash task was writing
+    uint32_t chunks;
+} client;
+
+static uint8_t image[TEST_OTA_IMAGE_SIZE];
+static uint8_t readback[TEST_OTA_IMAGE_SIZE];
+static TaskHandle_t flash_task;
+
+const esp_partition_t * esp_ota_get_running_partition(void)
+{
+    return &ota_parts[0];
+}
+
+const esp_partition_t * esp_ota_get_next_update_partition(const esp_partition_t * start_from)
+{
+    return &ota_parts[1];
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t * partition, esp_ota_img_states_t * ota_state)
+{
+    *ota_state = flash.running_state;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    flash.confirmed = true;
+    flash.running_state = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t * partition, size_t image_size, esp_ota_handle_t * out_handle)
+{
+    TEST_ASSERT_EQUAL_PTR(&ota_parts[1], partition);
+    TEST_ASSERT_FALSE(flash.open);
+    if(flash.file != NULL)
+        fclose(flash.file);
+    flash.file = tmpfile();
+    TEST_ASSERT_NOT_NULL(flash.file);
+    flash.open = true;
+    flash.written = 0;
+    flash.begins++;
+    *out_handle = flash.begins;
+    return ESP_OK;
+}
+
+// Sequential writes erase each sector as they reach it, as ESP-IDF does
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void * data, size_t size)
+{
+    TEST_ASSERT_TRUE(flash.open);
+    TEST_ASSERT_EQUAL_UINT32(flash.begins, handle);
+
+    uint32_t sectors_before = (flash.written + TEST_OTA_SECTOR_SIZE - 1) / TEST_OTA_SECTOR_SIZE;
+    uint32_t sectors_after = (flash.written + size + TEST_OTA_SECTOR_SIZE - 1) / TEST_OTA_SECTOR_SIZE;
+    uint32_t ms = (sectors_after - sectors_before) * TEST_OTA_ERASE_MS
+                  + (size + TEST_OTA_SECTOR_SIZE - 1) / TEST_OTA_SECTOR_SIZE * TEST_OTA_PROGRAM_MS;
+
+    flash.writing = true;
+    vTaskDelayMSec(ms);
+    TEST_ASSERT_EQUAL(size, fwrite(data, 1, size, flash.file));
+    flash.written += size;
+    flash.writing = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    TEST_ASSERT_TRUE(flash.open);
+    flash.open = false;
+
+    uint8_t magic = 0;
+    rewind(flash.file);
+    if(fread(&magic, 1, 1, flash.file) != 1 || magic != TEST_OTA_IMAGE_MAGIC)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    flash.open = false;
+    flash.aborts++;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t * partition)
+{
+    flash.boot = partition;
+    return ESP_OK;
+}
+
+/*
+ * @brief Boot the module again with an empty partition and connect the client
+*/
+static void ota_boot(uint16_t mtu)
+{
+    if(flash_task != NULL)
+        vTaskDelete(flash_task);
+    if(free_queue != NULL) {
+        vQueueDelete(free_queue);
+        vQueueDelete(job_queue);
+    }
+    if(flash.file != NULL)
+        fclose(flash.file);
+    memset(&flash, 0, sizeof(flash));
+    memset(&client, 0, sizeof(client));
+    memset(&ota, 0, sizeof(ota));
+    ota.fill_buf = -1;
+    ota.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    ota_handle = 0;
+
+    TEST_ASSERT_EQUAL(ESP_OK, ota_init());
+    TEST_ASSERT_EQUAL(pdPASS, task_create(&ota_flash_task, NULL, &flash_task, TASK_OTA_FLASH));
+    test_ble_connect(TEST_OTA_CONN, mtu);
+}
+
+// Random image that the stand-in accepts, or not if the magic byte is wrong
+static void ota_make_image(uint8_t magic)
+{
+    srand(TEST_OTA_IMAGE_SIZE);
+    for(size_t i = 0; i < sizeof(image); i++)
+        image[i] = rand();
+    image[0] = magic;
+}
+
+static int ota_begin(const uint8_t * sha256)
+{
+    uint8_t cmd[OTA_BEGIN_CMD_LEN] = {OTA_CMD_BEGIN};
+    uint32_t size = sizeof(image);
+    memcpy(&cmd[1], &size, sizeof(size));
+    memcpy(&cmd[5], sha256, 32);
+    return ota_control_write(TEST_OTA_CONN, 1, cmd, sizeof(cmd));
+}
+
+static int ota_begin_image()
+{
+    uint8_t sha256[32];
+    mbedtls_sha256(image, sizeof(image), sha256, 0);
+    return ota_begin(sha256);
+}
+
+static int ota_command(uint8_t op)
+{
+    return ota_control_write(TEST_OTA_CONN, 1, &op, 1);
+}
+
+// One write to the data characteristic from a connection, as the NimBLE host hands it over
+static int ota_send_chunk_from(uint16_t conn_handle, uint32_t offset, uint16_t len)
+{
+    static uint8_t write[TEST_OTA_MTU];
+    memcpy(write, &offset, sizeof(offset));
+    memcpy(&write[sizeof(offset)], &image[offset], len);
+
+    struct os_mbuf * om = ble_hs_mbuf_from_flat(write, sizeof(offset) + len);
+    TEST_ASSERT_NOT_NULL(om);
+    int rc = ota_data_write(conn_handle, om);
+    free(om);
+
+    if(rc == 0) {
+        client.chunks++;
+        if(flash.writing)
+            client.overlap++;
+    }
+    return rc;
+}
+
+static int ota_send_chunk(uint32_t offset, uint16_t len)
+{
+    return ota_send_chunk_from(TEST_OTA_CONN, offset, len);
+}
+
+static ota_status_t ota_status()
+{
+    ota_status_t status;
+    ota_get_status(TEST_OTA_CONN, &status);
+    return status;
+}
+
+/*
+ * @brief Wait for the module to reach a state
+ * @return Ticks waited
+*/
+static TickType_t ota_wait_state(uint8_t state)
+{
+    TickType_t start = xTaskGetTickCount();
+    for(int i = 0; i < 1000 && ota.state != state; i++)
+        vTaskDelay(1);
+    TEST_ASSERT_EQUAL_UINT8(state, ota.state);
+    return xTaskGetTickCount() - start;
+}
+
+/*
+ * @brief Send the image from `from` up to `to`, never more than the window ahead of the flash
+*/
+static void ota_stream(uint32_t from, uint32_t to)
+{
+    uint32_t offset = from;
+    while(offset < to) {
+        ota_status_t status = ota_status();
+        TEST_ASSERT_EQUAL_UINT8(OTA_STATE_RECEIVING, status.state);
+        TEST_ASSERT_EQUAL_UINT32(offset, status.received);
+
+        for(int sent = 0; sent < TEST_OTA_CHUNKS_PER_TICK && offset < to; sent++) {
+            uint16_t len = to - offset < status.max_chunk ? to - offset : status.max_chunk;
+            if(offset + len - ota.committed > status.window)
+                break;
+            TEST_ASSERT_EQUAL(0, ota_send_chunk(offset, len));
+            offset += len;
+        }
+        vTaskDelay(1);
+    }
+}
+
+static void test_ota_streams_image()
+{
+    ota_boot(TEST_OTA_MTU);
+    ota_make_image(TEST_OTA_IMAGE_MAGIC);
+
+    TickType_t start = xTaskGetTickCount();
+    TEST_ASSERT_EQUAL(0, ota_begin_image());
+    ota_wait_state(OTA_STATE_RECEIVING);
+    TEST_ASSERT_EQUAL_UINT32(1, test_ble_link.updates);
+    TEST_ASSERT_EQUAL_UINT16(OTA_CONN_ITVL_MIN, test_ble_link.itvl_min);
+    TEST_ASSERT_EQUAL_UINT16(OTA_CONN_ITVL_MAX, test_ble_link.itvl_max);
+    TEST_ASSERT_EQUAL_UINT16(251, test_ble_link.tx_octets);
+
+    ota_stream(0, sizeof(image));
+    TEST_ASSERT_EQUAL(0, ota_command(OTA_CMD_END));
+    ota_wait_state(OTA_STATE_DONE);
+    TickType_t elapsed = xTaskGetTickCount() - start;
+
+    TEST_ASSERT_EQUAL(sizeof(image), flash.written);
+    rewind(flash.file);
+    TEST_ASSERT_EQUAL(sizeof(image), fread(readback, 1, sizeof(readback), flash.file));
+    TEST_ASSERT_EQUAL_MEMORY(image, readback, sizeof(image));
+    TEST_ASSERT_EQUAL_PTR(&ota_parts[1], flash.boot);
+    TEST_ASSERT_EQUAL_UINT32(1, flash.begins);
+
+    // The client got the final state before the restart
+    ota_status_t last;
+    TEST_ASSERT_GREATER_OR_EQUAL(sizeof(last), test_ble_notify.len);
+    memcpy(&last, &test_ble_notify.data[test_ble_notify.len - sizeof(last)], sizeof(last));
+    TEST_ASSERT_EQUAL_UINT8(OTA_STATE_DONE, last.state);
+    TEST_ASSERT_EQUAL_UINT32(sizeof(image), last.committed);
+
+    uint32_t restarts = test_board_restarts();
+    vTaskDelayMSec(OTA_REBOOT_DELAY_MS + 100);
+    TEST_ASSERT_EQUAL_UINT32(restarts + 1, test_board_restarts());
+
+    // BLE and flash overlap: a transfer takes well under the link time and the flash time added up
+    TickType_t link_ticks = (sizeof(image) + TEST_OTA_MTU - 8) / (TEST_OTA_MTU - 7) / TEST_OTA_CHUNKS_PER_TICK;
+    TickType_t sectors = (sizeof(image) + TEST_OTA_SECTOR_SIZE - 1) / TEST_OTA_SECTOR_SIZE;
+    TickType_t flash_ticks = pdMS_TO_TICKS(sectors * (TEST_OTA_ERASE_MS + TEST_OTA_PROGRAM_MS));
+    TEST_ASSERT_GREATER_THAN_UINT32(0, client.overlap);
+    TEST_ASSERT_LESS_THAN_UINT32((link_ticks + flash_ticks) * 3, elapsed * 4);
+}
+
+static void test_ota_resumes_after_disconnect()
+{
+    ota_boot(TEST_OTA_MTU);
+    ota_make_image(TEST_OTA_IMAGE_MAGIC);
+
+    TEST_ASSERT_EQUAL(0, ota_begin_image());
+    ota_wait_state(OTA_STATE_RECEIVING);
+    ota_stream(0, sizeof(image) / 2);
+    uint32_t received = ota_status().received;
+
+    // Lost and repeated chunks are refused, the client resends from `received`
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_OFFSET, ota_send_chunk(received + 240, 240));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_OFFSET, ota_send_chunk(received - 240, 240));
+
+    // Another central cannot slip its chunks into the image
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_WRITE_NOT_PERMITTED, ota_send_chunk_from(TEST_OTA_CONN + 1, received, 240));
+    TEST_ASSERT_EQUAL_UINT32(received, ota_status().received);
+
+    // The phone reconnects with a smaller MTU and starts the same image again
+    test_ble_disconnect(TEST_OTA_CONN);
+    vTaskDelay(pdMS_TO_TICKS(500));
+    test_ble_connect(TEST_OTA_CONN, 185);
+    TEST_ASSERT_EQUAL(0, ota_begin_image());
+
+    ota_status_t status = ota_status();
+    TEST_ASSERT_EQUAL_UINT8(OTA_STATE_RECEIVING, status.state);
+    TEST_ASSERT_EQUAL_UINT32(received, status.received);
+    TEST_ASSERT_EQUAL_UINT16(185 - 7, status.max_chunk);
+
+    ota_stream(received, sizeof(image));
+    TEST_ASSERT_EQUAL(0, ota_command(OTA_CMD_END));
+    ota_wait_state(OTA_STATE_DONE);
+    TEST_ASSERT_EQUAL_UINT32(1, flash.begins);
+    TEST_ASSERT_EQUAL_UINT32(0, flash.aborts);
+
+    rewind(flash.file);
+    TEST_ASSERT_EQUAL(sizeof(image), fread(readback, 1, sizeof(readback), flash.file));
+    TEST_ASSERT_EQUAL_MEMORY(image, readback, sizeof(image));
+
+    vTaskDelayMSec(OTA_REBOOT_DELAY_MS + 100);
+}
+
+static void test_ota_rejects_corrupt_image()
+{
+    ota_boot(TEST_OTA_MTU);
+    ota_make_image(TEST_OTA_IMAGE_MAGIC);
+
+    uint8_t sha256[32];
+    mbedtls_sha256(image, sizeof(image), sha256, 0);
+    image[sizeof(image) / 2] ^= 0x01; // Flipped on the way
+
+    uint32_t restarts = test_board_restarts();
+    TEST_ASSERT_EQUAL(0, ota_begin(sha256));
+    ota_wait_state(OTA_STATE_RECEIVING);
+    ota_stream(0, sizeof(image));
+    TEST_ASSERT_EQUAL(0, ota_command(OTA_CMD_END));
+    ota_wait_state(OTA_STATE_ERROR);
+
+    TEST_ASSERT_EQUAL_UINT8(ESP_ERR_INVALID_CRC & 0xFF, ota_status().error);
+    TEST_ASSERT_EQUAL_UINT32(1, flash.aborts);
+    TEST_ASSERT_NULL(flash.boot);
+    vTaskDelayMSec(OTA_REBOOT_DELAY_MS + 100);
+    TEST_ASSERT_EQUAL_UINT32(restarts, test_board_restarts());
+}
+
+static void test_ota_rejects_invalid_image()
+{
+    ota_boot(TEST_OTA_MTU);
+    ota_make_image(0x00);
+
+    uint32_t restarts = test_board_restarts();
+    TEST_ASSERT_EQUAL(0, ota_begin_image());
+    ota_wait_state(OTA_STATE_RECEIVING);
+    ota_stream(0, sizeof(image));
+    TEST_ASSERT_EQUAL(0, ota_command(OTA_CMD_END));
+    ota_wait_state(OTA_STATE_ERROR);
+
+    TEST_ASSERT_EQUAL_UINT8(ESP_ERR_OTA_VALIDATE_FAILED & 0xFF, ota_status().error);
+    TEST_ASSERT_NULL(flash.boot);
+    vTaskDelayMSec(OTA_REBOOT_DELAY_MS + 100);
+    TEST_ASSERT_EQUAL_UINT32(restarts, test_board_restarts());
+}
+
+static void test_ota_window_overrun()
+{
+    ota_boot(TEST_OTA_MTU);
+    ota_make_image(TEST_OTA_IMAGE_MAGIC);
+
+    TEST_ASSERT_EQUAL(0, ota_begin_image());
+    ota_wait_state(OTA_STATE_RECEIVING);
+    uint16_t max_chunk = ota_status().max_chunk;
+
+    // A client ignoring the window runs out of buffers, nothing is dropped silently
+    uint32_t offset = 0;
+    int rc;
+    while((rc = ota_send_chunk(offset, max_chunk)) == 0)
+        offset += max_chunk;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_PREPARE_QUEUE_FULL, rc);
+    TEST_ASSERT_EQUAL_UINT32(offset, ota_status().received);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OTA_BUF_COUNT * OTA_BUF_SIZE, offset);
+
+    // Once the flash caught up the same chunk goes through
+    vTaskDelay(pdMS_TO_TICKS(2 * (TEST_OTA_ERASE_MS + TEST_OTA_PROGRAM_MS)));
+    TEST_ASSERT_EQUAL(0, ota_send_chunk(offset, max_chunk));
+
+    TEST_ASSERT_EQUAL(0, ota_command(OTA_CMD_ABORT));
+    vTaskDelay(pdMS_TO_TICKS(500));
+    TEST_ASSERT_FALSE(flash.open);
+    TEST_ASSERT_FALSE(ota_in_progress());
+}
+
+static void test_ota_confirms_pending_image()
+{
+    ota_boot(TEST_OTA_MTU);
+
+    flash.running_state = ESP_OTA_IMG_VALID;
+    ota_confirm_image();
+    TEST_ASSERT_FALSE(flash.confirmed);
+
+    flash.running_state = ESP_OTA_IMG_PENDING_VERIFY;
+    ota_confirm_image();
+    TEST_ASSERT_TRUE(flash.confirmed);
+}
+
+void test_ota()
+{
+    // The test task stands in for the NimBLE host, the flash task must not preempt it
+    UBaseType_t prio = uxTaskPriorityGet(NULL);
+    vTaskPrioritySet(NULL, task_priority(TASK_NIMBLE_HOST));
+
+    RUN_TEST(test_ota_streams_image);
+    RUN_TEST(test_ota_resumes_after_disconnect);
+    RUN_TEST(test_ota_rejects_corrupt_image);
+    RUN_TEST(test_ota_rejects_invalid_image);
+    RUN_TEST(test_ota_window_overrun);
+    RUN_TEST(test_ota_confirms_pending_image);
+
+    vTaskPrioritySet(NULL, prio);
+}
@@ -0,0 +1,224 @@
+/*
+ * @file tools/test/main/test_otp.c
+ *
+ * @proj imp-term
+ * @brief One-time code tests: RFC 6238 vectors, the time step window, single-use visitor codes and the verification cost
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Secrets and visitor codes are pushed through otp_command() as the web client
+ * does, and codes are claimed as the keypad does at '#'. The wall clock runs on
+ * with the virtual one, so the refresh timer brings the code table to each new
+ * time step by itself. otp.c is included to compute codes for any time and to
+ * look at its table and its pending used bits.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "unity.h"
+
+#include "otp.c"
+
+#include "test.h"
+
+#define TEST_OTP_SLOT 3
+#define TEST_OTP_TIME 2000000000 // 20 s into its step
+#define TEST_OTP_VISITOR 12345678
+#define TEST_OTP_OTHER_VISITOR 87654321
+#define TEST_OTP_WRONG_CODE "000000" // None of the codes of the benchmark's secrets around TEST_OTP_TIME
+#define TEST_OTP_TIMING_ROUNDS 5
+#define TEST_OTP_TIMING_CALLS 1000
+
+// RFC 6238 appendix B, SHA1, the last OTP_TOTP_DIGITS digits
+static const uint8_t rfc6238_key[OTP_SECRET_LEN] = "12345678901234567890";
+static const struct {
+    int64_t time;
+    uint32_t code;
+} rfc6238_vectors[] = {
+    {59, 287082},
+    {1111111109, 81804},
+    {1111111111, 50471},
+    {1234567890, 5924},
+    {2000000000, 279037},
+    {20000000000, 353130},
+};
+
+static void otp_push_secret(uint8_t slot, const uint8_t * key)
+{
+    uint8_t cmd[3 + OTP_SECRET_LEN] = { OTP_CMD_TOTP_SET, slot, SCHEDULE_ALWAYS };
+    memcpy(&cmd[3], key, OTP_SECRET_LEN);
+    TEST_ASSERT_EQUAL(0, otp_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+}
+
+static void otp_remove_secret(uint8_t slot)
+{
+    uint8_t cmd[] = { OTP_CMD_TOTP_REMOVE, slot };
+    TEST_ASSERT_EQUAL(0, otp_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+}
+
+static void otp_at(uint32_t epoch)
+{
+    TEST_ASSERT_EQUAL(ESP_OK, schedule_set_time(epoch, AUDIT_SOURCE_BLE));
+}
+
+/*
+ * @brief Claim a code as typed on the keypad
+ * @return Audit slot or -1
+*/
+static int otp_type(uint32_t value, uint8_t digits)
+{
+    char code[KEYPAD_PIN_MAX_LEN + 1];
+    uint8_t schedule = SCHEDULE_COUNT;
+
+    snprintf(code, sizeof(code), "%0*lu", digits, (unsigned long) value);
+    int slot = otp_claim(code, &schedule);
+    if(slot >= 0)
+        TEST_ASSERT_EQUAL_UINT8(SCHEDULE_ALWAYS, schedule);
+    return slot;
+}
+
+static int64_t otp_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_otp_rfc6238_vectors()
+{
+    for(uint8_t i = 0; i < array_len(rfc6238_vectors); i++)
+        TEST_ASSERT_EQUAL_UINT32(rfc6238_vectors[i].code, otp_totp(rfc6238_key, rfc6238_vectors[i].time / OTP_STEP_SEC));
+}
+
+static void test_otp_totp_window()
+{
+    int64_t step = TEST_OTP_TIME / OTP_STEP_SEC;
+    otp_push_secret(TEST_OTP_SLOT, rfc6238_key);
+
+    // A step early, the code of the next step is taken (clock drift), once
+    otp_at(TEST_OTP_TIME - OTP_STEP_SEC);
+    TEST_ASSERT_EQUAL(AUDIT_SLOT_TOTP(TEST_OTP_SLOT), otp_type(279037, OTP_TOTP_DIGITS));
+    TEST_ASSERT_EQUAL(-1, otp_type(279037, OTP_TOTP_DIGITS));
+
+    // The timer moves the table on, the used code stays used and older ones are refused
+    vTaskDelaySec(OTP_STEP_SEC);
+    TEST_ASSERT_EQUAL(step, totp.step);
+    TEST_ASSERT_EQUAL(-1, otp_type(279037, OTP_TOTP_DIGITS));
+    TEST_ASSERT_EQUAL(-1, otp_type(otp_totp(rfc6238_key, step - 1), OTP_TOTP_DIGITS));
+    TEST_ASSERT_EQUAL(-1, otp_type(otp_totp(rfc6238_key, step + 2), OTP_TOTP_DIGITS));
+    TEST_ASSERT_EQUAL(AUDIT_SLOT_TOTP(TEST_OTP_SLOT), otp_type(otp_totp(rfc6238_key, step + 1), OTP_TOTP_DIGITS));
+
+    // Given back when access was not granted after all
+    otp_release(AUDIT_SLOT_TOTP(TEST_OTP_SLOT));
+    TEST_ASSERT_EQUAL(AUDIT_SLOT_TOTP(TEST_OTP_SLOT), otp_type(otp_totp(rfc6238_key, step + 1), OTP_TOTP_DIGITS));
+
+    // Set a day ahead, the table follows at once, and no code is taken without a valid clock
+    otp_at(TEST_OTP_TIME + 86400);
+    TEST_ASSERT_EQUAL(AUDIT_SLOT_TOTP(TEST_OTP_SLOT),
+                      otp_type(otp_totp(rfc6238_key, (TEST_OTP_TIME + 86400) / OTP_STEP_SEC), OTP_TOTP_DIGITS));
+    otp_at(SCHEDULE_MIN_VALID_TIME - 1);
+    TEST_ASSERT_EQUAL(-1, otp_type(otp_totp(rfc6238_key, (SCHEDULE_MIN_VALID_TIME - 1) / OTP_STEP_SEC), OTP_TOTP_DIGITS));
+
+    otp_remove_secret(TEST_OTP_SLOT);
+    otp_at(TEST_OTP_TIME);
+    TEST_ASSERT_EQUAL(-1, otp_type(otp_totp(rfc6238_key, step), OTP_TOTP_DIGITS));
+}
+
+static void test_otp_visitor_single_use()
+{
+    uint8_t cmd[1 + 2 * sizeof(uint32_t)] = { OTP_CMD_VISITOR_ADD };
+    uint32_t codes[] = { TEST_OTP_VISITOR, TEST_OTP_OTHER_VISITOR };
+    memcpy(&cmd[1], codes, sizeof(codes));
+    TEST_ASSERT_EQUAL(0, otp_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+    codes[1] = OTP_VISITOR_MAX + 1;
+    memcpy(&cmd[1], codes, sizeof(codes));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, otp_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+
+    otp_at(TEST_OTP_TIME);
+    int slot = otp_type(TEST_OTP_VISITOR, OTP_VISITOR_DIGITS);
+    TEST_ASSERT_GREATER_OR_EQUAL(AUDIT_SLOT_VISITOR(0), slot);
+    TEST_ASSERT_EQUAL(-1, otp_type(TEST_OTP_VISITOR, OTP_VISITOR_DIGITS));
+    otp_release(slot);
+    TEST_ASSERT_EQUAL(slot, otp_type(TEST_OTP_VISITOR, OTP_VISITOR_DIGITS));
+    TEST_ASSERT_NOT_EQUAL(-1, otp_type(TEST_OTP_OTHER_VISITOR, OTP_VISITOR_DIGITS));
+
+    // The used bits reach NVS with the batch after the next step boundary, not with each claim
+    uint32_t used[OTP_USED_WORDS];
+    size_t len = sizeof(used);
+    nvs_handle_t handle;
+    TEST_ASSERT_TRUE(used_dirty);
+    vTaskDelaySec(OTP_STEP_SEC);
+    TEST_ASSERT_FALSE(used_dirty);
+    TEST_ASSERT_EQUAL(ESP_OK, nvs_open(OTP_STORAGE_NAME, NVS_READONLY, &handle));
+    TEST_ASSERT_EQUAL(ESP_OK, nvs_get_blob(handle, "used", used, &len));
+    nvs_close(handle);
+    TEST_ASSERT_EQUAL_MEMORY(visitors_used, used, sizeof(used));
+
+    cmd[0] = OTP_CMD_VISITOR_CLEAR;
+    TEST_ASSERT_EQUAL(0, otp_command(cmd, 1, AUDIT_SOURCE_BLE));
+}
+
+// With every secret enrolled, an entry is checked without a single HMAC and far faster than computing its window
+static void test_otp_verify_cost()
+{
+    uint8_t keys[OTP_MAX_SECRETS][OTP_SECRET_LEN];
+    int64_t claim_ns = INT64_MAX;
+    int64_t hmac_ns = INT64_MAX;
+    uint8_t schedule;
+    volatile uint32_t sink = 0;
+
+    otp_at(TEST_OTP_TIME);
+    for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++) {
+        memset(keys[i], 'a' + i, OTP_SECRET_LEN);
+        otp_push_secret(i, keys[i]);
+    }
+
+    for(int round = 0; round < TEST_OTP_TIMING_ROUNDS; round++) {
+        uint32_t oneshot = test_crypto.oneshot;
+        int64_t start = otp_now_ns();
+        for(int i = 0; i < TEST_OTP_TIMING_CALLS; i++)
+            TEST_ASSERT_EQUAL(-1, otp_claim(TEST_OTP_WRONG_CODE, &schedule));
+        int64_t elapsed = otp_now_ns() - start;
+        if(elapsed < claim_ns)
+            claim_ns = elapsed;
+        TEST_ASSERT_EQUAL_UINT32(oneshot, test_crypto.oneshot);
+
+        // What a check computing the codes of the window would do
+        start = otp_now_ns();
+        for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++) {
+            for(uint8_t w = 0; w < OTP_WINDOW_CODES; w++)
+                sink += otp_totp(keys[i], TEST_OTP_TIME / OTP_STEP_SEC - OTP_WINDOW + w);
+        }
+        elapsed = (otp_now_ns() - start) * TEST_OTP_TIMING_CALLS;
+        if(elapsed < hmac_ns)
+            hmac_ns = elapsed;
+    }
+    uint32_t claim_call_ns = claim_ns / TEST_OTP_TIMING_CALLS;
+    uint32_t hmac_call_ns = hmac_ns / TEST_OTP_TIMING_CALLS;
+    printf("otp: %u secrets, claim %lu ns, window of HMACs %lu ns\n", OTP_MAX_SECRETS,
+           (unsigned long) claim_call_ns, (unsigned long) hmac_call_ns);
+    TEST_ASSERT_LESS_THAN_UINT32(hmac_call_ns, claim_call_ns * 10);
+
+    // At a step boundary the timer computes only the newest column
+    uint32_t oneshot = test_crypto.oneshot;
+    vTaskDelaySec(OTP_STEP_SEC);
+    TEST_ASSERT_EQUAL_UINT32(oneshot + OTP_MAX_SECRETS, test_crypto.oneshot);
+
+    for(uint8_t i = 0; i < OTP_MAX_SECRETS; i++)
+        otp_remove_secret(i);
+}
+
+void test_otp()
+{
+    time_t boot = time(NULL);
+    TEST_ASSERT_EQUAL(ESP_OK, otp_init());
+
+    RUN_TEST(test_otp_rfc6238_vectors);
+    RUN_TEST(test_otp_totp_window);
+    RUN_TEST(test_otp_visitor_single_use);
+    RUN_TEST(test_otp_verify_cost);
+
+    otp_at(boot);
+}
@@ -0,0 +1,253 @@
+/*
+ * @file tools/test/main/test_phone.c
+ *
+ * @proj imp-term
+ * @brief Phone unlock tests: the decision path from the unlock write to the door, its refusals and its cost
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The test is the phone: it pairs through the fake stack (test_ble.c), enrolls
+ * its key and signs the challenges as the web client does. phone.c is included
+ * to rebuild its allowlist as at boot. NVS reads and bond store scans are
+ * counted (the link wraps nvs_get_blob, see CMakeLists.txt), an unlock must
+ * decide from RAM only.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "unity.h"
+
+#include "phone.c"
+
+#include "test.h"
+
+#define TEST_PHONE_CONN 0
+#define TEST_PHONE_OTHER_CONN 1
+#define TEST_PHONE_TIMING_ROUNDS 5
+#define TEST_PHONE_TIMING_CALLS 200
+#define TEST_PHONE_DECISION_MAX_US 2000 // Of the 200 ms from connection to relay, on the host
+
+static const ble_addr_t test_phone_addr = { .type = 0, .val = {0x01, 0x02, 0x03, 0x04, 0x05, 0xc6} };
+static const ble_addr_t test_other_addr = { .type = 0, .val = {0x11, 0x12, 0x13, 0x14, 0x15, 0xd6} };
+static const uint8_t test_phone_key[PHONE_KEY_LEN] = {0x5a, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                                      0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+
+static uint32_t nvs_reads;
+
+esp_err_t __real_nvs_get_blob(nvs_handle_t handle, const char * key, void * out_value, size_t * length);
+
+esp_err_t __wrap_nvs_get_blob(nvs_handle_t handle, const char * key, void * out_value, size_t * length)
+{
+    nvs_reads++;
+    return __real_nvs_get_blob(handle, key, out_value, length);
+}
+
+// Connect, pair and enroll as the phone does once, with an admin session
+static void phone_client_enroll(uint16_t conn_handle, const ble_addr_t * id_addr)
+{
+    uint8_t cmd[PHONE_ENROLL_CMD_MAX_LEN] = { PHONE_CMD_ENROLL };
+    memcpy(&cmd[1], test_phone_key, PHONE_KEY_LEN);
+
+    test_ble_connect(conn_handle, BLE_ATT_MTU_DFLT);
+    TEST_ASSERT_EQUAL(0, test_ble_pair(conn_handle, id_addr));
+    TEST_ASSERT_EQUAL(0, phone_enroll(conn_handle, cmd, sizeof(cmd)));
+}
+
+// HMAC-SHA256(key, "unlock" | challenge), as the phone computes it
+static void phone_client_sign(const uint8_t * challenge, uint8_t * response)
+{
+    uint8_t msg[6 + PHONE_CHALLENGE_LEN];
+    memcpy(msg, "unlock", 6);
+    memcpy(&msg[6], challenge, PHONE_CHALLENGE_LEN);
+    TEST_ASSERT_EQUAL(0, mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), test_phone_key, PHONE_KEY_LEN,
+                                         msg, sizeof(msg), response));
+}
+
+/*
+ * @brief Read a challenge and write the signed unlock request
+ * @return What phone_unlock() returned
+*/
+static int phone_client_unlock(uint16_t conn_handle)
+{
+    uint8_t challenge[PHONE_CHALLENGE_LEN];
+    uint8_t response[PHONE_RESPONSE_LEN];
+
+    int rc = phone_challenge(conn_handle, challenge);
+    if(rc != 0)
+        return rc;
+    phone_client_sign(challenge, response);
+    return phone_unlock(conn_handle, response);
+}
+
+// No phones enrolled, as setUp() leaves the stack without bonds
+static void phone_forget_all()
+{
+    allowlist_len = 0;
+    memset(challenges, 0, sizeof(challenges));
+}
+
+static int64_t phone_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_phone_unlock_opens_door()
+{
+    phone_forget_all();
+    phone_client_enroll(TEST_PHONE_CONN, &test_phone_addr);
+
+    uint32_t start = xTaskGetTickCount();
+    TEST_ASSERT_EQUAL(0, phone_client_unlock(TEST_PHONE_CONN));
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+    TEST_ASSERT_EQUAL_UINT32(0, test_door.failures);
+    // Decided on the host task that took the write, no waiting on the way
+    TEST_ASSERT_EQUAL_UINT32(start, test_door.opened_at);
+
+    // A new connection of the bonded phone unlocks without enrolling again
+    test_ble_disconnect(TEST_PHONE_CONN);
+    test_ble_connect(TEST_PHONE_OTHER_CONN, BLE_ATT_MTU_DFLT);
+    TEST_ASSERT_EQUAL(0, test_ble_pair(TEST_PHONE_OTHER_CONN, &test_phone_addr));
+    TEST_ASSERT_EQUAL(0, phone_client_unlock(TEST_PHONE_OTHER_CONN));
+    TEST_ASSERT_EQUAL_UINT32(2, test_door.opens);
+}
+
+static void test_phone_refuses_bad_requests()
+{
+    uint8_t challenge[PHONE_CHALLENGE_LEN];
+    uint8_t response[PHONE_RESPONSE_LEN];
+
+    phone_forget_all();
+    phone_client_enroll(TEST_PHONE_CONN, &test_phone_addr);
+
+    // Wrong signature: refused and counted as a failed attempt
+    TEST_ASSERT_EQUAL(0, phone_challenge(TEST_PHONE_CONN, challenge));
+    phone_client_sign(challenge, response);
+    response[0] ^= 1;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, phone_unlock(TEST_PHONE_CONN, response));
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.failures);
+
+    // The right signature once, then replayed
+    TEST_ASSERT_EQUAL(0, phone_challenge(TEST_PHONE_CONN, challenge));
+    phone_client_sign(challenge, response);
+    TEST_ASSERT_EQUAL(0, phone_unlock(TEST_PHONE_CONN, response));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, phone_unlock(TEST_PHONE_CONN, response));
+    TEST_ASSERT_EQUAL_UINT32(2, test_door.failures);
+
+    // Answered after the challenge timed out
+    TEST_ASSERT_EQUAL(0, phone_challenge(TEST_PHONE_CONN, challenge));
+    phone_client_sign(challenge, response);
+    vTaskDelaySec(PHONE_CHALLENGE_TIMEOUT_SEC);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, phone_unlock(TEST_PHONE_CONN, response));
+    TEST_ASSERT_EQUAL_UINT32(3, test_door.failures);
+
+    // Right signature during a lockout: refused, but not another failure
+    test_door.locked_out = true;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, phone_client_unlock(TEST_PHONE_CONN));
+    TEST_ASSERT_EQUAL_UINT32(3, test_door.failures);
+    test_door.locked_out = false;
+
+    // A bonded phone that is not enrolled gets no challenge, an unpaired link no answer at all
+    test_ble_connect(TEST_PHONE_OTHER_CONN, BLE_ATT_MTU_DFLT);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_ENC, phone_challenge(TEST_PHONE_OTHER_CONN, challenge));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_ENC, phone_unlock(TEST_PHONE_OTHER_CONN, response));
+    TEST_ASSERT_EQUAL(0, test_ble_pair(TEST_PHONE_OTHER_CONN, &test_other_addr));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_AUTHOR, phone_challenge(TEST_PHONE_OTHER_CONN, challenge));
+
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+}
+
+static void test_phone_allowlist_from_bonds()
+{
+    phone_forget_all();
+    phone_client_enroll(TEST_PHONE_CONN, &test_phone_addr);
+    phone_client_enroll(TEST_PHONE_OTHER_CONN, &test_other_addr);
+
+    // The bond of one phone is lost while the terminal is off
+    TEST_ASSERT_EQUAL(0, ble_gap_unpair(&test_other_addr));
+    allowlist_len = 0;
+    uint32_t store_reads = test_ble_store.reads;
+    TEST_ASSERT_EQUAL(ESP_OK, phone_init());
+    TEST_ASSERT_EQUAL_UINT32(store_reads + 1, test_ble_store.reads);
+    TEST_ASSERT_TRUE(phone_is_enrolled(&test_phone_addr));
+    TEST_ASSERT_FALSE(phone_is_enrolled(&test_other_addr));
+
+    // Saved without it, the next boot finds one phone as well
+    allowlist_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, phone_init());
+    TEST_ASSERT_EQUAL(1, allowlist_len);
+}
+
+static void test_phone_keeps_enrolled_bonds()
+{
+    uint8_t challenge[PHONE_CHALLENGE_LEN];
+    struct ble_store_status_event event = {
+        .event_code = BLE_STORE_EVENT_OVERFLOW,
+        .overflow = { .obj_type = BLE_STORE_OBJ_TYPE_PEER_SEC },
+    };
+
+    // Bonded first, so the oldest one
+    phone_forget_all();
+    phone_client_enroll(TEST_PHONE_CONN, &test_phone_addr);
+    test_ble_connect(TEST_PHONE_OTHER_CONN, BLE_ATT_MTU_DFLT);
+    TEST_ASSERT_EQUAL(0, test_ble_pair(TEST_PHONE_OTHER_CONN, &test_other_addr));
+
+    TEST_ASSERT_EQUAL(0, phone_store_status_cb(&event, NULL));
+    TEST_ASSERT_EQUAL_UINT32(1, test_ble_store.unpaired);
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INSUFFICIENT_ENC, phone_challenge(TEST_PHONE_OTHER_CONN, challenge));
+    TEST_ASSERT_EQUAL(0, phone_client_unlock(TEST_PHONE_CONN));
+
+    // Nothing left to evict but enrolled phones
+    TEST_ASSERT_EQUAL(BLE_HS_ESTORE_CAP, phone_store_status_cb(&event, NULL));
+}
+
+static void test_phone_decision_cost()
+{
+    int64_t best_ns = INT64_MAX;
+
+    phone_forget_all();
+    // Every other phone the allowlist takes is enrolled ahead of it, so its scan is the longest
+    for(uint8_t i = 1; i < PHONE_ALLOWLIST_LEN; i++) {
+        ble_addr_t addr = test_other_addr;
+        addr.val[0] = i;
+        phone_client_enroll(TEST_PHONE_OTHER_CONN, &addr);
+    }
+    phone_client_enroll(TEST_PHONE_CONN, &test_phone_addr);
+    TEST_ASSERT_EQUAL(PHONE_ALLOWLIST_LEN - 1, phone_find(&test_phone_addr));
+
+    uint32_t reads = nvs_reads;
+    uint32_t store_reads = test_ble_store.reads;
+    esp_log_level_t level = esp_log_level_get(PROJ_NAME);
+    esp_log_level_set(PROJ_NAME, ESP_LOG_NONE);
+    for(int round = 0; round < TEST_PHONE_TIMING_ROUNDS; round++) {
+        int64_t start = phone_now_ns();
+        for(int i = 0; i < TEST_PHONE_TIMING_CALLS; i++)
+            TEST_ASSERT_EQUAL(0, phone_client_unlock(TEST_PHONE_CONN));
+        int64_t elapsed = phone_now_ns() - start;
+        if(elapsed < best_ns)
+            best_ns = elapsed;
+    }
+    esp_log_level_set(PROJ_NAME, level);
+
+    // Decided from RAM: neither the allowlist nor the bonds are read again
+    TEST_ASSERT_EQUAL_UINT32(reads, nvs_reads);
+    TEST_ASSERT_EQUAL_UINT32(store_reads, test_ble_store.reads);
+    TEST_ASSERT_EQUAL_UINT32(TEST_PHONE_TIMING_ROUNDS * TEST_PHONE_TIMING_CALLS, test_door.opens);
+
+    // The phone's own HMAC is in it too
+    uint32_t decision_us = best_ns / TEST_PHONE_TIMING_CALLS / 1000;
+    printf("phone: challenge and unlock %lu us with %u phones enrolled\n", (unsigned long) decision_us, PHONE_ALLOWLIST_LEN);
+    TEST_ASSERT_LESS_THAN_UINT32(TEST_PHONE_DECISION_MAX_US, decision_us);
+}
+
+void test_phone()
+{
+    RUN_TEST(test_phone_unlock_opens_door);
+    RUN_TEST(test_phone_refuses_bad_requests);
+    RUN_TEST(test_phone_allowlist_from_bonds);
+    RUN_TEST(test_phone_keeps_enrolled_bonds);
+    RUN_TEST(test_phone_decision_cost);
+}
@@ -0,0 +1,187 @@
+/*
+ * @file tools/test/main/test_power.c
+ *
+ * @proj imp-term
+ * @brief Light sleep tests: keypad wakeup, the first key after it and the sleep accounting
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * power.c and main/gpio.c run as on the device, over the fake GPIO registers
+ * of test_gpio.c. The test sleeps the chip as the idle task would with no PM
+ * lock held: it runs the light sleep callbacks power.c registered around a
+ * stretch of virtual time, pressing a key in between. A task in place of
+ * keypad_handler_task() takes the row events and scans the keypad the same way,
+ * under the key deadline of supervisor.c.
+*/
+
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <soc/gpio_struct.h>
+
+#include "unity.h"
+
+#include "config.h"
+#include "gpio.h"
+#include "power.h"
+#include "supervisor.h"
+#include "common.h"
+#include "test.h"
+
+#define TEST_POWER_SLEEP_MS 5000
+
+// Key found by the scan after a row event
+typedef struct {
+    uint8_t key;
+    uint8_t keypad;
+    TickType_t at;
+} power_key_t;
+
+static QueueHandle_t keys;
+
+// Receive and scan as keypad_handler_task() does, the PIN entry itself is not part of the wake path
+static noreturn void power_keypad_task()
+{
+    uint32_t io_num;
+    power_key_t found;
+
+    while(1) {
+        deadline_expect(DEADLINE_KEY);
+        xQueueReceive(gpio_evt_queue, &io_num, portMAX_DELAY);
+        found.key = gpio_keypad_key_lookup(io_num, &found.keypad);
+        found.at = xTaskGetTickCount();
+        deadline_done(DEADLINE_KEY);
+        xQueueSend(keys, &found, portMAX_DELAY);
+        xQueueReset(gpio_evt_queue);
+    }
+}
+
+/*
+ * @brief Sleep as the idle task does with no PM lock held
+ * @param key Pressed while asleep, '\0' for a timer wakeup
+ * @return Tick of the wakeup
+*/
+static TickType_t power_light_sleep(uint32_t sleep_ms, char key)
+{
+    TEST_ASSERT_TRUE(test_pm.light_sleep);
+    TEST_ASSERT_EQUAL_INT32(0, test_pm.held);
+
+    TEST_ASSERT_EQUAL(ESP_OK, test_pm.cbs.enter_cb(sleep_ms * 1000, test_pm.cbs.enter_cb_user_arg));
+    vTaskDelayMSec(sleep_ms);
+    if(key != '\0')
+        TEST_ASSERT_EQUAL(0, test_gpio_press(KEYPAD_ENTRY, key));
+    TickType_t woke = xTaskGetTickCount();
+    TEST_ASSERT_EQUAL(ESP_OK, test_pm.cbs.exit_cb(sleep_ms * 1000, test_pm.cbs.exit_cb_user_arg));
+    return woke;
+}
+
+static void test_power_wake_keeps_first_key()
+{
+    power_stats_t before, after;
+    deadline_stats_t deadlines[DEADLINE_COUNT];
+    power_key_t found;
+
+    power_get_stats(&before);
+    TickType_t woke = power_light_sleep(TEST_POWER_SLEEP_MS, '5');
+
+    // The edge was lost while asleep, the wakeup itself hands the key over
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(keys, &found, pdMS_TO_TICKS(SUPERVISOR_KEY_MS)));
+    TEST_ASSERT_EQUAL_UINT8('5', found.key);
+    TEST_ASSERT_EQUAL_UINT8(KEYPAD_ENTRY, found.keypad);
+    // Scanned before the next tick, wake-to-key takes no waiting
+    TEST_ASSERT_EQUAL_UINT32(woke, found.at);
+    test_gpio_release();
+    TEST_ASSERT_EQUAL(pdFALSE, xQueueReceive(keys, &found, pdMS_TO_TICKS(100)));
+
+    deadline_get_stats(deadlines);
+    TEST_ASSERT_EQUAL_UINT32(0, deadlines[DEADLINE_KEY].misses);
+    TEST_ASSERT_LESS_THAN_UINT32(SUPERVISOR_KEY_MS * 1000, deadlines[DEADLINE_KEY].worst_us);
+
+    power_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.wakeups + 1, after.wakeups);
+    TEST_ASSERT_EQUAL_UINT32(before.key_wakeups + 1, after.key_wakeups);
+    TEST_ASSERT_EQUAL_UINT32(before.sleep_ms + TEST_POWER_SLEEP_MS, after.sleep_ms);
+}
+
+static void test_power_rows_armed_while_asleep()
+{
+    static const gpio_num_t rows[] = {
+#define X_ROW_GPIO(keypad, row, gpio) gpio,
+        KEYPAD_ROW_PINS(X_ROW_GPIO)
+    };
+    power_stats_t before, after;
+    power_key_t found;
+
+    TEST_ASSERT_TRUE(test_pm.gpio_wakeup);
+    power_get_stats(&before);
+
+    // A level wakes the chip, the edge interrupt would not
+    TEST_ASSERT_EQUAL(ESP_OK, test_pm.cbs.enter_cb(TEST_POWER_SLEEP_MS * 1000, test_pm.cbs.enter_cb_user_arg));
+    for(uint8_t i = 0; i < array_len(rows); i++) {
+        TEST_ASSERT_EQUAL_UINT32(GPIO_INTR_HIGH_LEVEL, GPIO.pin[rows[i]].int_type);
+        TEST_ASSERT_EQUAL_UINT32(1, GPIO.pin[rows[i]].wakeup_enable);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, test_pm.cbs.exit_cb(TEST_POWER_SLEEP_MS * 1000, test_pm.cbs.exit_cb_user_arg));
+    for(uint8_t i = 0; i < array_len(rows); i++) {
+        TEST_ASSERT_EQUAL_UINT32(GPIO_INTR_POSEDGE, GPIO.pin[rows[i]].int_type);
+        TEST_ASSERT_EQUAL_UINT32(0, GPIO.pin[rows[i]].wakeup_enable);
+    }
+
+    // Woken by the timer, no key to hand over
+    TEST_ASSERT_EQUAL(pdFALSE, xQueueReceive(keys, &found, pdMS_TO_TICKS(100)));
+    power_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.wakeups + 1, after.wakeups);
+    TEST_ASSERT_EQUAL_UINT32(before.key_wakeups, after.key_wakeups);
+}
+
+static void test_power_awake_key()
+{
+    power_stats_t before, after;
+    power_key_t found;
+
+    power_light_sleep(TEST_POWER_SLEEP_MS, '\0');
+    power_get_stats(&before);
+
+    // Back on the edge interrupt once awake
+    TEST_ASSERT_EQUAL(0, test_gpio_press(KEYPAD_ENTRY, '#'));
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(keys, &found, pdMS_TO_TICKS(SUPERVISOR_KEY_MS)));
+    TEST_ASSERT_EQUAL_UINT8('#', found.key);
+    test_gpio_release();
+
+    power_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.wakeups, after.wakeups);
+}
+
+static void test_power_locks_keep_awake()
+{
+    power_acquire(POWER_LOCK_PIN_ENTRY);
+    power_acquire(POWER_LOCK_PIN_ENTRY);
+    power_acquire(POWER_LOCK_DOOR);
+    TEST_ASSERT_EQUAL_INT32(3, test_pm.held);
+
+    // Holds nest per reason, the chip sleeps again once each is dropped
+    power_release(POWER_LOCK_PIN_ENTRY);
+    power_release(POWER_LOCK_DOOR);
+    TEST_ASSERT_EQUAL_INT32(1, test_pm.held);
+    power_release(POWER_LOCK_PIN_ENTRY);
+    TEST_ASSERT_EQUAL_INT32(0, test_pm.held);
+
+    // One release too many leaves no debt
+    power_release(POWER_LOCK_DOOR);
+    TEST_ASSERT_EQUAL_INT32(0, test_pm.held);
+}
+
+void test_power()
+{
+    TEST_ASSERT_EQUAL(ESP_OK, power_init());
+    gpio_configure();
+    keys = xQueueCreate(4, sizeof(power_key_t));
+    TEST_ASSERT_NOT_NULL(keys);
+    TEST_ASSERT_EQUAL(pdPASS, task_create(&power_keypad_task, NULL, NULL, TASK_KEYPAD_HANDLER));
+
+    RUN_TEST(test_power_wake_keeps_first_key);
+    RUN_TEST(test_power_rows_armed_while_asleep);
+    RUN_TEST(test_power_awake_key);
+    RUN_TEST(test_power_locks_keep_awake);
+}
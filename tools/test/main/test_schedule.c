@@ -0,0 +1,282 @@
+/*
+ * @file tools/test/main/test_schedule.c
+ *
+ * @proj imp-term
+ * @brief Access schedule tests: DST changes, the week boundary, holidays, an unset clock and the pushed config
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Schedules are pushed as the web client does, through schedule_command(), and
+ * checked in the firmware's time zone (TIME_ZONE, Central European). The wall
+ * clock is set with schedule_set_time() and then runs on with the virtual one,
+ * so the hourly cache of schedule.c has to notice the hour change by itself.
+ * The calendar lookups are counted (the link wraps localtime_r, see CMakeLists.txt).
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "unity.h"
+
+#include "config.h"
+#include "schedule.h"
+#include "audit.h"
+#include "common.h"
+#include "test.h"
+
+#define TEST_SCHEDULE_OFFICE 1 // Monday to Friday, 8:00 to 17:00
+#define TEST_SCHEDULE_HOURS 2  // Single hours, set by each test
+#define TEST_SCHEDULE_DECISIONS 1000
+
+#define SUNDAY 0
+#define WEDNESDAY 3
+#define SATURDAY 6
+
+static uint32_t calendar_lookups;
+
+struct tm * __real_localtime_r(const time_t * timep, struct tm * result);
+
+struct tm * __wrap_localtime_r(const time_t * timep, struct tm * result)
+{
+    calendar_lookups++;
+    return __real_localtime_r(timep, result);
+}
+
+/*
+ * @brief Seconds since the epoch of a UTC time
+*/
+static uint32_t utc(int32_t year, uint32_t month, uint32_t day, uint32_t hour, uint32_t min, uint32_t sec)
+{
+    return schedule_days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+/*
+ * @brief Push a schedule allowing the given hours of the week
+*/
+static void schedule_push(uint8_t id, const uint8_t * hours, uint8_t len, uint8_t flags)
+{
+    uint8_t cmd[2 + sizeof(schedule_t)] = { SCHEDULE_CMD_SET, id };
+    schedule_t * schedule = (schedule_t *) &cmd[2];
+    for(uint8_t i = 0; i < len; i++)
+        schedule->week[hours[i] / 8] |= BIT(hours[i] % 8);
+    schedule->flags = flags;
+    TEST_ASSERT_EQUAL(0, schedule_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+}
+
+static void schedule_push_hour(uint8_t day, uint8_t hour)
+{
+    uint8_t hour_of_week = day * 24 + hour;
+    schedule_push(TEST_SCHEDULE_HOURS, &hour_of_week, 1, 0);
+}
+
+static void schedule_push_holidays(const uint16_t * days, uint8_t len)
+{
+    uint8_t cmd[SCHEDULE_CMD_MAX_LEN] = { SCHEDULE_CMD_HOLIDAYS };
+    memcpy(&cmd[1], days, len * sizeof(days[0]));
+    TEST_ASSERT_EQUAL(0, schedule_command(cmd, 1 + len * sizeof(days[0]), AUDIT_SOURCE_BLE));
+}
+
+static void schedule_at(uint32_t epoch)
+{
+    TEST_ASSERT_EQUAL(ESP_OK, schedule_set_time(epoch, AUDIT_SOURCE_BLE));
+}
+
+static void test_schedule_office_hours()
+{
+    // Wednesday 2024-01-10, winter time (UTC+1)
+    schedule_at(utc(2024, 1, 10, 6, 59, 59));
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    vTaskDelaySec(1); // 8:00 local, the clock runs on by itself
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    schedule_at(utc(2024, 1, 10, 15, 59, 59));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    vTaskDelaySec(1);
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+
+    // Summer time (UTC+2) moves the same local hours an hour earlier in UTC
+    schedule_at(utc(2024, 7, 10, 6, 0, 0));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    schedule_at(utc(2024, 7, 10, 15, 0, 0));
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+
+    // Saturday, and the built-in schedule at any time
+    schedule_at(utc(2024, 1, 13, 10, 0, 0));
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    TEST_ASSERT_TRUE(schedule_allows(SCHEDULE_ALWAYS));
+}
+
+static void test_schedule_week_boundary()
+{
+    // Bit 167 is the last hour of the week, the next second is bit 0
+    schedule_push_hour(SATURDAY, 23);
+    schedule_at(utc(2024, 1, 13, 22, 59, 59)); // Saturday 23:59:59 local
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    vTaskDelaySec(1);
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_HOURS));
+
+    schedule_push_hour(SUNDAY, 0);
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_at(utc(2024, 1, 13, 22, 59, 59));
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_HOURS));
+
+    // Across the new year the week goes on
+    schedule_push_hour(SUNDAY, 23);
+    schedule_at(utc(2024, 12, 29, 22, 30, 0)); // Sunday 23:30 local
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_push_hour(WEDNESDAY, 0);
+    schedule_at(utc(2024, 12, 31, 23, 0, 0)); // Wednesday 2025-01-01 0:00 local
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+}
+
+/*
+ * @brief Walk a day hour by hour in UTC and count the ones a single local hour schedule allows
+*/
+static uint8_t schedule_hours_allowed(uint32_t midnight_utc)
+{
+    uint8_t allowed = 0;
+    for(uint8_t hour = 0; hour < 24; hour++) {
+        schedule_at(midnight_utc + hour * 3600 + 1800);
+        allowed += schedule_allows(TEST_SCHEDULE_HOURS);
+    }
+    return allowed;
+}
+
+static void test_schedule_dst_spring()
+{
+    // Sunday 2024-03-31, 2:00 CET is 3:00 CEST: the 2 o'clock hour never comes
+    schedule_push_hour(SUNDAY, 2);
+    TEST_ASSERT_EQUAL_UINT8(0, schedule_hours_allowed(utc(2024, 3, 30, 23, 0, 0)));
+    schedule_push_hour(SUNDAY, 1);
+    schedule_at(utc(2024, 3, 31, 0, 59, 59));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    vTaskDelaySec(1); // Straight to 3:00 local
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_push_hour(SUNDAY, 3);
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    TEST_ASSERT_EQUAL_UINT8(1, schedule_hours_allowed(utc(2024, 3, 30, 23, 0, 0)));
+}
+
+static void test_schedule_dst_autumn()
+{
+    // Sunday 2024-10-27, 3:00 CEST is 2:00 CET: the 2 o'clock hour comes twice
+    schedule_push_hour(SUNDAY, 2);
+    TEST_ASSERT_EQUAL_UINT8(2, schedule_hours_allowed(utc(2024, 10, 26, 22, 0, 0)));
+    schedule_at(utc(2024, 10, 27, 0, 59, 59)); // 2:59:59 CEST
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    vTaskDelaySec(1); // 2:00:00 CET
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_at(utc(2024, 10, 27, 1, 59, 59));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    vTaskDelaySec(1); // 3:00 CET
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_push_hour(SUNDAY, 3);
+    TEST_ASSERT_EQUAL_UINT8(1, schedule_hours_allowed(utc(2024, 10, 26, 22, 0, 0)));
+}
+
+static void test_schedule_holidays()
+{
+    const uint16_t christmas[] = { schedule_days_from_civil(2024, 12, 25) }; // A Wednesday
+    schedule_push_holidays(christmas, array_len(christmas));
+
+    // The holiday is a local date, it starts at local midnight
+    const uint8_t midnight[] = { 2 * 24 + 23, WEDNESDAY * 24 };
+    schedule_push(TEST_SCHEDULE_HOURS, midnight, array_len(midnight), 0);
+    schedule_at(utc(2024, 12, 24, 22, 59, 59));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    vTaskDelaySec(1);
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_at(utc(2024, 12, 25, 10, 0, 0));
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    TEST_ASSERT_TRUE(schedule_allows(SCHEDULE_ALWAYS));
+
+    // Unless the schedule keeps holidays, a week later it is a normal Wednesday
+    uint8_t hour_of_week = WEDNESDAY * 24 + 11;
+    schedule_push(TEST_SCHEDULE_HOURS, &hour_of_week, 1, SCHEDULE_F_HOLIDAYS);
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_HOURS));
+    schedule_at(utc(2025, 1, 1, 10, 0, 0));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+
+    schedule_push_holidays(christmas, 0);
+    schedule_at(utc(2024, 12, 25, 10, 0, 0));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+}
+
+static void test_schedule_clock_not_set()
+{
+    // After a power loss without the RTC, only the built-in schedule opens
+    schedule_at(SCHEDULE_MIN_VALID_TIME - 1);
+    TEST_ASSERT_FALSE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    TEST_ASSERT_TRUE(schedule_allows(SCHEDULE_ALWAYS));
+    schedule_at(utc(2024, 1, 10, 10, 0, 0));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+
+    // Ids past the table never open
+    TEST_ASSERT_FALSE(schedule_allows(SCHEDULE_COUNT));
+}
+
+static void test_schedule_refuses_bad_config()
+{
+    uint8_t cmd[SCHEDULE_CMD_MAX_LEN + 2] = { SCHEDULE_CMD_SET, SCHEDULE_ALWAYS };
+
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, schedule_command(cmd, 2 + sizeof(schedule_t), AUDIT_SOURCE_BLE));
+    cmd[1] = SCHEDULE_COUNT;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, schedule_command(cmd, 2 + sizeof(schedule_t), AUDIT_SOURCE_BLE));
+    cmd[1] = TEST_SCHEDULE_HOURS;
+    cmd[2 + sizeof(schedule_t) - 1] = 0x80; // Unknown flag
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, schedule_command(cmd, 2 + sizeof(schedule_t), AUDIT_SOURCE_BLE));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, schedule_command(cmd, 1 + sizeof(schedule_t), AUDIT_SOURCE_BLE));
+
+    cmd[0] = SCHEDULE_CMD_PIN;
+    cmd[1] = SCHEDULE_COUNT;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, schedule_command(cmd, 2, AUDIT_SOURCE_BLE));
+    cmd[0] = SCHEDULE_CMD_HOLIDAYS;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, schedule_command(cmd, 2, AUDIT_SOURCE_BLE));
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN, schedule_command(cmd, SCHEDULE_CMD_MAX_LEN + 2, AUDIT_SOURCE_BLE));
+    cmd[0] = 0;
+    TEST_ASSERT_EQUAL(BLE_ATT_ERR_VALUE_NOT_ALLOWED, schedule_command(cmd, 2, AUDIT_SOURCE_BLE));
+
+    // The office schedule pushed before is untouched
+    schedule_at(utc(2024, 1, 10, 10, 0, 0));
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+}
+
+static void test_schedule_decision_cost()
+{
+    // Within an hour a decision is a bit test, the calendar is looked up once
+    schedule_at(utc(2024, 1, 10, 10, 0, 0));
+    uint32_t lookups = calendar_lookups;
+    for(uint32_t i = 0; i < TEST_SCHEDULE_DECISIONS; i++)
+        TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    TEST_ASSERT_EQUAL_UINT32(lookups + 1, calendar_lookups);
+
+    vTaskDelaySec(3600);
+    TEST_ASSERT_TRUE(schedule_allows(TEST_SCHEDULE_OFFICE));
+    TEST_ASSERT_EQUAL_UINT32(lookups + 2, calendar_lookups);
+}
+
+void test_schedule()
+{
+    uint8_t office[5 * 9];
+    for(uint8_t day = 0; day < 5; day++) {
+        for(uint8_t hour = 0; hour < 9; hour++)
+            office[day * 9 + hour] = (1 + day) * 24 + 8 + hour;
+    }
+    time_t boot = time(NULL);
+
+    TEST_ASSERT_EQUAL(ESP_OK, schedule_init());
+    schedule_push(TEST_SCHEDULE_OFFICE, office, sizeof(office), 0);
+
+    RUN_TEST(test_schedule_office_hours);
+    RUN_TEST(test_schedule_week_boundary);
+    RUN_TEST(test_schedule_dst_spring);
+    RUN_TEST(test_schedule_dst_autumn);
+    RUN_TEST(test_schedule_holidays);
+    RUN_TEST(test_schedule_clock_not_set);
+    RUN_TEST(test_schedule_refuses_bad_config);
+    RUN_TEST(test_schedule_decision_cost);
+
+    schedule_at(boot);
+}
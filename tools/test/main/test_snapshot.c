@@ -0,0 +1,193 @@
+/*
+ * @file tools/test/main/test_snapshot.c
+ *
+ * @proj imp-term
+ * @brief Warm restart snapshot tests: what a reset keeps, torn and foreign snapshots, and the NVS reconcile
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * A restart is played by calling snapshot_load() again, as the next boot
+ * would, with the reset reason the test chooses (the link wraps
+ * esp_reset_reason, see CMakeLists.txt). The RTC memory is the snapshot's own
+ * static, the module's source is included to tear it as a restart in the
+ * middle of a save would, and the RTC timer runs on with the virtual clock.
+*/
+
+#include <string.h>
+
+#include "unity.h"
+
+#include "snapshot.c"
+
+#include "test.h"
+
+#define TEST_SNAPSHOT_LOCKOUT_MS 30000
+#define TEST_SNAPSHOT_STALE_PIN "97531"
+
+static esp_reset_reason_t reset_reason = ESP_RST_POWERON;
+
+static const esp_reset_reason_t warm_resets[] = { ESP_RST_SW, ESP_RST_PANIC, ESP_RST_INT_WDT, ESP_RST_TASK_WDT, ESP_RST_WDT };
+static const esp_reset_reason_t cold_resets[] = { ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_DEEPSLEEP, ESP_RST_BROWNOUT };
+
+static const keypad_config_t test_config = {
+    .access_pin = "2468",
+    .admin_pin = "13579",
+    .new_pin = "",
+    .door_duration = 7,
+};
+
+esp_reset_reason_t __wrap_esp_reset_reason(void)
+{
+    return reset_reason;
+}
+
+/*
+ * @brief Boot after a reset
+ * @return Whether the snapshot was taken
+*/
+static bool snapshot_boot(esp_reset_reason_t reason, snapshot_t * snapshot)
+{
+    reset_reason = reason;
+    memset(snapshot, 0, sizeof(*snapshot));
+    return snapshot_load(snapshot);
+}
+
+/*
+ * @brief Power the terminal on and run until the state is recorded
+*/
+static void snapshot_run(const keypad_config_t * config)
+{
+    snapshot_t snapshot;
+    uint32_t used[OTP_USED_WORDS];
+
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_POWERON, &snapshot));
+    memset(used, 0xA5, sizeof(used));
+    snapshot_save_config(config);
+    snapshot_save_otp_used(used);
+    snapshot_save_door(true);
+}
+
+static void test_snapshot_warm_restores()
+{
+    snapshot_t snapshot;
+    uint32_t used[OTP_USED_WORDS];
+    memset(used, 0xA5, sizeof(used));
+
+    snapshot_run(&test_config);
+    snapshot_save_lockout(TEST_SNAPSHOT_LOCKOUT_MS);
+    vTaskDelaySec(10);
+
+    // The security delay goes on where it was, it is not reset by a restart
+    TEST_ASSERT_TRUE(snapshot_boot(ESP_RST_TASK_WDT, &snapshot));
+    TEST_ASSERT_EQUAL_MEMORY(&test_config, &snapshot.config, sizeof(test_config));
+    TEST_ASSERT_EQUAL_UINT32(TEST_SNAPSHOT_LOCKOUT_MS - 10000, snapshot.lockout_left_ms);
+    TEST_ASSERT_TRUE(snapshot.door_open);
+    TEST_ASSERT_EQUAL_MEMORY(used, snapshot.otp_used, sizeof(used));
+
+    // Still valid for the restart after, and a delay that ran out is gone
+    vTaskDelayMSec(TEST_SNAPSHOT_LOCKOUT_MS);
+    TEST_ASSERT_TRUE(snapshot_boot(ESP_RST_SW, &snapshot));
+    TEST_ASSERT_EQUAL_UINT32(0, snapshot.lockout_left_ms);
+    TEST_ASSERT_EQUAL_STRING(test_config.access_pin, snapshot.config.access_pin);
+}
+
+static void test_snapshot_reset_reasons()
+{
+    snapshot_t snapshot;
+
+    for(uint8_t i = 0; i < array_len(warm_resets); i++) {
+        snapshot_run(&test_config);
+        TEST_ASSERT_TRUE_MESSAGE(snapshot_boot(warm_resets[i], &snapshot), "Warm reset not restored");
+    }
+
+    // RTC memory holds garbage after these, even if it happens to look valid
+    for(uint8_t i = 0; i < array_len(cold_resets); i++) {
+        snapshot_run(&test_config);
+        TEST_ASSERT_FALSE_MESSAGE(snapshot_boot(cold_resets[i], &snapshot), "Cold reset restored");
+        // Started over: a warm restart now has nothing to restore
+        TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+    }
+}
+
+static void test_snapshot_torn()
+{
+    snapshot_t snapshot;
+
+    // A restart in the middle of a save leaves the old CRC
+    snapshot_run(&test_config);
+    rtc_snapshot.config.access_pin[0] ^= 0x01;
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_PANIC, &snapshot));
+
+    // A restart before the config was recorded must not restore an empty PIN
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_POWERON, &snapshot));
+    snapshot_save_door(true);
+    snapshot_save_lockout(TEST_SNAPSHOT_LOCKOUT_MS);
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+
+    // Every field is covered
+    for(size_t i = 0; i < offsetof(rtc_snapshot_t, crc); i++) {
+        snapshot_run(&test_config);
+        ((uint8_t *) &rtc_snapshot)[i] ^= 0x80;
+        TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+    }
+}
+
+static void test_snapshot_other_layout()
+{
+    snapshot_t snapshot;
+
+    // Left by another firmware, its CRC matching: the layout fields alone refuse it
+    snapshot_run(&test_config);
+    rtc_snapshot.version = SNAPSHOT_VERSION - 1;
+    rtc_snapshot.crc = snapshot_crc();
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+
+    snapshot_run(&test_config);
+    rtc_snapshot.len = sizeof(rtc_snapshot) - sizeof(uint32_t);
+    rtc_snapshot.crc = snapshot_crc();
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+
+    snapshot_run(&test_config);
+    rtc_snapshot.magic = ~SNAPSHOT_MAGIC;
+    rtc_snapshot.crc = snapshot_crc();
+    TEST_ASSERT_FALSE(snapshot_boot(ESP_RST_SW, &snapshot));
+}
+
+static void test_snapshot_reconciled_with_nvs()
+{
+    snapshot_t snapshot;
+    keypad_config_t stale;
+    bool correct;
+
+    // The snapshot missed a PIN change that reached NVS
+    TEST_ASSERT_EQUAL(ESP_OK, read_pin("access_pin", stale.access_pin, sizeof(stale.access_pin)));
+    TEST_ASSERT_EQUAL(ESP_OK, read_pin("admin_pin", stale.admin_pin, sizeof(stale.admin_pin)));
+    TEST_ASSERT_EQUAL(ESP_OK, read_pin("new_pin", stale.new_pin, sizeof(stale.new_pin)));
+    TEST_ASSERT_EQUAL(ESP_OK, read_door_duration(&stale.door_duration));
+    char stored[KEYPAD_PIN_MAX_LEN + 1];
+    strcpy(stored, stale.access_pin);
+    strcpy(stale.access_pin, TEST_SNAPSHOT_STALE_PIN);
+    snapshot_run(&stale);
+
+    // The warm boot takes the snapshot as it is, without reading the config from flash
+    TEST_ASSERT_TRUE(snapshot_boot(ESP_RST_TASK_WDT, &snapshot));
+    nvs_configure_warm(&snapshot.config);
+    TEST_ASSERT_EQUAL(ESP_OK, check_pin(TEST_SNAPSHOT_STALE_PIN, "access_pin", &correct));
+    TEST_ASSERT_TRUE(correct);
+
+    // NVS wins once reconciled
+    TEST_ASSERT_EQUAL(ESP_OK, storage_reconcile());
+    TEST_ASSERT_EQUAL(ESP_OK, check_pin(TEST_SNAPSHOT_STALE_PIN, "access_pin", &correct));
+    TEST_ASSERT_FALSE(correct);
+    TEST_ASSERT_EQUAL(ESP_OK, check_pin(stored, "access_pin", &correct));
+    TEST_ASSERT_TRUE(correct);
+}
+
+void test_snapshot()
+{
+    RUN_TEST(test_snapshot_warm_restores);
+    RUN_TEST(test_snapshot_reset_reasons);
+    RUN_TEST(test_snapshot_torn);
+    RUN_TEST(test_snapshot_other_layout);
+    RUN_TEST(test_snapshot_reconciled_with_nvs);
+}
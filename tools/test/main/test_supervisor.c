@@ -0,0 +1,128 @@
+/*
+ * @file tools/test/main/test_supervisor.c
+ *
+ * @proj imp-term
+ * @brief Deadline supervisor tests: stalls injected into the access path, miss counters and the restart of a hung terminal
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * The test plays a task on the access path: it starts a deadline as the key
+ * interrupt or the door would, stalls for a given time and stops it. The
+ * supervisor task of supervisor.c runs as on the device and counts the misses.
+ * Its restart is caught (the link wraps esp_restart, see CMakeLists.txt) and
+ * leaves the supervisor suspended for good, so the hang test comes last.
+*/
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include "unity.h"
+
+#include "config.h"
+#include "supervisor.h"
+#include "audit.h"
+#include "common.h"
+#include "test.h"
+
+#define TEST_SUPERVISOR_CLOSE_MS 3000 // Open duration of the door in the tests
+
+static deadline_stats_t deadline_stats(enum Deadline deadline)
+{
+    deadline_stats_t stats[DEADLINE_COUNT];
+    deadline_get_stats(stats);
+    return stats[deadline];
+}
+
+/*
+ * @brief Take a key as keypad_handler_task() does, stalling in between
+*/
+static void supervisor_key(uint32_t stall_ms)
+{
+    deadline_expect(DEADLINE_KEY);
+    deadline_start_from_isr(DEADLINE_KEY);
+    vTaskDelayMSec(stall_ms);
+    deadline_done(DEADLINE_KEY);
+}
+
+static void test_supervisor_on_time()
+{
+    deadline_stats_t before = deadline_stats(DEADLINE_KEY);
+
+    supervisor_key(SUPERVISOR_KEY_MS - 20);
+    deadline_stats_t after = deadline_stats(DEADLINE_KEY);
+    TEST_ASSERT_EQUAL_UINT32(before.misses, after.misses);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32((SUPERVISOR_KEY_MS - 20) * 1000, after.worst_us);
+    TEST_ASSERT_LESS_THAN_UINT32(SUPERVISOR_KEY_MS * 1000, after.worst_us);
+}
+
+static void test_supervisor_late_key()
+{
+    deadline_stats_t before = deadline_stats(DEADLINE_KEY);
+
+    // Counted once, though the supervisor saw it overdue before the task finished it late
+    supervisor_key(SUPERVISOR_KEY_MS * 3);
+    deadline_stats_t after = deadline_stats(DEADLINE_KEY);
+    TEST_ASSERT_EQUAL_UINT32(before.misses + 1, after.misses);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(SUPERVISOR_KEY_MS * 3 * 1000, after.worst_us);
+    TEST_ASSERT_EQUAL_UINT32(esp_timer_get_time() / 1000000, after.last_miss);
+
+    // A key coming while the task is busy is not timed, the task did not wait for it
+    deadline_start_from_isr(DEADLINE_KEY);
+    vTaskDelayMSec(SUPERVISOR_KEY_MS * 3);
+    deadline_done(DEADLINE_KEY);
+    TEST_ASSERT_EQUAL_UINT32(after.misses, deadline_stats(DEADLINE_KEY).misses);
+}
+
+static void test_supervisor_stuck_door()
+{
+    deadline_stats_t before = deadline_stats(DEADLINE_DOOR_CLOSE);
+    uint32_t restarts = test_board_restarts();
+
+    // The door is not closed in time: the miss shows while the close is still pending
+    deadline_start(DEADLINE_DOOR_CLOSE, TEST_SUPERVISOR_CLOSE_MS + SUPERVISOR_DOOR_CLOSE_SLACK_MS);
+    vTaskDelayMSec((TEST_SUPERVISOR_CLOSE_MS + SUPERVISOR_DOOR_CLOSE_SLACK_MS - 10));
+    TEST_ASSERT_EQUAL_UINT32(before.misses, deadline_stats(DEADLINE_DOOR_CLOSE).misses);
+    vTaskDelayMSec(20);
+    TEST_ASSERT_EQUAL_UINT32(before.misses + 1, deadline_stats(DEADLINE_DOOR_CLOSE).misses);
+
+    // Late, but well short of a hang
+    vTaskDelayMSec(SUPERVISOR_HANG_MS / 2);
+    deadline_done(DEADLINE_DOOR_CLOSE);
+    TEST_ASSERT_EQUAL_UINT32(before.misses + 1, deadline_stats(DEADLINE_DOOR_CLOSE).misses);
+    TEST_ASSERT_EQUAL_UINT32(restarts, test_board_restarts());
+}
+
+static void test_supervisor_hang_restarts()
+{
+    uint32_t restarts = test_board_restarts();
+    uint32_t seq = audit_last_seq();
+
+    // The door task never takes its event
+    deadline_start(DEADLINE_DOOR_EVENT, 0);
+    vTaskDelayMSec((SUPERVISOR_DOOR_EVENT_MS + SUPERVISOR_HANG_MS - 10));
+    TEST_ASSERT_EQUAL_UINT32(restarts, test_board_restarts());
+    TEST_ASSERT_EQUAL_UINT32(1, deadline_stats(DEADLINE_DOOR_EVENT).misses);
+
+    // The terminal restarts once the audit writer had its time, the hang is in flash by then
+    vTaskDelayMSec(20);
+    TEST_ASSERT_EQUAL_UINT32(restarts, test_board_restarts());
+    vTaskDelayMSec(SUPERVISOR_RESTART_DELAY_MS);
+    TEST_ASSERT_EQUAL_UINT32(restarts + 1, test_board_restarts());
+    audit_record_t record;
+    TEST_ASSERT_EQUAL(1, audit_read(seq + 1, &record, 1));
+    TEST_ASSERT_EQUAL_UINT8(AUDIT_EVT_HANG, record.type);
+    TEST_ASSERT_EQUAL_UINT16(DEADLINE_DOOR_EVENT, record.aux);
+
+    deadline_done(DEADLINE_DOOR_EVENT);
+}
+
+void test_supervisor()
+{
+    TEST_ASSERT_EQUAL(pdPASS, task_create(&supervisor_task, NULL, NULL, TASK_SUPERVISOR));
+
+    RUN_TEST(test_supervisor_on_time);
+    RUN_TEST(test_supervisor_late_key);
+    RUN_TEST(test_supervisor_stuck_door);
+    RUN_TEST(test_supervisor_hang_restarts);
+}
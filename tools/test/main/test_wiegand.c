@@ -0,0 +1,237 @@
+/*
+ * @file tools/test/main/test_wiegand.c
+ *
+ * @proj imp-term
+ * @brief Wiegand reader tests: synthetic pulse trains with reader timing jitter, and a card through to the door
+ * @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+ * @year 2024
+ *
+ * Frames of 26 and 34 bits are replayed pulse by pulse into the frame assembly
+ * the decoder task runs, at the bit intervals readers use, each jittered, with
+ * ringing after some pulses and varying gaps between cards. The microsecond
+ * timestamps are the test's own and wrap around as esp_timer_get_time() does
+ * truncated to 32 bits. wiegand.c is included to start its task and call its
+ * interrupt handler as the D0/D1 edges would, for the path to the door.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "wiegand.c"
+
+#include "test.h"
+
+#define TEST_WIEGAND_FRAMES 2000
+#define TEST_WIEGAND_SEED 35
+#define TEST_WIEGAND_START_US (UINT32_MAX - 500000) // The timestamps wrap half a second in
+#define TEST_WIEGAND_JITTER_PCT 25 // Of the bit interval, either way
+#define TEST_WIEGAND_RINGING_PCT 5 // Pulses followed by a short spurious one on either line
+#define TEST_WIEGAND_MAX_GAP_MS 500 // Between two cards, from WIEGAND_FRAME_GAP_MS up
+#define TEST_WIEGAND_DECODE_MAX_MS 50 // Last bit to the door request
+#define TEST_WIEGAND_CARD 0x00a51234 // Facility 0xa5, card 0x1234
+#define TEST_WIEGAND_OTHER_CARD 0x00a54321
+
+// Bit intervals of common readers
+static const uint32_t test_wiegand_bit_us[] = {1000, 2000, 2500};
+
+// A replay of the frames the task would complete
+typedef struct {
+    wiegand_frame_t rx;
+    uint32_t now_us;
+    uint32_t len;
+    uint32_t cards[TEST_WIEGAND_FRAMES];
+    esp_err_t errors[TEST_WIEGAND_FRAMES];
+} wiegand_replay_t;
+
+static wiegand_replay_t replay;
+static unsigned int seed;
+
+static uint32_t wiegand_rand(uint32_t range)
+{
+    return rand_r(&seed) % range;
+}
+
+/*
+ * @brief Frame of a card number, with its leading even and trailing odd parity bits
+*/
+static uint64_t wiegand_encode(uint32_t card, uint8_t count)
+{
+    uint8_t half = count / 2;
+    uint64_t data = card & (BIT64(count - 2) - 1);
+    uint64_t first = data >> (half - 1);
+    uint64_t second = data & (BIT64(half - 1) - 1);
+    uint64_t even = __builtin_popcountll(first) % 2;
+    uint64_t odd = 1 - __builtin_popcountll(second) % 2;
+    return even << (count - 1) | data << 1 | odd;
+}
+
+static void wiegand_replay_done(const wiegand_frame_t * done)
+{
+    TEST_ASSERT_LESS_THAN_UINT32(TEST_WIEGAND_FRAMES, replay.len);
+    replay.errors[replay.len] = wiegand_decode(done->bits, done->count, &replay.cards[replay.len]);
+    replay.len++;
+}
+
+/*
+ * @brief Send the pulses of one frame at a jittered bit interval, as the task would take them
+*/
+static void wiegand_replay_frame(uint64_t bits, uint8_t count, uint32_t bit_us)
+{
+    wiegand_frame_t done;
+
+    for(int8_t i = count - 1; i >= 0; i--) {
+        uint32_t jitter = bit_us * TEST_WIEGAND_JITTER_PCT / 100;
+        replay.now_us += bit_us - jitter + wiegand_rand(2 * jitter + 1);
+        if(wiegand_frame_pulse(&replay.rx, (bits >> i) & 1, replay.now_us, &done))
+            wiegand_replay_done(&done);
+
+        if(wiegand_rand(100) < TEST_WIEGAND_RINGING_PCT) {
+            uint32_t ringing_us = 5 + wiegand_rand(WIEGAND_MIN_BIT_GAP_US - 5);
+            TEST_ASSERT_FALSE(wiegand_frame_pulse(&replay.rx, wiegand_rand(2), replay.now_us + ringing_us, &done));
+        }
+
+        // The task wakes up now and then in the middle of a frame
+        TEST_ASSERT_FALSE(wiegand_frame_idle(&replay.rx, replay.now_us + bit_us / 2, &done));
+    }
+}
+
+/*
+ * @brief Let the line idle until the next card, the task may or may not wake up in between
+*/
+static void wiegand_replay_gap(bool wake)
+{
+    wiegand_frame_t done;
+
+    replay.now_us += WIEGAND_FRAME_GAP_MS * 1000 + wiegand_rand((TEST_WIEGAND_MAX_GAP_MS - WIEGAND_FRAME_GAP_MS) * 1000);
+    if(wake && wiegand_frame_idle(&replay.rx, replay.now_us, &done))
+        wiegand_replay_done(&done);
+}
+
+static void wiegand_replay_start()
+{
+    memset(&replay, 0, sizeof(replay));
+    replay.now_us = TEST_WIEGAND_START_US;
+    seed = TEST_WIEGAND_SEED;
+}
+
+static void test_wiegand_decode()
+{
+    uint32_t card;
+
+    TEST_ASSERT_EQUAL(ESP_OK, wiegand_decode(wiegand_encode(TEST_WIEGAND_CARD, 26), 26, &card));
+    TEST_ASSERT_EQUAL_HEX32(TEST_WIEGAND_CARD, card);
+    TEST_ASSERT_EQUAL(ESP_OK, wiegand_decode(wiegand_encode(0xdeadbeef, 34), 34, &card));
+    TEST_ASSERT_EQUAL_HEX32(0xdeadbeef, card);
+
+    // Known frame: facility 1, card 1, the leading parity bit set and the trailing one clear
+    TEST_ASSERT_EQUAL_HEX32(0x2020002, wiegand_encode(0x010001, 26));
+    TEST_ASSERT_EQUAL(ESP_OK, wiegand_decode(0x2020002, 26, &card));
+    TEST_ASSERT_EQUAL_HEX32(0x010001, card);
+
+    // Any single bit wrong fails one of the parities, any other length is refused
+    uint64_t bits = wiegand_encode(TEST_WIEGAND_CARD, 26);
+    for(uint8_t i = 0; i < 26; i++)
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, wiegand_decode(bits ^ BIT64(i), 26, &card));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, wiegand_decode(bits >> 1, 25, &card));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, wiegand_decode(bits << 1, 27, &card));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, wiegand_decode(0, 0, &card));
+}
+
+static void test_wiegand_replay_jitter()
+{
+    static uint32_t expected[TEST_WIEGAND_FRAMES];
+
+    wiegand_replay_start();
+    for(uint32_t i = 0; i < TEST_WIEGAND_FRAMES; i++) {
+        uint8_t count = wiegand_rand(2) ? 34 : 26;
+        expected[i] = (uint32_t) ((uint64_t) rand_r(&seed) << 8 ^ rand_r(&seed)) & (BIT64(count - 2) - 1);
+        wiegand_replay_frame(wiegand_encode(expected[i], count), count,
+                             test_wiegand_bit_us[wiegand_rand(array_len(test_wiegand_bit_us))]);
+        wiegand_replay_gap(wiegand_rand(2) || i + 1 == TEST_WIEGAND_FRAMES);
+    }
+
+    // Every card once, in order, across the timestamp wrap
+    TEST_ASSERT_LESS_THAN_UINT32(TEST_WIEGAND_START_US, replay.now_us);
+    TEST_ASSERT_EQUAL_UINT32(TEST_WIEGAND_FRAMES, replay.len);
+    for(uint32_t i = 0; i < replay.len; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, replay.errors[i]);
+        TEST_ASSERT_EQUAL_HEX32(expected[i], replay.cards[i]);
+    }
+}
+
+static void test_wiegand_replay_damaged()
+{
+    wiegand_replay_start();
+
+    // A lost pulse shortens the frame, two cards too close together run into one
+    uint64_t bits = wiegand_encode(TEST_WIEGAND_CARD, 26);
+    wiegand_replay_frame(bits & (BIT64(25) - 1), 25, 2000);
+    wiegand_replay_gap(true);
+    wiegand_replay_frame(bits, 26, 2000);
+    replay.now_us += (WIEGAND_FRAME_GAP_MS - 5) * 1000;
+    wiegand_replay_frame(bits, 26, 2000);
+    wiegand_replay_gap(true);
+    // A bit read wrong fails parity
+    wiegand_replay_frame(bits ^ BIT64(7), 26, 2000);
+    wiegand_replay_gap(true);
+
+    TEST_ASSERT_EQUAL_UINT32(3, replay.len);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, replay.errors[0]);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, replay.errors[1]);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, replay.errors[2]);
+}
+
+/*
+ * @brief Pulse the D0/D1 lines through the interrupt handler, one bit per tick
+ * @return Tick of the last bit
+*/
+static TickType_t wiegand_reader_send(uint32_t card)
+{
+    uint64_t bits = wiegand_encode(card, 26);
+    for(int8_t i = 25; i >= 0; i--) {
+        vTaskDelay(1);
+        wiegand_interrupt((void *) (uintptr_t) ((bits >> i) & 1));
+    }
+    return xTaskGetTickCount();
+}
+
+static void test_wiegand_card_opens()
+{
+    uint8_t cmd[1 + sizeof(uint32_t)] = { CARD_CMD_ADD };
+    uint32_t card = TEST_WIEGAND_CARD;
+    memcpy(&cmd[1], &card, sizeof(card));
+    TEST_ASSERT_EQUAL(0, credential_card_command(cmd, sizeof(cmd), AUDIT_SOURCE_BLE));
+
+    // The frame ends WIEGAND_FRAME_GAP_MS after the last bit, the door is asked right after
+    TickType_t last = wiegand_reader_send(TEST_WIEGAND_CARD);
+    vTaskDelayMSec(100);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(pdMS_TO_TICKS(TEST_WIEGAND_DECODE_MAX_MS), test_door.opened_at - last);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(pdMS_TO_TICKS(WIEGAND_FRAME_GAP_MS), test_door.opened_at - last);
+
+    // An unknown card counts as a failed attempt, a lockout refuses a known one
+    wiegand_reader_send(TEST_WIEGAND_OTHER_CARD);
+    vTaskDelayMSec(100);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.failures);
+    test_door.locked_out = true;
+    wiegand_reader_send(TEST_WIEGAND_CARD);
+    vTaskDelayMSec(100);
+    TEST_ASSERT_EQUAL_UINT32(1, test_door.opens);
+
+    cmd[0] = CARD_CMD_CLEAR;
+    TEST_ASSERT_EQUAL(0, credential_card_command(cmd, 1, AUDIT_SOURCE_BLE));
+}
+
+void test_wiegand()
+{
+    // As wiegand_init() does with WIEGAND_ENABLE set, the lines themselves are not wired
+    TEST_ASSERT_EQUAL(pdPASS, task_create(&wiegand_task, NULL, &wiegand_task_handle, TASK_WIEGAND));
+
+    RUN_TEST(test_wiegand_decode);
+    RUN_TEST(test_wiegand_replay_jitter);
+    RUN_TEST(test_wiegand_replay_damaged);
+    RUN_TEST(test_wiegand_card_opens);
+}
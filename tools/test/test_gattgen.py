@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+#
+# @file tools/test/test_gattgen.py
+#
+# @proj imp-term
+# @brief Check that the C table and the JS module tools/gattgen.py generates describe the same characteristics
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   test_gattgen.py [-v]
+#
+# Both outputs are generated from main/gatt.json into a temporary directory and
+# parsed back: every characteristic has the same UUID, length range and admin
+# flag on both sides, and the HTTP table lists the ones with an API path. With
+# Node.js installed, the JS codecs also encode values of the lengths the
+# firmware takes. The schema checks of gattgen.py are tested on small schemas.
+#
+
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+
+ROOT = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", ".."))
+SCHEMA = os.path.join(ROOT, "main", "gatt.json")
+GATTGEN = os.path.join(ROOT, "tools", "gattgen.py")
+
+sys.path.insert(0, os.path.join(ROOT, "tools"))
+import gattgen  # noqa: E402
+
+
+def uuid_from_le(raw):
+    # BLE_UUID128_INIT takes the bytes least significant first
+    hexed = "".join(f"{b:02x}" for b in reversed(raw))
+    return f"{hexed[:8]}-{hexed[8:12]}-{hexed[12:16]}-{hexed[16:20]}-{hexed[20:]}"
+
+
+def parse_c(header, source):
+    defines = dict(re.findall(r"#define (GATT_\w+) (\d+)", header))
+    chrs = {}
+    order = []
+    for m in re.finditer(r"static const ble_uuid128_t (\w+)_uuid =\s*BLE_UUID128_INIT\(([^)]*)\);\s*"
+                         r"const gatt_chr_t gatt_\1_chr = \{(.*?)\};", source, re.S):
+        name, raw, body = m.groups()
+        fields = dict(re.findall(r"\.(\w+) = ([^,]+),", body))
+        upper = name.upper()
+        chrs[name] = {
+            "uuid": uuid_from_le([int(b, 16) for b in raw.split(",")]),
+            "min_len": int(defines[f"GATT_{upper}_MIN_LEN"]),
+            "max_len": int(defines[f"GATT_{upper}_MAX_LEN"]),
+            "auth": fields["auth"] == "true",
+            "read": fields["read"] != "NULL",
+            "write": fields["write"] != "NULL" or fields["write_raw"] != "NULL",
+        }
+        order.append(name)
+
+    # Characteristics registered with the stack, in table order
+    table = source[source.index(".characteristics = (struct ble_gatt_chr_def[])"):]
+    registered = re.findall(r"\.uuid = &(\w+)_uuid\.u,", table)
+    flags = dict(re.findall(r"\.arg = \(void \*\) &gatt_(\w+)_chr,\s*\.flags = ([^,]+),", table))
+
+    http_table = re.search(r"gatt_http_chrs\[GATT_HTTP_CHR_COUNT\] = \{(.*?)\};", source, re.S).group(1)
+    http = re.findall(r"&gatt_(\w+)_chr", http_table)
+    return {"chrs": chrs, "order": order, "registered": registered, "flags": flags, "http": http,
+            "http_count": int(defines["GATT_HTTP_CHR_COUNT"]),
+            "svc_uuid16": int(re.search(r"BLE_UUID16_INIT\((0x[0-9a-fA-F]+|\d+)\)", source).group(1), 0)}
+
+
+def parse_js(js):
+    chrs = {}
+    order = []
+    for m in re.finditer(r"export const (\w+)Chr = characteristic\('(\w+)', '([0-9a-f-]+)', '(\w+)', "
+                         r"(\d+), (\d+), (true|false), (null|'[^']*')\);", js):
+        var, name, uuid, type_, min_len, max_len, auth, api = m.groups()
+        chrs[name] = {"var": var, "uuid": uuid, "type": type_, "min_len": int(min_len), "max_len": int(max_len),
+                      "auth": auth == "true", "api": None if api == "null" else api.strip("'")}
+        order.append(name)
+    svc = int(re.search(r"export const impTermSvcUuid = (0x[0-9a-fA-F]+|\d+);", js).group(1), 0)
+    return {"chrs": chrs, "order": order, "svc_uuid16": svc}
+
+
+class GattgenAgreement(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.mkdtemp(prefix="gattgen-")
+        cls.js_path = os.path.join(cls.tmp, "gattSchema.mjs")
+        subprocess.run([sys.executable, GATTGEN, "--schema", SCHEMA, "--c-out", cls.tmp, "--js-out", cls.js_path],
+                       check=True)
+        with open(os.path.join(cls.tmp, "gatt_schema.h")) as f:
+            header = f.read()
+        with open(os.path.join(cls.tmp, "gatt_schema.c")) as f:
+            source = f.read()
+        with open(cls.js_path) as f:
+            cls.js_text = f.read()
+        with open(SCHEMA) as f:
+            cls.schema = json.load(f)
+        cls.c = parse_c(header, source)
+        cls.js = parse_js(cls.js_text)
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmp)
+
+    def test_same_characteristics(self):
+        names = [ch["name"] for ch in self.schema["characteristics"]]
+        self.assertEqual(names, self.c["order"])
+        self.assertEqual(names, self.c["registered"])
+        self.assertEqual([gattgen.camel(name) for name in names], self.js["order"])
+        self.assertEqual(self.c["svc_uuid16"], self.js["svc_uuid16"])
+
+    def test_same_descriptors(self):
+        for name, c in self.c["chrs"].items():
+            with self.subTest(name):
+                js = self.js["chrs"][gattgen.camel(name)]
+                self.assertEqual(js["var"], gattgen.camel(name))
+                self.assertEqual(c["uuid"], js["uuid"])
+                self.assertEqual(c["min_len"], js["min_len"])
+                self.assertEqual(c["max_len"], js["max_len"])
+                self.assertEqual(c["auth"], js["auth"])
+
+    def test_flags_follow_handlers(self):
+        for name, c in self.c["chrs"].items():
+            with self.subTest(name):
+                flags = self.c["flags"][name]
+                self.assertEqual(c["read"], "BLE_GATT_CHR_F_READ" in flags)
+                self.assertEqual(c["write"], "BLE_GATT_CHR_F_WRITE" in flags)
+
+    def test_same_http_routes(self):
+        self.assertEqual(len(self.c["http"]), self.c["http_count"])
+        with_api = [name for name in self.c["order"] if self.js["chrs"][gattgen.camel(name)]["api"] is not None]
+        self.assertEqual(self.c["http"], with_api)
+        for name in with_api:
+            self.assertEqual(f"/api/{name}", self.js["chrs"][gattgen.camel(name)]["api"])
+            self.assertTrue(self.c["chrs"][name]["auth"])
+
+    @unittest.skipUnless(shutil.which("node"), "Node.js not installed")
+    def test_js_codecs_match_lengths(self):
+        # Encode a value of every length the firmware takes, and one byte more and less
+        types = {gattgen.camel(ch["name"]): ch["type"] for ch in self.schema["characteristics"]}
+        script = """
+import * as gatt from %s;
+const types = %s;
+const probes = {string: (n) => 'x'.repeat(n), bytes: (n) => new Uint8Array(n)};
+const result = {};
+for (const [key, chr] of Object.entries(gatt)) {
+  if (!key.endsWith('Chr')) continue;
+  const probe = probes[types[chr.name]];
+  const accepts = (n) => { try { return chr.encode(probe(n)).byteLength === n; } catch (e) { return false; } };
+  result[chr.name] = probe
+    ? {min: accepts(chr.minLen), max: accepts(chr.maxLen),
+       below: chr.minLen > 0 && accepts(chr.minLen - 1), above: accepts(chr.maxLen + 1)}
+    : {fixed: chr.encode(0).byteLength};
+}
+console.log(JSON.stringify(result));
+""" % (json.dumps(self.js_path), json.dumps(types))
+        out = subprocess.run(["node", "--input-type=module", "-e", script], check=True, capture_output=True, text=True)
+        result = json.loads(out.stdout)
+
+        for ch in self.schema["characteristics"]:
+            with self.subTest(ch["name"]):
+                c = self.c["chrs"][ch["name"]]
+                got = result[gattgen.camel(ch["name"])]
+                if gattgen.TYPES[ch["type"]] is not None:
+                    self.assertEqual(c["min_len"], got["fixed"])
+                    self.assertEqual(c["max_len"], got["fixed"])
+                else:
+                    self.assertTrue(got["min"])
+                    self.assertTrue(got["max"])
+                    self.assertFalse(got["below"])
+                    self.assertFalse(got["above"])
+
+
+class GattgenSchemaChecks(unittest.TestCase):
+
+    def load(self, characteristics):
+        with tempfile.NamedTemporaryFile("w", suffix=".json", delete=False) as f:
+            json.dump({"service": {"uuid16": "0x1234", "comment": "Test"}, "characteristics": characteristics}, f)
+        try:
+            return gattgen.load(f.name)
+        finally:
+            os.unlink(f.name)
+
+    def chr(self, **fields):
+        ch = {"name": "value", "uuid": "00000000-0000-0000-0000-000000000001", "type": "bytes", "comment": "Test"}
+        ch.update(fields)
+        return ch
+
+    def test_fixed_types_set_lengths(self):
+        schema = self.load([self.chr(type="u16")])
+        self.assertEqual(2, schema["characteristics"][0]["min_len"])
+        self.assertEqual(2, schema["characteristics"][0]["max_len"])
+
+    def test_rejects(self):
+        cases = {
+            "duplicate UUID": [self.chr(), self.chr(name="other")],
+            "duplicate name": [self.chr(), self.chr(uuid="00000000-0000-0000-0000-000000000002")],
+            "unknown type": [self.chr(type="float")],
+            "wrong fixed length": [self.chr(type="u32", max_len=8)],
+            "authenticated write without response": [self.chr(write="auth", no_rsp=True)],
+            "HTTP without authentication": [self.chr(write="raw", http=True)],
+            "length range": [self.chr(min_len=10, max_len=5)],
+        }
+        for what, characteristics in cases.items():
+            with self.subTest(what), self.assertRaises(SystemExit):
+                self.load(characteristics)
+
+
+if __name__ == "__main__":
+    unittest.main()
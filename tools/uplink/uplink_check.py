@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# @file tools/uplink/uplink_check.py
+#
+# @proj imp-term
+# @brief Boot an UPLINK image in QEMU, unlock from the keypad and check what reaches the broker
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   uplink_check.py --build build-uplink-qemu [--timeout 60] [--pin 1234] [--mosquitto mosquitto]
+#
+# Starts mosquitto on the host port the image publishes to (UPLINK_BROKER_URI, the host is
+# 10.0.2.2 from QEMU user networking), boots the image and waits for its "online" status.
+# Then types the access PIN on the bench console (inject) and waits for the events message
+# with the granted keypad access. The latency from the submit key to that message is written
+# to <build>/uplink_check.json, the exit code is nonzero if the status or the event does not
+# arrive within the timeout. Needs mosquitto and paho-mqtt (pip install paho-mqtt).
+#
+
+import argparse
+import json
+import os
+import queue
+import subprocess
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+from uplink_sub import BATCH_HEADER, EVENTS, FORMAT_VERSION, RECORD, RESULTS, SOURCES, TOPIC_PREFIX
+
+FLASH_SIZE = "4MB"  # CONFIG_ESPTOOLPY_FLASHSIZE_4MB
+BROKER_PORT = 1883  # UPLINK_BROKER_URI
+READY_LINE = "Uplink connected"
+ACCESS_PIN = "1234"  # KEYPAD_DEFAULT_ACCESS_PIN
+SUBMIT_KEY = "#"  # KEYPAD_PIN_SUBMIT_KEY
+
+
+def fail(msg):
+    sys.exit(f"uplink_check: {msg}")
+
+
+def merge_flash(build):
+    # QEMU boots from a whole flash image, esptool knows the offsets from flash_args
+    image = os.path.join(build, "flash.bin")
+    subprocess.run([sys.executable, "-m", "esptool", "--chip", "esp32", "merge_bin",
+                    "--fill-flash-size", FLASH_SIZE, "-o", "flash.bin", "@flash_args"],
+                   cwd=build, check=True)
+    return image
+
+
+def start_broker(mosquitto):
+    try:
+        proc = subprocess.Popen([mosquitto, "-p", str(BROKER_PORT)], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    except OSError as e:
+        fail(f"cannot start {mosquitto}: {e}")
+    time.sleep(1)
+    if proc.poll() is not None:
+        fail(f"{mosquitto} exited, is port {BROKER_PORT} taken?")
+    return proc
+
+
+def subscribe(messages):
+    """Queue every (topic kind, payload, arrival time) the terminals publish"""
+    try:
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+    except AttributeError:  # paho-mqtt 1.x
+        client = mqtt.Client()
+    client.on_message = lambda client, userdata, msg: messages.put((msg.topic.split("/")[-1], msg.payload, time.monotonic()))
+    try:
+        client.connect("localhost", BROKER_PORT)
+    except OSError as e:
+        fail(f"cannot connect to the broker: {e}")
+    client.subscribe(f"{TOPIC_PREFIX}/+/#", qos=1)
+    client.loop_start()
+    return client
+
+
+def start_qemu(image):
+    cmd = ["qemu-system-xtensa", "-nographic", "-machine", "esp32",
+           "-drive", f"file={image},if=mtd,format=raw",
+           "-nic", "user,model=open_eth"]
+    proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            text=True, errors="replace")
+    lines = queue.Queue()
+
+    # Keep draining the console, a full pipe would stall the emulator
+    def console():
+        for line in proc.stdout:
+            print(line.rstrip())
+            lines.put(line)
+    threading.Thread(target=console, daemon=True).start()
+    return proc, lines
+
+
+def wait_console(lines, text, deadline):
+    """First console line containing text, None on timeout"""
+    while time.monotonic() < deadline:
+        try:
+            line = lines.get(timeout=max(deadline - time.monotonic(), 0))
+        except queue.Empty:
+            break
+        if text in line:
+            return line
+    return None
+
+
+def wait_message(messages, match, deadline):
+    """First queued message match() accepts, None on timeout"""
+    while time.monotonic() < deadline:
+        try:
+            kind, payload, arrived = messages.get(timeout=max(deadline - time.monotonic(), 0))
+        except queue.Empty:
+            break
+        if match(kind, payload):
+            return arrived
+    return None
+
+
+def granted_keypad_access(kind, payload):
+    if kind != "events" or len(payload) < BATCH_HEADER.size:
+        return False
+    version, count, _, _ = BATCH_HEADER.unpack_from(payload)
+    if version != FORMAT_VERSION or len(payload) != BATCH_HEADER.size + count * RECORD.size:
+        fail("malformed events message")
+    for i in range(count):
+        _, _, event, _, result, source, _, _ = RECORD.unpack_from(payload, BATCH_HEADER.size + i * RECORD.size)
+        if EVENTS.get(event) == "access" and RESULTS.get(result) == "granted" and SOURCES.get(source) == "keypad":
+            return True
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description="QEMU uplink check")
+    parser.add_argument("--build", required=True, help="build directory of an UPLINK=1 BENCH_CONSOLE=1 QEMU image")
+    parser.add_argument("--timeout", type=int, default=60, help="seconds to wait for each step")
+    parser.add_argument("--pin", default=ACCESS_PIN, help="access PIN of the image")
+    parser.add_argument("--mosquitto", default="mosquitto", help="broker to start")
+    args = parser.parse_args()
+
+    image = merge_flash(args.build)
+    messages = queue.Queue()
+    broker = start_broker(args.mosquitto)
+    client = None
+    proc = None
+    try:
+        client = subscribe(messages)
+        proc, lines = start_qemu(image)
+
+        deadline = time.monotonic() + args.timeout
+        if wait_console(lines, READY_LINE, deadline) is None:
+            fail(f"uplink did not connect within {args.timeout} s")
+        if wait_message(messages, lambda kind, payload: kind == "status" and payload == b"online", deadline) is None:
+            fail(f"no online status within {args.timeout} s")
+
+        # The console started before the uplink, it takes the command right away
+        proc.stdin.write(f"inject {args.pin}{SUBMIT_KEY}\n")
+        proc.stdin.flush()
+        line = wait_console(lines, f"INJECT {SUBMIT_KEY} ", time.monotonic() + args.timeout)
+        if line is None:
+            fail("no answer to inject, is the image built with BENCH_CONSOLE=1?")
+        if "timeout" in line:
+            fail("the keypad task did not take the submit key")
+        submitted = time.monotonic()
+
+        arrived = wait_message(messages, granted_keypad_access, submitted + args.timeout)
+        if arrived is None:
+            fail(f"no granted keypad access in the events within {args.timeout} s")
+    finally:
+        if proc is not None:
+            proc.kill()
+            proc.wait()
+        if client is not None:
+            client.loop_stop()
+            client.disconnect()
+        broker.kill()
+        broker.wait()
+
+    metrics = {"uplink.event_ms": round((arrived - submitted) * 1000)}
+    with open(os.path.join(args.build, "uplink_check.json"), "w") as f:
+        json.dump(metrics, f, indent=2, sort_keys=True)
+    for name, value in metrics.items():
+        print(f"UPLINK {name} {value}")
+    print("uplink_check: status and granted keypad access received")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# @file tools/uplink/uplink_sub.py
+#
+# @proj imp-term
+# @brief Subscribe to the terminals' uplink topics and print what they send as JSON lines
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   uplink_sub.py [--host localhost] [--port 1883]
+#
+# Decodes the events and metrics messages of main/src/uplink.c (see main/include/uplink.h).
+# Events already seen (resent after a restart or a lost acknowledgement) are dropped by their
+# sequence number, gaps in the sequence are reported. Needs paho-mqtt (pip install paho-mqtt).
+#
+
+import argparse
+import json
+import struct
+import sys
+
+import paho.mqtt.client as mqtt
+
+TOPIC_PREFIX = "imp-term"  # UPLINK_TOPIC_PREFIX
+FORMAT_VERSION = 1  # UPLINK_FORMAT_VERSION
+
+BATCH_HEADER = struct.Struct("<BBHI")  # uplink_batch_header_t
+RECORD = struct.Struct("<IIBBBBHH")  # audit_record_t
+METRICS = struct.Struct("<B3x7I3I")  # uplink_metrics_t, DEADLINE_COUNT misses
+
+# enum AuditEventType, enum AuditResult and the AUDIT_SOURCE_* values of main/include/audit.h
+EVENTS = {1: "boot", 2: "access", 3: "admin_auth", 4: "pin_change", 5: "config_change", 6: "door_open",
+          7: "door_close", 8: "time_set", 9: "hang", 10: "door_forced", 11: "door_held"}
+RESULTS = {0: "ok", 1: "granted", 2: "denied", 3: "fail", 4: "schedule"}
+SOURCES = {0: "system", 1: "keypad", 2: "ble", 3: "card", 4: "rex", 5: "http"}
+DEADLINES = ["key", "door_event", "door_close"]  # enum Deadline
+
+last_seq = {}  # Newest event printed, by terminal
+
+
+def emit(obj):
+    print(json.dumps(obj), flush=True)
+
+
+def on_events(terminal, payload):
+    version, count, _, lost = BATCH_HEADER.unpack_from(payload)
+    if version != FORMAT_VERSION or len(payload) != BATCH_HEADER.size + count * RECORD.size:
+        emit({"terminal": terminal, "error": "malformed events message"})
+        return
+    if lost:
+        emit({"terminal": terminal, "lost": lost})
+    for i in range(count):
+        seq, timestamp, event, slot, result, source, aux, _ = RECORD.unpack_from(payload, BATCH_HEADER.size + i * RECORD.size)
+        prev = last_seq.get(terminal)
+        if prev is not None and seq <= prev:
+            continue  # Duplicate
+        if prev is not None and seq != prev + 1 and not lost:
+            emit({"terminal": terminal, "gap": [prev + 1, seq - 1]})
+        last_seq[terminal] = seq
+        emit({"terminal": terminal, "seq": seq, "time": timestamp, "event": EVENTS.get(event, event),
+              "slot": slot, "result": RESULTS.get(result, result), "source": SOURCES.get(source, source), "aux": aux})
+
+
+def on_metrics(terminal, payload):
+    if len(payload) != METRICS.size or payload[0] != FORMAT_VERSION:
+        emit({"terminal": terminal, "error": "malformed metrics message"})
+        return
+    _, uptime, heap_free, heap_min_free, seq, acked, lost, reconnects, *misses = METRICS.unpack(payload)
+    emit({"terminal": terminal, "metrics": {"uptime_sec": uptime, "heap_free": heap_free, "heap_min_free": heap_min_free,
+                                            "pending": seq - acked, "lost": lost, "reconnects": reconnects,
+                                            "deadline_misses": dict(zip(DEADLINES, misses))}})
+
+
+def on_message(client, userdata, msg):
+    parts = msg.topic.split("/")
+    if len(parts) != 3:
+        return
+    terminal, kind = parts[1], parts[2]
+    if kind == "events":
+        on_events(terminal, msg.payload)
+    elif kind == "metrics":
+        on_metrics(terminal, msg.payload)
+    elif kind == "status":
+        emit({"terminal": terminal, "status": msg.payload.decode(errors="replace")})
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print the events and metrics of imp-term terminals")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    args = parser.parse_args()
+
+    try:
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+    except AttributeError:  # paho-mqtt 1.x
+        client = mqtt.Client()
+    client.on_message = on_message
+    try:
+        client.connect(args.host, args.port)
+    except OSError as e:
+        sys.exit(f"uplink_sub: cannot connect to {args.host}:{args.port}: {e}")
+    client.subscribe(f"{TOPIC_PREFIX}/+/#", qos=1)
+    client.loop_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+# @file tools/wwwpack.py
+#
+# @proj imp-term
+# @brief Pack the built web client, gzipped, into the image of the www partition
+# @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+# @year 2024
+#
+# Usage:
+#   wwwpack.py --build web-control/build-device --out www.bin [--max-size <partition size>]
+#
+# Image layout (little endian), read in place by main/http_server.c:
+#   header   magic "IMPW", u16 version, u16 count, u32 image size
+#   index    count entries sorted by path: path[48], content type[32], u32 offset,
+#            u32 length, u32 CRC-32 of the gzipped file (ETag), u32 flags
+#   files    gzipped, each at a 4 byte aligned offset
+#
+
+import argparse
+import gzip
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x57504d49  # WWW_MAGIC
+VERSION = 1         # WWW_FORMAT_VERSION
+PATH_LEN = 48       # WWW_PATH_LEN
+TYPE_LEN = 32       # WWW_TYPE_LEN
+F_IMMUTABLE = 1     # WWW_F_IMMUTABLE
+
+HEADER = struct.Struct("<IHHI")
+ENTRY = struct.Struct(f"<{PATH_LEN}s{TYPE_LEN}sIIII")
+
+TYPES = {
+    ".html": "text/html",
+    ".js": "text/javascript",
+    ".css": "text/css",
+    ".json": "application/json",
+    ".ico": "image/x-icon",
+    ".png": "image/png",
+    ".svg": "image/svg+xml",
+    ".txt": "text/plain",
+    ".webmanifest": "application/manifest+json",
+}
+
+# Source maps are for development only, the flash has no room to spare
+SKIP = (".map",)
+
+
+def fail(msg):
+    sys.exit(f"wwwpack: {msg}")
+
+
+def collect(build):
+    files = []
+    for root, _, names in os.walk(build):
+        for name in names:
+            if name.endswith(SKIP):
+                continue
+            full = os.path.join(root, name)
+            path = os.path.relpath(full, build).replace(os.sep, "/")
+            ext = os.path.splitext(name)[1]
+            if ext not in TYPES:
+                fail(f"{path}: no content type for {ext or 'files without an extension'}")
+            if len(path.encode()) >= PATH_LEN:
+                fail(f"{path}: path longer than {PATH_LEN - 1} bytes")
+            files.append((path, full, TYPES[ext]))
+    # The device looks files up by binary search
+    return sorted(files, key=lambda f: f[0].encode())
+
+
+def pack(files):
+    offset = HEADER.size + len(files) * ENTRY.size
+    index = []
+    data = bytearray()
+    for path, full, content_type in files:
+        with open(full, "rb") as f:
+            # No timestamp in the gzip header, the same build packs to the same image
+            packed = gzip.compress(f.read(), compresslevel=9, mtime=0)
+        padding = -(offset + len(data)) % 4
+        data += bytes(padding)
+        flags = F_IMMUTABLE if path.startswith("static/") else 0
+        index.append(ENTRY.pack(path.encode(), content_type.encode(), offset + len(data), len(packed),
+                                zlib.crc32(packed), flags))
+        data += packed
+    size = offset + len(data)
+    return HEADER.pack(MAGIC, VERSION, len(files), size) + b"".join(index) + bytes(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack the web client into the www partition image")
+    parser.add_argument("--build", required=True, help="web client build directory")
+    parser.add_argument("--out", required=True, help="path of the image")
+    parser.add_argument("--max-size", type=lambda value: int(value, 0), help="size of the www partition")
+    args = parser.parse_args()
+
+    if not os.path.isfile(os.path.join(args.build, "index.html")):
+        fail(f"no web client in {args.build}, build it first (make http does)")
+
+    files = collect(args.build)
+    image = pack(files)
+    if args.max_size is not None and len(image) > args.max_size:
+        fail(f"image is {len(image)} bytes, the www partition only {args.max_size}")
+
+    with open(args.out, "wb") as f:
+        f.write(image)
+    print(f"wwwpack: {len(files)} files, {len(image)} bytes")
+
+
+if __name__ == "__main__":
+    main()
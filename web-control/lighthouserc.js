@@ -0,0 +1,41 @@
+//
+// @file web-control/lighthouserc.js
+//
+// @proj imp-term
+// @brief Lighthouse CI run that fails when the load times exceed src/budget.json
+// @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+// @year 2024
+//
+// Used by npm run vitals (make web-vitals) on a build served from the root
+// (PUBLIC_URL=/). Lighthouse measures in a lab, so FID, which needs a real
+// user, is checked through its upper bound max-potential-fid, and TTI through
+// Lighthouse's own time to interactive. The median of the runs is compared.
+//
+
+const budget = require('./src/budget.json');
+
+// budget.vitalsMs name -> Lighthouse audit
+const audits = {
+  TTFB: 'server-response-time',
+  FCP: 'first-contentful-paint',
+  LCP: 'largest-contentful-paint',
+  FID: 'max-potential-fid',
+  TTI: 'interactive',
+};
+
+module.exports = {
+  ci: {
+    collect: {
+      staticDistDir: process.env.BUILD_PATH || 'build',
+      numberOfRuns: 3,
+    },
+    assert: {
+      assertions: Object.fromEntries(Object.entries(audits).map(([name, audit]) =>
+        [audit, ['error', { maxNumericValue: budget.vitalsMs[name], aggregationMethod: 'median' }]])),
+    },
+    upload: {
+      target: 'filesystem',
+      outputDir: '.lighthouseci',
+    },
+  },
+};
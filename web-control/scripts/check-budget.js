@@ -0,0 +1,48 @@
+#!/usr/bin/env node
+//
+// @file web-control/scripts/check-budget.js
+//
+// @proj imp-term
+// @brief Fail the build when the gzipped bundles exceed src/budget.json
+// @author Lukas Tesar <xtesar43@stud.fit.vut.cz>
+// @year 2024
+//
+// Initial files are the entrypoints of build/asset-manifest.json, every other
+// script chunk is loaded lazily and checked on its own. BUILD_PATH is honoured
+// like react-scripts does (make web-device builds into build-device).
+//
+
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
+
+const root = path.join(__dirname, '..');
+const budget = require(path.join(root, 'src', 'budget.json'));
+const build = path.resolve(root, process.env.BUILD_PATH || 'build');
+const manifest = require(path.join(build, 'asset-manifest.json'));
+
+const gzipKb = (file) => zlib.gzipSync(fs.readFileSync(path.join(build, file)), { level: 9 }).length / 1024;
+
+let failures = [];
+const check = (what, size, limit) => {
+  console.log(`${what}: ${size.toFixed(1)} kB gzipped (budget ${limit} kB)`);
+  if (size > limit)
+    failures.push(`${what} is ${size.toFixed(1)} kB, budget ${limit} kB`);
+};
+
+const initial = manifest.entrypoints;
+const sum = (files) => files.reduce((total, file) => total + gzipKb(file), 0);
+check('Initial JS', sum(initial.filter(file => file.endsWith('.js'))), budget.initialJsGzipKb);
+check('Initial CSS', sum(initial.filter(file => file.endsWith('.css'))), budget.initialCssGzipKb);
+
+// Files are listed with the public URL (homepage) in front
+Object.values(manifest.files)
+  .filter(url => url.includes('static/js/') && url.endsWith('.js'))
+  .map(url => url.slice(url.indexOf('static/js/')))
+  .filter(file => !initial.includes(file))
+  .forEach(file => check(`Lazy chunk ${path.basename(file)}`, gzipKb(file), budget.lazyChunkGzipKb));
+
+if (failures.length > 0) {
+  failures.forEach(failure => console.error(`Budget exceeded: ${failure}`));
+  process.exit(1);
+}
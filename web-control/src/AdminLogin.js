@@ -0,0 +1,81 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import TextField from '@mui/material/TextField';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  adminLogin,
+  ConnectionAborted,
+  handleChangeError,
+  handleConnection,
+  isAdminLoggedIn
+} from './bluetooth';
+
+const AdminLogin = () => {
+  const [adminPin, setAdminPin] = useState('');
+  const [loggedIn, setLoggedIn] = useState(isAdminLoggedIn());
+
+  const handleLogin = (e) => {
+    e.preventDefault();
+
+    const loginToast = toast.loading("Logging in...");
+
+    handleConnection(loginToast)
+    .then(server => {
+      server.device.addEventListener('gattserverdisconnected', () => setLoggedIn(false), { once: true });
+      return adminLogin(server, adminPin);
+    })
+    .then(_ => {
+      console.log('Admin session opened');
+      setAdminPin('');
+      setLoggedIn(true);
+      toast.update(loginToast, { render: "Logged in", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      if(error.message.includes('not authorized') || error.message.includes('authentication')) {
+        console.error('Admin login rejected');
+        toast.update(loginToast, { render: "Wrong admin PIN", type: "error", isLoading: false, autoClose: true });
+        return;
+      }
+      handleChangeError(error, loginToast);
+    });
+  };
+
+  return (
+    <Box
+      component="form"
+      onSubmit={handleLogin}
+      display="flex"
+      flexDirection="column"
+      gap={2}
+    >
+      <Typography variant="h6" gutterBottom>
+        Admin login
+      </Typography>
+      <TextField
+        label="Admin PIN"
+        variant="outlined"
+        id="admin-pin"
+        value={adminPin}
+        onChange={(e) => setAdminPin(e.target.value)}
+        required
+        type="password"
+        inputProps={{ inputMode: 'numeric' }}
+        helperText={loggedIn ? 'Logged in, the session ends on disconnect' : ''}
+      />
+      <Button
+        type="submit"
+        variant="contained"
+        color="primary"
+        fullWidth
+      >
+        Log in
+      </Button>
+    </Box>
+  );
+};
+
+export default AdminLogin;
@@ -0,0 +1,188 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  auditLogChr,
+  authWrite,
+  ConnectionAborted,
+  getCharacteristic,
+  getDevice,
+  handleChangeError,
+  handleConnection
+} from './bluetooth';
+
+// Record layout, see audit_record_t in main/include/audit.h
+const AUDIT_RECORD_SIZE = 16;
+const auditEventNames = {
+  1: 'boot',
+  2: 'access',
+  3: 'admin_auth',
+  4: 'pin_change',
+  5: 'config_change',
+  6: 'door_open',
+  7: 'door_close',
+  8: 'time_set',
+  9: 'hang',
+  10: 'door_forced',
+  11: 'door_held',
+};
+const auditResultNames = ['ok', 'granted', 'denied', 'fail', 'schedule'];
+const auditSourceNames = ['system', 'keypad', 'ble', 'card', 'rex', 'http'];
+
+// Key under which the next sequence number to fetch is remembered
+const cursorStorageKey = 'impTermAuditCursor';
+
+/**
+ * Parse one notification into records
+ * @param {DataView} view Notification value
+ * @returns {Array<Object>} Records contained in the notification
+ */
+const parseAuditRecords = (view) => {
+  let records = [];
+  for (let offset = 0; offset + AUDIT_RECORD_SIZE <= view.byteLength; offset += AUDIT_RECORD_SIZE) {
+    records.push({
+      seq: view.getUint32(offset, true),
+      timestamp: view.getUint32(offset + 4, true),
+      type: view.getUint8(offset + 8),
+      slot: view.getUint8(offset + 9),
+      result: view.getUint8(offset + 10),
+      source: view.getUint8(offset + 11),
+      aux: view.getUint16(offset + 12, true),
+    });
+  }
+  return records;
+};
+
+/**
+ * Convert records to CSV
+ * @param {Array<Object>} records Parsed records
+ * @returns {string} CSV document with a header line
+ * @note Timestamps before 2020 mean the device clock was not set, they are left as seconds since boot
+ */
+const auditRecordsToCsv = (records) => {
+  const lines = records.map(record => [
+    record.seq,
+    record.timestamp > 1577836800 ? new Date(record.timestamp * 1000).toISOString() : record.timestamp,
+    auditEventNames[record.type] ?? record.type,
+    record.slot === 0xFF ? '' : record.slot,
+    auditResultNames[record.result] ?? record.result,
+    auditSourceNames[record.source] ?? record.source,
+    record.aux,
+  ].join(','));
+  return ['seq,time,event,slot,result,source,aux', ...lines].join('\n') + '\n';
+};
+
+const saveCsv = (csv) => {
+  const url = URL.createObjectURL(new Blob([csv], { type: 'text/csv' }));
+  const link = document.createElement('a');
+  link.href = url;
+  link.download = `imp-term-audit-${new Date().toISOString().slice(0, 19).replace(/:/g, '-')}.csv`;
+  link.click();
+  URL.revokeObjectURL(url);
+};
+
+/**
+ * Stream records starting at the given cursor
+ * @param {BluetoothRemoteGATTServer} server Connected GATT server
+ * @param {number} cursor First sequence number to request
+ * @param {function} onRecords Called with every received batch of records
+ * @returns {Promise} Resolved once the device sends the end-of-log marker
+ */
+const streamAuditLog = async (server, cursor, onRecords) => {
+  const characteristic = await getCharacteristic(server, auditLogChr);
+  await characteristic.startNotifications();
+
+  return new Promise((resolve, reject) => {
+    const cleanup = () => {
+      characteristic.removeEventListener('characteristicvaluechanged', onValue);
+      getDevice().removeEventListener('gattserverdisconnected', onDisconnect);
+    };
+    const onValue = (event) => {
+      const view = event.target.value;
+      if (view.byteLength === 0) { // End of log
+        cleanup();
+        resolve();
+        return;
+      }
+      onRecords(parseAuditRecords(view));
+    };
+    const onDisconnect = () => {
+      cleanup();
+      reject(new Error('Disconnected during export'));
+    };
+
+    characteristic.addEventListener('characteristicvaluechanged', onValue);
+    getDevice().addEventListener('gattserverdisconnected', onDisconnect);
+
+    authWrite(characteristic, auditLogChr.encode(cursor)).catch(error => {
+      cleanup();
+      reject(error);
+    });
+  });
+};
+
+// Records received so far, kept across attempts so an interrupted export can resume
+var pendingRecords = [];
+
+const AuditLog = () => {
+  const [received, setReceived] = useState(0);
+  const [resumable, setResumable] = useState(false);
+
+  const handleExport = (fromStart) => {
+    const exportToast = toast.loading("Downloading audit log...");
+
+    if (!resumable) {
+      pendingRecords = [];
+    }
+    let cursor = fromStart && !resumable ? 0 : Number(localStorage.getItem(cursorStorageKey) ?? 0);
+    if (pendingRecords.length > 0) {
+      cursor = pendingRecords[pendingRecords.length - 1].seq + 1;
+    }
+
+    handleConnection(exportToast)
+    .then(server => streamAuditLog(server, cursor, records => {
+      pendingRecords.push(...records);
+      setReceived(pendingRecords.length);
+    }))
+    .then(_ => {
+      console.log(`Audit log downloaded, ${pendingRecords.length} records`);
+      if (pendingRecords.length > 0) {
+        localStorage.setItem(cursorStorageKey, pendingRecords[pendingRecords.length - 1].seq + 1);
+      }
+      saveCsv(auditRecordsToCsv(pendingRecords));
+      pendingRecords = [];
+      setResumable(false);
+      setReceived(0);
+      toast.update(exportToast, { render: "Audit log saved", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      setResumable(pendingRecords.length > 0);
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, exportToast);
+    });
+  };
+
+  return (
+    <Box display="flex" flexDirection="column" gap={2}>
+      <Typography variant="h6" gutterBottom>
+        Audit log
+      </Typography>
+      {resumable && (
+        <Typography variant="body2">
+          Export interrupted after {received} records, it will continue where it stopped.
+        </Typography>
+      )}
+      <Button variant="contained" color="primary" fullWidth onClick={() => handleExport(false)}>
+        {resumable ? 'Resume export' : 'Export new records'}
+      </Button>
+      <Button variant="outlined" color="primary" fullWidth onClick={() => handleExport(true)} disabled={resumable}>
+        Export all records
+      </Button>
+    </Box>
+  );
+};
+
+export default AuditLog;
@@ -0,0 +1,108 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import MenuItem from '@mui/material/MenuItem';
+import TextField from '@mui/material/TextField';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  cardEnrollChr,
+  ConnectionAborted,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection
+} from './bluetooth';
+
+// Protocol constants, see enum CardCommand in main/include/credential.h
+const CARD_CMD_ADD = 1;
+const CARD_CMD_REMOVE = 2;
+const CARD_CMD_CLEAR = 3;
+
+const UINT32_MAX = Math.pow(2, 32) - 1;
+const SCHEDULE_COUNT = 8; // See main/include/config.h
+
+/**
+ * Build a card command: command byte followed by the card number (u32, little endian)
+ */
+const cardCommand = (cmd, card, schedule) => {
+  if (cmd === CARD_CMD_CLEAR)
+    return new Uint8Array([cmd]);
+  let view = new DataView(new ArrayBuffer(6));
+  view.setUint8(0, cmd);
+  view.setUint32(1, card, true);
+  view.setUint8(5, schedule);
+  return new Uint8Array(view.buffer);
+};
+
+const Cards = () => {
+  const [card, setCard] = useState('');
+  const [schedule, setSchedule] = useState(0);
+
+  const cardValid = () => /^[0-9]+$/.test(card) && Number(card) <= UINT32_MAX;
+
+  const handleCommand = (cmd) => {
+    if (cmd !== CARD_CMD_CLEAR && !cardValid()) {
+      toast.error("Card number must be a number up to " + UINT32_MAX);
+      return;
+    }
+    const messages = {
+      [CARD_CMD_ADD]: ["Adding card...", "Card added"],
+      [CARD_CMD_REMOVE]: ["Removing card...", "Card removed"],
+      [CARD_CMD_CLEAR]: ["Removing all cards...", "All cards removed"],
+    };
+    const cardToast = toast.loading(messages[cmd][0]);
+
+    handleConnection(cardToast)
+    .then(server => getCharacteristic(server, cardEnrollChr))
+    .then(characteristic => authWrite(characteristic, cardEnrollChr.encode(cardCommand(cmd, Number(card), schedule))))
+    .then(_ => {
+      console.log(messages[cmd][1]);
+      toast.update(cardToast, { render: messages[cmd][1], type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, cardToast);
+    });
+  };
+
+  return (
+    <Box display="flex" flexDirection="column" gap={2}>
+      <Typography variant="h6" gutterBottom>
+        Cards
+      </Typography>
+      <TextField
+        label="Card number"
+        variant="outlined"
+        id="card-number"
+        value={card}
+        onChange={(e) => setCard(e.target.value)}
+        inputProps={{ inputMode: 'numeric' }}
+        helperText="As reported by the terminal when the card is read"
+      />
+      <TextField
+        select
+        label="Schedule"
+        value={schedule}
+        onChange={(e) => setSchedule(e.target.value)}
+        helperText="Schedule 0 allows access at any time"
+      >
+        {[...Array(SCHEDULE_COUNT).keys()].map(i => <MenuItem key={i} value={i}>{i}</MenuItem>)}
+      </TextField>
+      <Box display="flex" gap={2}>
+        <Button variant="contained" fullWidth onClick={() => handleCommand(CARD_CMD_ADD)}>
+          Add
+        </Button>
+        <Button variant="outlined" fullWidth onClick={() => handleCommand(CARD_CMD_REMOVE)}>
+          Remove
+        </Button>
+        <Button variant="outlined" color="error" fullWidth onClick={() => handleCommand(CARD_CMD_CLEAR)}>
+          Remove all
+        </Button>
+      </Box>
+    </Box>
+  );
+};
+
+export default Cards;
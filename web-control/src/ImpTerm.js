@@ -1,38 +1,41 @@
-import { Alert, Box, Button, Container, FormControl, InputAdornment, InputLabel, OutlinedInput, TextField, Typography } from '@mui/material';
+import Alert from '@mui/material/Alert';
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import Container from '@mui/material/Container';
+import FormControl from '@mui/material/FormControl';
+import InputAdornment from '@mui/material/InputAdornment';
+import InputLabel from '@mui/material/InputLabel';
 import Link from '@mui/material/Link';
-import React, { useState } from 'react';
+import OutlinedInput from '@mui/material/OutlinedInput';
+import TextField from '@mui/material/TextField';
+import Typography from '@mui/material/Typography';
+import React, { lazy, Suspense, useEffect, useState } from 'react';
 import { toast } from 'react-toastify';
+import AdminLogin from './AdminLogin';
+import Cards from './Cards';
+import OneTimeCodes from './OneTimeCodes';
+import PhoneUnlock from './PhoneUnlock';
+import Schedule from './Schedule';
+import {
+  accessPinChr,
+  authWrite,
+  bluetoothAPI,
+  ConnectionAborted,
+  doorOpenDurationChr,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection,
+  httpTransport
+} from './bluetooth';
+import { markInteractive } from './reportWebVitals';
 
-// BLE service and characteristic UUIDs
-const impTermSvcUuid = "automation_io";
-const accessPinChrUuid = 'bf6036dc-5b62-425e-bed4-9b7f6ba1c921';
-const doorOpenDurationChrUuid = '4e3ee180-27a0-4894-815a-c98a07ba1555';
+// Rarely used screens, loaded after the rest of the page is usable
+const AuditLog = lazy(() => import('./AuditLog'));
+const OtaUpload = lazy(() => import('./OtaUpload'));
+const Provisioning = lazy(() => import('./Provisioning'));
 
 // Convenience definitions
 const UINT16_MAX = Math.pow(2, 16) - 1;
-const bluetoothAPI = navigator.bluetooth;
-
-/**
- * Convert a number to a Uint8Array
- * @param {number} num The number to convert
- * @returns {Uint8Array} The converted number
- * @example numToUint8Array(0) => Uint8Array(2) [0, 0]
- * @example numToUint8Array(1) => Uint8Array(2) [1, 0]
- * @example numToUint8Array(256) => Uint8Array(2) [0, 1]
- * @example numToUint8Array(65535) => Uint8Array(2) [255, 255]
- * @example numToUint8Array(1234) => Uint8Array(2) [210, 4]
- * @cite Peschel, R. (2022). "How to convert a Javascript number to a Uint8Array?" Stack Overflow. Available at: https://stackoverflow.com/a/72476502 [Accessed 17 Nov. 2024].
-*/
-function numToUint8Array(num) {
-  let arr = new Uint8Array(2);
-
-  for (let i = 0; i < 8; i++) {
-    arr[i] = num % 256;
-    num = Math.floor(num / 256);
-  }
-
-  return arr;
-}
 
 /**
  * Check if the PIN is a valid 4-10 digit number
@@ -48,55 +51,6 @@ const pinValid = (pin) => {
   return pinFormat.test(pin);
 };
 
-class ConnectionAborted extends Error {}
-
-/**
- * Get the Bluetooth device
- * @returns {Promise<BluetoothDevice>} The Bluetooth device
- */
-const handleConnection = async (notification) => {
-  try {
-    if (impTermDevice.gatt.connected)
-        console.log('Device already connected')
-    return impTermDevice.gatt.connect();
-  } catch(error) {
-    try {
-      impTermDevice = await bluetoothAPI.requestDevice({
-        // acceptAllDevices: true,
-        filters: [{ name: 'imp-term' }],
-        optionalServices: [impTermSvcUuid]
-      });
-      console.log(`Selected device: ${impTermDevice.name} (${impTermDevice.id})`);
-      return impTermDevice.gatt.connect()
-    }
-    catch(error) {
-      if(error.message.includes('User cancelled')) {
-        console.log('Transaction cancelled by user');
-        toast.update(notification, { render: "Connection cancelled", type: "warning", isLoading: false, autoClose: true });
-      }
-      else {
-        console.error('Error:', error);
-        toast.error('An error occurred');
-      }
-      throw new ConnectionAborted();
-    }
-  }
-}
-
-const handleChangeError = (error, notification) => {
-  if(error.message.includes('GATT operation not permitted')) {
-    console.error('Operation not permitted: You need to unlock the device first');
-    toast.update(notification, { render: "Unlock the device first", type: "error", isLoading: false, autoClose: true });
-  }
-  else {
-    console.error('Error:', error);
-    toast.update(notification, { render: "An error occurred", type: "error", isLoading: false, autoClose: true });
-  }
-}
-
-// Global variable to store the connected device
-var impTermDevice = null;
-
 const ImpTerm = () => {
   // State for input fields
   const [pin, setPin] = useState('');
@@ -108,6 +62,8 @@ const ImpTerm = () => {
   const [pinHelper, setPinHelper] = useState('');
   const [pinConfirmationHelper, setPinConfirmationHelper] = useState('');
 
+  useEffect(markInteractive, []);
+
   const checkPinValid = () => {
     checkPinsMatch();
     if(!pinValid(pin) && pin.length > 0) {
@@ -150,21 +106,13 @@ const ImpTerm = () => {
     const pinChangeToast = toast.loading("PIN change pending...")
 
     console.log('Requested access PIN change:', pin);
-    const textEncoder = new TextEncoder();
-    const pinConvUint8 = textEncoder.encode(pin);
+    const pinConvUint8 = accessPinChr.encode(pin);
 
     handleConnection(pinChangeToast)
-    .then(server => {
-      console.log('Getting service...');
-      return server.getPrimaryService(impTermSvcUuid);
-    })
-    .then(service => {
-      console.log('Getting characteristic...');
-      return service.getCharacteristic(accessPinChrUuid);
-    })
+    .then(server => getCharacteristic(server, accessPinChr))
     .then(characteristic => {
       console.log('Writing value...');
-      return characteristic.writeValue(pinConvUint8);
+      return authWrite(characteristic, pinConvUint8);
     })
     .then(_ => {
       console.log('PIN set successfully');
@@ -186,20 +134,13 @@ const ImpTerm = () => {
     const durationChangeToast = toast.loading("Duration change pending...")
     console.log('Requested door open duration change:', doorOpenDuration);
 
-    const durationConvUint8 = numToUint8Array(doorOpenDuration);
+    const durationConvUint8 = doorOpenDurationChr.encode(Number(doorOpenDuration));
 
     handleConnection(durationChangeToast)
-    .then(server => {
-      console.log('Getting service...');
-      return server.getPrimaryService(impTermSvcUuid);
-    })
-    .then(service => {
-      console.log('Getting characteristic...');
-      return service.getCharacteristic(doorOpenDurationChrUuid);
-    })
+    .then(server => getCharacteristic(server, doorOpenDurationChr))
     .then(characteristic => {
       console.log('Writing value...');
-      return characteristic.writeValue(durationConvUint8);
+      return authWrite(characteristic, durationConvUint8);
     })
     .then(_ => {
       console.log('Duration set successfully');
@@ -219,8 +160,17 @@ const ImpTerm = () => {
       <Typography variant="h4" align="center" gutterBottom>
         IMP Access Terminal
       </Typography>
-      {bluetoothAPI ? (
+      {(bluetoothAPI || httpTransport) ? (
         <>
+          <br />
+          {/* Phone bonding, card sync, audit export and OTA need Bluetooth (notifications) */}
+          {!httpTransport && (
+            <>
+              <PhoneUnlock />
+              <br />
+            </>
+          )}
+          <AdminLogin />
           <br />
           <Box
             component="form"
@@ -301,6 +251,28 @@ const ImpTerm = () => {
               Update
             </Button>
           </Box>
+          <br />
+          <Cards />
+          <br />
+          {!httpTransport && (
+            <>
+              <Suspense fallback={null}>
+                <Provisioning />
+              </Suspense>
+              <br />
+            </>
+          )}
+          <Schedule />
+          <br />
+          <OneTimeCodes />
+          <br />
+          {!httpTransport && (
+            <Suspense fallback={null}>
+              <AuditLog />
+              <br />
+              <OtaUpload />
+            </Suspense>
+          )}
         </>
       ) : (
         <Container>
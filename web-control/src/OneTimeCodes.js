@@ -0,0 +1,172 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import MenuItem from '@mui/material/MenuItem';
+import TextField from '@mui/material/TextField';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  ConnectionAborted,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection,
+  otpConfigChr
+} from './bluetooth';
+
+// Protocol constants, see main/include/otp.h and main/include/config.h
+const OTP_SECRET_LEN = 20;
+const OTP_MAX_SECRETS = 16;
+const OTP_VISITOR_DIGITS = 8;
+const OTP_CMD_MAX_CODES = 16;
+const OTP_CMD_TOTP_SET = 1;
+const OTP_CMD_TOTP_REMOVE = 2;
+const OTP_CMD_VISITOR_ADD = 3;
+const OTP_CMD_VISITOR_CLEAR = 4;
+const SCHEDULE_COUNT = 8;
+
+// RFC 4648 base32 without padding, as expected by authenticator apps
+const base32 = (bytes) => {
+  const alphabet = 'ABCDEFGHIJKLMNOPQRSTUVWXYZ234567';
+  let bits = 0, value = 0, out = '';
+  bytes.forEach(byte => {
+    value = (value << 8) | byte;
+    bits += 8;
+    while (bits >= 5) {
+      out += alphabet[(value >>> (bits - 5)) & 31];
+      bits -= 5;
+    }
+  });
+  if (bits > 0)
+    out += alphabet[(value << (5 - bits)) & 31];
+  return out;
+};
+
+// Uniformly distributed visitor code, rejection sampling avoids the modulo bias
+const randomCode = () => {
+  const max = Math.pow(10, OTP_VISITOR_DIGITS);
+  const limit = Math.floor(0x100000000 / max) * max;
+  let value = new Uint32Array(1);
+  do {
+    crypto.getRandomValues(value);
+  } while (value[0] >= limit);
+  return value[0] % max;
+};
+
+const OneTimeCodes = () => {
+  const [slot, setSlot] = useState(0);
+  const [schedule, setSchedule] = useState(0);
+  const [secret, setSecret] = useState('');
+  const [visitorCount, setVisitorCount] = useState(5);
+  const [visitorCodes, setVisitorCodes] = useState([]);
+
+  const writeCommand = (value, pending, done) => {
+    const otpToast = toast.loading(pending);
+
+    return handleConnection(otpToast)
+    .then(server => getCharacteristic(server, otpConfigChr))
+    .then(characteristic => authWrite(characteristic, otpConfigChr.encode(value)))
+    .then(_ => {
+      console.log(done);
+      toast.update(otpToast, { render: done, type: "success", isLoading: false, autoClose: true });
+      return true;
+    })
+    .catch(error => {
+      if(!(error instanceof ConnectionAborted))
+        handleChangeError(error, otpToast);
+      return false;
+    });
+  };
+
+  const handleEnrollTotp = () => {
+    const key = crypto.getRandomValues(new Uint8Array(OTP_SECRET_LEN));
+    const value = new Uint8Array(3 + OTP_SECRET_LEN);
+    value.set([OTP_CMD_TOTP_SET, slot, schedule]);
+    value.set(key, 3);
+    writeCommand(value, "Enrolling secret...", `Secret enrolled in slot ${slot}`)
+    .then(ok => setSecret(ok ? base32(key) : ''));
+  };
+
+  const handleRemoveTotp = () => {
+    setSecret('');
+    writeCommand(new Uint8Array([OTP_CMD_TOTP_REMOVE, slot]), "Removing secret...", `Slot ${slot} removed`);
+  };
+
+  const handleAddVisitors = () => {
+    if (!(visitorCount >= 1 && visitorCount <= OTP_CMD_MAX_CODES)) {
+      toast.error(`Between 1 and ${OTP_CMD_MAX_CODES} codes at once`);
+      return;
+    }
+    const codes = Array.from({ length: visitorCount }, randomCode);
+    let view = new DataView(new ArrayBuffer(1 + 4 * codes.length));
+    view.setUint8(0, OTP_CMD_VISITOR_ADD);
+    codes.forEach((code, i) => view.setUint32(1 + 4 * i, code, true));
+    writeCommand(new Uint8Array(view.buffer), "Adding visitor codes...", "Visitor codes added")
+    .then(ok => setVisitorCodes(ok ? codes.map(code => String(code).padStart(OTP_VISITOR_DIGITS, '0')) : []));
+  };
+
+  const handleClearVisitors = () => {
+    setVisitorCodes([]);
+    writeCommand(new Uint8Array([OTP_CMD_VISITOR_CLEAR]), "Removing visitor codes...", "Visitor codes removed");
+  };
+
+  const otpauth = `otpauth://totp/imp-term:slot${slot}?secret=${secret}&issuer=imp-term`;
+
+  return (
+    <Box display="flex" flexDirection="column" gap={2}>
+      <Typography variant="h6" gutterBottom>
+        One-time codes
+      </Typography>
+      <Box display="flex" gap={2}>
+        <TextField select label="TOTP slot" value={slot} onChange={(e) => { setSlot(e.target.value); setSecret(''); }} fullWidth>
+          {[...Array(OTP_MAX_SECRETS).keys()].map(i => <MenuItem key={i} value={i}>{i}</MenuItem>)}
+        </TextField>
+        <TextField select label="Schedule" value={schedule} onChange={(e) => setSchedule(e.target.value)} fullWidth>
+          {[...Array(SCHEDULE_COUNT).keys()].map(i => <MenuItem key={i} value={i}>{i}</MenuItem>)}
+        </TextField>
+      </Box>
+      <Box display="flex" gap={2}>
+        <Button variant="contained" fullWidth onClick={handleEnrollTotp}>
+          Enroll new secret
+        </Button>
+        <Button variant="outlined" fullWidth onClick={handleRemoveTotp}>
+          Remove
+        </Button>
+      </Box>
+      {secret && (
+        <TextField
+          label="Add to an authenticator app"
+          value={otpauth}
+          InputProps={{ readOnly: true }}
+          helperText="Shown only once, the terminal never sends the secret back"
+          multiline
+        />
+      )}
+      <Box display="flex" gap={2}>
+        <TextField
+          label="Visitor codes"
+          type="number"
+          value={visitorCount}
+          onChange={(e) => setVisitorCount(Number(e.target.value))}
+          fullWidth
+        />
+        <Button variant="contained" fullWidth onClick={handleAddVisitors}>
+          Generate
+        </Button>
+      </Box>
+      {visitorCodes.length > 0 && (
+        <TextField
+          label="New visitor codes, each opens the door once"
+          value={visitorCodes.join('\n')}
+          InputProps={{ readOnly: true }}
+          multiline
+        />
+      )}
+      <Button variant="outlined" fullWidth onClick={handleClearVisitors}>
+        Remove all visitor codes
+      </Button>
+    </Box>
+  );
+};
+
+export default OneTimeCodes;
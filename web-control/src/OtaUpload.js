@@ -0,0 +1,205 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import LinearProgress from '@mui/material/LinearProgress';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  ConnectionAborted,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection,
+  otaControlChr,
+  otaDataChr
+} from './bluetooth';
+
+// Protocol constants, see main/include/ota.h
+const OTA_CMD_BEGIN = 1;
+const OTA_CMD_END = 2;
+const OTA_STATE_STARTING = 1;
+const OTA_STATE_RECEIVING = 2;
+const OTA_STATE_DONE = 4;
+const OTA_STATE_ERROR = 5;
+
+// Time without progress after which the client asks the device where it is
+const OTA_STALL_TIMEOUT_MS = 2000;
+
+/**
+ * Parse the status read from or notified on the control characteristic
+ * @param {DataView} view Characteristic value
+ * @returns {Object} Status fields
+ */
+const parseOtaStatus = (view) => ({
+  state: view.getUint8(0),
+  error: view.getUint8(1),
+  maxChunk: view.getUint16(2, true),
+  window: view.getUint32(4, true),
+  size: view.getUint32(8, true),
+  received: view.getUint32(12, true),
+  committed: view.getUint32(16, true),
+});
+
+/**
+ * Send a firmware image, resuming where the device stopped if it already has part of it
+ * @param {BluetoothRemoteGATTServer} server Connected GATT server
+ * @param {Uint8Array} image Firmware image (build/imp-term.bin)
+ * @param {function} onProgress Called with the number of bytes written to flash
+ */
+const uploadFirmware = async (server, image, onProgress) => {
+  const digest = new Uint8Array(await crypto.subtle.digest('SHA-256', image));
+  const control = await getCharacteristic(server, otaControlChr);
+  const data = await getCharacteristic(server, otaDataChr);
+
+  let latest = null;
+  let waiters = [];
+  const onStatus = (event) => {
+    latest = parseOtaStatus(event.target.value);
+    onProgress(latest.committed);
+    waiters = waiters.filter(waiter => !waiter(latest));
+  };
+  // Resolves with the first status matching the predicate, or null after a timeout
+  const waitForStatus = (predicate, timeout) => new Promise(resolve => {
+    if (latest && predicate(latest)) {
+      resolve(latest);
+      return;
+    }
+    const timer = setTimeout(() => {
+      waiters = waiters.filter(waiter => waiter !== check);
+      resolve(null);
+    }, timeout);
+    const check = (status) => {
+      if (!predicate(status))
+        return false;
+      clearTimeout(timer);
+      resolve(status);
+      return true;
+    };
+    waiters.push(check);
+  });
+  const readStatus = async () => {
+    latest = parseOtaStatus(await control.readValue());
+    return latest;
+  };
+  const checkError = (status) => {
+    if (status.state === OTA_STATE_ERROR)
+      throw new Error(`Device rejected the update (error ${status.error})`);
+  };
+
+  await control.startNotifications();
+  control.addEventListener('characteristicvaluechanged', onStatus);
+
+  try {
+    // Same size and hash as a transfer in progress makes the device resume it
+    let begin = new Uint8Array(1 + 4 + digest.length);
+    begin[0] = OTA_CMD_BEGIN;
+    new DataView(begin.buffer).setUint32(1, image.length, true);
+    begin.set(digest, 5);
+    await authWrite(control, begin);
+
+    let status = await waitForStatus(s => s.state !== OTA_STATE_STARTING && s.size === image.length, OTA_STALL_TIMEOUT_MS * 5)
+      ?? await readStatus();
+    checkError(status);
+    if (status.state !== OTA_STATE_RECEIVING)
+      throw new Error('Device did not start the update');
+
+    const chunkSize = status.maxChunk;
+    let offset = status.received;
+    console.log(`Sending firmware from offset ${offset}, ${chunkSize} B chunks`);
+
+    while (offset < image.length) {
+      const length = Math.min(chunkSize, image.length - offset);
+
+      // Keep no more than the device's buffer window in flight
+      if (offset + length - latest.committed > status.window) {
+        const progress = await waitForStatus(s => offset + length - s.committed <= s.window || s.state === OTA_STATE_ERROR, OTA_STALL_TIMEOUT_MS);
+        if (progress === null) {
+          // A chunk got lost, continue from where the device actually is
+          const actual = await readStatus();
+          checkError(actual);
+          offset = actual.received;
+          continue;
+        }
+        checkError(progress);
+      }
+
+      let packet = new Uint8Array(4 + length);
+      new DataView(packet.buffer).setUint32(0, offset, true);
+      packet.set(image.subarray(offset, offset + length), 4);
+      await data.writeValueWithoutResponse(packet);
+      offset += length;
+    }
+
+    await waitForStatus(s => s.committed === image.length || s.state === OTA_STATE_ERROR, OTA_STALL_TIMEOUT_MS * 5);
+    await authWrite(control, new Uint8Array([OTA_CMD_END]));
+    status = await waitForStatus(s => s.state === OTA_STATE_DONE || s.state === OTA_STATE_ERROR, OTA_STALL_TIMEOUT_MS * 5)
+      ?? await readStatus();
+    checkError(status);
+  } finally {
+    control.removeEventListener('characteristicvaluechanged', onStatus);
+  }
+};
+
+const OtaUpload = () => {
+  const [image, setImage] = useState(null);
+  const [progress, setProgress] = useState(0);
+  const [uploading, setUploading] = useState(false);
+
+  const handleFileChange = async (e) => {
+    const file = e.target.files[0];
+    if (!file)
+      return;
+    setImage({ name: file.name, data: new Uint8Array(await file.arrayBuffer()) });
+    setProgress(0);
+  };
+
+  const handleUpload = (e) => {
+    e.preventDefault();
+
+    const otaToast = toast.loading("Firmware update pending...");
+    setUploading(true);
+
+    handleConnection(otaToast)
+    .then(server => uploadFirmware(server, image.data, committed => setProgress(100 * committed / image.data.length)))
+    .then(_ => {
+      console.log('Firmware update finished');
+      toast.update(otaToast, { render: "Firmware updated, the device is restarting", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, otaToast);
+    })
+    .finally(() => setUploading(false));
+  };
+
+  return (
+    <Box
+      component="form"
+      onSubmit={handleUpload}
+      display="flex"
+      flexDirection="column"
+      gap={2}
+    >
+      <Typography variant="h6" gutterBottom>
+        Firmware update
+      </Typography>
+      <Button variant="outlined" component="label" fullWidth disabled={uploading}>
+        {image ? image.name : 'Select firmware image (.bin)'}
+        <input type="file" accept=".bin" hidden onChange={handleFileChange} />
+      </Button>
+      {image && <LinearProgress variant="determinate" value={progress} />}
+      <Button
+        type="submit"
+        variant="contained"
+        color="primary"
+        fullWidth
+        disabled={!image || uploading}
+      >
+        {progress > 0 && progress < 100 && !uploading ? 'Resume' : 'Upload'}
+      </Button>
+    </Box>
+  );
+};
+
+export default OtaUpload;
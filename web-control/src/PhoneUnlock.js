@@ -0,0 +1,118 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import Typography from '@mui/material/Typography';
+import React from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  concatBytes,
+  ConnectionAborted,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection,
+  hmac,
+  hmacKey,
+  phoneEnrollChr,
+  phoneUnlockChr,
+  queuedRead,
+  queuedWrite
+} from './bluetooth';
+
+// Protocol constants, see main/include/phone.h
+const PHONE_KEY_LEN = 16;
+const PHONE_CMD_ENROLL = 1;
+const PHONE_CMD_REVOKE = 2;
+
+// Unlock key of this browser, sent to the terminal when the device is enrolled
+const PHONE_KEY_STORAGE = 'impTermPhoneKey';
+
+/**
+ * Get the unlock key of this browser
+ * @param {boolean} create Generate a new key when there is none
+ * @returns {Uint8Array|null} The key
+ */
+const phoneKey = (create) => {
+  const stored = localStorage.getItem(PHONE_KEY_STORAGE);
+  if (stored !== null)
+    return Uint8Array.from(stored.match(/../g).map(byte => parseInt(byte, 16)));
+  if (!create)
+    return null;
+  const key = crypto.getRandomValues(new Uint8Array(PHONE_KEY_LEN));
+  localStorage.setItem(PHONE_KEY_STORAGE, Array.from(key, byte => byte.toString(16).padStart(2, '0')).join(''));
+  return key;
+};
+
+const PhoneUnlock = () => {
+  const handleUnlock = () => {
+    const unlockToast = toast.loading("Unlocking...");
+
+    // The first read makes the browser pair with the device, later ones reuse the bond.
+    // The request is signed with the key this browser was enrolled with.
+    const key = phoneKey(false);
+    if (key === null) {
+      toast.update(unlockToast, { render: "Enroll this device first", type: "error", isLoading: false, autoClose: true });
+      return;
+    }
+
+    handleConnection(unlockToast)
+    .then(server => getCharacteristic(server, phoneUnlockChr))
+    .then(async characteristic => {
+      const challenge = await queuedRead(characteristic);
+      const response = await hmac(await hmacKey(key), new TextEncoder().encode('unlock'), challenge);
+      return queuedWrite(characteristic, phoneUnlockChr.encode(response));
+    })
+    .then(_ => {
+      console.log('Door unlocked');
+      toast.update(unlockToast, { render: "Door unlocked", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      if(error.message.includes('not authorized')) {
+        console.error('Unlock denied');
+        toast.update(unlockToast, { render: "This device is not enrolled or the terminal is locked out", type: "error", isLoading: false, autoClose: true });
+        return;
+      }
+      handleChangeError(error, unlockToast);
+    });
+  };
+
+  const handleEnroll = (cmd) => {
+    const enrollToast = toast.loading(cmd === PHONE_CMD_ENROLL ? "Enrolling this device..." : "Revoking this device...");
+
+    handleConnection(enrollToast)
+    .then(server => getCharacteristic(server, phoneEnrollChr))
+    .then(characteristic => authWrite(characteristic, phoneEnrollChr.encode(
+      cmd === PHONE_CMD_ENROLL ? concatBytes(Uint8Array.of(cmd), phoneKey(true)) : Uint8Array.of(cmd))))
+    .then(_ => {
+      console.log(cmd === PHONE_CMD_ENROLL ? 'Device enrolled' : 'Device revoked');
+      toast.update(enrollToast, { render: cmd === PHONE_CMD_ENROLL ? "Device enrolled" : "Device revoked", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, enrollToast);
+    });
+  };
+
+  return (
+    <Box display="flex" flexDirection="column" gap={2}>
+      <Typography variant="h6" gutterBottom>
+        Phone unlock
+      </Typography>
+      <Button variant="contained" color="primary" fullWidth onClick={handleUnlock}>
+        Unlock
+      </Button>
+      <Box display="flex" gap={2}>
+        <Button variant="outlined" fullWidth onClick={() => handleEnroll(PHONE_CMD_ENROLL)}>
+          Enroll this device
+        </Button>
+        <Button variant="outlined" fullWidth onClick={() => handleEnroll(PHONE_CMD_REVOKE)}>
+          Revoke this device
+        </Button>
+      </Box>
+    </Box>
+  );
+};
+
+export default PhoneUnlock;
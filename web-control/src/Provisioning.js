@@ -0,0 +1,292 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import LinearProgress from '@mui/material/LinearProgress';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  cardSyncChr,
+  cardSyncDataChr,
+  ConnectionAborted,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection
+} from './bluetooth';
+
+// Protocol constants, see main/include/credential.h
+const CARD_SYNC_CMD_BEGIN = 1;
+const CARD_SYNC_CMD_COMMIT = 2;
+const CARD_SYNC_RECEIVING = 1;
+const CARD_SYNC_ERROR = 2;
+const CARD_SYNC_OP_PUT = 1;
+const CARD_SYNC_OP_REMOVE = 2;
+const CARD_SYNC_ACK_INTERVAL = 8;
+const CARD_SYNC_DIGEST_LEN = 8;
+const CARD_RECORD_LEN = 5; // card_t, u32 number and u8 schedule
+const CARD_OP_LEN = 1 + CARD_RECORD_LEN;
+
+const UINT32_MAX = Math.pow(2, 32) - 1;
+const SCHEDULE_COUNT = 8; // See main/include/config.h
+
+// Chunks sent ahead of the last acknowledged one
+const SYNC_WINDOW = 2 * CARD_SYNC_ACK_INTERVAL;
+// Time without an acknowledgement after which the client asks the device where it is
+const SYNC_STALL_TIMEOUT_MS = 2000;
+
+/**
+ * Parse a roster CSV: card number, optional schedule (default 0), further columns are ignored
+ * @param {string} text CSV contents, an optional header line and lines starting with # are skipped
+ * @returns {Map<number, number>} Schedule by card number
+ */
+export const parseRoster = (text) => {
+  const roster = new Map();
+  text.split(/\r?\n/).forEach((line, i) => {
+    const cells = line.split(/[,;]/).map(cell => cell.trim());
+    if (cells[0] === '' || cells[0].startsWith('#'))
+      return;
+    if (i === 0 && !/^[0-9]+$/.test(cells[0]))
+      return; // Header
+    if (!/^[0-9]+$/.test(cells[0]) || Number(cells[0]) > UINT32_MAX)
+      throw new Error(`Line ${i + 1}: card number must be a number up to ${UINT32_MAX}`);
+    const schedule = cells.length > 1 && cells[1] !== '' ? Number(cells[1]) : 0;
+    if (!Number.isInteger(schedule) || schedule < 0 || schedule >= SCHEDULE_COUNT)
+      throw new Error(`Line ${i + 1}: schedule must be 0-${SCHEDULE_COUNT - 1}`);
+    roster.set(Number(cells[0]), schedule);
+  });
+  return roster;
+};
+
+/**
+ * Parse the card list read from the data characteristic
+ * @param {DataView} view Characteristic value, card_t records
+ * @returns {Map<number, number>} Schedule by card number
+ */
+const parseCardList = (view) => {
+  const cards = new Map();
+  for (let offset = 0; offset + CARD_RECORD_LEN <= view.byteLength; offset += CARD_RECORD_LEN)
+    cards.set(view.getUint32(offset, true), view.getUint8(offset + 4));
+  return cards;
+};
+
+/**
+ * Parse the status read from or notified on the sync characteristic
+ * @param {DataView} view Characteristic value
+ * @returns {Object} Status fields
+ */
+const parseSyncStatus = (view) => ({
+  state: view.getUint8(0),
+  count: view.getUint8(1),
+  maxOps: view.getUint16(2, true),
+  nextSeq: view.getUint16(4, true),
+  digest: new Uint8Array(view.buffer, view.byteOffset + 6, CARD_SYNC_DIGEST_LEN),
+});
+
+/**
+ * Digest of a card list as computed by the device, over the records sorted by card number
+ * @param {Map<number, number>} cards Schedule by card number
+ * @returns {Promise<Uint8Array>} Truncated SHA-256
+ */
+const cardListDigest = async (cards) => {
+  const numbers = [...cards.keys()].sort((a, b) => a - b);
+  let view = new DataView(new ArrayBuffer(numbers.length * CARD_RECORD_LEN));
+  numbers.forEach((number, i) => {
+    view.setUint32(i * CARD_RECORD_LEN, number, true);
+    view.setUint8(i * CARD_RECORD_LEN + 4, cards.get(number));
+  });
+  const digest = new Uint8Array(await crypto.subtle.digest('SHA-256', view.buffer));
+  return digest.subarray(0, CARD_SYNC_DIGEST_LEN);
+};
+
+const sameBytes = (a, b) => a.length === b.length && a.every((byte, i) => byte === b[i]);
+
+/**
+ * Operations turning the device's card list into the roster
+ */
+const cardListDiff = (current, roster) => {
+  let ops = [];
+  roster.forEach((schedule, card) => {
+    if (current.get(card) !== schedule)
+      ops.push({ op: CARD_SYNC_OP_PUT, card, schedule });
+  });
+  current.forEach((_, card) => {
+    if (!roster.has(card))
+      ops.push({ op: CARD_SYNC_OP_REMOVE, card, schedule: 0 });
+  });
+  return ops;
+};
+
+/**
+ * Build a data chunk: u16 sequence number followed by card_sync_op_t entries
+ */
+const syncChunk = (seq, ops) => {
+  let view = new DataView(new ArrayBuffer(2 + ops.length * CARD_OP_LEN));
+  view.setUint16(0, seq, true);
+  ops.forEach((op, i) => {
+    const offset = 2 + i * CARD_OP_LEN;
+    view.setUint8(offset, op.op);
+    view.setUint32(offset + 1, op.card, true);
+    view.setUint8(offset + 5, op.schedule);
+  });
+  return new Uint8Array(view.buffer);
+};
+
+/**
+ * Bring the device's cards in line with the roster, sending only the changed records
+ * @param {BluetoothRemoteGATTServer} server Connected GATT server
+ * @param {Map<number, number>} roster Schedule by card number
+ * @param {function} onProgress Called with the number of acknowledged and total chunks
+ * @returns {Promise<number>} Number of changed records, 0 if the device was up to date
+ */
+export const syncCards = async (server, roster, onProgress) => {
+  const control = await getCharacteristic(server, cardSyncChr);
+  const data = await getCharacteristic(server, cardSyncDataChr);
+  const readStatus = async () => parseSyncStatus(await control.readValue());
+
+  // Equal digests mean equal lists, no need to read the list itself
+  const digest = await cardListDigest(roster);
+  let status = await readStatus();
+  if (sameBytes(status.digest, digest))
+    return 0;
+
+  const ops = cardListDiff(parseCardList(await data.readValue()), roster);
+  if (ops.length === 0)
+    return 0;
+
+  let latest = status;
+  let waiter = null;
+  const onStatus = (event) => {
+    latest = parseSyncStatus(event.target.value);
+    if (waiter)
+      waiter();
+  };
+  const waitForStatus = () => new Promise(resolve => {
+    const timer = setTimeout(() => { waiter = null; resolve(false); }, SYNC_STALL_TIMEOUT_MS);
+    waiter = () => { clearTimeout(timer); waiter = null; resolve(true); };
+  });
+  const checkError = (status) => {
+    if (status.state === CARD_SYNC_ERROR)
+      throw new Error('Device rejected the cards (invalid record or too many cards)');
+  };
+
+  await control.startNotifications();
+  control.addEventListener('characteristicvaluechanged', onStatus);
+
+  try {
+    await authWrite(control, cardSyncChr.encode(new Uint8Array([CARD_SYNC_CMD_BEGIN])));
+    status = await readStatus();
+    if (status.state !== CARD_SYNC_RECEIVING)
+      throw new Error('Device did not start the sync');
+    latest = status;
+
+    let chunks = [];
+    for (let i = 0; i < ops.length; i += status.maxOps)
+      chunks.push(ops.slice(i, i + status.maxOps));
+    console.log(`Syncing ${ops.length} card record(s) in ${chunks.length} chunk(s)`);
+
+    // Chunks go out back to back, the device acknowledges every CARD_SYNC_ACK_INTERVAL of them
+    let seq = 0;
+    while (true) {
+      while (seq < chunks.length) {
+        if (seq - latest.nextSeq >= SYNC_WINDOW && !await waitForStatus()) {
+          // A chunk or an acknowledgement got lost, continue from where the device actually is
+          latest = await readStatus();
+          seq = latest.nextSeq;
+        }
+        checkError(latest);
+        if (seq < latest.nextSeq)
+          seq = latest.nextSeq;
+        if (seq < chunks.length)
+          await data.writeValueWithoutResponse(syncChunk(seq, chunks[seq]));
+        seq++;
+        onProgress(latest.nextSeq, chunks.length);
+      }
+
+      // Reads are answered after the writes before them, so this is the final position
+      latest = await readStatus();
+      checkError(latest);
+      onProgress(latest.nextSeq, chunks.length);
+      if (latest.nextSeq >= chunks.length)
+        break;
+      seq = latest.nextSeq;
+    }
+
+    let commit = new Uint8Array(1 + CARD_SYNC_DIGEST_LEN);
+    commit[0] = CARD_SYNC_CMD_COMMIT;
+    commit.set(digest, 1);
+    await authWrite(control, cardSyncChr.encode(commit));
+  } finally {
+    control.removeEventListener('characteristicvaluechanged', onStatus);
+  }
+  return ops.length;
+};
+
+const Provisioning = () => {
+  const [roster, setRoster] = useState(null);
+  const [progress, setProgress] = useState(0);
+  const [syncing, setSyncing] = useState(false);
+
+  const handleFileChange = async (e) => {
+    const file = e.target.files[0];
+    if (!file)
+      return;
+    try {
+      setRoster({ name: file.name, cards: parseRoster(await file.text()) });
+      setProgress(0);
+    } catch(error) {
+      toast.error(error.message);
+    }
+  };
+
+  const handleSync = (e) => {
+    e.preventDefault();
+
+    const syncToast = toast.loading("Syncing cards...");
+    setSyncing(true);
+
+    handleConnection(syncToast)
+    .then(server => syncCards(server, roster.cards, (done, total) => setProgress(100 * done / total)))
+    .then(changed => {
+      const message = changed === 0 ? "Cards already up to date" : `${changed} card record(s) updated`;
+      console.log(message);
+      setProgress(100);
+      toast.update(syncToast, { render: message, type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, syncToast);
+    })
+    .finally(() => setSyncing(false));
+  };
+
+  return (
+    <Box
+      component="form"
+      onSubmit={handleSync}
+      display="flex"
+      flexDirection="column"
+      gap={2}
+    >
+      <Typography variant="h6" gutterBottom>
+        Card provisioning
+      </Typography>
+      <Button variant="outlined" component="label" fullWidth disabled={syncing}>
+        {roster ? `${roster.name} (${roster.cards.size} cards)` : 'Select roster (.csv: card, schedule)'}
+        <input type="file" accept=".csv,text/csv" hidden onChange={handleFileChange} />
+      </Button>
+      {roster && <LinearProgress variant="determinate" value={progress} />}
+      <Button
+        type="submit"
+        variant="contained"
+        color="primary"
+        fullWidth
+        disabled={!roster || syncing}
+      >
+        Sync
+      </Button>
+    </Box>
+  );
+};
+
+export default Provisioning;
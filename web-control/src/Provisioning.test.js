@@ -0,0 +1,161 @@
+import { FakeTerminal, tick } from './fakeTerminal';
+
+jest.mock('react-toastify');
+
+// See Provisioning.js and main/include/credential.h
+const SYNC_WINDOW = 16;
+const SYNC_STALL_TIMEOUT_MS = 2000;
+const CARD_SYNC_ACK_INTERVAL = 8;
+const CARD_OP_LEN = 6;
+const ADMIN_PIN = '13579';
+const ONE_OP_MTU = 5 + CARD_OP_LEN; // One record per chunk, for many chunks from few cards
+
+let terminal;
+let server;
+let parseRoster;
+let syncCards;
+
+/**
+ * Cards with consecutive numbers
+ */
+const roster = (first, count, schedule = 1) =>
+  new Map(Array.from({ length: count }, (_, i) => [first + i, schedule]));
+
+const sorted = (cards) => [...cards.entries()].sort((a, b) => a[0] - b[0]);
+
+const chunkWrites = () => terminal.log.filter(entry => entry.op === 'writeWithoutResponse');
+
+/**
+ * Sync the roster. The only timer of the sync is its stall timeout, so once everything in flight
+ * has been answered and one is pending, the client waits in vain and the fake clock runs it out.
+ * @returns {Promise<object>} Changed records, stall timeouts and the progress reports
+ */
+const sync = async (cards) => {
+  let progress = [];
+  let settled = false;
+  const result = syncCards(server, cards, (done, total) => progress.push([done, total]));
+  result.then(() => { settled = true; }, () => { settled = true; });
+
+  let stalls = 0;
+  while (!settled) {
+    await tick();
+    if (jest.getTimerCount() > 0) {
+      jest.advanceTimersByTime(SYNC_STALL_TIMEOUT_MS);
+      stalls++;
+    }
+  }
+  return { changed: await result, stalls, progress };
+};
+
+// Every test loads the modules again, for a new connection and admin session on a new terminal
+beforeEach(async () => {
+  jest.useFakeTimers();
+  jest.spyOn(console, 'log').mockImplementation(() => {});
+  terminal = new FakeTerminal().install();
+  jest.resetModules();
+  const bluetooth = require('./bluetooth');
+  ({ parseRoster, syncCards } = require('./Provisioning'));
+  server = await bluetooth.handleConnection();
+  await bluetooth.adminLogin(server, ADMIN_PIN);
+  terminal.log = [];
+});
+
+afterEach(() => {
+  jest.useRealTimers();
+});
+
+describe('roster', () => {
+  test('takes card numbers and schedules', () => {
+    const cards = parseRoster('card,schedule\n1001,2\n# Visitors\n1002\n\n1003;7;Jane Doe\r\n4294967295,0\n');
+    expect(sorted(cards)).toEqual([[1001, 2], [1002, 0], [1003, 7], [4294967295, 0]]);
+  });
+
+  test('refuses lines it cannot take', () => {
+    expect(() => parseRoster('1001,8')).toThrow('Line 1: schedule');
+    expect(() => parseRoster('card\nabc')).toThrow('Line 2: card number');
+    expect(() => parseRoster('4294967296')).toThrow('Line 1: card number');
+  });
+});
+
+describe('sync', () => {
+  test('sends only the records that changed', async () => {
+    const full = roster(1000, 60);
+    expect((await sync(full)).changed).toBe(60);
+    expect(sorted(terminal.cards)).toEqual(sorted(full));
+    const fullBytes = chunkWrites().reduce((len, entry) => len + entry.bytes.length, 0);
+
+    // Up to date: the digests match and nothing else is read or written
+    terminal.log = [];
+    expect((await sync(full)).changed).toBe(0);
+    expect(terminal.log.map(entry => entry.op)).toEqual(['read']);
+
+    let changed = new Map(full);
+    changed.set(1005, 3);
+    changed.delete(1010);
+    changed.set(5000, 2);
+    terminal.log = [];
+    expect((await sync(changed)).changed).toBe(3);
+    expect(sorted(terminal.cards)).toEqual(sorted(changed));
+    expect(chunkWrites()).toHaveLength(1);
+    expect(chunkWrites()[0].bytes.length).toBe(2 + 3 * CARD_OP_LEN);
+    expect(chunkWrites()[0].bytes.length * 10).toBeLessThan(fullBytes);
+    expect(terminal.commits).toBe(2);
+  });
+
+  test('pipelines the chunks, acknowledged every 8', async () => {
+    const cards = roster(1000, 40);
+    terminal.mtu = ONE_OP_MTU;
+    const { changed, stalls, progress } = await sync(cards);
+    expect(changed).toBe(40);
+    expect(sorted(terminal.cards)).toEqual(sorted(cards));
+
+    // Each chunk once, in order, an acknowledgement interval in flight but never past the window
+    expect(terminal.chunks).toEqual([...cards.keys()].map((_, i) => i));
+    expect(terminal.maxAhead).toBeGreaterThanOrEqual(CARD_SYNC_ACK_INTERVAL - 1);
+    expect(terminal.maxAhead).toBeLessThan(SYNC_WINDOW);
+    expect(terminal.notifications).toBe(40 / CARD_SYNC_ACK_INTERVAL + 1);
+    expect(stalls).toBe(0);
+    expect(progress[progress.length - 1]).toEqual([40, 40]);
+  });
+
+  test('asks the terminal where it is when acknowledgements get lost', async () => {
+    const cards = roster(1000, 40);
+    terminal.mtu = ONE_OP_MTU;
+    terminal.loseAcks = new Set([8, 16]);
+    const { changed, stalls } = await sync(cards);
+    expect(changed).toBe(40);
+    expect(sorted(terminal.cards)).toEqual(sorted(cards));
+
+    // Stopped a window ahead for one stall timeout, nothing was sent twice
+    expect(terminal.maxAhead).toBe(SYNC_WINDOW - 1);
+    expect(stalls).toBe(1);
+    expect(terminal.chunks).toEqual([...cards.keys()].map((_, i) => i));
+  });
+
+  test('resends from the lost chunk', async () => {
+    const cards = roster(1000, 40);
+    terminal.mtu = ONE_OP_MTU;
+    terminal.loseChunks = new Set([3]);
+    const { changed, stalls } = await sync(cards);
+    expect(changed).toBe(40);
+    expect(sorted(terminal.cards)).toEqual(sorted(cards));
+    expect(terminal.commits).toBe(1);
+
+    // The chunks after the lost one are refused, the client goes back to it
+    const back = terminal.chunks.findIndex((seq, i) => i > 0 && seq <= terminal.chunks[i - 1]);
+    expect(terminal.chunks[back]).toBe(3);
+    expect(terminal.chunks.slice(back)).toEqual(Array.from({ length: 40 - 3 }, (_, i) => 3 + i));
+    expect(back).toBeLessThanOrEqual(3 + SYNC_WINDOW);
+    expect(stalls).toBe(1);
+  });
+
+  test('leaves the cards as they were when the terminal refuses the batch', async () => {
+    const before = roster(1000, 10);
+    terminal.cards = new Map(before);
+
+    // More cards than the terminal holds, it refuses the batch part way through
+    await expect(sync(roster(2000, 70))).rejects.toThrow('Device rejected the cards');
+    expect(sorted(terminal.cards)).toEqual(sorted(before));
+    expect(terminal.commits).toBe(0);
+  });
+});
@@ -0,0 +1,188 @@
+import Box from '@mui/material/Box';
+import Button from '@mui/material/Button';
+import Checkbox from '@mui/material/Checkbox';
+import FormControlLabel from '@mui/material/FormControlLabel';
+import FormGroup from '@mui/material/FormGroup';
+import MenuItem from '@mui/material/MenuItem';
+import TextField from '@mui/material/TextField';
+import Typography from '@mui/material/Typography';
+import React, { useState } from 'react';
+import { toast } from 'react-toastify';
+import {
+  authWrite,
+  ConnectionAborted,
+  currentTimeChr,
+  getCharacteristic,
+  handleChangeError,
+  handleConnection,
+  scheduleConfigChr
+} from './bluetooth';
+
+// Protocol constants, see main/include/schedule.h
+const SCHEDULE_COUNT = 8;
+const SCHEDULE_WEEK_BYTES = 21;
+const SCHEDULE_F_HOLIDAYS = 0x01;
+const SCHEDULE_MAX_HOLIDAYS = 16;
+const SCHEDULE_CMD_SET = 1;
+const SCHEDULE_CMD_PIN = 2;
+const SCHEDULE_CMD_HOLIDAYS = 3;
+
+// Same order as struct tm, bit (day * 24 + hour) of the week bitmap
+const weekDays = ['Sun', 'Mon', 'Tue', 'Wed', 'Thu', 'Fri', 'Sat'];
+
+/**
+ * Build the 168-bit week bitmap allowing the given hours on the given days
+ * @param {Array<boolean>} days Allowed days, Sunday first
+ * @param {number} from First allowed hour
+ * @param {number} to Hour at which access ends
+ */
+const weekBitmap = (days, from, to) => {
+  let week = new Uint8Array(SCHEDULE_WEEK_BYTES);
+  days.forEach((allowed, day) => {
+    if (!allowed)
+      return;
+    for (let hour = from; hour < to; hour++) {
+      const bit = day * 24 + hour;
+      week[bit >> 3] |= 1 << (bit & 7);
+    }
+  });
+  return week;
+};
+
+/**
+ * Local calendar date as days since 1970-01-01
+ */
+const dayNumber = (date) => Math.floor(Date.UTC(date.getFullYear(), date.getMonth(), date.getDate()) / 86400000);
+
+const Schedule = () => {
+  const [id, setId] = useState(1);
+  const [days, setDays] = useState([false, true, true, true, true, true, false]);
+  const [from, setFrom] = useState(8);
+  const [to, setTo] = useState(17);
+  const [onHolidays, setOnHolidays] = useState(false);
+  const [pinSchedule, setPinSchedule] = useState(0);
+  const [holidays, setHolidays] = useState('');
+
+  const writeConfig = (value, pending, done) => {
+    const scheduleToast = toast.loading(pending);
+
+    handleConnection(scheduleToast)
+    .then(server => getCharacteristic(server, scheduleConfigChr))
+    .then(characteristic => authWrite(characteristic, scheduleConfigChr.encode(value)))
+    .then(_ => {
+      console.log(done);
+      toast.update(scheduleToast, { render: done, type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, scheduleToast);
+    });
+  };
+
+  const handleSyncTime = () => {
+    const timeToast = toast.loading("Setting time...");
+
+    handleConnection(timeToast)
+    .then(server => getCharacteristic(server, currentTimeChr))
+    .then(characteristic => authWrite(characteristic, currentTimeChr.encode(Math.floor(Date.now() / 1000))))
+    .then(_ => {
+      console.log('Time set');
+      toast.update(timeToast, { render: "Time set", type: "success", isLoading: false, autoClose: true });
+    })
+    .catch(error => {
+      if(error instanceof ConnectionAborted)
+        return;
+      handleChangeError(error, timeToast);
+    });
+  };
+
+  const handleSetSchedule = () => {
+    if (!(from >= 0 && from < to && to <= 24)) {
+      toast.error("Hours must be within 0-24 and start before they end");
+      return;
+    }
+    const value = new Uint8Array(2 + SCHEDULE_WEEK_BYTES + 1);
+    value[0] = SCHEDULE_CMD_SET;
+    value[1] = id;
+    value.set(weekBitmap(days, from, to), 2);
+    value[2 + SCHEDULE_WEEK_BYTES] = onHolidays ? SCHEDULE_F_HOLIDAYS : 0;
+    writeConfig(value, "Saving schedule...", `Schedule ${id} saved`);
+  };
+
+  const handleSetPinSchedule = () => {
+    writeConfig(new Uint8Array([SCHEDULE_CMD_PIN, pinSchedule]), "Saving...", `Access PIN uses schedule ${pinSchedule}`);
+  };
+
+  const handleSetHolidays = () => {
+    const dates = holidays.split(',').map(date => date.trim()).filter(date => date.length > 0);
+    if (dates.length > SCHEDULE_MAX_HOLIDAYS || dates.some(date => !/^\d{4}-\d{2}-\d{2}$/.test(date))) {
+      toast.error(`Up to ${SCHEDULE_MAX_HOLIDAYS} dates in YYYY-MM-DD format, separated by commas`);
+      return;
+    }
+    let view = new DataView(new ArrayBuffer(1 + 2 * dates.length));
+    view.setUint8(0, SCHEDULE_CMD_HOLIDAYS);
+    dates.forEach((date, i) => {
+      const [year, month, day] = date.split('-').map(Number);
+      view.setUint16(1 + 2 * i, dayNumber(new Date(year, month - 1, day)), true);
+    });
+    writeConfig(new Uint8Array(view.buffer), "Saving holidays...", "Holidays saved");
+  };
+
+  const scheduleIds = [...Array(SCHEDULE_COUNT).keys()];
+
+  return (
+    <Box display="flex" flexDirection="column" gap={2}>
+      <Typography variant="h6" gutterBottom>
+        Access schedules
+      </Typography>
+      <Button variant="outlined" fullWidth onClick={handleSyncTime}>
+        Set terminal time from this device
+      </Button>
+      <TextField select label="Schedule" value={id} onChange={(e) => setId(e.target.value)}>
+        {scheduleIds.slice(1).map(i => <MenuItem key={i} value={i}>{i}</MenuItem>)}
+      </TextField>
+      <FormGroup row>
+        {weekDays.map((name, day) => (
+          <FormControlLabel
+            key={name}
+            label={name}
+            control={<Checkbox checked={days[day]} onChange={(e) => setDays(days.map((v, i) => i === day ? e.target.checked : v))} />}
+          />
+        ))}
+      </FormGroup>
+      <Box display="flex" gap={2}>
+        <TextField label="From hour" type="number" value={from} onChange={(e) => setFrom(Number(e.target.value))} fullWidth />
+        <TextField label="To hour" type="number" value={to} onChange={(e) => setTo(Number(e.target.value))} fullWidth />
+      </Box>
+      <FormControlLabel
+        label="Also on holidays"
+        control={<Checkbox checked={onHolidays} onChange={(e) => setOnHolidays(e.target.checked)} />}
+      />
+      <Button variant="contained" fullWidth onClick={handleSetSchedule}>
+        Save schedule
+      </Button>
+      <Box display="flex" gap={2}>
+        <TextField select label="Access PIN schedule" value={pinSchedule} onChange={(e) => setPinSchedule(e.target.value)} fullWidth
+          helperText="Schedule 0 allows access at any time">
+          {scheduleIds.map(i => <MenuItem key={i} value={i}>{i}</MenuItem>)}
+        </TextField>
+        <Button variant="outlined" onClick={handleSetPinSchedule}>
+          Assign
+        </Button>
+      </Box>
+      <TextField
+        label="Holidays"
+        variant="outlined"
+        value={holidays}
+        onChange={(e) => setHolidays(e.target.value)}
+        helperText="Dates in YYYY-MM-DD format, separated by commas"
+      />
+      <Button variant="outlined" fullWidth onClick={handleSetHolidays}>
+        Save holidays
+      </Button>
+    </Box>
+  );
+};
+
+export default Schedule;
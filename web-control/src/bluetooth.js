@@ -0,0 +1,287 @@
+import { toast } from 'react-toastify';
+
+import { adminLoginChr, impTermSvcUuid } from './gattSchema';
+
+// BLE service and characteristic UUIDs and codecs, generated from main/gatt.json
+export * from './gattSchema';
+
+// Admin session protocol, see main/include/admin.h
+const ADMIN_TAG_LEN = 8;
+
+// Reconnection after an unexpected disconnect, the delay doubles after every failed attempt
+const RECONNECT_DELAY_MS = 500;
+const RECONNECT_MAX_DELAY_MS = 8000;
+const RECONNECT_ATTEMPTS = 6;
+
+// Built by make web-device, the page is served by the terminal and talks to its JSON API
+// (main/src/http_server.c) instead of Web Bluetooth
+export const httpTransport = process.env.REACT_APP_TRANSPORT === 'http';
+
+export const bluetoothAPI = httpTransport ? null : navigator.bluetooth;
+
+export class ConnectionAborted extends Error {}
+export class AdminRequired extends Error {}
+
+// Global variable to store the connected device
+var impTermDevice = null;
+
+// Session key and last used write counter, valid until the device disconnects
+// (over HTTP also the session handle the server gave out)
+var adminSession = null;
+
+// Connection in progress, shared by everyone who asks for the server meanwhile
+var pendingConnection = null;
+
+// Service and characteristic lookups (promises) of the current connection, by UUID
+var primaryService = null;
+var characteristics = new Map();
+
+// Tail of the GATT operation queue, the browser allows one operation at a time
+var gattQueue = Promise.resolve();
+
+/**
+ * Get the connected device
+ * @returns {BluetoothDevice|null} The device selected by the user, if any
+ */
+export const getDevice = () => impTermDevice;
+
+const sleep = (ms) => new Promise(resolve => setTimeout(resolve, ms));
+
+const connect = () => {
+  if (pendingConnection === null) {
+    pendingConnection = impTermDevice.gatt.connect()
+    .finally(() => { pendingConnection = null; });
+  }
+  return pendingConnection;
+};
+
+/**
+ * Drop the cached lookups and try to get the link back, so the next change does not wait for it
+ */
+const onDisconnected = async () => {
+  console.log('Device disconnected');
+  primaryService = null;
+  characteristics = new Map();
+
+  let delay = RECONNECT_DELAY_MS;
+  for (let attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++) {
+    await sleep(delay);
+    if (impTermDevice.gatt.connected)
+      return; // Someone else reconnected meanwhile
+    try {
+      await connect();
+      console.log(`Reconnected after ${attempt} attempt(s)`);
+      return;
+    } catch(error) {
+      console.log(`Reconnection attempt ${attempt} failed:`, error.message);
+      delay = Math.min(2 * delay, RECONNECT_MAX_DELAY_MS);
+    }
+  }
+  console.log('Giving up reconnecting, the next change will connect again');
+};
+
+const toHex = (bytes) => Array.from(bytes, byte => byte.toString(16).padStart(2, '0')).join('');
+const fromHex = (hex) => Uint8Array.from(hex.match(/../g), byte => parseInt(byte, 16));
+
+// Stands in for the GATT server over HTTP, there is no link to lose
+const httpServer = { device: new EventTarget() };
+
+const httpRequest = async (path, body) => {
+  const response = await fetch(path, body === undefined ? {} : {
+    method: 'POST',
+    headers: { 'Content-Type': 'application/json' },
+    body: JSON.stringify(body),
+  });
+  if (!response.ok)
+    throw new Error(await response.text());
+  return response;
+};
+
+/**
+ * Characteristic written over the JSON API, only those marked http in main/gatt.json have a route
+ * @param {object} chr Characteristic from gattSchema.js
+ * @returns {object} The part of BluetoothRemoteGATTCharacteristic the admin writes use
+ */
+const httpCharacteristic = (chr) => ({
+  uuid: chr.uuid,
+  writeValue: async (value) => {
+    if (chr.api === null)
+      throw new Error(`${chr.name} is only available over Bluetooth`);
+    await httpRequest(chr.api, { session: adminSession?.id, value: toHex(concatBytes(value)) });
+  },
+});
+
+/**
+ * Get the GATT server of the terminal, asking the user for the device on first use
+ * @param {Id} notification Toast to update when the user cancels the device selection
+ * @returns {Promise<BluetoothRemoteGATTServer>} Connected GATT server
+ */
+export const handleConnection = async (notification) => {
+  if (httpTransport)
+    return httpServer;
+
+  if (impTermDevice !== null) {
+    if (impTermDevice.gatt.connected)
+      return impTermDevice.gatt;
+    return connect();
+  }
+
+  try {
+    impTermDevice = await bluetoothAPI.requestDevice({
+      // acceptAllDevices: true,
+      filters: [{ name: 'imp-term' }],
+      optionalServices: [impTermSvcUuid]
+    });
+  }
+  catch(error) {
+    if(error.message.includes('User cancelled')) {
+      console.log('Transaction cancelled by user');
+      toast.update(notification, { render: "Connection cancelled", type: "warning", isLoading: false, autoClose: true });
+    }
+    else {
+      console.error('Error:', error);
+      toast.error('An error occurred');
+    }
+    throw new ConnectionAborted();
+  }
+  console.log(`Selected device: ${impTermDevice.name} (${impTermDevice.id})`);
+  impTermDevice.addEventListener('gattserverdisconnected', onDisconnected);
+  return connect();
+}
+
+/**
+ * Get a characteristic of the terminal service, discovered once per connection
+ * @param {BluetoothRemoteGATTServer} server Connected GATT server
+ * @param {object} chr Characteristic from gattSchema.js
+ * @returns {Promise<BluetoothRemoteGATTCharacteristic>} The characteristic
+ */
+export const getCharacteristic = (server, chr) => {
+  if (httpTransport)
+    return Promise.resolve(httpCharacteristic(chr));
+
+  if (primaryService === null) {
+    primaryService = server.getPrimaryService(impTermSvcUuid);
+    primaryService.catch(() => { primaryService = null; });
+  }
+  if (!characteristics.has(chr.uuid)) {
+    const lookup = primaryService.then(service => service.getCharacteristic(chr.uuid));
+    lookup.catch(() => characteristics.delete(chr.uuid));
+    characteristics.set(chr.uuid, lookup);
+  }
+  return characteristics.get(chr.uuid);
+};
+
+/**
+ * Run a GATT operation after the ones queued before it
+ * @param {function} operation Returns a promise, started once the previous operation settles
+ * @returns {Promise} Result of the operation
+ */
+const enqueue = (operation) => {
+  const result = gattQueue.then(operation);
+  gattQueue = result.catch(() => {});
+  return result;
+};
+
+/**
+ * Write a value once the writes queued before it are done
+ * @param {BluetoothRemoteGATTCharacteristic} characteristic Target characteristic
+ * @param {BufferSource} payload Value to write
+ */
+export const queuedWrite = (characteristic, payload) =>
+  enqueue(() => characteristic.writeValue(payload));
+
+/**
+ * Read a value once the operations queued before it are done
+ * @param {BluetoothRemoteGATTCharacteristic} characteristic Source characteristic
+ * @returns {Promise<DataView>} The value
+ */
+export const queuedRead = (characteristic) =>
+  enqueue(() => characteristic.readValue());
+
+export const concatBytes = (...parts) => {
+  let result = new Uint8Array(parts.reduce((len, part) => len + part.byteLength, 0));
+  let offset = 0;
+  for (const part of parts) {
+    result.set(new Uint8Array(part.buffer ?? part, part.byteOffset ?? 0, part.byteLength), offset);
+    offset += part.byteLength;
+  }
+  return result;
+};
+
+export const hmacKey = (raw) =>
+  crypto.subtle.importKey('raw', raw, { name: 'HMAC', hash: 'SHA-256' }, false, ['sign']);
+
+export const hmac = async (key, ...parts) =>
+  new Uint8Array(await crypto.subtle.sign('HMAC', key, concatBytes(...parts)));
+
+/**
+ * Convert a 128-bit UUID to the byte order NimBLE keeps it in
+ * @param {string} uuid UUID string
+ * @returns {Uint8Array} 16 bytes, least significant first
+ */
+const uuidToBytes = (uuid) =>
+  Uint8Array.from(uuid.replace(/-/g, '').match(/../g).map(byte => parseInt(byte, 16))).reverse();
+
+/**
+ * Log in with the admin PIN, the PIN itself never leaves the browser
+ * @param {BluetoothRemoteGATTServer} server Connected GATT server
+ * @param {string} pin Admin PIN
+ */
+export const adminLogin = async (server, pin) => {
+  const encoder = new TextEncoder();
+  const pinKey = await hmacKey(encoder.encode(pin));
+  let id = null;
+  let challenge;
+
+  if (httpTransport) {
+    // The server hands out the session, the response goes back with it
+    const login = await (await httpRequest('/api/login')).json();
+    id = login.session;
+    challenge = fromHex(login.challenge);
+    const response = await hmac(pinKey, encoder.encode('login'), challenge);
+    await enqueue(() => httpRequest('/api/login', { session: id, response: toHex(response) }));
+  }
+  else {
+    const login = await getCharacteristic(server, adminLoginChr);
+
+    // Challenge and response must not be interleaved with other writes
+    challenge = await enqueue(() => login.readValue());
+    await queuedWrite(login, await hmac(pinKey, encoder.encode('login'), challenge));
+  }
+
+  adminSession = {
+    id,
+    key: await hmacKey(await hmac(pinKey, encoder.encode('session'), challenge)),
+    counter: 0,
+  };
+  server.device.addEventListener('gattserverdisconnected', () => { adminSession = null; }, { once: true });
+};
+
+export const isAdminLoggedIn = () => adminSession !== null;
+
+/**
+ * Write a value authenticated by the admin session
+ * @param {BluetoothRemoteGATTCharacteristic} characteristic Target characteristic
+ * @param {BufferSource} payload Value to write
+ */
+export const authWrite = (characteristic, payload) => enqueue(async () => {
+  if (adminSession === null)
+    throw new AdminRequired();
+
+  // Counters are taken in queue order, the device rejects one that goes backwards
+  let counter = new Uint8Array(4);
+  new DataView(counter.buffer).setUint32(0, ++adminSession.counter, true);
+  const tag = await hmac(adminSession.key, uuidToBytes(characteristic.uuid), counter, payload);
+  return characteristic.writeValue(concatBytes(payload, counter, tag.subarray(0, ADMIN_TAG_LEN)));
+});
+
+export const handleChangeError = (error, notification) => {
+  if(error instanceof AdminRequired || error.message.includes('not authorized') || error.message.includes('not permitted')) {
+    console.error('Operation not permitted: You need to log in as admin first');
+    toast.update(notification, { render: "Log in as admin first", type: "error", isLoading: false, autoClose: true });
+  }
+  else {
+    console.error('Error:', error);
+    toast.update(notification, { render: "An error occurred", type: "error", isLoading: false, autoClose: true });
+  }
+}
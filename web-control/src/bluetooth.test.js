@@ -0,0 +1,220 @@
+import { deferred, FakeTerminal, settle, tick, until } from './fakeTerminal';
+import { accessPinChr, doorOpenDurationChr } from './gattSchema';
+
+jest.mock('react-toastify');
+
+// See bluetooth.js
+const ADMIN_TAG_LEN = 8;
+const ADMIN_PIN = '13579';
+
+const encoder = new TextEncoder();
+
+// Typed arrays of the test, jsdom and Node compare equal only as plain arrays
+const bytes = (value) => Array.from(value);
+
+const uuidBytes = (uuid) =>
+  Uint8Array.from(uuid.replace(/-/g, '').match(/../g), byte => parseInt(byte, 16)).reverse();
+
+let terminal;
+let bluetooth;
+
+// The connection lives in module state, so every test loads bluetooth.js again. Fake timers keep
+// the reconnection a drop starts from running into the next test.
+beforeEach(() => {
+  jest.useFakeTimers();
+  jest.spyOn(console, 'log').mockImplementation(() => {});
+  terminal = new FakeTerminal().install();
+  jest.resetModules();
+  bluetooth = require('./bluetooth');
+});
+
+afterEach(() => {
+  jest.useRealTimers();
+});
+
+describe('connection', () => {
+  test('stays open between changes', async () => {
+    const server = await bluetooth.handleConnection();
+    expect(server.connected).toBe(true);
+    expect(await bluetooth.handleConnection()).toBe(server);
+    expect(await bluetooth.handleConnection()).toBe(server);
+    expect(terminal.requests).toBe(1);
+    expect(terminal.connects).toBe(1);
+  });
+
+  test('is made once for changes waiting on it together', async () => {
+    const server = await bluetooth.handleConnection();
+    terminal.drop();
+
+    const hold = deferred();
+    terminal.connectHold = hold.promise;
+    const first = bluetooth.handleConnection();
+    const second = bluetooth.handleConnection();
+    await settle();
+    hold.resolve();
+    expect(await first).toBe(server);
+    expect(await second).toBe(server);
+    expect(terminal.connects).toBe(2);
+    expect(terminal.requests).toBe(1);
+  });
+
+  test('looks every characteristic up once', async () => {
+    const server = await bluetooth.handleConnection();
+    const pin = await bluetooth.getCharacteristic(server, accessPinChr);
+    expect(await bluetooth.getCharacteristic(server, accessPinChr)).toBe(pin);
+    await bluetooth.getCharacteristic(server, doorOpenDurationChr);
+    await bluetooth.getCharacteristic(server, accessPinChr);
+    expect(terminal.serviceLookups).toBe(1);
+    expect(terminal.characteristicLookups).toBe(2);
+
+    // Handles of a lost connection are not used again
+    terminal.drop();
+    await bluetooth.handleConnection();
+    await bluetooth.getCharacteristic(server, accessPinChr);
+    expect(terminal.serviceLookups).toBe(2);
+    expect(terminal.characteristicLookups).toBe(3);
+  });
+
+  test('looks a characteristic up again after a failed lookup', async () => {
+    const server = await bluetooth.handleConnection();
+    terminal.lookupFailures = 1;
+    await expect(bluetooth.getCharacteristic(server, accessPinChr)).rejects.toThrow('GATT operation failed');
+    await expect(bluetooth.getCharacteristic(server, accessPinChr)).resolves.toBe(terminal.characteristic(accessPinChr));
+    expect(terminal.characteristicLookups).toBe(2);
+  });
+});
+
+describe('reconnection', () => {
+  /**
+   * Run the fake clock in 10 ms steps, letting the reconnection go on in between
+   * @returns {number[]} Times of the connection attempts since the call
+   */
+  const attemptTimes = async (ms) => {
+    let times = [];
+    let seen = terminal.connects;
+    for (let t = 10; t <= ms; t += 10) {
+      jest.advanceTimersByTime(10);
+      await settle();
+      for (; seen < terminal.connects; seen++)
+        times.push(t);
+    }
+    return times;
+  };
+
+  test('backs off exponentially until the link is back', async () => {
+    await bluetooth.handleConnection();
+    terminal.connectFailures = 3;
+    terminal.drop();
+    expect(await attemptTimes(30000)).toEqual([500, 1500, 3500, 7500]);
+    expect(terminal.gatt.connected).toBe(true);
+    expect(terminal.requests).toBe(1);
+  });
+
+  test('caps the delay and gives up, the next change connects', async () => {
+    await bluetooth.handleConnection();
+    terminal.connectFailures = Infinity;
+    terminal.drop();
+    expect(await attemptTimes(60000)).toEqual([500, 1500, 3500, 7500, 15500, 23500]);
+    expect(terminal.gatt.connected).toBe(false);
+
+    terminal.connectFailures = 0;
+    expect((await bluetooth.handleConnection()).connected).toBe(true);
+    expect(terminal.requests).toBe(1);
+  });
+
+  test('stops when a change reconnected first', async () => {
+    await bluetooth.handleConnection();
+    terminal.drop();
+    await bluetooth.handleConnection();
+    expect(await attemptTimes(30000)).toEqual([]);
+  });
+});
+
+describe('write queue', () => {
+  let server;
+  let pin;
+  let duration;
+
+  beforeEach(async () => {
+    server = await bluetooth.handleConnection();
+    pin = await bluetooth.getCharacteristic(server, accessPinChr);
+    duration = await bluetooth.getCharacteristic(server, doorOpenDurationChr);
+    terminal.log = [];
+  });
+
+  test('runs one operation at a time, in call order', async () => {
+    const hold = deferred();
+    pin.hold = hold.promise;
+    const done = Promise.all([
+      bluetooth.queuedWrite(pin, encoder.encode('1111')),
+      bluetooth.queuedWrite(duration, doorOpenDurationChr.encode(5)),
+      bluetooth.queuedRead(pin),
+      bluetooth.queuedWrite(pin, encoder.encode('2222')),
+    ]);
+    await settle();
+    expect(terminal.log).toHaveLength(1);
+
+    hold.resolve();
+    await done;
+    expect(terminal.log.map(entry => [entry.op, entry.uuid])).toEqual([
+      ['write', pin.uuid],
+      ['write', duration.uuid],
+      ['read', pin.uuid],
+      ['write', pin.uuid],
+    ]);
+    expect(bytes(terminal.log[3].bytes)).toEqual(bytes(encoder.encode('2222')));
+  });
+
+  test('goes on after a failed write', async () => {
+    pin.failNext = true;
+    const failed = bluetooth.queuedWrite(pin, encoder.encode('1111'));
+    const next = bluetooth.queuedWrite(duration, doorOpenDurationChr.encode(5));
+    await expect(failed).rejects.toThrow('GATT operation failed');
+    await expect(next).resolves.toBeUndefined();
+    expect(terminal.log).toHaveLength(2);
+  });
+
+  test('tags admin writes with counters in queue order', async () => {
+    await bluetooth.adminLogin(server, ADMIN_PIN);
+    expect(bluetooth.isAdminLoggedIn()).toBe(true);
+    terminal.log = [];
+
+    const payloads = [encoder.encode('1111'), doorOpenDurationChr.encode(5), encoder.encode('2222')];
+    const hold = deferred();
+    pin.hold = hold.promise;
+    const done = Promise.all([
+      bluetooth.authWrite(pin, payloads[0]),
+      bluetooth.authWrite(duration, payloads[1]),
+      bluetooth.authWrite(pin, payloads[2]),
+    ]);
+
+    // The next write does not even compute its tag while the first is on the air
+    await until(() => terminal.log.length === 1);
+    for (let i = 0; i < 10; i++)
+      await tick();
+    expect(terminal.log).toHaveLength(1);
+    hold.resolve();
+    await done;
+
+    const pinKey = await bluetooth.hmacKey(encoder.encode(ADMIN_PIN));
+    const sessionKey = await bluetooth.hmacKey(await bluetooth.hmac(pinKey, encoder.encode('session'), terminal.challenge));
+    expect(terminal.log.map(entry => entry.uuid)).toEqual([pin.uuid, duration.uuid, pin.uuid]);
+    for (const [i, entry] of terminal.log.entries()) {
+      const payload = entry.bytes.subarray(0, payloads[i].length);
+      const counter = entry.bytes.subarray(payloads[i].length, payloads[i].length + 4);
+      const tag = await bluetooth.hmac(sessionKey, uuidBytes(entry.uuid), counter, payload);
+      expect(bytes(payload)).toEqual(bytes(payloads[i]));
+      expect(new DataView(counter.buffer, counter.byteOffset).getUint32(0, true)).toBe(i + 1);
+      expect(bytes(entry.bytes.subarray(payloads[i].length + 4))).toEqual(bytes(tag.subarray(0, ADMIN_TAG_LEN)));
+    }
+  });
+
+  test('refuses admin writes without a session, which ends with the link', async () => {
+    await expect(bluetooth.authWrite(pin, encoder.encode('1111'))).rejects.toBeInstanceOf(bluetooth.AdminRequired);
+    await bluetooth.adminLogin(server, ADMIN_PIN);
+    terminal.drop();
+    expect(bluetooth.isAdminLoggedIn()).toBe(false);
+    await expect(bluetooth.authWrite(pin, encoder.encode('1111'))).rejects.toBeInstanceOf(bluetooth.AdminRequired);
+    expect(terminal.log.filter(entry => entry.uuid === pin.uuid)).toHaveLength(0);
+  });
+});
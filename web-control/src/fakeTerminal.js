@@ -0,0 +1,350 @@
+/**
+ * Fake imp-term for the tests: the device navigator.bluetooth hands out, with its GATT server,
+ * the terminal service, the admin login and the card sync of main/src/credential.c.
+ * GATT operations are logged in the order they start.
+ */
+import { createHash } from 'crypto';
+import { setImmediate } from 'timers';
+
+import { adminLoginChr, cardSyncChr, cardSyncDataChr, impTermSvcUuid } from './gattSchema';
+
+const ADMIN_CHALLENGE_LEN = 32;
+const ADMIN_TRAILER_LEN = 4 + 8; // Write counter and tag, see authWrite() in bluetooth.js
+
+// See main/include/credential.h and main/include/config.h
+const CARD_SYNC_CMD_BEGIN = 1;
+const CARD_SYNC_CMD_COMMIT = 2;
+const CARD_SYNC_CMD_ABORT = 3;
+const CARD_SYNC_IDLE = 0;
+const CARD_SYNC_RECEIVING = 1;
+const CARD_SYNC_ERROR = 2;
+const CARD_SYNC_OP_PUT = 1;
+const CARD_SYNC_OP_REMOVE = 2;
+const CARD_SYNC_DIGEST_LEN = 8;
+const CARD_SYNC_ACK_INTERVAL = 8;
+const CARD_SYNC_CHUNK_MAX_OPS = 85;
+const CARD_SYNC_STATUS_LEN = 6 + CARD_SYNC_DIGEST_LEN;
+const CARD_RECORD_LEN = 5;
+const CARD_OP_LEN = 1 + CARD_RECORD_LEN;
+const CREDENTIAL_MAX_CARDS = 64;
+const SCHEDULE_COUNT = 8;
+
+const toBytes = (value) =>
+  Uint8Array.from(new Uint8Array(value.buffer ?? value, value.byteOffset ?? 0, value.byteLength));
+
+const toView = (bytes) => new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+
+/**
+ * card_t records of a card list, in the order given
+ * @param {Map<number, number>} cards Schedule by card number
+ */
+const cardRecords = (cards, numbers = [...cards.keys()]) => {
+  let view = new DataView(new ArrayBuffer(numbers.length * CARD_RECORD_LEN));
+  numbers.forEach((number, i) => {
+    view.setUint32(i * CARD_RECORD_LEN, number, true);
+    view.setUint8(i * CARD_RECORD_LEN + 4, cards.get(number));
+  });
+  return new Uint8Array(view.buffer);
+};
+
+/**
+ * Digest of a card list as card_digest() computes it, over the records sorted by number
+ */
+const cardDigest = (cards) => {
+  const records = cardRecords(cards, [...cards.keys()].sort((a, b) => a - b));
+  return Uint8Array.from(createHash('sha256').update(records).digest().subarray(0, CARD_SYNC_DIGEST_LEN));
+};
+
+/**
+ * Promise settled from outside, to hold an operation until the test lets it go
+ */
+export const deferred = () => {
+  let resolve, reject;
+  const promise = new Promise((res, rej) => { resolve = res; reject = rej; });
+  return { promise, resolve, reject };
+};
+
+/**
+ * Let everything waiting on settled promises run, fake timers do not
+ */
+export const settle = async () => {
+  for (let i = 0; i < 20; i++)
+    await Promise.resolve();
+};
+
+/**
+ * Turn the real event loop once: crypto.subtle answers on it, not on fake timers
+ */
+export const tick = () => new Promise(resolve => setImmediate(resolve));
+
+export const until = async (condition) => {
+  while (!condition())
+    await tick();
+};
+
+export class FakeCharacteristic extends EventTarget {
+  constructor(terminal, uuid) {
+    super();
+    this.terminal = terminal;
+    this.uuid = uuid;
+    this.value = null;
+    this.onRead = () => new Uint8Array(0);
+    this.onWrite = () => {};
+    this.hold = null; // Promise the next write waits for before it completes
+    this.failNext = false;
+  }
+
+  async readValue() {
+    this.terminal.log.push({ op: 'read', uuid: this.uuid });
+    return toView(this.onRead());
+  }
+
+  async writeValue(value) {
+    const bytes = toBytes(value);
+    this.terminal.log.push({ op: 'write', uuid: this.uuid, bytes });
+    if (this.hold !== null) {
+      const hold = this.hold;
+      this.hold = null;
+      await hold;
+    }
+    if (this.failNext) {
+      this.failNext = false;
+      throw new Error('GATT operation failed for unknown reason.');
+    }
+    this.onWrite(bytes);
+  }
+
+  async writeValueWithoutResponse(value) {
+    const bytes = toBytes(value);
+    this.terminal.log.push({ op: 'writeWithoutResponse', uuid: this.uuid, bytes });
+    this.onWrite(bytes);
+  }
+
+  async startNotifications() {
+    return this;
+  }
+
+  /**
+   * Notify a value, it arrives after the operation that caused it
+   */
+  notify(bytes) {
+    Promise.resolve().then(() => {
+      this.value = toView(bytes);
+      this.dispatchEvent(new Event('characteristicvaluechanged'));
+    });
+  }
+}
+
+export class FakeTerminal {
+  constructor() {
+    this.log = [];
+    this.requests = 0; // Device pickers shown
+    this.connects = 0; // Connection attempts, failed ones too
+    this.connectFailures = 0; // Attempts to fail from now on
+    this.connectHold = null; // Promise the next connection waits for
+    this.serviceLookups = 0;
+    this.characteristicLookups = 0;
+    this.lookupFailures = 0;
+    this.characteristics = new Map();
+
+    this.device = new EventTarget();
+    this.device.name = 'imp-term';
+    this.device.id = 'fake';
+    this.device.gatt = {
+      device: this.device,
+      connected: false,
+      connect: () => this.connect(),
+      getPrimaryService: (uuid) => this.getPrimaryService(uuid),
+    };
+    this.gatt = this.device.gatt;
+
+    this.challenge = Uint8Array.from({ length: ADMIN_CHALLENGE_LEN }, (_, i) => 7 * i + 1);
+    this.characteristic(adminLoginChr).onRead = () => this.challenge;
+
+    this.cards = new Map(); // Enrolled, schedule by card number
+    this.mtu = 247;
+    this.sync = { state: CARD_SYNC_IDLE, batch: null, nextSeq: 0, nacked: false };
+    this.chunks = []; // Sequence numbers of the data chunks as they arrived
+    this.loseChunks = new Set(); // Sequence numbers of chunks to lose, once each
+    this.loseAcks = new Set(); // Positions whose acknowledgement gets lost
+    this.reported = 0; // Position the client last heard of
+    this.maxAhead = 0; // Most chunks sent past that position
+    this.notifications = 0;
+    this.commits = 0;
+
+    const control = this.characteristic(cardSyncChr);
+    control.onRead = () => this.syncStatus();
+    control.onWrite = (bytes) => this.syncCommand(bytes.subarray(0, bytes.length - ADMIN_TRAILER_LEN));
+    const data = this.characteristic(cardSyncDataChr);
+    data.onRead = () => cardRecords(this.cards);
+    data.onWrite = (bytes) => this.syncData(toView(bytes));
+  }
+
+  /**
+   * Stand in for Web Bluetooth, before bluetooth.js is loaded as it takes navigator.bluetooth then
+   */
+  install() {
+    Object.defineProperty(navigator, 'bluetooth', {
+      configurable: true,
+      value: {
+        requestDevice: async () => {
+          this.requests++;
+          return this.device;
+        },
+      },
+    });
+    return this;
+  }
+
+  /**
+   * The characteristic of the terminal service
+   * @param {object} chr Characteristic from gattSchema.js
+   * @returns {FakeCharacteristic} The same object each time
+   */
+  characteristic(chr) {
+    if (!this.characteristics.has(chr.uuid))
+      this.characteristics.set(chr.uuid, new FakeCharacteristic(this, chr.uuid));
+    return this.characteristics.get(chr.uuid);
+  }
+
+  async connect() {
+    this.connects++;
+    if (this.connectHold !== null) {
+      const hold = this.connectHold;
+      this.connectHold = null;
+      await hold;
+    }
+    if (this.connectFailures > 0) {
+      this.connectFailures--;
+      throw new Error('Connection attempt failed.');
+    }
+    this.gatt.connected = true;
+    return this.gatt;
+  }
+
+  async getPrimaryService(uuid) {
+    if (!this.gatt.connected)
+      throw new Error('GATT Server is disconnected.');
+    if (uuid !== impTermSvcUuid)
+      throw new Error('No Services matching UUID found in Device.');
+    this.serviceLookups++;
+    return {
+      uuid,
+      getCharacteristic: async (chrUuid) => {
+        this.characteristicLookups++;
+        if (this.lookupFailures > 0) {
+          this.lookupFailures--;
+          throw new Error('GATT operation failed for unknown reason.');
+        }
+        return this.characteristic({ uuid: chrUuid });
+      },
+    };
+  }
+
+  /**
+   * Lose the link, as when the terminal goes out of range
+   */
+  drop() {
+    this.gatt.connected = false;
+    this.sync.state = CARD_SYNC_IDLE;
+    this.device.dispatchEvent(new Event('gattserverdisconnected'));
+  }
+
+  /**
+   * Status as credential_sync_status() gives it
+   */
+  syncStatus() {
+    const receiving = this.sync.state === CARD_SYNC_RECEIVING;
+    let view = new DataView(new ArrayBuffer(CARD_SYNC_STATUS_LEN));
+    view.setUint8(0, this.sync.state);
+    view.setUint8(1, receiving ? this.sync.batch.size : this.cards.size);
+    view.setUint16(2, Math.min(Math.floor(Math.max(this.mtu - 5, 0) / CARD_OP_LEN), CARD_SYNC_CHUNK_MAX_OPS), true);
+    view.setUint16(4, this.sync.nextSeq, true);
+    let status = new Uint8Array(view.buffer);
+    status.set(cardDigest(this.cards), 6);
+    this.reported = this.sync.nextSeq;
+    return status;
+  }
+
+  syncNotify() {
+    this.notifications++;
+    this.characteristic(cardSyncChr).notify(this.syncStatus());
+  }
+
+  syncFail() {
+    this.sync.state = CARD_SYNC_ERROR;
+    this.syncNotify();
+  }
+
+  syncCommand(cmd) {
+    switch (cmd[0]) {
+      case CARD_SYNC_CMD_BEGIN:
+        this.sync = { state: CARD_SYNC_RECEIVING, batch: new Map(this.cards), nextSeq: 0, nacked: false };
+        return;
+
+      case CARD_SYNC_CMD_COMMIT: {
+        if (cmd.length !== 1 + CARD_SYNC_DIGEST_LEN || this.sync.state !== CARD_SYNC_RECEIVING)
+          throw new Error('GATT operation not permitted.');
+        const digest = cardDigest(this.sync.batch);
+        if (!digest.every((byte, i) => byte === cmd[1 + i])) {
+          this.syncFail();
+          throw new Error('GATT operation not permitted.');
+        }
+        // The whole batch at once, as the one NVS blob write of the device
+        this.cards = this.sync.batch;
+        this.sync.state = CARD_SYNC_IDLE;
+        this.commits++;
+        this.syncNotify();
+        return;
+      }
+
+      case CARD_SYNC_CMD_ABORT:
+        this.sync.state = CARD_SYNC_IDLE;
+        return;
+
+      default:
+        throw new Error('GATT operation not permitted.');
+    }
+  }
+
+  syncData(view) {
+    // Errors of a write without response never reach the client
+    if (this.sync.state !== CARD_SYNC_RECEIVING || view.byteLength <= 2 || (view.byteLength - 2) % CARD_OP_LEN !== 0)
+      return;
+
+    const seq = view.getUint16(0, true);
+    this.chunks.push(seq);
+    this.maxAhead = Math.max(this.maxAhead, seq - this.reported);
+    if (this.loseChunks.delete(seq))
+      return;
+    if (seq !== this.sync.nextSeq) {
+      if (!this.sync.nacked)
+        this.syncNotify();
+      this.sync.nacked = true;
+      return;
+    }
+    this.sync.nacked = false;
+
+    for (let offset = 2; offset < view.byteLength; offset += CARD_OP_LEN) {
+      const number = view.getUint32(offset + 1, true);
+      const schedule = view.getUint8(offset + 5);
+      switch (view.getUint8(offset)) {
+        case CARD_SYNC_OP_PUT:
+          if (schedule >= SCHEDULE_COUNT || (!this.sync.batch.has(number) && this.sync.batch.size >= CREDENTIAL_MAX_CARDS))
+            return this.syncFail();
+          this.sync.batch.set(number, schedule);
+          break;
+
+        case CARD_SYNC_OP_REMOVE:
+          this.sync.batch.delete(number);
+          break;
+
+        default:
+          return this.syncFail();
+      }
+    }
+
+    if (++this.sync.nextSeq % CARD_SYNC_ACK_INTERVAL === 0 && !this.loseAcks.delete(this.sync.nextSeq))
+      this.syncNotify();
+  }
+}
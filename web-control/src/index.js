@@ -1,7 +1,8 @@
 import React from 'react';
 import ReactDOM from 'react-dom/client';
 import App from './App';
-import reportWebVitals from './reportWebVitals';
+import reportWebVitals, { checkBudget } from './reportWebVitals';
+import * as serviceWorkerRegistration from './serviceWorkerRegistration';
 
 const root = ReactDOM.createRoot(document.getElementById('root'));
 root.render(
@@ -10,7 +11,9 @@ root.render(
   </React.StrictMode>
 );
 
-// If you want to start measuring performance in your app, pass a function
-// to log results (for example: reportWebVitals(console.log))
-// or send to an analytics endpoint. Learn more: https://bit.ly/CRA-vitals
-reportWebVitals();
+// Load times against the budget in src/budget.json, see the console of the phone
+// (remote debugging) or of the desktop browser. Learn more: https://bit.ly/CRA-vitals
+reportWebVitals(checkBudget);
+
+// Precache the app so it opens offline, at the door the phone often has no signal
+serviceWorkerRegistration.register();
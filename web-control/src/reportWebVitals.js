@@ -1,5 +1,11 @@
+import budget from './budget.json';
+
+// Callback of reportWebVitals(), also used for the time to interactive
+var onInteractive = null;
+
 const reportWebVitals = onPerfEntry => {
   if (onPerfEntry && onPerfEntry instanceof Function) {
+    onInteractive = onPerfEntry;
     import('web-vitals').then(({ getCLS, getFID, getFCP, getLCP, getTTFB }) => {
       getCLS(onPerfEntry);
       getFID(onPerfEntry);
@@ -10,4 +16,27 @@ const reportWebVitals = onPerfEntry => {
   }
 };
 
+/**
+ * Report the time to interactive, once the main screen is rendered and takes input
+ * @note web-vitals has no such metric, it is reported in the same form as "TTI"
+ */
+export const markInteractive = () => {
+  if (onInteractive === null)
+    return;
+  onInteractive({ name: 'TTI', value: performance.now() });
+  onInteractive = null;
+};
+
+/**
+ * Log a metric and warn when it is over the budget in src/budget.json
+ * @param {Object} metric Metric reported by web-vitals or markInteractive()
+ */
+export const checkBudget = ({ name, value }) => {
+  const limit = budget.vitalsMs[name];
+  if (limit !== undefined && value > limit)
+    console.warn(`${name} ${Math.round(value)} ms is over the budget of ${limit} ms`);
+  else
+    console.log(`${name} ${limit !== undefined ? `${Math.round(value)} ms` : value.toFixed(3)}`);
+};
+
 export default reportWebVitals;
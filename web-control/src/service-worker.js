@@ -0,0 +1,46 @@
+/* eslint-disable no-restricted-globals */
+
+// Offline support: every file of the build is cached on install, so the page
+// opens without a network connection (the terminal is reached over Bluetooth).
+// The list of files is injected by the build (workbox InjectManifest in react-scripts).
+const precache = self.__WB_MANIFEST;
+
+// A new build has a new file list and so a new cache, old ones are dropped on activation
+const cacheVersion = precache
+  .map(entry => entry.url + (entry.revision ?? ''))
+  .join()
+  .split('')
+  .reduce((hash, char) => (hash * 31 + char.charCodeAt(0)) >>> 0, 0)
+  .toString(16);
+const cacheName = `imp-term-${cacheVersion}`;
+const indexUrl = `${process.env.PUBLIC_URL}/index.html`;
+
+self.addEventListener('install', (event) => {
+  event.waitUntil(
+    caches.open(cacheName)
+    .then(cache => cache.addAll(precache.map(entry => entry.url)))
+    .then(() => self.skipWaiting())
+  );
+});
+
+self.addEventListener('activate', (event) => {
+  event.waitUntil(
+    caches.keys()
+    .then(names => Promise.all(names.filter(name => name.startsWith('imp-term-') && name !== cacheName).map(name => caches.delete(name))))
+    .then(() => self.clients.claim())
+  );
+});
+
+self.addEventListener('fetch', (event) => {
+  const request = event.request;
+  if (request.method !== 'GET' || new URL(request.url).origin !== self.location.origin)
+    return;
+
+  if (request.mode === 'navigate') {
+    // Fresh page when online, the cached one otherwise
+    event.respondWith(fetch(request).catch(() => caches.match(indexUrl)));
+    return;
+  }
+  // Build files have content hashes in their names, so the cached copy is always right
+  event.respondWith(caches.match(request).then(cached => cached ?? fetch(request)));
+});
@@ -0,0 +1,14 @@
+/**
+ * Register the service worker (src/service-worker.js) of a production build
+ * @note The page works without it, it only makes it load offline and without waiting for the network
+ */
+export const register = () => {
+  if (process.env.NODE_ENV !== 'production' || !('serviceWorker' in navigator))
+    return;
+
+  window.addEventListener('load', () => {
+    navigator.serviceWorker.register(`${process.env.PUBLIC_URL}/service-worker.js`)
+    .then(registration => console.log('Service worker registered, scope:', registration.scope))
+    .catch(error => console.error('Service worker registration failed:', error));
+  });
+};
@@ -0,0 +1,12 @@
+// Run by npm test before every test file
+
+import { webcrypto } from 'crypto';
+import { TextDecoder, TextEncoder } from 'util';
+
+// Browsers have these, jsdom does not
+if (global.TextEncoder === undefined) {
+  global.TextEncoder = TextEncoder;
+  global.TextDecoder = TextDecoder;
+}
+if (global.crypto?.subtle === undefined)
+  Object.defineProperty(global, 'crypto', { value: webcrypto, configurable: true });